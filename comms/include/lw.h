@@ -10,6 +10,8 @@
 #define LW_ID_CMD_LEN                       4
 #define LW_ID_CMD                           0x434d4400 /* CMD  */
 #define LW_ID_CCMD                          0x43434d44 /* CCMD */
+#define LW_ID_SESSION                       0x53455353 /* SESS */
+#define LW_ID_BCMD                          0x42434d44 /* BCMD */
 #define LW_ID_FW_START                      0x46572d00 /* FW-  */
 #define LW_ID_FW_CHUNK                      0x46572b00 /* FW+  */
 #define LW_ID_FW_COMPLETE                   0x46574000 /* FW@  */
@@ -60,6 +62,7 @@ typedef struct
     char    app_key[LW_APP_KEY_LEN];
     uint8_t region; /* lw_region_t */
     uint8_t version;
+    uint8_t class_a; /* Idle in Class A, opt in. Otherwise Class C, receiver always open. */
 } __attribute__((__packed__)) lw_config_t;
 
 _Static_assert(sizeof(lw_config_t) < sizeof(comms_config_t), "LoRaWAN config too big.");
@@ -70,5 +73,6 @@ lw_config_t*    lw_get_config(void);
 bool            lw_persist_data_is_valid(void);
 bool            lw_config_setup_str(char * str);
 uint64_t        lw_consume(char *p, unsigned len);
+uint16_t        lw_get_max_payload(lw_region_t region, uint8_t dr);
 void            lw_config_init(comms_config_t* config);
 bool            lw_persist_config_cmp(lw_config_t* d0, lw_config_t* d1);
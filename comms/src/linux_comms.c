@@ -1,6 +1,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 
 #include "config.h"
@@ -8,15 +9,34 @@
 #include "pinmap.h"
 #include "log.h"
 #include "common.h"
+#include "persist_config.h"
 
 
 #define COMMS_DEFAULT_MTU       256
 #define COMMS_ID_STR            "LINUX_COMMS"
+#define COMMS_CONFIG_VALUE_LEN  32
+
+
+/* Kept in the comms config like a real unit's credentials, so moving a
+ * config between units can be tested against it. */
+typedef struct
+{
+    uint8_t type;
+    uint8_t _[3];
+    char    dev_eui[COMMS_CONFIG_VALUE_LEN];
+    char    app_key[COMMS_CONFIG_VALUE_LEN];
+} __attribute__((__packed__)) linux_comms_config_t;
+
+_Static_assert(sizeof(linux_comms_config_t) < sizeof(comms_config_t), "Linux comms config too big.");
+
+
+static bool     _linux_comms_connected = true;
+static uint16_t _linux_comms_mtu       = COMMS_DEFAULT_MTU;
 
 
 uint16_t linux_comms_get_mtu(void)
 {
-    return COMMS_DEFAULT_MTU;
+    return _linux_comms_mtu;
 }
 
 
@@ -42,13 +62,20 @@ bool linux_comms_send_allowed(void)
 
 void linux_comms_send(int8_t* hex_arr, uint16_t arr_len)
 {
-    char buf[3];
+    static const char hex_chars[] = "0123456789abcdef";
+    char buf[2 * PROTOCOL_HEX_ARRAY_SIZE + 2];
+    if (arr_len > PROTOCOL_HEX_ARRAY_SIZE)
+        arr_len = PROTOCOL_HEX_ARRAY_SIZE;
+    char* p = buf;
     for (uint16_t i = 0; i < arr_len; i++)
     {
-        snprintf(buf, 3, "%.2"PRIx32, hex_arr[i]);
-        uart_ring_out(COMMS_UART, buf, 2);
+        uint8_t b = (uint8_t)hex_arr[i];
+        *p++ = hex_chars[b >> 4];
+        *p++ = hex_chars[b & 0xF];
     }
-    uart_ring_out(COMMS_UART, "\r\n", 2);
+    *p++ = '\r';
+    *p++ = '\n';
+    uart_ring_out(COMMS_UART, buf, p - buf);
     on_comms_sent_ack(true);
 }
 
@@ -70,7 +97,7 @@ void linux_comms_process(char* message)
 
 bool linux_comms_get_connected(void)
 {
-    return true;
+    return _linux_comms_connected;
 }
 
 
@@ -79,16 +106,40 @@ void linux_comms_loop_iteration(void)
 }
 
 
-void linux_comms_config_setup_str(char * str)
+static linux_comms_config_t* _linux_comms_get_config(void)
 {
-    if (strstr(str, "dev-eui"))
+    linux_comms_config_t* config = (linux_comms_config_t*)&persist_data.model_config.comms_config;
+    if (config->type != COMMS_TYPE_LW)
     {
-        log_out("Dev EUI: LINUX-DEV");
+        memset(config, 0, sizeof(linux_comms_config_t));
+        config->type = COMMS_TYPE_LW;
+        strncpy(config->dev_eui, "LINUX-DEV", COMMS_CONFIG_VALUE_LEN);
+        strncpy(config->app_key, "LINUX-APP", COMMS_CONFIG_VALUE_LEN);
     }
-    else if (strstr(str, "app-key"))
+    return config;
+}
+
+
+static void _linux_comms_config_value(const char* desc, char* value, char* arg)
+{
+    arg = skip_space(arg);
+    if (*arg)
     {
-        log_out("App Key: LINUX-APP");
+        memset(value, 0, COMMS_CONFIG_VALUE_LEN);
+        strncpy(value, arg, COMMS_CONFIG_VALUE_LEN);
     }
+    log_out("%s: %."STR(COMMS_CONFIG_VALUE_LEN)"s", desc, value);
+}
+
+
+void linux_comms_config_setup_str(char * str)
+{
+    linux_comms_config_t* config = _linux_comms_get_config();
+    char* p = skip_space(str);
+    if (strncmp(p, "dev-eui", 7) == 0)
+        _linux_comms_config_value("Dev EUI", config->dev_eui, p + 7);
+    else if (strncmp(p, "app-key", 7) == 0)
+        _linux_comms_config_value("App Key", config->app_key, p + 7);
 }
 
 
@@ -115,6 +166,10 @@ static command_response_t _linux_comms_config_cb(char * args)
 
 static command_response_t _linux_comms_conn_cb(char* args)
 {
+    char* p = skip_space(args);
+    /* Fake losing coverage for testing. */
+    if (*p == '0' || *p == '1')
+        _linux_comms_connected = (*p == '1');
     if (linux_comms_get_connected())
     {
         log_out("1 | Connected");
@@ -127,6 +182,19 @@ static command_response_t _linux_comms_conn_cb(char* args)
 }
 
 
+static command_response_t _linux_comms_mtu_cb(char* args)
+{
+    char* p = skip_space(args);
+    char* np;
+    /* Fake the payload limit of a slower data rate for testing. */
+    unsigned mtu = strtoul(p, &np, 10);
+    if (p != np)
+        _linux_comms_mtu = mtu;
+    log_out("MTU: %"PRIu16, _linux_comms_mtu);
+    return COMMAND_RESP_OK;
+}
+
+
 static command_response_t _linux_comms_dbg_cb(char* args)
 {
     uart_ring_out(COMMS_UART, args, strlen(args));
@@ -140,6 +208,7 @@ struct cmd_link_t* linux_comms_add_commands(struct cmd_link_t* tail)
     static struct cmd_link_t cmds[] = {{ "comms_send",   "Send linux_comms message",        _linux_comms_send_cb        , false , NULL },
                                        { "comms_config", "Set linux_comms config",          _linux_comms_config_cb      , false , NULL },
                                        { "comms_conn",   "LoRa connected",                  _linux_comms_conn_cb        , false , NULL },
+                                       { "comms_mtu",    "Get/set max payload",             _linux_comms_mtu_cb         , false , NULL },
                                        { "comms_dbg",    "Comms Chip Debug",                _linux_comms_dbg_cb         , false , NULL }};
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
@@ -287,8 +287,27 @@ bool lw_config_setup_str(char * str)
         log_out("Set region to %.*s (%"PRIu8")", LW_REGION_LEN, p, config->region);
         return true;
     }
+    if (strncmp(p, "class", wordlen) == 0)
+    {
+        /* Class when not in a config session */
+        p = skip_space(np);
+        if (!p[0])
+        {
+            log_out("Class: %c", (config->class_a == 1)?'A':'C');
+            return false;
+        }
+        char class = toupper((unsigned char)p[0]);
+        if (class != 'A' && class != 'C')
+        {
+            log_out("Class should be A or C.");
+            return false;
+        }
+        config->class_a = (class == 'A')?1:0;
+        log_out("Set class to %c", class);
+        return true;
+    }
 syntax_exit:
-    log_out("lora_config dev-eui/app-key/region [EUI/KEY/REG]");
+    log_out("lora_config dev-eui/app-key/region/class [EUI/KEY/REG/A|C]");
     return false;
 }
 
@@ -306,6 +325,19 @@ uint64_t lw_consume(char *p, unsigned len)
 }
 
 
+/* Max application payload for a data rate, from the LoRaWAN Regional
+ * Parameters without repeater and without dwell time limits. US915 is the
+ * odd one out; the other regions share the EU868 pattern. */
+uint16_t lw_get_max_payload(lw_region_t region, uint8_t dr)
+{
+    static const uint16_t us915[] = { 11, 53, 125, 242, 242 };
+    static const uint16_t others[] = { 51, 51, 51, 115, 242, 242, 242, 242 };
+    if (region == LW_REGION_US915)
+        return (dr < ARRAY_SIZE(us915)) ? us915[dr] : 0;
+    return (dr < ARRAY_SIZE(others)) ? others[dr] : 0;
+}
+
+
 /* Return true  if different
  *        false if same      */
 bool lw_persist_config_cmp(lw_config_t* d0, lw_config_t* d1)
@@ -320,6 +352,7 @@ static void _lw_config_init2(lw_config_t* lw_config)
 {
     lw_config->region = LW_REGION_EU868;
     lw_config->version = LW_CONFIG_VERSION;
+    lw_config->class_a = 0;
     memset(lw_config->dev_eui, 0, LW_DEV_EUI_LEN);
     memset(lw_config->app_key, 0, LW_APP_KEY_LEN);
 }
@@ -18,8 +18,10 @@
 #include "pinmap.h"
 #include "sleep.h"
 #include "cmd.h"
+#include "cmd_batch.h"
 #include "update.h"
 #include "protocol.h"
+#include "energy.h"
 
 
 #define RAK3172_TIMEOUT_MS              15000
@@ -31,7 +33,7 @@
 _Static_assert(RAK3172_JOIN_TIME_S > 5, "RAK3172 join time is less than 5");
 
 #define RAK3172_NB_TRIALS               2
-#define RAK3172_PAYLOAD_MAX_DEFAULT     242
+#define RAK3172_DR_DEFAULT              4
 
 #define RAK3172_SHORT_RESET_COUNT       5
 #define RAK3172_SHORT_RESET_TIME_MS     10
@@ -39,6 +41,12 @@ _Static_assert(RAK3172_JOIN_TIME_S > 5, "RAK3172 join time is less than 5");
 
 #define RAK3172_MAX_CMD_LEN             64
 #define RAK3172_INIT_MSG_LEN            64
+#define RAK3172_CMD_QUEUE_LEN           8
+
+#define RAK3172_CLASS_DEFAULT           "AT+CLASS=C"
+#define RAK3172_CLASS_IDLE              "AT+CLASS=A"    /* Opt in, "lora_config class A". */
+#define RAK3172_CLASS_SESSION           "AT+CLASS=C"
+#define RAK3172_SESSION_MAX_MINS        60
 
 #define RAK3172_MSG_INIT                "Current Work Mode: LoRaWAN."
 #define RAK3172_MSG_OK                  "OK"
@@ -49,31 +57,55 @@ _Static_assert(RAK3172_JOIN_TIME_S > 5, "RAK3172 join time is less than 5");
 #define RAK3172_MSG_SEND_HEADER_LEN     13
 #define RAK3172_MSG_ACK                 "+EVT:SEND_CONFIRMED_OK"
 #define RAK3172_MSG_NACK                "+EVT:SEND_CONFIRMED_FAILED"
+#define RAK3172_MSG_ERR                 "AT_"
+#define RAK3172_MSG_DR                  "AT+DR="
+#define RAK3172_MSG_DR_QUERY            "AT+DR=?"
+
+#define RAK3172_SEND_BUF_LEN            (RAK3172_MSG_SEND_HEADER_LEN + (2 * PROTOCOL_HEX_ARRAY_SIZE) + 2)
 
 
 typedef enum
 {
     RAK3172_STATE_OFF = 0,
-    RAK3172_STATE_INIT_WAIT_BOOT,
-    RAK3172_STATE_INIT_WAIT_OK,
-    RAK3172_STATE_INIT_WAIT_REPLAY,
-    RAK3172_STATE_JOIN_WAIT_OK,
-    RAK3172_STATE_JOIN_WAIT_REPLAY,
-    RAK3172_STATE_JOIN_WAIT_JOIN,
+    RAK3172_STATE_INIT,
+    RAK3172_STATE_JOIN,
     RAK3172_STATE_RESETTING,
     RAK3172_STATE_IDLE,
-    RAK3172_STATE_SEND_WAIT_REPLAY,
-    RAK3172_STATE_SEND_WAIT_OK,
-    RAK3172_STATE_SEND_WAIT_ACK,
 } rak3172_state_t;
 
 
-static uint16_t _rak3172_packet_max_size        = RAK3172_PAYLOAD_MAX_DEFAULT;
+typedef enum
+{
+    RAK3172_CMD_WAITING = 0,
+    RAK3172_CMD_OK,
+    RAK3172_CMD_FAILED,         /* The chip said it didn't work out. */
+    RAK3172_CMD_REJECTED,       /* The chip refused the command. */
+    RAK3172_CMD_TIMEOUT,
+} rak3172_cmd_result_t;
+
+
+typedef rak3172_cmd_result_t (*rak3172_cmd_match_t)(char* msg);
+typedef void (*rak3172_cmd_done_t)(char* cmd, rak3172_cmd_result_t result);
+
+
+/* An AT command waiting to go, or going. Each says what reply finishes
+ * it and how long to wait for it, so nothing has to block on the chip. */
+typedef struct
+{
+    char                    cmd[RAK3172_MAX_CMD_LEN];
+    bool                    uplink;         /* Write the uplink buffer, not cmd. */
+    rak3172_cmd_match_t     match;
+    rak3172_cmd_done_t      done;
+    uint32_t                timeout_ms;
+    uint32_t                gap_ms;         /* Quiet time needed since the last command. */
+} rak3172_cmd_t;
+
 
 static bool     _rak3172_boot_enabled           = false;
 static bool     _rak3172_reset_enabled          = false;
 static uint16_t _rak3172_next_fw_chunk_id       = 0;
 static char     _rak3172_ascii_cmd[CMD_LINELEN] = {0};
+static char     _rak3172_send_buf[RAK3172_SEND_BUF_LEN];
 
 
 struct
@@ -86,8 +118,24 @@ struct
     port_n_pins_t       reset_pin;
     port_n_pins_t       boot_pin;
     bool                config_is_valid;
-    char                last_sent_msg[RAK3172_MAX_CMD_LEN+1];
     uint8_t             err_code;
+    lw_region_t         region;
+    uint8_t             dr;
+    uint8_t             dr_pending;
+    bool                echo;
+    bool                send_busy;
+    unsigned            send_len;
+    rak3172_cmd_t       cmd;
+    bool                cmd_active;
+    rak3172_cmd_t       cmd_queue[RAK3172_CMD_QUEUE_LEN];
+    unsigned            cmd_head;
+    unsigned            cmd_count;
+    bool                session;
+    uint32_t            session_start;
+    uint32_t            session_ms;
+    bool                batch_pending;
+    uint8_t             batch_count;
+    uint32_t            batch_ok;
 } _rak3172_ctx =
 {
     .init_count       = 0,
@@ -98,8 +146,22 @@ struct
     .reset_pin        = COMMS_RESET_PORT_N_PINS,
     .boot_pin         = COMMS_BOOT_PORT_N_PINS,
     .config_is_valid  = false,
-    .last_sent_msg    = {0},
     .err_code         = 0,
+    .region           = LW_REGION_EU868,
+    .dr               = RAK3172_DR_DEFAULT,
+    .dr_pending       = RAK3172_DR_DEFAULT,
+    .echo             = true,
+    .send_busy        = false,
+    .send_len         = 0,
+    .cmd_active       = false,
+    .cmd_head         = 0,
+    .cmd_count        = 0,
+    .session          = false,
+    .session_start    = 0,
+    .session_ms       = 0,
+    .batch_pending    = false,
+    .batch_count      = 0,
+    .batch_ok         = 0,
 };
 
 
@@ -110,9 +172,9 @@ char _rak3172_init_msgs[][RAK3172_INIT_MSG_LEN] =
     "ATE",                  /* Enable line replay */
     "AT+CFM=1",             /* Set confirmation   */
     "AT+NJM=1",             /* Set OTAA mode      */
-    "AT+CLASS=C",           /* Set Class A mode   */
+    RAK3172_CLASS_DEFAULT,  /* Set Class C mode   */
     "AT+ADR=0",             /* Do not use ADR     */
-    "AT+DR=4",              /* Set to DR 4        */
+    RAK3172_MSG_DR STR(RAK3172_DR_DEFAULT), /* Set to DR 4 */
     "AT+TXP=0",             /* Set highest TX     */
     "REGION goes here",     /* Set to EU868       */
     "DEVEUI goes here",
@@ -139,203 +201,343 @@ static void _rak3172_chip_off(void)
 }
 
 
-static bool _rak3172_write(char* cmd)
+static bool _rak3172_write(char* line, unsigned len)
 {
-    unsigned len = strnlen(cmd, RAK3172_MAX_CMD_LEN);
-    return (bool)uart_ring_out(COMMS_UART, cmd, len);
+    return (bool)uart_ring_out(COMMS_UART, line, len);
 }
 
 
-static int _rak3172_printf(char* fmt, ...)
+static void _rak3172_cmd_write(rak3172_cmd_t* cmd)
 {
-    char buf[RAK3172_MAX_CMD_LEN];
-    va_list args;
-    va_start(args, fmt);
-    int len = vsnprintf(buf, RAK3172_MAX_CMD_LEN - 3, fmt, args);
-    va_end(args);
     _rak3172_ctx.cmd_last_sent = get_since_boot_ms();
-    memcpy(_rak3172_ctx.last_sent_msg, buf, len);
-    _rak3172_ctx.last_sent_msg[len] = 0;
-    comms_debug(" << %s", buf);
-    buf[len] = '\r';
-    buf[len+1] = '\n';
-    buf[len+2] = 0;
-    return _rak3172_write(buf) ? len : 0;
+    if (cmd->uplink)
+    {
+        comms_debug(" << %.*s", _rak3172_ctx.send_len - 2, _rak3172_send_buf);
+        _rak3172_write(_rak3172_send_buf, _rak3172_ctx.send_len);
+        /* Radio is up from here until the chip answers the send. */
+        energy_start(ENERGY_TX);
+        return;
+    }
+    char buf[RAK3172_MAX_CMD_LEN + 2];
+    unsigned len = strnlen(cmd->cmd, RAK3172_MAX_CMD_LEN - 1);
+    comms_debug(" << %s", cmd->cmd);
+    memcpy(buf, cmd->cmd, len);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    _rak3172_write(buf, len);
 }
 
 
-static void _rak3172_process_state_off(char* msg)
+/* Start the next queued command if nothing is outstanding and it has
+ * had its quiet time. Otherwise the loop iteration comes back to it. */
+static void _rak3172_cmd_kick(void)
 {
-    if (_rak3172_ctx.config_is_valid && msg_is(RAK3172_MSG_INIT, msg))
-    {
-        comms_debug("READ INIT MESSAGE");
-        _rak3172_ctx.state = RAK3172_STATE_INIT_WAIT_BOOT;
-        _rak3172_ctx.init_count = 0;
-        _rak3172_printf((char*)_rak3172_init_msgs[0]);
-    }
+    if (_rak3172_ctx.cmd_active || !_rak3172_ctx.cmd_count)
+        return;
+    rak3172_cmd_t* next = &_rak3172_ctx.cmd_queue[_rak3172_ctx.cmd_head];
+    if (since_boot_delta(get_since_boot_ms(), _rak3172_ctx.cmd_last_sent) < next->gap_ms)
+        return;
+    _rak3172_ctx.cmd = *next;
+    _rak3172_ctx.cmd_head = (_rak3172_ctx.cmd_head + 1) % RAK3172_CMD_QUEUE_LEN;
+    _rak3172_ctx.cmd_count--;
+    _rak3172_ctx.cmd_active = true;
+    _rak3172_cmd_write(&_rak3172_ctx.cmd);
 }
 
 
-static void _rak3172_process_state_init_wait_boot(char* msg)
+static bool _rak3172_cmd_queue(char* cmd, rak3172_cmd_match_t match, rak3172_cmd_done_t done, uint32_t timeout_ms, uint32_t gap_ms)
 {
-    if (msg_is(RAK3172_MSG_INIT, msg))
+    if (_rak3172_ctx.cmd_count >= RAK3172_CMD_QUEUE_LEN)
     {
-        comms_debug("READ RE-BOOT MESSAGE");
-        _rak3172_ctx.state = RAK3172_STATE_INIT_WAIT_OK;
-        _rak3172_printf((char*)_rak3172_init_msgs[++_rak3172_ctx.init_count]);
+        comms_debug("Command queue full, dropping '%s'.", cmd ? cmd : "uplink");
+        return false;
     }
+    unsigned pos = (_rak3172_ctx.cmd_head + _rak3172_ctx.cmd_count) % RAK3172_CMD_QUEUE_LEN;
+    rak3172_cmd_t* new_cmd = &_rak3172_ctx.cmd_queue[pos];
+    memset(new_cmd, 0, sizeof(rak3172_cmd_t));
+    if (cmd)
+        strncpy(new_cmd->cmd, cmd, RAK3172_MAX_CMD_LEN - 1);
+    new_cmd->uplink     = !cmd;
+    new_cmd->match      = match;
+    new_cmd->done       = done;
+    new_cmd->timeout_ms = timeout_ms;
+    new_cmd->gap_ms     = gap_ms;
+    _rak3172_ctx.cmd_count++;
+    _rak3172_cmd_kick();
+    return true;
+}
+
+
+static void _rak3172_cmd_finish(rak3172_cmd_result_t result)
+{
+    _rak3172_ctx.cmd_active = false;
+    if (_rak3172_ctx.cmd.uplink)
+        energy_stop(ENERGY_TX);
+    if (_rak3172_ctx.cmd.done)
+        _rak3172_ctx.cmd.done(_rak3172_ctx.cmd.cmd, result);
+    _rak3172_cmd_kick();
 }
 
 
-static void _rak3172_process_state_init_wait_replay(char* msg)
+/* Drop everything queued or outstanding, as the chip is going away. */
+static void _rak3172_cmd_flush(void)
 {
-    if (msg_is(_rak3172_init_msgs[_rak3172_ctx.init_count], msg))
+    energy_stop(ENERGY_TX);
+    _rak3172_ctx.cmd_active = false;
+    _rak3172_ctx.cmd_count = 0;
+    /* The chip comes back in Class A. */
+    _rak3172_ctx.session = false;
+    if (_rak3172_ctx.send_busy)
     {
-        comms_debug("READ INIT REPLAY");
-        _rak3172_ctx.state = RAK3172_STATE_INIT_WAIT_OK;
+        _rak3172_ctx.send_busy = false;
+        on_comms_sent_ack(false);
     }
 }
 
 
-static void _rak3172_send_join(void)
+static rak3172_cmd_result_t _rak3172_match_ok(char* msg)
 {
-    char join_msg[RAK3172_MAX_CMD_LEN+1];
-    snprintf(join_msg, RAK3172_MAX_CMD_LEN, RAK3172_MSG_JOIN, RAK3172_JOIN_TIME_S);
-    _rak3172_printf(join_msg);
+    /* The replay of the command itself is not a match. */
+    if (msg_is(RAK3172_MSG_OK, msg))
+        return RAK3172_CMD_OK;
+    if (msg_is(RAK3172_MSG_ERR, msg))
+        return RAK3172_CMD_REJECTED;
+    return RAK3172_CMD_WAITING;
 }
 
 
-static bool _rak3172_msg_is_replay(char* msg)
+static rak3172_cmd_result_t _rak3172_match_boot(char* msg)
 {
-    unsigned len = strnlen(msg, RAK3172_MAX_CMD_LEN);
-    unsigned sent_len = strnlen(_rak3172_ctx.last_sent_msg, RAK3172_MAX_CMD_LEN);
-    comms_debug("LAST SENT: %s", _rak3172_ctx.last_sent_msg);
-    if (len != sent_len)
-        return false;
-    return (strncmp(msg, _rak3172_ctx.last_sent_msg, len) == 0);
+    return msg_is(RAK3172_MSG_INIT, msg) ? RAK3172_CMD_OK : RAK3172_CMD_WAITING;
 }
 
 
-static void _rak3172_process_state_init_wait_ok(char* msg)
+static rak3172_cmd_result_t _rak3172_match_ok_or_boot(char* msg)
 {
-    /* Second command now reboots the device by the looks, so allow that
-     * to pass with init message. */
-    if ((_rak3172_ctx.init_count == 1 && msg_is(RAK3172_MSG_INIT, msg)) ||
-        msg_is(RAK3172_MSG_OK, msg))
-    {
-        comms_debug("READ INIT OK");
-        if (ARRAY_SIZE(_rak3172_init_msgs) == _rak3172_ctx.init_count + 1)
-        {
-            comms_debug("FINISHED INIT");
-            _rak3172_ctx.state = RAK3172_STATE_JOIN_WAIT_REPLAY;
-            _rak3172_send_join();
-            return;
-        }
-        comms_debug("SENDING NEXT INIT");
+    if (msg_is(RAK3172_MSG_INIT, msg))
+        return RAK3172_CMD_OK;
+    return _rak3172_match_ok(msg);
+}
 
-        /* ATE is 3rd command so first 3 commands wont have replay */
-        if (_rak3172_ctx.init_count > 2)
-        {
-            _rak3172_ctx.state = RAK3172_STATE_INIT_WAIT_REPLAY;
-        }
-        else
-        {
-            _rak3172_ctx.state = RAK3172_STATE_INIT_WAIT_OK;
-        }
-        _rak3172_printf((char*)_rak3172_init_msgs[++_rak3172_ctx.init_count]);
-    }
+
+static rak3172_cmd_result_t _rak3172_match_join(char* msg)
+{
+    if (msg_is(RAK3172_MSG_JOINED, msg))
+        return RAK3172_CMD_OK;
+    if (msg_is(RAK3172_MSG_JOIN_FAILED, msg))
+        return RAK3172_CMD_FAILED;
+    if (msg_is(RAK3172_MSG_ERR, msg))
+        return RAK3172_CMD_REJECTED;
+    return RAK3172_CMD_WAITING;
 }
 
 
-static void _rak3172_process_state_join_wait_replay(char* msg)
+static rak3172_cmd_result_t _rak3172_match_send(char* msg)
 {
-    if (_rak3172_msg_is_replay(msg))
-    {
-        comms_debug("READ JOIN REPLAY");
-        _rak3172_ctx.state = RAK3172_STATE_JOIN_WAIT_OK;
-    }
-    else
+    /* OK only means it is going, the ack is what finishes it. */
+    if (msg_is(RAK3172_MSG_ACK, msg))
+        return RAK3172_CMD_OK;
+    if (msg_is(RAK3172_MSG_NACK, msg))
+        return RAK3172_CMD_FAILED;
+    if (msg_is(RAK3172_MSG_ERR, msg))
+        return RAK3172_CMD_REJECTED;
+    return RAK3172_CMD_WAITING;
+}
+
+
+static rak3172_cmd_result_t _rak3172_match_dr(char* msg)
+{
+    unsigned len = strlen(RAK3172_MSG_DR);
+    if (msg_is(RAK3172_MSG_DR, msg) && isdigit((unsigned char)msg[len]))
     {
-        comms_debug("UNKNOWN: %s", msg);
+        /* Either the reply to a query or the replay of a set. */
+        _rak3172_ctx.dr_pending = strtoul(msg + len, NULL, 10);
+        return RAK3172_CMD_WAITING;
     }
+    return _rak3172_match_ok(msg);
 }
 
 
-static void _rak3172_process_state_join_wait_ok(char* msg)
+static const char* _rak3172_cmd_result_to_str(rak3172_cmd_result_t result)
 {
-    if (msg_is(RAK3172_MSG_OK, msg))
+    static const char result_strs[5][10] =
     {
-        comms_debug("READ JOIN OK");
-        _rak3172_ctx.state = RAK3172_STATE_JOIN_WAIT_JOIN;
-    }
+        {"WAITING"},
+        {"OK"},
+        {"FAILED"},
+        {"REJECTED"},
+        {"TIMEOUT"},
+    };
+    static const char none[] = "";
+    if (result >= ARRAY_SIZE(result_strs))
+        return none;
+    return result_strs[result];
 }
 
 
-static void _rak3172_process_state_join_wait_join(char* msg)
+static void _rak3172_cmd_done_log(char* cmd, rak3172_cmd_result_t result)
 {
-    if (msg_is(RAK3172_MSG_JOINED, msg))
+    log_out("%s : %s", cmd, _rak3172_cmd_result_to_str(result));
+}
+
+
+static bool _rak3172_cmd_printf(rak3172_cmd_done_t done, char* fmt, ...)
+{
+    char buf[RAK3172_MAX_CMD_LEN];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, RAK3172_MAX_CMD_LEN, fmt, args);
+    va_end(args);
+    return _rak3172_cmd_queue(buf, _rak3172_match_ok, done, RAK3172_TIMEOUT_MS, 0);
+}
+
+
+static void _rak3172_dr_done(char* cmd, rak3172_cmd_result_t result)
+{
+    switch (result)
     {
-        comms_debug("READ JOIN");
-        _rak3172_ctx.reset_count = 0;
-        _rak3172_ctx.state = RAK3172_STATE_IDLE;
+        case RAK3172_CMD_OK:
+            _rak3172_ctx.dr = _rak3172_ctx.dr_pending;
+            comms_debug("DR %"PRIu8" (MTU %"PRIu16")", _rak3172_ctx.dr, rak3172_get_mtu());
+            break;
+        case RAK3172_CMD_TIMEOUT:
+            comms_debug("TIMED OUT");
+            rak3172_reset();
+            break;
+        default:
+            comms_debug("DR NOT CHANGED");
+            break;
     }
-    else if (msg_is(RAK3172_MSG_JOIN_FAILED, msg))
+}
+
+
+/* ADR is off, so the data rate only moves when asked to, but read back
+ * what the chip is using rather than assume. */
+static void _rak3172_query_dr(void)
+{
+    _rak3172_ctx.dr_pending = _rak3172_ctx.dr;
+    _rak3172_cmd_queue(RAK3172_MSG_DR_QUERY, _rak3172_match_dr, _rak3172_dr_done, RAK3172_TIMEOUT_MS, 0);
+}
+
+
+static void _rak3172_join_done(char* cmd, rak3172_cmd_result_t result)
+{
+    if (result != RAK3172_CMD_OK)
     {
-        comms_debug("READ JOIN FAILED");
+        comms_debug("JOIN %s", _rak3172_cmd_result_to_str(result));
         rak3172_reset();
+        return;
     }
+    comms_debug("READ JOIN");
+    _rak3172_ctx.reset_count = 0;
+    _rak3172_ctx.state = RAK3172_STATE_IDLE;
+    _rak3172_query_dr();
 }
 
 
-static void _rak3172_process_state_send_replay(char* msg)
+static void _rak3172_send_join(void)
 {
-    if (_rak3172_msg_is_replay(msg))
+    char join_msg[RAK3172_MAX_CMD_LEN+1];
+    snprintf(join_msg, RAK3172_MAX_CMD_LEN, RAK3172_MSG_JOIN, RAK3172_JOIN_TIME_S);
+    _rak3172_ctx.state = RAK3172_STATE_JOIN;
+    _rak3172_cmd_queue(join_msg, _rak3172_match_join, _rak3172_join_done, RAK3172_TIMEOUT_MS, 0);
+}
+
+
+static void _rak3172_init_step(void);
+
+
+static void _rak3172_init_done(char* cmd, rak3172_cmd_result_t result)
+{
+    if (result != RAK3172_CMD_OK)
+    {
+        comms_debug("INIT '%s' %s", cmd, _rak3172_cmd_result_to_str(result));
+        rak3172_reset();
+        return;
+    }
+    if (++_rak3172_ctx.init_count < ARRAY_SIZE(_rak3172_init_msgs))
     {
-        comms_debug("READ SEND REPLAY");
-        _rak3172_ctx.state = RAK3172_STATE_SEND_WAIT_OK;
+        _rak3172_init_step();
+        return;
     }
+    comms_debug("FINISHED INIT");
+    _rak3172_send_join();
 }
 
 
-static void _rak3172_process_state_send_ok(char* msg)
+static void _rak3172_init_step(void)
 {
-    if (msg_is(RAK3172_MSG_OK, msg))
+    rak3172_cmd_match_t match;
+    switch (_rak3172_ctx.init_count)
     {
-        comms_debug("READ SEND OKAY");
-        _rak3172_ctx.state = RAK3172_STATE_SEND_WAIT_ACK;
+        case 0:
+            /* Resetting the config reboots the chip. */
+            match = _rak3172_match_boot;
+            break;
+        case 1:
+            /* Second command now reboots the device by the looks, so allow
+             * that to pass with init message. */
+            match = _rak3172_match_ok_or_boot;
+            break;
+        default:
+            match = _rak3172_match_ok;
+            break;
     }
+    _rak3172_cmd_queue(_rak3172_init_msgs[_rak3172_ctx.init_count], match, _rak3172_init_done, RAK3172_TIMEOUT_MS, 0);
 }
 
 
-static void _rak3172_process_state_send_ack(char* msg)
+static void _rak3172_process_state_off(char* msg)
 {
-    if (msg_is(RAK3172_MSG_ACK, msg))
+    if (_rak3172_ctx.config_is_valid && msg_is(RAK3172_MSG_INIT, msg))
     {
-        comms_debug("READ SEND ACK");
-        _rak3172_ctx.reset_count = 0;
-        _rak3172_ctx.state = RAK3172_STATE_IDLE;
-        on_comms_sent_ack(true);
-
-        return;
+        comms_debug("READ INIT MESSAGE");
+        _rak3172_ctx.state = RAK3172_STATE_INIT;
+        _rak3172_ctx.init_count = 0;
+        _rak3172_init_step();
     }
-    if (msg_is(RAK3172_MSG_NACK, msg))
+}
+
+
+static void _rak3172_send_done(char* cmd, rak3172_cmd_result_t result)
+{
+    _rak3172_ctx.send_busy = false;
+    switch (result)
     {
-        comms_debug("READ NO SEND ACK");
-        rak3172_reset();
-        return;
+        case RAK3172_CMD_OK:
+            comms_debug("READ SEND ACK");
+            _rak3172_ctx.reset_count = 0;
+            on_comms_sent_ack(true);
+            break;
+        case RAK3172_CMD_REJECTED:
+            /* Most likely too long for the data rate, so check it. */
+            comms_debug("SEND REJECTED");
+            on_comms_sent_ack(false);
+            _rak3172_query_dr();
+            break;
+        case RAK3172_CMD_TIMEOUT:
+            comms_debug("TIMED OUT WAITING FOR ACK");
+            on_comms_sent_ack(false);
+            rak3172_reset();
+            break;
+        default:
+            comms_debug("READ NO SEND ACK");
+            on_comms_sent_ack(false);
+            rak3172_reset();
+            break;
     }
 }
 
 
 uint16_t rak3172_get_mtu(void)
 {
-    return _rak3172_packet_max_size;
+    return lw_get_max_payload(_rak3172_ctx.region, _rak3172_ctx.dr);
 }
 
 
 bool rak3172_send_ready(void)
 {
-    return (_rak3172_ctx.state == RAK3172_STATE_IDLE);
+    return (_rak3172_ctx.state == RAK3172_STATE_IDLE && !_rak3172_ctx.send_busy);
 }
 
 
@@ -346,8 +548,11 @@ bool rak3172_send_str(char* str)
         comms_debug("Cannot send '%s' as chip is not in IDLE state.", str);
         return false;
     }
-    _rak3172_ctx.state = RAK3172_STATE_SEND_WAIT_REPLAY;
-    _rak3172_printf("AT+SEND=:%u:%s", _rak3172_get_port(), str);
+    char buf[RAK3172_MAX_CMD_LEN];
+    snprintf(buf, RAK3172_MAX_CMD_LEN, "AT+SEND=:%u:%s", _rak3172_get_port(), str);
+    if (!_rak3172_cmd_queue(buf, _rak3172_match_send, _rak3172_send_done, RAK3172_ACK_TIMEOUT_MS, RAK3172_SEND_DELAY_MS))
+        return false;
+    _rak3172_ctx.send_busy = true;
     return true;
 }
 
@@ -358,6 +563,15 @@ bool rak3172_send_allowed(void)
 }
 
 
+/* Class C unless Class A was opted into, the receiver then only opens
+ * after uplinks or in a config session. */
+static bool _rak3172_idle_class_a(void)
+{
+    lw_config_t* config = lw_get_config();
+    return config && config->class_a == 1;
+}
+
+
 static bool _rak3172_load_config(void)
 {
     if (!lw_persist_data_is_valid())
@@ -380,6 +594,14 @@ static bool _rak3172_load_config(void)
     {
         region = config->region;
     }
+    _rak3172_ctx.region = region;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(_rak3172_init_msgs); i++)
+    {
+        if (strncmp(_rak3172_init_msgs[i], "AT+CLASS=", 9) == 0)
+            snprintf(_rak3172_init_msgs[i], RAK3172_INIT_MSG_LEN, "%s",
+                _rak3172_idle_class_a()?RAK3172_CLASS_IDLE:RAK3172_CLASS_DEFAULT);
+    }
 
     snprintf(
         _rak3172_init_msgs[ARRAY_SIZE(_rak3172_init_msgs)-4],
@@ -453,6 +675,7 @@ void rak3172_reset(void)
     if (_rak3172_ctx.state == RAK3172_STATE_RESETTING)
         return;
     _rak3172_ctx.state = RAK3172_STATE_RESETTING;
+    _rak3172_cmd_flush();
 
     if (_rak3172_ctx.reset_count < RAK3172_SHORT_RESET_COUNT)
         _rak3172_ctx.reset_count++;
@@ -462,6 +685,74 @@ void rak3172_reset(void)
 }
 
 
+static void _rak3172_session_class_done(char* cmd, rak3172_cmd_result_t result)
+{
+    comms_debug("%s : %s", cmd, _rak3172_cmd_result_to_str(result));
+}
+
+
+/* A config session keeps the receiver open (Class C), so a run of
+ * configuration downlinks doesn't each wait on the next uplink. If idle
+ * in Class A, it always ends, as the open receiver costs power the whole
+ * time. */
+static void _rak3172_session_start(unsigned mins)
+{
+    if (mins > RAK3172_SESSION_MAX_MINS)
+        mins = RAK3172_SESSION_MAX_MINS;
+    _rak3172_ctx.session_start = get_since_boot_ms();
+    _rak3172_ctx.session_ms = mins * 60 * 1000;
+    comms_debug("Config session for %u mins.", mins);
+    if (_rak3172_ctx.session)
+        return;
+    _rak3172_ctx.session = true;
+    if (!_rak3172_idle_class_a())
+        return;
+    _rak3172_cmd_queue(RAK3172_CLASS_SESSION, _rak3172_match_ok, _rak3172_session_class_done, RAK3172_TIMEOUT_MS, 0);
+}
+
+
+static void _rak3172_session_end(void)
+{
+    if (!_rak3172_ctx.session)
+        return;
+    comms_debug("Config session ended.");
+    _rak3172_ctx.session = false;
+    if (!_rak3172_idle_class_a())
+        return;
+    _rak3172_cmd_queue(RAK3172_CLASS_IDLE, _rak3172_match_ok, _rak3172_session_class_done, RAK3172_TIMEOUT_MS, 0);
+}
+
+
+/* Run each command of a batch on its own, so one failing doesn't stop
+ * the rest, and keep a bit per command to confirm in one uplink. */
+static void _rak3172_process_batch(char* cmds, unsigned len)
+{
+    uint8_t count = 0;
+    uint32_t ok_mask = 0;
+    char* end = cmds + len;
+    while (cmds < end && count < PROTOCOL_CMD_RESULTS_MAX)
+    {
+        char* sep = cmds_batch_next(cmds, end);
+        *sep = 0;
+        cmds = skip_space(cmds);
+        if (cmds < sep)
+        {
+            if (cmds_process(cmds, sep - cmds) == COMMAND_RESP_OK)
+                ok_mask |= 1UL << count;
+            count++;
+        }
+        cmds = sep + 1;
+    }
+    /* The results only say how many ran, so the rest are reported here. */
+    if (cmds < end && *skip_space(cmds))
+        log_error("Batch over %u commands, the rest not run.", PROTOCOL_CMD_RESULTS_MAX);
+    comms_debug("Batch of %"PRIu8" commands, OK mask 0x%"PRIx32, count, ok_mask);
+    _rak3172_ctx.batch_count = count;
+    _rak3172_ctx.batch_ok = ok_mask;
+    _rak3172_ctx.batch_pending = true;
+}
+
+
 static unsigned _rak3172_cmd_to_ascii(char* data, char* ascii)
 {
     unsigned len = strnlen(data, 2*CMD_LINELEN);
@@ -470,6 +761,12 @@ static unsigned _rak3172_cmd_to_ascii(char* data, char* ascii)
         comms_debug("Data misaligned to convert to ascii.");
         return 0;
     }
+    if (len / 2 >= CMD_LINELEN)
+    {
+        log_error("Downlink command over %u chars, dropped.", CMD_LINELEN - 1);
+        return 0;
+    }
+    ascii[len / 2] = 0;
     char* p = ascii;
     for (unsigned i = 0; i < len; i+=2)
     {
@@ -512,6 +809,24 @@ static void _rak3172_process_unsol2(uint8_t fport, char* data)
             comms_debug("Command exited with ERR: %"PRIu8, _rak3172_ctx.err_code);
             break;
         }
+        case LW_ID_SESSION:
+        {
+            comms_debug("Message is config session.");
+            unsigned ascii_len = _rak3172_cmd_to_ascii(p, _rak3172_ascii_cmd);
+            unsigned mins = ascii_len ? strtoul(_rak3172_ascii_cmd, NULL, 10) : 0;
+            if (mins)
+                _rak3172_session_start(mins);
+            else
+                _rak3172_session_end();
+            break;
+        }
+        case LW_ID_BCMD:
+        {
+            comms_debug("Message is batch of commands.");
+            unsigned ascii_len = _rak3172_cmd_to_ascii(p, _rak3172_ascii_cmd);
+            _rak3172_process_batch(_rak3172_ascii_cmd, ascii_len);
+            break;
+        }
         case LW_ID_FW_START:
         {
             comms_debug("Message is fw start.");
@@ -661,100 +976,76 @@ void rak3172_process(char* msg)
 {
     char* p = _rak3172_skip_to_msg(msg);
     _rak3172_process_unsol(p);
-    switch (_rak3172_ctx.state)
+    if (_rak3172_ctx.cmd_active)
     {
-        case RAK3172_STATE_OFF:
-            _rak3172_process_state_off(p);
-            break;
-        case RAK3172_STATE_INIT_WAIT_BOOT:
-            _rak3172_process_state_init_wait_boot(p);
-            break;
-        case RAK3172_STATE_INIT_WAIT_REPLAY:
-            _rak3172_process_state_init_wait_replay(p);
-            break;
-        case RAK3172_STATE_INIT_WAIT_OK:
-            _rak3172_process_state_init_wait_ok(p);
-            break;
-        case RAK3172_STATE_JOIN_WAIT_REPLAY:
-            _rak3172_process_state_join_wait_replay(p);
-            break;
-        case RAK3172_STATE_JOIN_WAIT_OK:
-            _rak3172_process_state_join_wait_ok(p);
-            break;
-        case RAK3172_STATE_JOIN_WAIT_JOIN:
-            _rak3172_process_state_join_wait_join(p);
-            break;
-        case RAK3172_STATE_RESETTING:
-            break;
-        case RAK3172_STATE_IDLE:
-            break;
-        case RAK3172_STATE_SEND_WAIT_REPLAY:
-            _rak3172_process_state_send_replay(p);
-            break;
-        case RAK3172_STATE_SEND_WAIT_OK:
-            _rak3172_process_state_send_ok(p);
-            break;
-        case RAK3172_STATE_SEND_WAIT_ACK:
-            _rak3172_process_state_send_ack(p);
-            break;
-        default:
-            comms_debug("Unknown state. (%d)", _rak3172_ctx.state);
-            return;
+        rak3172_cmd_result_t result = _rak3172_ctx.cmd.match(p);
+        if (result != RAK3172_CMD_WAITING)
+            _rak3172_cmd_finish(result);
+        return;
     }
+    if (_rak3172_ctx.state == RAK3172_STATE_OFF)
+        _rak3172_process_state_off(p);
 }
 
 
-static bool _rak3172_wait_send(void* userdata)
+static bool _rak3172_send_payload(int8_t* hex_arr, uint16_t arr_len, rak3172_cmd_done_t done)
 {
-    return !(since_boot_delta(get_since_boot_ms(), _rak3172_ctx.cmd_last_sent) < RAK3172_SEND_DELAY_MS);
-}
+    static const char hex_chars[] = "0123456789abcdef";
 
-
-void rak3172_send(int8_t* hex_arr, uint16_t arr_len)
-{
-    if (_rak3172_ctx.state != RAK3172_STATE_IDLE)
+    if (!rak3172_send_ready())
     {
         comms_debug("Incorrect state to send : %s",
             _rak3172_state_to_str((unsigned)_rak3172_ctx.state));
-        return;
+        return false;
+    }
+    if (arr_len > PROTOCOL_HEX_ARRAY_SIZE)
+    {
+        comms_debug("Payload of %"PRIu16" too long to send.", arr_len);
+        return false;
     }
 
-    char send_header[RAK3172_MSG_SEND_HEADER_LEN];
-
-    snprintf(
-        send_header,
+    /* Whole command in one buffer so it goes out in one write. */
+    char* p = _rak3172_send_buf;
+    p += snprintf(
+        p,
         RAK3172_MSG_SEND_HEADER_LEN,
         RAK3172_MSG_SEND_HEADER_FMT,
         _rak3172_get_port());
-
-    main_loop_iterate_for(RAK3172_SEND_DELAY_MS, _rak3172_wait_send, NULL);
-
-    if (!_rak3172_write(send_header))
+    char* hex_str = p;
+    for (uint16_t i = 0; i < arr_len; i++)
     {
-        comms_debug("Could not write SEND header.");
-        return;
+        uint8_t b = (uint8_t)hex_arr[i];
+        *p++ = hex_chars[b >> 4];
+        *p++ = hex_chars[b & 0xF];
     }
-    char hex_str[5];
-    memset(hex_str, 0, 5);
-    for (uint16_t i = 0; i < arr_len; i++)
+    *p++ = '\r';
+    *p++ = '\n';
+    _rak3172_ctx.send_len = p - _rak3172_send_buf;
+
+    if (_rak3172_ctx.echo)
+        uart_ring_out(CMD_UART, hex_str, p - hex_str);
+
+    /* Queued behind the quiet time after the last command rather than
+     * waiting it out here. */
+    _rak3172_ctx.send_busy = true;
+    if (!_rak3172_cmd_queue(NULL, _rak3172_match_send, done, RAK3172_ACK_TIMEOUT_MS, RAK3172_SEND_DELAY_MS))
     {
-        snprintf(hex_str, 3, "%02"PRIx8, hex_arr[i]);
-        _rak3172_write(hex_str);
-        uart_ring_out(CMD_UART, hex_str, 2);
+        _rak3172_ctx.send_busy = false;
+        return false;
     }
-    _rak3172_write("\r\n");
-    uart_ring_out(CMD_UART, "\r\n", 2);
-    _rak3172_ctx.state = RAK3172_STATE_SEND_WAIT_OK;
-    _rak3172_ctx.cmd_last_sent = get_since_boot_ms();
+    return true;
+}
+
+
+void rak3172_send(int8_t* hex_arr, uint16_t arr_len)
+{
+    _rak3172_send_payload(hex_arr, arr_len, _rak3172_send_done);
 }
 
 
 bool rak3172_get_connected(void)
 {
-    return (_rak3172_ctx.state == RAK3172_STATE_IDLE                ||
-            _rak3172_ctx.state == RAK3172_STATE_SEND_WAIT_REPLAY    ||
-            _rak3172_ctx.state == RAK3172_STATE_SEND_WAIT_OK        ||
-            _rak3172_ctx.state == RAK3172_STATE_SEND_WAIT_ACK       );
+    return (_rak3172_ctx.state == RAK3172_STATE_IDLE);
 }
 
 
@@ -762,14 +1053,20 @@ void rak3172_loop_iteration(void)
 {
     switch(_rak3172_ctx.state)
     {
-        case RAK3172_STATE_OFF:
-            break;
         case RAK3172_STATE_IDLE:
-            if (_rak3172_ctx.err_code)
+            if (_rak3172_ctx.err_code && rak3172_send_ready())
             {
                 protocol_send_error_code(_rak3172_ctx.err_code);
                 _rak3172_ctx.err_code = 0;
             }
+            else if (_rak3172_ctx.batch_pending && rak3172_send_ready())
+            {
+                protocol_send_cmd_results(_rak3172_ctx.batch_count, _rak3172_ctx.batch_ok);
+                _rak3172_ctx.batch_pending = false;
+            }
+            if (_rak3172_ctx.session &&
+                since_boot_delta(get_since_boot_ms(), _rak3172_ctx.session_start) > _rak3172_ctx.session_ms)
+                _rak3172_session_end();
             break;
         case RAK3172_STATE_RESETTING:
         {
@@ -779,49 +1076,36 @@ void rak3172_loop_iteration(void)
                 _rak3172_ctx.state = RAK3172_STATE_OFF;
                 _rak3172_chip_on();
             }
-            break;
+            return;
         }
-        case RAK3172_STATE_SEND_WAIT_ACK:
-            if (since_boot_delta(get_since_boot_ms(), _rak3172_ctx.cmd_last_sent) > RAK3172_ACK_TIMEOUT_MS)
-            {
-                comms_debug("TIMED OUT WAITING FOR ACK");
-                on_comms_sent_ack(false);
-                rak3172_reset();
-            }
-            break;
         default:
-            if (since_boot_delta(get_since_boot_ms(), _rak3172_ctx.cmd_last_sent) > RAK3172_TIMEOUT_MS)
-            {
-                comms_debug("TIMED OUT");
-                rak3172_reset();
-            }
             break;
     }
-}
-
-
-void _rak3172_send_alive(void)
-{
-    if (!rak3172_send_ready())
+    if (_rak3172_ctx.cmd_active)
     {
-        comms_debug("Attempted to send alive packet, not in idle state");
+        if (since_boot_delta(get_since_boot_ms(), _rak3172_ctx.cmd_last_sent) > _rak3172_ctx.cmd.timeout_ms)
+        {
+            comms_debug("TIMED OUT");
+            _rak3172_cmd_finish(RAK3172_CMD_TIMEOUT);
+        }
         return;
     }
+    _rak3172_cmd_kick();
+}
 
-    char send_packet[RAK3172_MSG_SEND_HEADER_LEN];
 
-    unsigned len = snprintf(
-        send_packet,
-        RAK3172_MSG_SEND_HEADER_LEN-1,
-        RAK3172_MSG_SEND_HEADER_FMT,
-        _rak3172_get_port());
+static void _rak3172_send_alive_done(char* cmd, rak3172_cmd_result_t result)
+{
+    _rak3172_ctx.send_busy = false;
+    comms_debug("'is alive' packet : %s", _rak3172_cmd_result_to_str(result));
+}
 
-    send_packet[len] = 0;
 
+static void _rak3172_send_alive(void)
+{
+    int8_t alive[] = { 0x12, 0x34 };
     comms_debug("Sending an 'is alive' packet.");
-    _rak3172_write(send_packet);
-    _rak3172_write("1234\r\n");
-    return;
+    _rak3172_send_payload(alive, sizeof(alive), _rak3172_send_alive_done);
 }
 
 
@@ -879,22 +1163,17 @@ static command_response_t _rak3172_reset_cb(char* args)
 }
 
 
+
+
 static const char* _rak3172_state_to_str(rak3172_state_t state)
 {
-    static const char state_strs[12][32] =
+    static const char state_strs[5][32] =
     {
         {"RAK3172_STATE_OFF"},
-        {"RAK3172_STATE_INIT_WAIT_BOOT"},
-        {"RAK3172_STATE_INIT_WAIT_OK"},
-        {"RAK3172_STATE_INIT_WAIT_REPLAY"},
-        {"RAK3172_STATE_JOIN_WAIT_OK"},
-        {"RAK3172_STATE_JOIN_WAIT_REPLAY"},
-        {"RAK3172_STATE_JOIN_WAIT_JOIN"},
+        {"RAK3172_STATE_INIT"},
+        {"RAK3172_STATE_JOIN"},
         {"RAK3172_STATE_RESETTING"},
         {"RAK3172_STATE_IDLE"},
-        {"RAK3172_STATE_SEND_WAIT_REPLAY"},
-        {"RAK3172_STATE_SEND_WAIT_OK"},
-        {"RAK3172_STATE_SEND_WAIT_ACK"},
     };
     static const char none[] = "";
     if (state >= ARRAY_SIZE(state_strs))
@@ -917,9 +1196,7 @@ static command_response_t _rak3172_state_cb(char* args)
     log_out("STATE: %s (%d)", _rak3172_state_to_str(_rak3172_ctx.state), _rak3172_ctx.state);
     switch (_rak3172_ctx.state)
     {
-        case RAK3172_STATE_INIT_WAIT_OK:
-            /* Fall through */
-        case RAK3172_STATE_INIT_WAIT_REPLAY:
+        case RAK3172_STATE_INIT:
             log_out("INIT COUNT         : %"PRIu8,  _rak3172_ctx.init_count);
             log_out("INIT MESSAGE       : %s",      _rak3172_init_count_to_str(_rak3172_ctx.init_count));
             break;
@@ -943,12 +1220,22 @@ static command_response_t _rak3172_state_cb(char* args)
         default:
             break;
     }
+    if (_rak3172_ctx.session)
+    {
+        uint32_t passed = since_boot_delta(get_since_boot_ms(), _rak3172_ctx.session_start);
+        uint32_t left = (passed < _rak3172_ctx.session_ms) ? _rak3172_ctx.session_ms - passed : 0;
+        log_out("CONFIG SESSION     : %"PRIu32" s left", left / 1000);
+    }
+    if (_rak3172_ctx.cmd_active)
+        log_out("WAITING ON         : %s", _rak3172_ctx.cmd.uplink ? "uplink" : _rak3172_ctx.cmd.cmd);
+    log_out("QUEUED             : %u", _rak3172_ctx.cmd_count);
     return COMMAND_RESP_OK;
 }
 
 
 static command_response_t _rak3172_restart_cb(char* args)
 {
+    _rak3172_cmd_flush();
     _rak3172_ctx.state          = RAK3172_STATE_OFF;
     _rak3172_ctx.reset_count    = 0;
     _rak3172_chip_off();
@@ -984,8 +1271,8 @@ static command_response_t _rak3172_tx_power_cb(char* str)
     command_response_t status = COMMAND_RESP_OK;
     if (str != np)
     {
-        status = _rak3172_printf("AT+TXP=%u", pwr) ? COMMAND_RESP_OK  :
-                                                     COMMAND_RESP_ERR ;
+        status = _rak3172_cmd_printf(_rak3172_cmd_done_log, "AT+TXP=%u", pwr) ? COMMAND_RESP_OK  :
+                                                                                 COMMAND_RESP_ERR ;
     }
     else
     {
@@ -998,8 +1285,8 @@ static command_response_t _rak3172_tx_power_cb(char* str)
 
 static command_response_t _rak3172_trssi_cb(char* str)
 {
-    return _rak3172_printf("AT+TRSSI=?") ? COMMAND_RESP_OK  :
-                                           COMMAND_RESP_ERR ;
+    return _rak3172_cmd_printf(_rak3172_cmd_done_log, "AT+TRSSI=?") ? COMMAND_RESP_OK  :
+                                                                       COMMAND_RESP_ERR ;
 }
 
 
@@ -1010,8 +1297,8 @@ static command_response_t _rak3172_ttx_cb(char* str)
     command_response_t status = COMMAND_RESP_OK;
     if (str != np)
     {
-        status = _rak3172_printf("AT+TTX=%u", inp) ? COMMAND_RESP_OK  :
-                                                     COMMAND_RESP_ERR ;
+        status = _rak3172_cmd_printf(_rak3172_cmd_done_log, "AT+TTX=%u", inp) ? COMMAND_RESP_OK  :
+                                                                                 COMMAND_RESP_ERR ;
     }
     else
     {
@@ -1029,8 +1316,8 @@ static command_response_t _rak3172_trx_cb(char* str)
     command_response_t status = COMMAND_RESP_OK;
     if (str != np)
     {
-        status = _rak3172_printf("AT+TRX=%u", inp) ? COMMAND_RESP_OK  :
-                                                     COMMAND_RESP_ERR ;
+        status = _rak3172_cmd_printf(_rak3172_cmd_done_log, "AT+TRX=%u", inp) ? COMMAND_RESP_OK  :
+                                                                                 COMMAND_RESP_ERR ;
     }
     else
     {
@@ -1041,6 +1328,57 @@ static command_response_t _rak3172_trx_cb(char* str)
 }
 
 
+static command_response_t _rak3172_dr_cb(char* str)
+{
+    char* np;
+    unsigned dr = strtoul(str, &np, 10);
+    if (str != np)
+    {
+        char buf[RAK3172_MAX_CMD_LEN];
+        snprintf(buf, RAK3172_MAX_CMD_LEN, RAK3172_MSG_DR"%u", dr);
+        _rak3172_ctx.dr_pending = _rak3172_ctx.dr;
+        return _rak3172_cmd_queue(buf, _rak3172_match_dr, _rak3172_dr_done, RAK3172_TIMEOUT_MS, 0) ? COMMAND_RESP_OK  :
+                                                                                                       COMMAND_RESP_ERR ;
+    }
+    log_out("DR: %"PRIu8, _rak3172_ctx.dr);
+    log_out("MTU: %"PRIu16, rak3172_get_mtu());
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _rak3172_session_cb(char* str)
+{
+    char* np;
+    unsigned mins = strtoul(str, &np, 10);
+    if (str == np)
+    {
+        log_out("Config session: %"PRIu8, (uint8_t)_rak3172_ctx.session);
+        return COMMAND_RESP_OK;
+    }
+    if (!rak3172_get_connected())
+    {
+        log_out("Not connected.");
+        return COMMAND_RESP_ERR;
+    }
+    if (mins)
+        _rak3172_session_start(mins);
+    else
+        _rak3172_session_end();
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _rak3172_echo_cb(char* str)
+{
+    char* np;
+    unsigned enabled = strtoul(str, &np, 10);
+    if (str != np)
+        _rak3172_ctx.echo = enabled;
+    log_out("Echo uplinks: %"PRIu8, (uint8_t)_rak3172_ctx.echo);
+    return COMMAND_RESP_OK;
+}
+
+
 struct cmd_link_t* rak3172_add_commands(struct cmd_link_t* tail)
 {
     static struct cmd_link_t cmds[] =
@@ -1057,12 +1395,16 @@ struct cmd_link_t* rak3172_add_commands(struct cmd_link_t* tail)
         { "comms_trssi",  "Start RF RSSI tone test",     _rak3172_trssi_cb             , false , NULL },
         { "comms_ttx",    "Start RF TX test",            _rak3172_ttx_cb               , false , NULL },
         { "comms_trx",    "Start RF RX test",            _rak3172_trx_cb               , false , NULL },
+        { "comms_dr",     "Get/set data rate",           _rak3172_dr_cb                , false , NULL },
+        { "comms_echo",   "Echo uplinks to command UART", _rak3172_echo_cb             , false , NULL },
+        { "comms_session", "Config session mins (0 ends)", _rak3172_session_cb         , false , NULL },
     };
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
 
 void rak3172_power_down(void)
 {
+    _rak3172_cmd_flush();
     _rak3172_ctx.state = RAK3172_STATE_OFF;
     _rak3172_chip_off();
 }
@@ -22,6 +22,7 @@
 #include "update.h"
 #include "pinmap.h"
 #include "lw.h"
+#include "energy.h"
 
 #define RAK4270_HEADER_SIZE                      17
 #define RAK4270_TAIL_SIZE                        2
@@ -409,6 +410,14 @@ static void _rak4270_soft_reset(void)
 }
 
 
+/* Radio is counted as on from the send until the chip answers it. */
+static void _rak4270_sent_ack(bool acked)
+{
+    energy_stop(ENERGY_TX);
+    on_comms_sent_ack(acked);
+}
+
+
 bool rak4270_send_ready(void)
 {
     return _rak4270_state_machine.state == RAK4270_STATE_IDLE;
@@ -424,6 +433,7 @@ bool rak4270_send_str(char* str)
     }
     _rak4270_state_machine.state = RAK4270_STATE_WAIT_OK;
     _rak4270_write("at+send=lora:%u:%s", _rak4270_get_port(), str);
+    energy_start(ENERGY_TX);
     _rak4270_backup_message.backup_type = RAK4270_BKUP_MSG_STR;
     strncpy(_rak4270_backup_message.string, str, strlen(str));
     return true;
@@ -443,7 +453,7 @@ static void _rak4270_retry_write(void)
         comms_debug("Failed to successfully resend (%u times), resetting chip.", RAK4270_MAX_RESEND);
         _rak4270_state_machine.resend_count = 0;
         rak4270_reset();
-        on_comms_sent_ack(false);
+        _rak4270_sent_ack(false);
         return;
     }
     _rak4270_state_machine.resend_count++;
@@ -759,7 +769,7 @@ static void _rak4270_handle_error(char* message)
         case RAK4270_ERROR_PACKET_SIZE:
             comms_debug("Packet size too large, reducing limit throwing data and resetting chip.");
             _rak4270_packet_max_size -= 2;
-            on_comms_sent_ack(false);
+            _rak4270_sent_ack(false);
             rak4270_reset();
             break;
         case RAK4270_ERROR_TIMEOUT_RX1:
@@ -800,7 +810,7 @@ static void _rak4270_handle_error(char* message)
         case RAK4270_ERROR_PAYLOAD_SIZE:
             comms_debug("Packet size not valid for current data rate, reducing limit throwing data and resetting chip.");
             _rak4270_packet_max_size -= 2;
-            on_comms_sent_ack(false);
+            _rak4270_sent_ack(false);
             rak4270_reset();
             break;
         case RAK4270_ERROR_INVLD_MIC:
@@ -881,7 +891,7 @@ static void _rak4270_process_wait_ack(char* message)
         _rak4270_state_machine.reset_count = 0;
         _rak4270_state_machine.resend_count = 0;
         _rak4270_clear_backup();
-        on_comms_sent_ack(true);
+        _rak4270_sent_ack(true);
     }
 }
 
@@ -1029,6 +1039,7 @@ void rak4270_send(int8_t* hex_arr, uint16_t arr_len)
         sent += _rak4270_write_to_uart("\r\n");
         uart_ring_out(CMD_UART, "\r\n", 2);
         _rak4270_state_machine.state = RAK4270_STATE_WAIT_OK;
+        energy_start(ENERGY_TX);
 
         if (_rak4270_backup_message.hex.arr != hex_arr)
         {
@@ -1083,7 +1094,7 @@ void rak4270_loop_iteration(void)
             {
                 if (_rak4270_state_machine.state == RAK4270_STATE_WAIT_OK || _rak4270_state_machine.state == RAK4270_STATE_WAIT_ACK)
                 {
-                    on_comms_sent_ack(false);
+                    _rak4270_sent_ack(false);
                 }
                 comms_debug("LoRa chip timed out, resetting.");
                 rak4270_reset();
@@ -12,6 +12,7 @@ typedef enum
     ADCS_KEY_CC,
     ADCS_KEY_BAT,
     ADCS_KEY_FTMA,
+    ADCS_KEY_MAINS,
 } adcs_keys_t;
 
 
@@ -33,6 +34,7 @@ extern adcs_resp_t adcs_collect_avg(uint32_t* avg, unsigned num_channels, unsign
 extern adcs_resp_t adcs_collect_avgs(uint32_t* avgs, unsigned num_channels, unsigned num_samples, adcs_keys_t key, uint32_t* time_taken);
 extern adcs_resp_t adcs_collect_rms(uint32_t* rms, uint32_t midpoint, unsigned num_channels, unsigned num_samples, unsigned cc_index, adcs_keys_t key, uint32_t* time_taken);
 extern adcs_resp_t adcs_collect_rmss(uint32_t* rmss, uint32_t* midpoints, unsigned num_channels, unsigned num_samples, adcs_keys_t key, uint32_t* time_taken);
+extern adcs_resp_t adcs_collect_raw(const uint16_t** samples, adcs_keys_t key, uint32_t* time_taken);
 extern adcs_resp_t adcs_wait_done(uint32_t timeout, adcs_keys_t key);
 extern void adcs_release(adcs_keys_t key);
 
@@ -38,6 +38,11 @@ extern bool osm_decompose_uart_str(char             * str,
 extern char * skip_space(char * pos);
 extern char * skip_to_space(char * pos);
 
+#define BASE64_ENCODED_LEN(_len_)   ((((_len_) + 2) / 3) * 4)
+
+extern unsigned base64_encode(const uint8_t * src, unsigned len, char * dst, unsigned dst_size);
+extern int      base64_decode(const char * src, unsigned len, uint8_t * dst, unsigned dst_size);
+
 
 /** FLAGS */
 /* Flag Masks */
@@ -56,6 +61,7 @@ extern char * skip_to_space(char * pos);
 #define IO_AS_INPUT         0x0100
 #define IO_DIR_LOCKED       0x0200
 #define IO_OUT_ON           0x0400
+#define IO_PULSE_HW         0x0800  /* Pulses counted by a timer if the IO has one. */
 
 /** ENUMS */
 /* Enum Masks */
@@ -98,6 +104,10 @@ typedef enum
     CUSTOM_1      = 15,
     IO_READING    = 16,
     CONFIG_REVISION = 17,
+    CAN           = 18,
+    PULSE_STATS   = 19,
+    ENERGY        = 20,
+    MAINS         = 21,
 } measurements_def_type_t;
 
 
@@ -115,6 +125,10 @@ typedef enum
 #define MEASUREMENTS_DEF_NAME_FW_VERSION        "FW_VERSION"
 #define MEASUREMENTS_DEF_NAME_CONFIG_REVISION   "CONFIG_REVISION"
 #define MEASUREMENTS_DEF_NAME_FTMA              "FTMA"
+#define MEASUREMENTS_DEF_NAME_CAN               "CAN"
+#define MEASUREMENTS_DEF_NAME_PULSE_STATS       "PULSE_STATS"
+#define MEASUREMENTS_DEF_NAME_ENERGY            "ENERGY"
+#define MEASUREMENTS_DEF_NAME_MAINS             "MAINS"
 
 #ifndef MEASUREMENTS_DEF_NAME_CUSTOM_0
 #define MEASUREMENTS_DEF_NAME_CUSTOM_0          "CUSTOM_0"
@@ -136,8 +150,8 @@ typedef struct
     uint8_t  is_immediate:1;                            // Should collect as soon to sending as possible.
 } measurements_def_t;
 
-#define MODBUS_BLOCK_SIZE 16
-#define MODBUS_BLOCKS  ((MODBUS_MEMORY_SIZE / MODBUS_BLOCK_SIZE) - 1) /* We have 1k and the first block is the bus description.*/
+#define MODBUS_MAX_DEVS 32
+#define MODBUS_MAX_REGS 160 /* Runtime table, the blob may fill up first with long names. */
 
 #define MODBUS_READ_HOLDING_FUNC 3
 #define MODBUS_READ_INPUT_FUNC 4
@@ -178,6 +192,7 @@ typedef enum
 } modbus_reg_state_t;
 
 
+/* Runtime form of a register, decoded from the blob's modbus_reg_rec_t. */
 typedef struct
 {
     char              name[MODBUS_NAME_LEN];
@@ -187,29 +202,53 @@ typedef struct
     uint8_t           value_state:4; /*modbus_reg_state_t*/
     uint16_t          reg_addr;
     uint16_t          unit_id;
-    uint16_t          next_reg_offset;
+    uint8_t           bus;  /* With the unit id, what its device is found by. */
 } __attribute__((__packed__)) modbus_reg_t;
 
 
+/* Blob holds these one after the other, a device's registers follow on
+ * from those of the devices before it. */
 typedef struct
 {
     char           name[MODBUS_NAME_LEN];
-    uint8_t        byte_order; /* modbus_byte_orders_t */
-    uint8_t        word_order; /* modbus_word_orders_t */
-    uint8_t        reg_count;
-    uint8_t        _;
     uint16_t       unit_id;
-    uint16_t       first_reg_offset;
-    uint16_t       next_dev_offset;
-    uint16_t       __;
+    uint8_t        byte_order:1; /* modbus_byte_orders_t */
+    uint8_t        word_order:1; /* modbus_word_orders_t */
+    uint8_t        bus:2;        /* Index into the model's modbus UARTs, 0 is EXT_UART. */
+    uint8_t        _:4;
+    uint8_t        reg_count;
 } __attribute__((__packed__)) modbus_dev_t;
 
+
+/* Sorted by address within the device, name is the next name_len + 1
+ * characters of the name pool. */
+typedef struct
+{
+    uint16_t       reg_addr;
+    uint8_t        type:3;       /* modbus_reg_type_t */
+    uint8_t        input:1;      /* MODBUS_READ_INPUT_FUNC, else MODBUS_READ_HOLDING_FUNC */
+    uint8_t        name_len:2;   /* Less one */
+    uint8_t        _:2;
+} __attribute__((__packed__)) modbus_reg_rec_t;
+
+/* Comms of the buses after the first, which keeps its own in modbus_bus_t. */
+typedef struct
+{
+    uint32_t baudrate;
+    uint8_t  binary_protocol:1;
+    uint8_t  stopbits:2;        /* osm_uart_stop_bits_t */
+    uint8_t  parity:2;          /* osm_uart_parity_t */
+    uint8_t  _:3;
+    uint8_t  databits;
+} __attribute__((__packed__)) modbus_bus_comms_t;
+
+#define MODBUS_EXTRA_BUSES 2
+
 typedef struct
 {
-    uint64_t _;
-    uint32_t __;
-    uint32_t next_free_offset;
-} __attribute__((__packed__)) modbus_free_t;
+    modbus_bus_comms_t comms[MODBUS_EXTRA_BUSES];
+    uint32_t _;
+} __attribute__((__packed__)) modbus_buses_t;
 
 typedef struct
 {
@@ -220,17 +259,22 @@ typedef struct
     uint8_t  parity:2;          /* osm_uart_parity_t */
     uint8_t  dev_count;
     uint32_t baudrate;
-    uint16_t first_dev_offset;
-    uint16_t first_free_offset;
-    uint32_t _;
-    modbus_free_t  blocks[MODBUS_BLOCKS];
+    uint16_t reg_count;
+    uint16_t names_len;
+    uint8_t  slave_unit_id;     /* Non-zero to answer reads as this unit instead of being master. */
+    uint8_t  cache_max_age_s;   /* Reads this recent are answered from the last reply, 0 for off. */
+    uint16_t _;
+    modbus_buses_t buses;
+    uint8_t  data[MODBUS_MEMORY_SIZE - 32]; /* Devices, then registers, then the name pool. */
 } __attribute__((__packed__)) modbus_bus_t;
 
-_Static_assert(((sizeof(modbus_bus_t) % MODBUS_BLOCK_SIZE) == 0) &&
-               (sizeof(modbus_free_t) == MODBUS_BLOCK_SIZE) &&
-               (sizeof(modbus_dev_t) == MODBUS_BLOCK_SIZE) &&
-               (sizeof(modbus_reg_t) == MODBUS_BLOCK_SIZE),
-               "Modbus blocks broken.");
+_Static_assert((sizeof(modbus_bus_t) == MODBUS_MEMORY_SIZE) &&
+               (sizeof(modbus_dev_t) == 8) &&
+               (sizeof(modbus_reg_rec_t) == 3) &&
+               (sizeof(modbus_buses_t) == 16) &&
+               (MODBUS_NAME_LEN == 4) &&
+               (MODBUS_MAX_REGS <= UINT8_MAX),
+               "Modbus blob broken.");
 
 typedef enum
 {
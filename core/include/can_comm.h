@@ -5,6 +5,10 @@
 
 
 #define CAN_COMM_MAX_DATA_SIZE                                      8
+#define CAN_COMM_FILTER_COUNT                                       4
+
+#define CAN_COMM_STD_ID_MASK                                        0x7FF
+#define CAN_COMM_EXT_ID_MASK                                        0x1FFFFFFF
 
 
 typedef uint8_t can_comm_data_t[CAN_COMM_MAX_DATA_SIZE];
@@ -24,13 +28,34 @@ typedef struct
     uint8_t*            data;
 } can_comm_packet_t;
 
+/* Fixed size record queued in can_comm_ring_data, one per received frame. */
+typedef struct
+{
+    can_comm_header_t   header;
+    can_comm_data_t     data;
+} can_comm_frame_t;
+
+/* Acceptance filter, frame accepted if (frame.id & mask) == (id & mask).
+ * If no filter is enabled, all frames are accepted. */
+typedef struct
+{
+    uint32_t            id;
+    uint32_t            mask;
+    uint8_t             enabled:1;
+    uint8_t             ext:1;
+    uint8_t             _:6;
+    uint8_t             __[3];
+} __attribute__((__packed__)) can_comm_filter_t;
+
 
 extern ring_buf_t can_comm_ring_data;
 
 
-extern void can_comm_init(void);
-extern void can_comm_send(can_comm_packet_t* pkt);
-extern void can_comm_enable(bool enabled);
+extern void     can_comm_init(void);
+extern void     can_comm_send(can_comm_packet_t* pkt);
+extern void     can_comm_enable(bool enabled);
+extern bool     can_comm_set_filters(can_comm_filter_t* filters, unsigned count);
+extern uint32_t can_comm_get_dropped(void);
 
 /* To be implemented by caller.*/
 extern void can_drain_array(void) __attribute__((weak));
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "config.h"
+
+
+/* Where the command starting at command ends, at the next
+ * CMDS_BATCH_SEPARATOR outside double quotes or at end. */
+extern char* cmds_batch_next(char* command, char* end);
@@ -1,6 +1,8 @@
 #pragma once
 
 #define LOG_LINELEN 64
+#define LOG_DEFER_RECORDS       16
+#define LOG_DEFER_ARGS_SIZE     32
 
 #define MEASURE_NAME_LEN            4
 #define MEASURE_NAME_NULLED_LEN     (MEASURE_NAME_LEN+1)
@@ -9,6 +11,10 @@
 
 #define MODBUS_MEMORY_SIZE 1024
 
+#define CMDS_MAX_COUNT              160
+#define CMDS_BATCH_SEPARATOR        ';'
+#define CMDS_SEQ_TAG                '#'
+
 /* On some versions of gcc this header isn't defining it. Quick fix. */
 #ifndef PRIu64
 #define PRIu64 "llu"
@@ -44,6 +50,10 @@
 
 #define PROTOCOL_HEX_ARRAY_SIZE 117
 
+#ifndef MEASUREMENTS_BACKLOG_SIZE
+#define MEASUREMENTS_BACKLOG_SIZE   1024
+#endif
+
 #define CMD_VUART 0
 #define UART_ERR_NU 0
 
@@ -55,7 +65,7 @@
 
 #define ARRAY_SIZE(_a) (sizeof(_a)/sizeof(_a[0]))
 
-#define MODBUS_BLOB_VERSION 2
+#define MODBUS_BLOB_VERSION 3
 
 #define ALIGN_TO(_x, _y) ((_x + _y -1 ) & ~(_y - 1)) ///< Align one number to another, for instance 16 for optimial addressing.
 #define ALIGN_16(_x) ALIGN_TO(_x, 16)                ///< Align given number to 16.
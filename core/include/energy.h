@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "base_types.h"
+#include "measurements.h"
+
+
+/* Indexed by measurement slot. Slots past this are counted as
+ * unaccounted rather than given a row. */
+#define ENERGY_MEAS_MAX                 48
+
+
+/* Things that draw current that aren't a measurement. */
+typedef enum
+{
+    ENERGY_SLEEP    = 0,
+    ENERGY_TX       = 1,
+    ENERGY_FLASH    = 2,
+    ENERGY_SOURCE_COUNT,
+} energy_source_t;
+
+
+typedef enum
+{
+    ENERGY_PHASE_INIT       = 0,
+    ENERGY_PHASE_ITERATE    = 1,
+    ENERGY_PHASE_COLLECT    = 2,
+    ENERGY_PHASE_COUNT,
+} energy_phase_t;
+
+
+typedef struct
+{
+    uint32_t    phase_ms[ENERGY_PHASE_COUNT];   // Time spent in the callbacks of each phase.
+    uint32_t    active_ms;                      // Time from a successful init to the collect, sensor powered.
+    uint16_t    collects;
+} energy_meas_t;
+
+
+typedef struct
+{
+    uint32_t        duration_ms;
+    uint32_t        source_ms[ENERGY_SOURCE_COUNT];
+    uint32_t        unaccounted_ms;             // Callbacks of measurement slots past ENERGY_MEAS_MAX.
+    energy_meas_t   meas[ENERGY_MEAS_MAX];
+} energy_interval_t;
+
+
+extern void     energy_add(energy_source_t source, uint32_t ms);
+extern void     energy_start(energy_source_t source);
+extern void     energy_stop(energy_source_t source);
+
+extern void     energy_meas_phase(unsigned index, energy_phase_t phase, uint32_t start_ms);
+extern void     energy_meas_begin(unsigned index);
+extern void     energy_meas_end(unsigned index);
+
+extern void     energy_interval_end(void);
+extern const energy_interval_t* energy_get_last(void);
+extern const char* energy_meas_name(unsigned index);
+
+extern struct cmd_link_t* energy_add_commands(struct cmd_link_t* tail);
+
+extern void     energy_inf_init(measurements_inf_t* inf);
+
+/* Optional, given each finished interval to keep as a trace. */
+extern void     energy_trace(const energy_interval_t* interval) __attribute__((weak));
@@ -31,10 +31,11 @@ extern unsigned ios_get_count(void);
 extern void     io_configure(unsigned io, bool as_input, io_pupd_t pull);
 
 
-extern bool     io_enable_pulsecount(unsigned io, io_pupd_t pupd, io_special_t edge);
+extern bool     io_enable_pulsecount(unsigned io, io_pupd_t pupd, io_special_t edge, bool hw);
 extern bool     io_enable_w1(unsigned io);
 
 extern bool     io_is_pulsecount_now(unsigned io);
+extern bool     io_is_pulsecount_hw(unsigned io);
 extern bool     io_is_w1_now(unsigned io);
 extern bool     io_is_watch_now(unsigned io);
 
@@ -5,6 +5,7 @@
 #include "config.h"
 
 extern bool log_async_log;
+extern bool log_defer;
 extern uint32_t log_debug_mask;
 
 extern void platform_raw_msg(const char * s);
@@ -18,6 +19,9 @@ extern void log_init(void);
 
 extern void log_debug_data(uint32_t flag, void * data, unsigned size);
 
+extern void     log_defer_drain(void);
+extern uint32_t log_defer_get_dropped(void);
+
 #ifdef NOPODEBUG
 inline static void _empty_log() {}
 #define log_sys_debug(...)      _empty_log(__VA_ARGS__)
@@ -32,19 +32,6 @@ typedef enum
 } measurements_value_type_t;
 
 
-typedef struct
-{
-    measurements_sensor_state_t     (* collection_time_cb)(char* name, uint32_t* collection_time);  // Function to retrieve the time in ms between calling the init function (init_cb) and collecting the value (get_cb)
-    measurements_sensor_state_t     (* init_cb)(char* name, bool in_isolation);                     // Function to start the process of retrieving the data
-    measurements_sensor_state_t     (* get_cb)(char* name, measurements_reading_t* value);          // Function to collect the value
-    void                            (* acked_cb)(char* name);                                       // Function to tell subsystem measurement was successfully sent.
-    measurements_sensor_state_t     (* iteration_cb)(char* name);                                   // Function that iterates between init and get.
-    void                            (* enable_cb)(char* name, bool enabled);                        // Function to inform measurement if active or not.
-    bool                            (* is_enabled_cb)(char* name);                                  // Function to get if it is already enabled.
-    measurements_value_type_t       (* value_type_cb)(char* name);                                  // Function to inform measurement of the value type.
-} measurements_inf_t;
-
-
 typedef struct
 {
     union
@@ -69,15 +56,32 @@ typedef struct
 } measurements_value_t;
 
 
+typedef struct
+{
+    measurements_sensor_state_t     (* collection_time_cb)(char* name, uint32_t* collection_time);  // Function to retrieve the time in ms between calling the init function (init_cb) and collecting the value (get_cb)
+    measurements_sensor_state_t     (* init_cb)(char* name, bool in_isolation);                     // Function to start the process of retrieving the data
+    measurements_sensor_state_t     (* get_cb)(char* name, measurements_reading_t* value);          // Function to collect the value
+    void                            (* acked_cb)(char* name);                                       // Function to tell subsystem measurement was successfully sent.
+    measurements_sensor_state_t     (* iteration_cb)(char* name);                                   // Function that iterates between init and get.
+    void                            (* enable_cb)(char* name, bool enabled);                        // Function to inform measurement if active or not.
+    bool                            (* is_enabled_cb)(char* name);                                  // Function to get if it is already enabled.
+    measurements_value_type_t       (* value_type_cb)(char* name);                                  // Function to inform measurement of the value type.
+    measurements_sensor_state_t     (* get_summary_cb)(char* name, measurements_value_t* value, uint8_t* num_samples); // Optional, collect a sum/min/max the subsystem aggregated itself over the interval, instead of get_cb.
+} measurements_inf_t;
+
+
 typedef struct
 {
     measurements_value_t    value;
-    uint8_t                 value_type:6;                                 /* measurements_value_type_t */
+    uint8_t                 value_type:4;                                 /* measurements_value_type_t */
+    uint8_t                 is_queued:1;                                  /* Due in the coming uplinks. */
+    uint8_t                 is_sent:1;                                    /* In an uplink waiting on ack. */
     uint8_t                 instant_send:1;
     uint8_t                 is_collecting:1;
     uint8_t                 num_samples;
     uint8_t                 num_samples_init;
     uint8_t                 num_samples_collected;
+    uint8_t                 is_backlogged:1;                              /* In the backlog, acked once it has all been sent. */
     uint32_t                collection_time_cache;
 
 } measurements_data_t;
@@ -88,6 +92,7 @@ typedef bool (*measurements_for_each_cb_t)(measurements_def_t* def, void * data)
 
 extern bool     measurements_get_measurements_def(char* name, measurements_def_t ** measurements_def, measurements_data_t ** measurements_data);
 extern bool     measurements_for_each(measurements_for_each_cb_t cb, void * data);
+extern bool     measurements_get_by_index(unsigned index, measurements_def_t ** measurements_def, measurements_data_t ** measurements_data);
 
 extern void     measurements_print(void);
 
@@ -104,7 +109,6 @@ extern void     measurements_init(void);
 extern void     measurements_set_debug_mode(bool enable);
 
 extern void     measurements_power_mode(measurements_power_mode_t mode);
-extern void     measurements_derive_cc_phase(void);
 extern bool     measurements_send_test(char * name);
 
 extern bool     measurements_enabled;
@@ -118,3 +122,6 @@ extern void     model_measurements_repopulate(void);
 extern bool     measurements_rename(char* orig_name, char* new_name_raw);
 
 extern struct cmd_link_t* measurements_add_commands(struct cmd_link_t* tail);
+
+/* Optional, given each single sample as it is taken. */
+extern void     measurements_sampled(unsigned index, measurements_value_type_t type, measurements_reading_t* value) __attribute__((weak));
@@ -22,12 +22,26 @@
 #define MEASUREMENTS_BATMON_NAME            "BAT"
 #define MEASUREMENTS_PULSE_COUNT_NAME_1     "CNT1"
 #define MEASUREMENTS_PULSE_COUNT_NAME_2     "CNT2"
+#define MEASUREMENTS_PULSE_RATE_NAME_1      "PRT1"
+#define MEASUREMENTS_PULSE_RATE_NAME_2      "PRT2"
+#define MEASUREMENTS_PULSE_IVAL_NAME_1      "PIV1"
+#define MEASUREMENTS_PULSE_IVAL_NAME_2      "PIV2"
 #define MEASUREMENTS_LIGHT_NAME             "LGHT"
 #define MEASUREMENTS_SOUND_NAME             "SND"
 #define MEASUREMENTS_FTMA_1_NAME            "FTA1"
 #define MEASUREMENTS_FTMA_2_NAME            "FTA2"
 #define MEASUREMENTS_FTMA_3_NAME            "FTA3"
 #define MEASUREMENTS_FTMA_4_NAME            "FTA4"
+#define MEASUREMENTS_ENERGY_AWAKE_NAME      "EAWK"
+#define MEASUREMENTS_ENERGY_TX_NAME         "ETX"
+#define MEASUREMENTS_ENERGY_FLASH_NAME      "EFLS"
+#define MEASUREMENTS_ENERGY_SENSE_NAME      "ESNS"
+#define MEASUREMENTS_MAINS_FREQ_NAME        "MFRQ"
+#define MEASUREMENTS_MAINS_THD_1_NAME       "THD1"
+#define MEASUREMENTS_MAINS_THD_2_NAME       "THD2"
+#define MEASUREMENTS_MAINS_THD_3_NAME       "THD3"
+#define MEASUREMENTS_MAINS_PHASE_2_NAME     "PHS2"
+#define MEASUREMENTS_MAINS_PHASE_3_NAME     "PHS3"
 
 #define MEASUREMENTS_LEGACY_PULSE_COUNT_NAME "PCNT"
 
@@ -7,25 +7,40 @@
 
 
 extern bool modbus_requires_echo_removal(void) __attribute__((weak));
+/* Driver enable of a bus that isn't on EXT_UART, left be if not given. */
+extern void modbus_bus_set_rs485_mode(unsigned uart, bool driver_enable) __attribute__((weak));
+
+/* Result of each register of a queued write, as its reply comes in. */
+extern void modbus_reg_write_result(unsigned bus, uint16_t unit_id, uint16_t reg_addr, bool success) __attribute__((weak));
+
+typedef struct
+{
+    uint16_t reg_addr;
+    uint16_t value;
+} modbus_reg_write_t;
 
 extern uint16_t modbus_crc(uint8_t * buf, unsigned length);
+extern uint16_t modbus_crc_continue(uint16_t crc, uint8_t * buf, unsigned length);
 
 extern bool modbus_start_read(modbus_reg_t * reg);
+extern unsigned modbus_write_batch(modbus_dev_t * dev, modbus_reg_write_t * regs, unsigned count);
 
-extern void modbus_setup(unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop, bool binary_framing);
+extern void modbus_setup(unsigned bus, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop, bool binary_framing);
 
 extern bool modbus_setup_from_str(char * str);
 extern bool modbus_add_dev_from_str(char* str);
 
-extern uint32_t modbus_start_delay(void);
-extern uint32_t modbus_stop_delay(void);
-
 extern bool modbus_has_pending(void);
+/* Called by modbus_mem before registers move, so none are left queued. */
+extern void modbus_regs_moving(void);
 
 extern void modbus_log();
 
-extern void modbus_uart_ring_in_process(ring_buf_t * ring);
-extern bool modbus_uart_ring_do_out_drain(ring_buf_t * ring);
+extern unsigned modbus_bus_count(void);
+extern bool modbus_uart_is_bus(unsigned uart);
+
+extern void modbus_uart_ring_in_process(unsigned uart, ring_buf_t * ring);
+extern bool modbus_uart_ring_do_out_drain(unsigned uart, ring_buf_t * ring);
 
 extern void modbus_bus_init(modbus_bus_t * bus);
 extern void modbus_init(void);
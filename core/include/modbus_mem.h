@@ -13,10 +13,16 @@ extern modbus_reg_type_t modbus_reg_type_from_str(const char * type, const char
 extern char *         modbus_reg_type_get_str(modbus_reg_type_t type);
 
 extern unsigned       modbus_get_device_count(void);
-extern modbus_dev_t * modbus_get_device_by_id(unsigned unit_id);
+extern modbus_dev_t * modbus_get_device_by_id(unsigned bus, unsigned unit_id);
 extern modbus_dev_t * modbus_get_device_by_name(char * name);
 
-extern modbus_dev_t * modbus_add_device(unsigned slave_id, char *name, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order);
+extern modbus_dev_t * modbus_add_device(unsigned slave_id, char *name, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order, unsigned bus);
+
+extern bool           modbus_bus_get_comms(unsigned bus, modbus_bus_comms_t * comms);
+extern bool           modbus_bus_set_comms(unsigned bus, modbus_bus_comms_t * comms);
+
+extern uint8_t        modbus_get_cache_max_age(void);
+extern bool           modbus_set_cache_max_age(uint8_t max_age_s);
 
 extern bool           modbus_for_each_dev(bool (*cb)(modbus_dev_t * dev, void * userdata), void * userdata);
 extern bool           modbus_dev_add_reg(modbus_dev_t * dev, char * name, modbus_reg_type_t type, uint8_t func, uint16_t reg_addr);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "measurements.h"
+
+
+/* Each measurement slot gets a block of registers at slot * MODBUS_SLAVE_BLOCK_REGS. */
+#define MODBUS_SLAVE_BLOCK_REGS         8
+
+#define MODBUS_SLAVE_REG_LAST           0   /* Float, MSW first */
+#define MODBUS_SLAVE_REG_MIN            2   /* Float, MSW first, this interval */
+#define MODBUS_SLAVE_REG_MAX            4   /* Float, MSW first, this interval */
+#define MODBUS_SLAVE_REG_AGE            6   /* Seconds since the last sample, 0xFFFF if none */
+#define MODBUS_SLAVE_REG_SAMPLES        7   /* Samples so far this interval */
+
+
+extern uint8_t  modbus_slave_get_unit_id(void);
+extern bool     modbus_slave_set_unit_id(uint8_t unit_id);
+
+extern unsigned modbus_slave_request(uint8_t * packet, unsigned len, unsigned size);
+
+extern void     modbus_slave_log(void);
@@ -36,3 +36,28 @@ typedef struct
     measurements_def_t      measurements_arr[MEASUREMENTS_MAX_NUMBER];
 } persist_measurements_storage_t;
 
+
+#define PERSIST_IMG_MAGIC                   0x434D534F /* "OSMC" */
+#define PERSIST_IMG_VERSION                 1
+
+
+/* Header of the binary config image moved over the command UART. */
+typedef struct
+{
+    uint32_t                magic;
+    uint16_t                img_version;
+    uint16_t                persist_version;
+    uint16_t                persist_size;
+    uint16_t                measurements_size;
+    uint16_t                crc;                /* Modbus CRC of what follows. */
+    uint8_t                 _[2];
+    /* 16 byte boundary ---- */
+} __attribute__((__packed__)) persist_img_header_t;
+
+
+typedef struct
+{
+    persist_img_header_t            header;
+    persist_storage_t               data;
+    persist_measurements_storage_t  measurements;
+} __attribute__((__packed__)) persist_img_t;
@@ -32,6 +32,8 @@ void platform_adc_set_regular_sequence(uint8_t num_channels, adcs_type_t* channe
 void platform_adc_start_conversion_regular(void);
 void platform_adc_power_off(void);
 void platform_adc_set_num_data(unsigned num_data);
+/* Between one conversion and the next, 0 if not known. */
+uint32_t platform_adc_get_sample_period_ns(void);
 
 void platform_hpm_enable(bool enable);
 
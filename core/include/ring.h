@@ -19,6 +19,7 @@ extern bool     ring_buf_add(ring_buf_t * ring_buf, char c);
 extern bool     ring_buf_add_data(ring_buf_t * ring_buf, void * data, unsigned size);
 extern void     ring_buf_add_str(ring_buf_t * ring_buf, char * s);
 extern unsigned ring_buf_get_pending(ring_buf_t * ring_buf);
+extern unsigned ring_buf_get_free(ring_buf_t * ring_buf);
 
 extern bool     ring_buf_is_full(ring_buf_t * ring_buf);
 
@@ -7,8 +7,14 @@
 extern unsigned uart_ring_in(unsigned uart, const char* s, unsigned len);
 extern unsigned uart_ring_out(unsigned uart, const char* s, unsigned len);
 
+extern unsigned uart_ring_in_get_free(unsigned uart);
+
+extern void     uart_ring_in_frame_end(unsigned uart);
+extern unsigned uart_ring_in_get_frame(unsigned uart);
+
 extern bool uart_ring_out_busy(unsigned uart);
 extern bool uart_rings_out_busy(void);
+extern bool uart_ring_out_wait(unsigned uart, unsigned len);
 
 extern void uart_ring_in_drain(unsigned uart);
 extern void uart_rings_in_drain();
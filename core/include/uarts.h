@@ -12,6 +12,10 @@ extern void uart_resetup(unsigned uart, unsigned speed, uint8_t databits, osm_ua
 extern bool uart_get_setup(unsigned uart, unsigned * speed, uint8_t * databits, osm_uart_parity_t * parity, osm_uart_stop_bits_t * stop);
 extern bool uart_resetup_str(unsigned uart, char * str);
 
+/* Idle time in bit times after which the port calls uart_ring_in_frame_end().
+ * Zero disables. Returns false if the UART can't do it. */
+extern bool uart_set_frame_timeout(unsigned uart, unsigned bits);
+
 extern bool uart_is_tx_empty(unsigned uart);
 
 extern void uart_blocking(unsigned uart, const char *data, int size);
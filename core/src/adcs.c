@@ -292,6 +292,30 @@ adcs_resp_t adcs_collect_avgs(uint32_t* avgs, unsigned num_channels, unsigned nu
 }
 
 
+/* The samples as the DMA left them, interleaved by channel, for those
+ * doing more with them than an average or RMS. Valid until released. */
+adcs_resp_t adcs_collect_raw(const uint16_t** samples, adcs_keys_t key, uint32_t* time_taken)
+{
+    if (!samples)
+    {
+        adc_debug("Handed NULL pointer.");
+        return ADCS_RESP_FAIL;
+    }
+    if (_adcs_in_use)
+    {
+        return ADCS_RESP_WAIT;
+    }
+    if (_adcs_active_key != key)
+        return ADCS_RESP_WAIT;
+
+    *samples = _adcs_buffer;
+
+    if (time_taken)
+        *time_taken = since_boot_delta(_adcs_end_time, _adcs_start_time);
+    return ADCS_RESP_OK;
+}
+
+
 static bool _adcs_wait_loop_iteration(void* userdata)
 {
     return !_adcs_in_use;
@@ -21,6 +21,84 @@ char * skip_to_space(char * pos)
 }
 
 
+static const char _base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+/* Returns the length written to dst (NULL terminated), 0 if it doesn't fit. */
+unsigned base64_encode(const uint8_t * src, unsigned len, char * dst, unsigned dst_size)
+{
+    unsigned out_len = BASE64_ENCODED_LEN(len);
+    if (out_len + 1 > dst_size)
+        return 0;
+    char * pos = dst;
+    for (unsigned n = 0; n < len; n += 3)
+    {
+        uint32_t v = (uint32_t)src[n] << 16;
+        if (n + 1 < len)
+            v |= (uint32_t)src[n + 1] << 8;
+        if (n + 2 < len)
+            v |= src[n + 2];
+        *pos++ = _base64_chars[(v >> 18) & 0x3F];
+        *pos++ = _base64_chars[(v >> 12) & 0x3F];
+        *pos++ = (n + 1 < len)?_base64_chars[(v >> 6) & 0x3F]:'=';
+        *pos++ = (n + 2 < len)?_base64_chars[v & 0x3F]:'=';
+    }
+    *pos = 0;
+    return out_len;
+}
+
+
+static int _base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+
+/* Returns the number of bytes decoded into dst, -1 if invalid or too big. */
+int base64_decode(const char * src, unsigned len, uint8_t * dst, unsigned dst_size)
+{
+    if (len % 4)
+        return -1;
+    unsigned out_len = 0;
+    for (unsigned n = 0; n < len; n += 4)
+    {
+        uint32_t v = 0;
+        unsigned pad = 0;
+        for (unsigned i = 0; i < 4; i++)
+        {
+            int c;
+            if (src[n + i] == '=' && n + 4 == len && i >= 2)
+            {
+                pad++;
+                c = 0;
+            }
+            else if (pad || (c = _base64_value(src[n + i])) < 0)
+                return -1;
+            v = (v << 6) | (uint32_t)c;
+        }
+        unsigned count = 3 - pad;
+        if (out_len + count > dst_size)
+            return -1;
+        dst[out_len++] = v >> 16;
+        if (count > 1)
+            dst[out_len++] = (v >> 8) & 0xFF;
+        if (count > 2)
+            dst[out_len++] = v & 0xFF;
+    }
+    return out_len;
+}
+
+
 #define IO_PULL_STR_NONE "NONE"
 #define IO_PULL_STR_UP   "UP"
 #define IO_PULL_STR_DOWN "DOWN"
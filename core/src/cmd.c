@@ -6,17 +6,21 @@
 #include <inttypes.h>
 
 #include "cmd.h"
+#include "cmd_batch.h"
 #include "io.h"
 #include "timers.h"
 #include "persist_config.h"
 #include "common.h"
 #include "log.h"
 #include "platform_model.h"
+#include "uart_rings.h"
+#include "pinmap.h"
 
 #define SERIAL_NUM_COMM_LEN         17
 
 
-static struct cmd_link_t* _cmds;
+static struct cmd_link_t* _cmds_sorted[CMDS_MAX_COUNT];
+static unsigned           _cmds_count = 0;
 
 
 static command_response_t _cmd_count_cb(char * args)
@@ -67,6 +71,16 @@ static command_response_t _cmd_debug_cb(char * args)
 }
 
 
+static command_response_t _cmd_log_defer_cb(char * args)
+{
+    char * pos = skip_space(args);
+    if (pos[0])
+        log_defer = strtoul(pos, NULL, 10);
+    log_out("Deferred debug : %s (%"PRIu32" dropped)", log_defer?"On":"Off", log_defer_get_dropped());
+    return COMMAND_RESP_OK;
+}
+
+
 static command_response_t _cmd_timer_cb(char* args)
 {
     char* pos = skip_space(args);
@@ -94,9 +108,76 @@ print_exit:
 }
 
 
+/* Binary search of the sorted command table, O(log(n) * len). */
+static struct cmd_link_t* _cmds_find(const char * key, unsigned keylen)
+{
+    unsigned low = 0;
+    unsigned high = _cmds_count;
+    while (low < high)
+    {
+        unsigned mid = (low + high) / 2;
+        struct cmd_link_t * cmd = _cmds_sorted[mid];
+        int r = strncmp(cmd->key, key, keylen);
+        if (!r && cmd->key[keylen])
+            r = 1;
+        if (!r)
+            return cmd;
+        if (r < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+
+/* The listing is longer than the out ring, so it is let out as it goes,
+ * and cut short rather than the response's end line being dropped. */
+static void _cmds_print_unknown(char * command)
+{
+    log_out("Unknown command \"%s\"", command);
+    log_out(LOG_SPACER);
+    for(unsigned i = 0; i < _cmds_count; i++)
+    {
+        struct cmd_link_t * cmd = _cmds_sorted[i];
+        if (cmd->hidden)
+            continue;
+        /* This line, and the end line after it. */
+        if (!uart_ring_out_wait(CMD_VUART, 2 * LOG_LINELEN))
+        {
+            log_out("...");
+            return;
+        }
+        log_out("%10s : %s", cmd->key, cmd->desc);
+    }
+}
+
+
+static command_response_t _cmds_process_one(char * command, unsigned len)
+{
+    while(len && command[len-1] == ' ')
+        command[--len] = 0;
+
+    if (!len)
+        return COMMAND_RESP_ERR;
+
+    unsigned keylen = 0;
+    while(command[keylen] && command[keylen] != ' ')
+        keylen++;
+
+    struct cmd_link_t * cmd = _cmds_find(command, keylen);
+    if (!cmd)
+    {
+        _cmds_print_unknown(command);
+        return COMMAND_RESP_ERR;
+    }
+    return cmd->cb(skip_space(command + keylen));
+}
+
+
 command_response_t cmds_process(char * command, unsigned len)
 {
-    if (!_cmds)
+    if (!_cmds_count)
     {
         log_out("Commands not filled.");
         return COMMAND_RESP_ERR;
@@ -106,47 +187,98 @@ command_response_t cmds_process(char * command, unsigned len)
         return COMMAND_RESP_ERR;
 
     log_sys_debug("Command \"%s\"", command);
+    /* Keep deferred debug where it would have been around the response. */
+    log_defer_drain();
 
-    bool found = false;
-    log_out(LOG_START_SPACER);
-    command_response_t resp = COMMAND_RESP_ERR;
-    char * args;
-    for(struct cmd_link_t * cmd = _cmds; cmd; cmd = cmd->next)
+    /* "#<seq> <command>" tags the response so a host can pipeline
+     * commands and match responses to them. */
+    bool tagged = false;
+    unsigned seq = 0;
+    if (command[0] == CMDS_SEQ_TAG)
     {
-        unsigned keylen = strlen(cmd->key);
-        if(len >= keylen &&
-           !strncmp(cmd->key, command, keylen) &&
-           (command[keylen] == '\0' || command[keylen] == ' '))
+        char * np;
+        seq = strtoul(command + 1, &np, 10);
+        if (np != command + 1)
         {
-            found = true;
-            args = skip_space(command + keylen);
-            while(command[len-1] == ' ')
-                command[--len] = 0;
-            resp = cmd->cb(args);
-            break;
+            tagged = true;
+            len -= np - command;
+            command = np;
         }
     }
-    if (!found)
+
+    /* A line may hold several commands separated by CMDS_BATCH_SEPARATOR,
+     * all answered in one response, stopping at the first failure. One
+     * in double quotes is part of the command. */
+    if (tagged)
+        log_out(LOG_START_SPACER"%c%u", CMDS_SEQ_TAG, seq);
+    else
+        log_out(LOG_START_SPACER);
+    command_response_t resp = COMMAND_RESP_ERR;
+    char * end = command + len;
+    unsigned index = 0;
+    while(command < end)
     {
-        log_out("Unknown command \"%s\"", command);
-        log_out(LOG_SPACER);
-        for(struct cmd_link_t * cmd = _cmds; cmd; cmd = cmd->next)
+        char * sep = cmds_batch_next(command, end);
+        if (sep < end)
+            *sep = 0;
+        command = skip_space(command);
+        if (command < sep)
         {
-            if (!cmd->hidden)
-                log_out("%10s : %s", cmd->key, cmd->desc);
+            resp = _cmds_process_one(command, sep - command);
+            if (resp == COMMAND_RESP_ERR)
+            {
+                if (index)
+                    log_out("Batch stopped at command %u.", index + 1);
+                break;
+            }
+            index++;
         }
+        command = sep + 1;
     }
-    log_out(LOG_END_SPACER);
+    log_defer_drain();
+    if (tagged)
+        /* Free space lets the host size how much it keeps in flight. */
+        log_out(LOG_END_SPACER"%c%u %s %u", CMDS_SEQ_TAG, seq,
+                (resp == COMMAND_RESP_OK) ? "OK" : "ERR",
+                uart_ring_in_get_free(CMD_UART));
+    else
+        log_out(LOG_END_SPACER);
     return resp;
 }
 
 
+static void _cmds_sort(struct cmd_link_t * cmds)
+{
+    _cmds_count = 0;
+    for(struct cmd_link_t * cmd = cmds; cmd; cmd = cmd->next)
+    {
+        if (_cmds_count >= CMDS_MAX_COUNT)
+        {
+            log_error("Too many commands, \"%s\" and after dropped.", cmd->key);
+            return;
+        }
+        /* Insertion sort, only done once at start up. */
+        unsigned pos = _cmds_count;
+        while(pos && strcmp(_cmds_sorted[pos-1]->key, cmd->key) > 0)
+        {
+            _cmds_sorted[pos] = _cmds_sorted[pos-1];
+            pos--;
+        }
+        if (pos && !strcmp(_cmds_sorted[pos-1]->key, cmd->key))
+            log_error("Command \"%s\" registered twice.", cmd->key);
+        _cmds_sorted[pos] = cmd;
+        _cmds_count++;
+    }
+}
+
+
 void cmds_init(void)
 {
     static struct cmd_link_t cmds[] = {
         { "count",        "Counts of controls.",      _cmd_count_cb                  , false , NULL},
         { "version",      "Print version.",           _cmd_version_cb                , false , NULL},
         { "debug",        "Set hex debug mask",       _cmd_debug_cb                  , false , NULL},
+        { "log_defer",    "Set/get deferred debug",   _cmd_log_defer_cb              , false , NULL},
         { "timer",        "Test usecs timer",         _cmd_timer_cb                  , false , NULL},
         { "serial_num",   "Set/get serial number",    _cmd_serial_num_cb             , true  , NULL},
     };
@@ -157,5 +289,5 @@ void cmds_init(void)
         cur->next = cur + 1;
 
     model_cmds_add_all(tail);
-    _cmds = cmds;
+    _cmds_sort(cmds);
 }
@@ -0,0 +1,17 @@
+#include <stdbool.h>
+
+#include "cmd_batch.h"
+
+
+char* cmds_batch_next(char* command, char* end)
+{
+    bool quoted = false;
+    for (; command < end; command++)
+    {
+        if (*command == '"')
+            quoted = !quoted;
+        else if (*command == CMDS_BATCH_SEPARATOR && !quoted)
+            return command;
+    }
+    return end;
+}
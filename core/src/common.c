@@ -13,6 +13,8 @@
 #include "config.h"
 #include "log.h"
 #include "pinmap.h"
+#include "can_comm.h"
+#include "pulsecount.h"
 
 
 bool msg_is(const char* ref, char* message)
@@ -136,6 +138,10 @@ bool main_loop_iterate_for(uint32_t timeout, bool (*should_exit_db)(void *userda
         }
 
         uart_rings_out_drain();
+        if (can_drain_array)
+            can_drain_array();
+        if (pulsecount_drain)
+            pulsecount_drain();
         platform_tight_loop();
         if (should_exit_db(userdata))
             return true;
@@ -179,10 +185,8 @@ struct cmd_link_t* add_commands(struct cmd_link_t* tail, struct cmd_link_t* cmds
 }
 
 
-uint16_t modbus_crc(uint8_t * buf, unsigned length)
+uint16_t modbus_crc_continue(uint16_t crc, uint8_t * buf, unsigned length)
 {
-    uint16_t crc = 0xFFFF;
-
     for (unsigned pos = 0; pos < length; pos++)
     {
         crc ^= (uint16_t)buf[pos];        // XOR byte into least sig. byte of crc
@@ -200,3 +204,9 @@ uint16_t modbus_crc(uint8_t * buf, unsigned length)
     }
     return crc;
 }
+
+
+uint16_t modbus_crc(uint8_t * buf, unsigned length)
+{
+    return modbus_crc_continue(0xFFFF, buf, length);
+}
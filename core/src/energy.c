@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "energy.h"
+
+#include "log.h"
+#include "common.h"
+#include "measurements.h"
+
+
+typedef struct
+{
+    uint32_t    start_ms;
+    bool        running;
+} energy_timer_t;
+
+
+static energy_interval_t    _energy_current                         = {0};
+static energy_interval_t    _energy_last                            = {0};
+static uint32_t             _energy_interval_start                  = 0;
+static energy_timer_t       _energy_source_timers[ENERGY_SOURCE_COUNT] = {0};
+static energy_timer_t       _energy_meas_timers[ENERGY_MEAS_MAX]    = {0};
+
+
+static const char* _energy_source_names[ENERGY_SOURCE_COUNT] =
+{
+    [ENERGY_SLEEP] = "Sleep",
+    [ENERGY_TX]    = "TX",
+    [ENERGY_FLASH] = "Flash",
+};
+
+
+void energy_add(energy_source_t source, uint32_t ms)
+{
+    if (source >= ENERGY_SOURCE_COUNT)
+        return;
+    _energy_current.source_ms[source] += ms;
+}
+
+
+/* Already running is left be, so a resend counts from the first try. */
+void energy_start(energy_source_t source)
+{
+    if (source >= ENERGY_SOURCE_COUNT || _energy_source_timers[source].running)
+        return;
+    _energy_source_timers[source].start_ms = get_since_boot_ms();
+    _energy_source_timers[source].running = true;
+}
+
+
+void energy_stop(energy_source_t source)
+{
+    if (source >= ENERGY_SOURCE_COUNT || !_energy_source_timers[source].running)
+        return;
+    _energy_source_timers[source].running = false;
+    energy_add(source, since_boot_delta(get_since_boot_ms(), _energy_source_timers[source].start_ms));
+}
+
+
+static bool _energy_meas_valid(unsigned index)
+{
+    static bool warned = false;
+    if (index < ENERGY_MEAS_MAX)
+        return true;
+    if (!warned)
+    {
+        log_error("Measurement slot %u past the energy table (%u), not accounted.", index, ENERGY_MEAS_MAX);
+        warned = true;
+    }
+    return false;
+}
+
+
+void energy_meas_phase(unsigned index, energy_phase_t phase, uint32_t start_ms)
+{
+    if (phase >= ENERGY_PHASE_COUNT)
+        return;
+    uint32_t ms = since_boot_delta(get_since_boot_ms(), start_ms);
+    if (!_energy_meas_valid(index))
+    {
+        _energy_current.unaccounted_ms += ms;
+        return;
+    }
+    energy_meas_t* meas = &_energy_current.meas[index];
+    meas->phase_ms[phase] += ms;
+    if (phase == ENERGY_PHASE_COLLECT)
+        meas->collects++;
+}
+
+
+static void _energy_meas_active_add(unsigned index, uint32_t now)
+{
+    energy_timer_t* timer = &_energy_meas_timers[index];
+    if (!timer->running)
+        return;
+    _energy_current.meas[index].active_ms += since_boot_delta(now, timer->start_ms);
+    timer->start_ms = now;
+}
+
+
+void energy_meas_begin(unsigned index)
+{
+    if (!_energy_meas_valid(index))
+        return;
+    uint32_t now = get_since_boot_ms();
+    /* Init again without a collect, count what there was. */
+    _energy_meas_active_add(index, now);
+    _energy_meas_timers[index].start_ms = now;
+    _energy_meas_timers[index].running = true;
+}
+
+
+void energy_meas_end(unsigned index)
+{
+    if (!_energy_meas_valid(index))
+        return;
+    _energy_meas_active_add(index, get_since_boot_ms());
+    _energy_meas_timers[index].running = false;
+}
+
+
+/* NULL for a slot with no measurement in it (now). */
+const char* energy_meas_name(unsigned index)
+{
+    measurements_def_t* def;
+    if (!measurements_get_by_index(index, &def, NULL))
+        return NULL;
+    return def->name;
+}
+
+
+void energy_interval_end(void)
+{
+    uint32_t now = get_since_boot_ms();
+    /* Split anything still running at the boundary between intervals. */
+    for (unsigned i = 0; i < ENERGY_SOURCE_COUNT; i++)
+    {
+        energy_timer_t* timer = &_energy_source_timers[i];
+        if (!timer->running)
+            continue;
+        energy_add(i, since_boot_delta(now, timer->start_ms));
+        timer->start_ms = now;
+    }
+    for (unsigned i = 0; i < ENERGY_MEAS_MAX; i++)
+        _energy_meas_active_add(i, now);
+
+    _energy_current.duration_ms = since_boot_delta(now, _energy_interval_start);
+    memcpy(&_energy_last, &_energy_current, sizeof(energy_interval_t));
+    _energy_interval_start = now;
+
+    _energy_current.duration_ms = 0;
+    memset(_energy_current.source_ms, 0, sizeof(_energy_current.source_ms));
+    _energy_current.unaccounted_ms = 0;
+    for (unsigned i = 0; i < ENERGY_MEAS_MAX; i++)
+    {
+        energy_meas_t* meas = &_energy_current.meas[i];
+        memset(meas->phase_ms, 0, sizeof(meas->phase_ms));
+        meas->active_ms = 0;
+        meas->collects = 0;
+    }
+
+    if (energy_trace)
+        energy_trace(&_energy_last);
+}
+
+
+const energy_interval_t* energy_get_last(void)
+{
+    return &_energy_last;
+}
+
+
+static uint32_t _energy_awake_ms(const energy_interval_t* interval)
+{
+    uint32_t sleep_ms = interval->source_ms[ENERGY_SLEEP];
+    return (interval->duration_ms > sleep_ms)?(interval->duration_ms - sleep_ms):0;
+}
+
+
+static uint32_t _energy_sense_ms(const energy_interval_t* interval)
+{
+    uint32_t total = 0;
+    for (unsigned i = 0; i < ENERGY_MEAS_MAX; i++)
+        total += interval->meas[i].active_ms;
+    return total;
+}
+
+
+static void _energy_print(const energy_interval_t* interval)
+{
+    log_out("Interval : %"PRIu32"ms", interval->duration_ms);
+    log_out("Awake : %"PRIu32"ms", _energy_awake_ms(interval));
+    for (unsigned i = 0; i < ENERGY_SOURCE_COUNT; i++)
+        log_out("%s : %"PRIu32"ms", _energy_source_names[i], interval->source_ms[i]);
+    if (interval->unaccounted_ms)
+        log_out("Unaccounted : %"PRIu32"ms", interval->unaccounted_ms);
+    log_out("Name\tInit\tIter\tCollect\tActive\tCount");
+    for (unsigned i = 0; i < ENERGY_MEAS_MAX; i++)
+    {
+        const energy_meas_t* meas = &interval->meas[i];
+        const char* name = energy_meas_name(i);
+        if (!name)
+            continue;
+        log_out("%s\t%"PRIu32"\t%"PRIu32"\t%"PRIu32"\t%"PRIu32"\t%"PRIu16,
+            name,
+            meas->phase_ms[ENERGY_PHASE_INIT],
+            meas->phase_ms[ENERGY_PHASE_ITERATE],
+            meas->phase_ms[ENERGY_PHASE_COLLECT],
+            meas->active_ms,
+            meas->collects);
+    }
+}
+
+
+static command_response_t _energy_cb(char* args)
+{
+    char* p = skip_space(args);
+    if (strncmp(p, "now", 3) == 0)
+    {
+        _energy_current.duration_ms = since_boot_delta(get_since_boot_ms(), _energy_interval_start);
+        _energy_print(&_energy_current);
+        return COMMAND_RESP_OK;
+    }
+    if (p[0])
+    {
+        log_out("energy [now]");
+        return COMMAND_RESP_ERR;
+    }
+    _energy_print(&_energy_last);
+    return COMMAND_RESP_OK;
+}
+
+
+struct cmd_link_t* energy_add_commands(struct cmd_link_t* tail)
+{
+    static struct cmd_link_t cmds[] = {{ "energy",       "Time awake/asleep/in TX per interval.", _energy_cb , false , NULL }};
+    return add_commands(tail, cmds, ARRAY_SIZE(cmds));
+}
+
+
+static measurements_sensor_state_t _energy_get(char* name, measurements_reading_t* value)
+{
+    if (!value)
+    {
+        measurements_debug("Handed NULL pointer.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    const energy_interval_t* interval = &_energy_last;
+    if (!interval->duration_ms)
+        /* No whole interval yet. */
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    if (strncmp(name, MEASUREMENTS_ENERGY_AWAKE_NAME, MEASURE_NAME_LEN) == 0)
+        value->v_i64 = _energy_awake_ms(interval);
+    else if (strncmp(name, MEASUREMENTS_ENERGY_TX_NAME, MEASURE_NAME_LEN) == 0)
+        value->v_i64 = interval->source_ms[ENERGY_TX];
+    else if (strncmp(name, MEASUREMENTS_ENERGY_FLASH_NAME, MEASURE_NAME_LEN) == 0)
+        value->v_i64 = interval->source_ms[ENERGY_FLASH];
+    else if (strncmp(name, MEASUREMENTS_ENERGY_SENSE_NAME, MEASURE_NAME_LEN) == 0)
+        value->v_i64 = _energy_sense_ms(interval);
+    else
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_value_type_t _energy_value_type(char* name)
+{
+    return MEASUREMENTS_VALUE_TYPE_I64;
+}
+
+
+void energy_inf_init(measurements_inf_t* inf)
+{
+    inf->get_cb         = _energy_get;
+    inf->value_type_cb  = _energy_value_type;
+}
@@ -227,7 +227,7 @@ static unsigned io_pull(io_pupd_t pull)
 }
 
 
-bool io_enable_pulsecount(unsigned io, io_pupd_t pupd, io_special_t edge)
+bool io_enable_pulsecount(unsigned io, io_pupd_t pupd, io_special_t edge, bool hw)
 {
     if (io >= ARRAY_SIZE(ios_pins))
         return false;
@@ -244,6 +244,11 @@ bool io_enable_pulsecount(unsigned io, io_pupd_t pupd, io_special_t edge)
     ios_state[io] &= ~IO_ACTIVE_SPECIAL_MASK;
     ios_state[io] |= edge;
 
+    if (hw)
+        ios_state[io] |= IO_PULSE_HW;
+    else
+        ios_state[io] &= ~IO_PULSE_HW;
+
     w1_enable(io, false);
     io_watch_enable(io, false, pupd);
     pulsecount_enable(io, true, pupd, edge);
@@ -286,7 +291,7 @@ void     io_configure(unsigned io, bool as_input, io_pupd_t pull)
 
     if ((io_state & IO_ACTIVE_SPECIAL_MASK))
     {
-        ios_state[io] &= ~IO_ACTIVE_SPECIAL_MASK;
+        ios_state[io] &= ~(IO_ACTIVE_SPECIAL_MASK | IO_PULSE_HW);
         w1_enable(io, false);
         pulsecount_enable(io, false, IO_PUPD_NONE, IO_SPECIAL_NONE);
         io_debug("%02u : NO LONGER SPECIAL", io);
@@ -343,6 +348,15 @@ bool io_is_pulsecount_now(unsigned io)
 }
 
 
+bool io_is_pulsecount_hw(unsigned io)
+{
+    if (io >= ARRAY_SIZE(ios_pins))
+        return false;
+
+    return io_is_pulsecount_now(io) && (ios_state[io] & IO_PULSE_HW);
+}
+
+
 bool io_is_watch_now(unsigned io)
 {
     if (io >= ARRAY_SIZE(ios_pins))
@@ -434,7 +448,8 @@ void     io_log(unsigned io)
             pupd_char = 'N';
         else
             pupd_char = ' ';
-        log_out("IO %02u : %s%s%sUSED %s %c", io, pretype, type, posttype, active_type, pupd_char);
+        log_out("IO %02u : %s%s%sUSED %s %c%s", io, pretype, type, posttype, active_type, pupd_char,
+                (io_state & IO_PULSE_HW)?" HW":"");
     }
 }
 
@@ -557,7 +572,7 @@ static command_response_t _io_cb(char *args)
 
 static command_response_t _io_cmd_enable_pulsecount_cb(char * args)
 {
-    /* <io> <R/F/B> <U/D/N>
+    /* <io> <R/F/B> <U/D/N> [H]
      */
     char * pos = NULL;
     unsigned io = strtoul(args, &pos, 10);
@@ -585,13 +600,16 @@ static command_response_t _io_cmd_enable_pulsecount_cb(char * args)
     else
         goto bad_exit;
 
-    if (io_enable_pulsecount(io, pupd, edge))
+    pos = skip_space(pos+1);
+    bool hw = (pos[0] == 'H');
+
+    if (io_enable_pulsecount(io, pupd, edge, hw))
         log_out("IO %02u pulsecount enabled", io);
     else
         log_out("IO %02u has no pulsecount", io);
     return COMMAND_RESP_OK;
 bad_exit:
-    log_out("<io> <R/F/B> <U/D/N>");
+    log_out("<io> <R/F/B> <U/D/N> [H]");
     return COMMAND_RESP_ERR;
 }
 
@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 
 #include "log.h"
@@ -12,6 +13,7 @@
 
 uint32_t log_debug_mask = DEBUG_SYS | DEBUG_COMMS | DEBUG_MEASUREMENTS | DEBUG_LIGHT;
 bool     log_async_log  = false;
+bool     log_defer      = false;
 
 
 extern void platform_raw_msg(const char * s)
@@ -53,6 +55,295 @@ static void log_msgv(unsigned uart, bool blocking, const char * prefix, const ch
 }
 
 
+/* Deferred debug logging stores the format string and raw arguments,
+ * formatting is done later from the main loop by log_defer_drain().
+ * Records are claimed with a compare and swap so ISRs may log. */
+
+typedef enum
+{
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+} log_arg_type_t;
+
+
+typedef struct
+{
+    const char *        fmt;
+    uint32_t            ts;
+    volatile uint8_t    ready;
+    uint8_t             args_len;
+    uint8_t             args[LOG_DEFER_ARGS_SIZE];
+} log_defer_record_t;
+
+
+static log_defer_record_t   _log_defer_records[LOG_DEFER_RECORDS];
+static volatile unsigned    _log_defer_w        = 0;
+static volatile unsigned    _log_defer_r        = 0;
+static volatile uint32_t    _log_defer_dropped  = 0;
+
+
+/* Parse a conversion after the '%', returns the conversion character
+ * or 0 if not supported. */
+static char _log_spec_parse(const char ** pos, unsigned * stars, log_arg_type_t * type)
+{
+    const char * p = *pos;
+    *stars = 0;
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    for (unsigned n = 0; n < 2; n++)
+    {
+        if (*p == '*')
+        {
+            (*stars)++;
+            p++;
+        }
+        else while (*p >= '0' && *p <= '9')
+            p++;
+        if (n || *p != '.')
+            break;
+        p++;
+    }
+    unsigned longs = 0;
+    log_arg_type_t sized = LOG_ARG_NONE;
+    while (*p && strchr("hlzjt", *p))
+    {
+        if (*p == 'l')
+            longs++;
+        else if (*p == 'z')
+            sized = LOG_ARG_SIZE;
+        else if (*p == 'j')
+            sized = LOG_ARG_INTMAX;
+        else if (*p == 't')
+            sized = LOG_ARG_PTRDIFF;
+        p++;
+    }
+    char conv = *p;
+    if (!conv)
+        return 0;
+    *pos = p + 1;
+    switch (conv)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            *type = (sized != LOG_ARG_NONE)?sized:(longs > 1)?LOG_ARG_LLONG:(longs)?LOG_ARG_LONG:LOG_ARG_INT;
+            return (sized != LOG_ARG_NONE && longs)?0:conv;
+        case 'c':
+            *type = LOG_ARG_INT;
+            return conv;
+        case 'f': case 'e': case 'g': case 'E': case 'G':
+            *type = LOG_ARG_DOUBLE;
+            return conv;
+        case 'p':
+            *type = LOG_ARG_PTR;
+            return conv;
+        case 's':
+            *type = LOG_ARG_STR;
+            return conv;
+        case '%':
+            *type = LOG_ARG_NONE;
+            return conv;
+        default:
+            return 0;
+    }
+}
+
+
+#define _LOG_ARG_PACK(_type_)                                               \
+{                                                                           \
+    _type_ _v = va_arg(ap, _type_);                                         \
+    if (len + sizeof(_v) > LOG_DEFER_ARGS_SIZE)                             \
+        return false;                                                       \
+    memcpy(args + len, &_v, sizeof(_v));                                    \
+    len += sizeof(_v);                                                      \
+}
+
+
+static bool _log_defer_pack(const char * fmt, va_list ap, uint8_t * args, uint8_t * args_len)
+{
+    unsigned len = 0;
+    while ((fmt = strchr(fmt, '%')))
+    {
+        fmt++;
+        unsigned stars;
+        log_arg_type_t type;
+        if (!_log_spec_parse(&fmt, &stars, &type))
+            return false;
+        while (stars--)
+            _LOG_ARG_PACK(int);
+        switch (type)
+        {
+            case LOG_ARG_INT:       _LOG_ARG_PACK(int);         break;
+            case LOG_ARG_LONG:      _LOG_ARG_PACK(long);        break;
+            case LOG_ARG_LLONG:     _LOG_ARG_PACK(long long);   break;
+            case LOG_ARG_SIZE:      _LOG_ARG_PACK(size_t);      break;
+            case LOG_ARG_INTMAX:    _LOG_ARG_PACK(intmax_t);    break;
+            case LOG_ARG_PTRDIFF:   _LOG_ARG_PACK(ptrdiff_t);   break;
+            case LOG_ARG_DOUBLE:    _LOG_ARG_PACK(double);      break;
+            case LOG_ARG_PTR:       _LOG_ARG_PACK(void*);       break;
+            case LOG_ARG_STR:
+            {
+                /* Strings are often on the stack, so copied. */
+                const char * str = va_arg(ap, const char *);
+                if (!str)
+                    str = "(null)";
+                if (len >= LOG_DEFER_ARGS_SIZE)
+                    return false;
+                unsigned str_len = strnlen(str, LOG_DEFER_ARGS_SIZE - len);
+                if (str_len >= LOG_DEFER_ARGS_SIZE - len)
+                    return false;
+                memcpy(args + len, str, str_len);
+                args[len + str_len] = 0;
+                len += str_len + 1;
+                break;
+            }
+            default: break;
+        }
+    }
+    *args_len = len;
+    return true;
+}
+
+
+#define _LOG_ARG_FORMAT(_type_)                                             \
+{                                                                           \
+    _type_ _v;                                                              \
+    memcpy(&_v, args, sizeof(_v));                                          \
+    args += sizeof(_v);                                                     \
+    n = snprintf(out, end - out, spec, _v);                                 \
+}
+
+
+static unsigned _log_defer_format(log_defer_record_t * record, char * buf, unsigned size)
+{
+    const char * fmt = record->fmt;
+    const uint8_t * args = record->args;
+    char * out = buf;
+    char * end = buf + size;
+    while (*fmt && out < end - 1)
+    {
+        if (*fmt != '%')
+        {
+            *out++ = *fmt++;
+            continue;
+        }
+        /* Rebuild the conversion with any '*' as the stored number. */
+        const char * spec_start = fmt++;
+        unsigned stars;
+        log_arg_type_t type;
+        _log_spec_parse(&fmt, &stars, &type);
+        char spec[24];
+        char * spec_pos = spec;
+        for (const char * p = spec_start; p < fmt && spec_pos < spec + sizeof(spec) - 12; p++)
+        {
+            if (*p == '*')
+            {
+                int v;
+                memcpy(&v, args, sizeof(v));
+                args += sizeof(v);
+                spec_pos += snprintf(spec_pos, 12, "%d", v);
+            }
+            else *spec_pos++ = *p;
+        }
+        *spec_pos = 0;
+        int n = 0;
+        switch (type)
+        {
+            case LOG_ARG_INT:       _LOG_ARG_FORMAT(int);       break;
+            case LOG_ARG_LONG:      _LOG_ARG_FORMAT(long);      break;
+            case LOG_ARG_LLONG:     _LOG_ARG_FORMAT(long long); break;
+            case LOG_ARG_SIZE:      _LOG_ARG_FORMAT(size_t);    break;
+            case LOG_ARG_INTMAX:    _LOG_ARG_FORMAT(intmax_t);  break;
+            case LOG_ARG_PTRDIFF:   _LOG_ARG_FORMAT(ptrdiff_t); break;
+            case LOG_ARG_DOUBLE:    _LOG_ARG_FORMAT(double);    break;
+            case LOG_ARG_PTR:       _LOG_ARG_FORMAT(void*);     break;
+            case LOG_ARG_STR:
+                n = snprintf(out, end - out, spec, (const char*)args);
+                args += strlen((const char*)args) + 1;
+                break;
+            default:
+                *out++ = '%';
+                break;
+        }
+        if (n > 0)
+            out += ((unsigned)n < (unsigned)(end - out))?(unsigned)n:(unsigned)(end - out - 1);
+    }
+    *out = 0;
+    return out - buf;
+}
+
+
+/* Returns false if the arguments can't be stored raw, for the caller to
+ * format the message now rather than lose any of it. */
+static bool _log_defer(const char * fmt, va_list ap)
+{
+    uint8_t args[LOG_DEFER_ARGS_SIZE];
+    uint8_t args_len;
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    bool packed = _log_defer_pack(fmt, ap_copy, args, &args_len);
+    va_end(ap_copy);
+    if (!packed)
+        return false;
+
+    unsigned w;
+    do
+    {
+        w = _log_defer_w;
+        if (w - _log_defer_r >= LOG_DEFER_RECORDS)
+        {
+            __sync_add_and_fetch(&_log_defer_dropped, 1);
+            return true;
+        }
+    }
+    while (!__sync_bool_compare_and_swap(&_log_defer_w, w, w + 1));
+
+    log_defer_record_t * record = &_log_defer_records[w % LOG_DEFER_RECORDS];
+    record->ts = get_since_boot_ms();
+    record->fmt = fmt;
+    record->args_len = args_len;
+    memcpy(record->args, args, args_len);
+    __sync_synchronize();
+    record->ready = 1;
+    return true;
+}
+
+
+void log_defer_drain(void)
+{
+    /* Only what was there at the start, formatting can log more. */
+    unsigned w = _log_defer_w;
+    while (_log_defer_r != w)
+    {
+        log_defer_record_t * record = &_log_defer_records[_log_defer_r % LOG_DEFER_RECORDS];
+        if (!record->ready)
+            break;
+        char prefix[18];
+        char line[LOG_LINELEN];
+        snprintf(prefix, sizeof(prefix), "DEBUG:%010u:", (unsigned)record->ts);
+        unsigned len = _log_defer_format(record, line, sizeof(line));
+        uart_ring_out(UART_ERR_NU, prefix, strlen(prefix));
+        uart_ring_out(UART_ERR_NU, line, len);
+        uart_ring_out(UART_ERR_NU, "\n\r", 2);
+        record->ready = 0;
+        __sync_synchronize();
+        _log_defer_r++;
+    }
+}
+
+
+uint32_t log_defer_get_dropped(void)
+{
+    return _log_defer_dropped;
+}
+
+
 void log_debug(uint32_t flag, const char *s, ...)
 {
     if (!(flag & log_debug_mask))
@@ -61,6 +352,12 @@ void log_debug(uint32_t flag, const char *s, ...)
     va_list ap;
     va_start(ap, s);
 
+    if (log_defer && log_async_log && _log_defer(s, ap))
+    {
+        va_end(ap);
+        return;
+    }
+
     char prefix[18];
 
     snprintf(prefix, sizeof(prefix), "DEBUG:%010u:", (unsigned)get_since_boot_ms());
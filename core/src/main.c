@@ -18,6 +18,8 @@
 #include "protocol.h"
 #include "measurements.h"
 #include "debug_mode.h"
+#include "can_comm.h"
+#include "pulsecount.h"
 
 
 #define SLOW_FLASHING_TIME_SEC              3000
@@ -75,6 +77,10 @@ int osm_main(void)
             uart_rings_in_drain();
             uart_rings_out_drain();
             measurements_loop_iteration();
+            if (can_drain_array)
+                can_drain_array();
+            if (pulsecount_drain)
+                pulsecount_drain();
             platform_tight_loop();
         }
         protocol_loop_iteration();
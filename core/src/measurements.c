@@ -16,6 +16,8 @@
 #include "platform.h"
 #include "platform_model.h"
 #include "protocol.h"
+#include "ring.h"
+#include "energy.h"
 
 
 #define MEASUREMENTS_DEFAULT_COLLECTION_TIME    (uint32_t)1000
@@ -43,6 +45,14 @@ typedef struct
 } measurements_info_t;
 
 
+/* Header of an interval's encoded records held while not connected. */
+typedef struct
+{
+    uint32_t    timestamp;
+    uint8_t     len;
+} __attribute__((__packed__)) measurements_backlog_header_t;
+
+
 static uint32_t                     _last_sent_ms                                        = 0;
 static bool                         _pending_send                                        = false;
 static measurements_check_time_t    _check_time                                          = {0, 0};
@@ -54,8 +64,16 @@ bool                                 measurements_enabled
 
 static measurements_power_mode_t    _measurements_power_mode                             = MEASUREMENTS_POWER_MODE_AUTO;
 
-static unsigned _measurements_chunk_start_pos = 0;
-static unsigned _measurements_chunk_prev_start_pos = 0;
+static uint32_t                     _measurements_queued_interval   = 0;
+static bool                         _measurements_group_enabled     = true;
+static uint8_t                      _measurements_group_cands[MEASUREMENTS_MAX_NUMBER];
+static unsigned                     _measurements_group_cands_count = 0;
+
+static char                         _measurements_backlog_buf[MEASUREMENTS_BACKLOG_SIZE];
+static ring_buf_t                   _measurements_backlog           = RING_BUF_INIT(_measurements_backlog_buf, sizeof(_measurements_backlog_buf));
+static unsigned                     _measurements_backlog_inflight  = 0;
+static uint32_t                     _measurements_backlog_dropped   = 0;
+static uint32_t                     _measurements_backlog_last_ms   = 0;
 
 
 uint32_t transmit_interval = MEASUREMENTS_DEFAULT_TRANSMIT_INTERVAL; /* in minutes, defaulting to 15 minutes */
@@ -65,6 +83,9 @@ uint32_t transmit_interval = MEASUREMENTS_DEFAULT_TRANSMIT_INTERVAL; /* in minut
 #define MEASUREMENTS_MIN_TRANSMIT_MS                (15 * 1000)
 
 
+static bool _measurements_get_reading2(measurements_def_t* def, measurements_data_t* data, measurements_reading_t* reading, measurements_value_type_t* type);
+
+
 bool measurements_get_measurements_def(char* name, measurements_def_t ** measurements_def, measurements_data_t ** measurements_data)
 {
     if (!name || strlen(name) > MEASURE_NAME_LEN || !name[0])
@@ -88,6 +109,30 @@ bool measurements_get_measurements_def(char* name, measurements_def_t ** measure
 }
 
 
+/* Slot index, stable for as long as the measurement isn't deleted. */
+bool measurements_get_by_index(unsigned index, measurements_def_t ** measurements_def, measurements_data_t ** measurements_data)
+{
+    if (index >= MEASUREMENTS_MAX_NUMBER || !_measurements_arr.def)
+        return false;
+
+    measurements_def_t * def = &_measurements_arr.def[index];
+    if (!def->name[0])
+        return false;
+
+    if (measurements_def)
+        *measurements_def = def;
+    if (measurements_data)
+        *measurements_data = &_measurements_arr.data[index];
+    return true;
+}
+
+
+static unsigned _measurements_index(measurements_def_t* def)
+{
+    return def - _measurements_arr.def;
+}
+
+
 static bool _measurements_send_start(void)
 {
     if (!protocol_init())
@@ -145,6 +190,267 @@ bool measurements_send_test(char * name)
 }
 
 
+static bool _measurements_backlog_drop_oldest(void)
+{
+    measurements_backlog_header_t header;
+    if (ring_buf_read(&_measurements_backlog, (char*)&header, sizeof(header)) != sizeof(header))
+        return false;
+    ring_buf_discard(&_measurements_backlog, header.len);
+    _measurements_backlog_dropped++;
+    return true;
+}
+
+
+static void _measurements_backlog_push(uint32_t timestamp, int8_t* records, unsigned len)
+{
+    if (!len)
+        return;
+    unsigned size = sizeof(measurements_backlog_header_t) + len;
+    if (size > _measurements_backlog.size - 1)
+    {
+        _measurements_backlog_dropped++;
+        return;
+    }
+    while (ring_buf_get_free(&_measurements_backlog) < size)
+    {
+        /* Oldest goes first, unless it's waiting on an ack. */
+        if (_measurements_backlog_inflight || !_measurements_backlog_drop_oldest())
+        {
+            measurements_debug("Backlog full, dropping readings.");
+            _measurements_backlog_dropped++;
+            return;
+        }
+    }
+    measurements_backlog_header_t header = { .timestamp = timestamp, .len = len };
+    ring_buf_add_data(&_measurements_backlog, &header, sizeof(header));
+    ring_buf_add_data(&_measurements_backlog, records, len);
+}
+
+
+static void _measurements_backlog_push_protocol(uint32_t timestamp)
+{
+    int8_t* records;
+    unsigned len = protocol_get_records(&records);
+    _measurements_backlog_push(timestamp, records, len);
+}
+
+
+/* Encode the interval's readings as they would have been sent and keep
+ * them until there is a connection to send them on. */
+static void _measurements_backlog_store(void)
+{
+    uint32_t now = get_since_boot_ms();
+    if (!protocol_init_backlog())
+        return;
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t*  def  = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!def->interval || (_interval_count % def->interval))
+            continue;
+        if (data->num_samples)
+        {
+            if (!protocol_append_measurement(def, data))
+            {
+                _measurements_backlog_push_protocol(now);
+                if (!protocol_init_backlog() || !protocol_append_measurement(def, data))
+                    measurements_debug("Failed to store \"%s\".", def->name);
+            }
+            data->is_backlogged = 1;
+        }
+        memset(&data->value, 0, sizeof(measurements_value_t));
+        data->num_samples = 0;
+        data->num_samples_init = 0;
+        data->num_samples_collected = 0;
+    }
+    _measurements_backlog_push_protocol(now);
+    measurements_debug("Backlog %u bytes.", ring_buf_get_pending(&_measurements_backlog));
+}
+
+
+/* Append as many whole backlog records as fit after what is already in
+ * the protocol buffer. They are released once the send is acked. */
+static bool _measurements_backlog_append(void)
+{
+    if (_measurements_backlog_inflight || _measurements_debug_mode)
+        return false;
+    /* Walk a copy so nothing is taken out until acked. */
+    ring_buf_t walk = _measurements_backlog;
+    uint32_t now = get_since_boot_ms();
+    unsigned added = 0;
+    measurements_backlog_header_t header;
+    int8_t records[PROTOCOL_HEX_ARRAY_SIZE];
+    while (ring_buf_peek(&walk, (char*)&header, sizeof(header)) == sizeof(header))
+    {
+        if (header.len > sizeof(records))
+            break;
+        ring_buf_discard(&walk, sizeof(header));
+        if (ring_buf_read(&walk, (char*)records, header.len) != header.len)
+            break;
+        uint32_t age_s = since_boot_delta(now, header.timestamp) / 1000;
+        if (!protocol_append_backlog(age_s, records, header.len))
+        {
+            int8_t* pending;
+            if (added || protocol_get_records(&pending))
+                break;
+            /* Kept at a faster data rate than is used now. */
+            measurements_debug("Backlog record too long for the uplink, dropping.");
+            _measurements_backlog_drop_oldest();
+            walk = _measurements_backlog;
+            continue;
+        }
+        added += sizeof(header) + header.len;
+    }
+    _measurements_backlog_inflight = added;
+    if (added)
+        measurements_debug("Sending %u bytes of backlog.", added);
+    return added > 0;
+}
+
+
+/* Subsystems count from their last ack, so each stored reading includes
+ * those before it. Only once all of them are sent is what they counted
+ * acked, a record dropped from a full backlog is then still in the next. */
+static void _measurements_backlog_sent_ack(bool ack)
+{
+    bool was_inflight = (_measurements_backlog_inflight > 0);
+    if (ack)
+        ring_buf_discard(&_measurements_backlog, _measurements_backlog_inflight);
+    _measurements_backlog_inflight = 0;
+    if (!ack || !was_inflight || ring_buf_get_pending(&_measurements_backlog))
+        return;
+
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t*  def  = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!data->is_backlogged)
+            continue;
+        data->is_backlogged = 0;
+        measurements_inf_t inf;
+        if (model_measurements_get_inf(def, NULL, &inf) && inf.acked_cb)
+            inf.acked_cb(def->name);
+    }
+}
+
+
+/* Catch up between intervals with uplinks holding only backlog. */
+static void _measurements_backlog_send(void)
+{
+    if (!ring_buf_get_pending(&_measurements_backlog) ||
+        _measurements_backlog_inflight ||
+        _pending_send ||
+        _measurements_debug_mode ||
+        !protocol_get_connected() ||
+        !protocol_send_ready())
+        return;
+    uint32_t now = get_since_boot_ms();
+    if (since_boot_delta(now, _measurements_backlog_last_ms) < MEASUREMENTS_MIN_TRANSMIT_MS)
+        return;
+    _measurements_backlog_last_ms = now;
+    if (!protocol_init() || !_measurements_backlog_append())
+        return;
+    protocol_send();
+}
+
+
+static void _measurements_send_unqueue(void)
+{
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        _measurements_arr.data[i].is_queued = 0;
+        _measurements_arr.data[i].is_sent = 0;
+    }
+}
+
+
+static void _measurements_send_queue_due(void)
+{
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t*  def  = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!def->interval || (_interval_count % def->interval))
+            continue;
+        if (data->num_samples == 0)
+        {
+            data->num_samples_init = 0;
+            data->num_samples_collected = 0;
+            log_error("Measurement \"%s\" requested but value not set.", def->name);
+            continue;
+        }
+        data->is_queued = 1;
+    }
+}
+
+
+/* Instant send readings not yet sent, ahead of anything else. */
+static unsigned _measurements_send_pack_instant(void)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t* def = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!data->instant_send)
+            continue;
+        measurements_reading_t reading;
+        measurements_value_type_t type;
+        if (!_measurements_get_reading2(def, data, &reading, &type))
+        {
+            data->instant_send = 0;
+            measurements_debug("Could not get measurement '%s' for instant send.", def->name);
+            continue;
+        }
+        if (!protocol_append_instant_measurement(def, &reading, type))
+        {
+            /* Left flagged for the next uplink. */
+            measurements_debug("No room for measurement '%s' in this uplink.", def->name);
+            continue;
+        }
+        data->instant_send = 0;
+        count++;
+    }
+    return count;
+}
+
+
+/* First fit of the queued measurements into what is left of the uplink,
+ * so one that doesn't fit doesn't stop smaller ones behind it. */
+static unsigned _measurements_send_pack(bool immediate, unsigned* num_left)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t*  def  = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!data->is_queued || (bool)def->is_immediate != immediate)
+            continue;
+        if (!protocol_append_measurement(def, data))
+        {
+            int8_t* records;
+            if (protocol_get_records(&records))
+            {
+                (*num_left)++;
+                continue;
+            }
+            log_error("Measurement \"%s\" too long for an uplink, dropping.", def->name);
+        }
+        else
+        {
+            data->is_sent = 1;
+            count++;
+        }
+        data->is_queued = 0;
+        memset(&data->value, 0, sizeof(measurements_value_t));
+        data->num_samples = 0;
+        data->num_samples_init = 0;
+        data->num_samples_collected = 0;
+    }
+    return count;
+}
+
+
 static void _measurements_send(void)
 {
     uint16_t            num_qd = 0;
@@ -155,15 +461,18 @@ static void _measurements_send(void)
     {
         if (!has_printed_no_con)
         {
-            measurements_debug("Not connected to send, dropping readings");
+            measurements_debug("Not connected to send, keeping readings in backlog");
             has_printed_no_con = true;
-            _measurements_chunk_start_pos = _measurements_chunk_prev_start_pos = 0;
         }
+        _measurements_send_unqueue();
         _pending_send = false;
-        if (_measurements_debug_mode)
-            _last_sent_ms = get_since_boot_ms();
-        else
+        _measurements_backlog_inflight = 0;
+        _last_sent_ms = get_since_boot_ms();
+        if (!_measurements_debug_mode)
+        {
+            _measurements_backlog_store();
             return;
+        }
     }
 
     has_printed_no_con = false;
@@ -181,7 +490,7 @@ static void _measurements_send(void)
             {
                 measurements_debug("Pending send timed out.");
                 protocol_reset();
-                _measurements_chunk_start_pos = _measurements_chunk_prev_start_pos = 0;
+                _measurements_send_unqueue();
                 _pending_send = false;
             }
             return;
@@ -194,56 +503,29 @@ static void _measurements_send(void)
     if (!_measurements_send_start())
         return;
 
-    if (_measurements_chunk_start_pos == MEASUREMENTS_MAX_NUMBER)
-        _measurements_chunk_start_pos = 0;
-
-    unsigned i = _measurements_chunk_start_pos;
-
-    if (_measurements_chunk_start_pos)
-        measurements_debug("Resuming previous measurements send.");
-
-    for (; i < MEASUREMENTS_MAX_NUMBER; i++)
+    if (_measurements_queued_interval != _interval_count)
     {
-        measurements_def_t*  def  = &_measurements_arr.def[i];
-        measurements_data_t* data = &_measurements_arr.data[i];
-        if (def->interval && (_interval_count % def->interval == 0))
-        {
-            if (data->num_samples == 0)
-            {
-                data->num_samples_init = 0;
-                data->num_samples_collected = 0;
-                log_error("Measurement \"%s\" requested but value not set.", def->name);
-                continue;
-            }
-            if (!protocol_append_measurement(def, data))
-            {
-                measurements_debug("Failed to queue send of  \"%s\".", def->name);
-                _measurements_chunk_prev_start_pos = _measurements_chunk_start_pos;
-                _measurements_chunk_start_pos = i;
-                break;
-            }
-            num_qd++;
-            memset(&data->value, 0, sizeof(measurements_value_t));
-            data->num_samples = 0;
-            data->num_samples_init = 0;
-            data->num_samples_collected = 0;
-        }
-    }
-    bool is_max = i == MEASUREMENTS_MAX_NUMBER;
-    if (is_max)
-    {
-        if (_measurements_chunk_start_pos)
-            /* Last of fragments */
-            _measurements_chunk_prev_start_pos = _measurements_chunk_start_pos;
-        else
-            _measurements_chunk_prev_start_pos = 0;
-        _measurements_chunk_start_pos = MEASUREMENTS_MAX_NUMBER;
+        _measurements_queued_interval = _interval_count;
+        _measurements_send_queue_due();
     }
+    else measurements_debug("Resuming previous measurements send.");
+
+    /* The uplink is sized by the comms' current MTU. Instant and
+     * immediate measurements go first so they are never what waits for
+     * the next fragment. */
+    unsigned num_left = 0;
+    num_qd += _measurements_send_pack_instant();
+    num_qd += _measurements_send_pack(true, &num_left);
+    num_qd += _measurements_send_pack(false, &num_left);
+    bool is_max = !num_left;
 
     if (!_pending_send)
         _last_sent_ms = get_since_boot_ms();
+    if (is_max && _measurements_backlog_append())
+        num_qd++;
     if (num_qd > 0)
     {
+        _measurements_backlog_last_ms = get_since_boot_ms();
         _pending_send = !is_max;
         if (_measurements_debug_mode)
             protocol_debug();
@@ -252,8 +534,9 @@ static void _measurements_send(void)
         if (is_max)
             measurements_debug("Complete send");
         else
-            measurements_debug("Fragment send, wait to send more.");
+            measurements_debug("Fragment send, %u measurements wait to send.", num_left);
     }
+    else _pending_send = false;
 }
 
 
@@ -291,18 +574,21 @@ static uint32_t _measurements_get_collection_time(measurements_def_t* def, measu
 
 void on_protocol_sent_ack(bool ack)
 {
+    _measurements_backlog_sent_ack(ack);
     if (!ack)
     {
-        _measurements_chunk_prev_start_pos = _measurements_chunk_start_pos = 0;
-         _pending_send = false;
+        _measurements_send_unqueue();
+        _pending_send = false;
         return;
     }
 
-    for (unsigned i = _measurements_chunk_prev_start_pos; i < _measurements_chunk_start_pos; i++)
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
     {
         measurements_def_t*  def  = &_measurements_arr.def[i];
-        if (!def->name[0])
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!data->is_sent)
             continue;
+        data->is_sent = 0;
         measurements_inf_t inf;
         if (!model_measurements_get_inf(def, NULL, &inf))
             continue;
@@ -312,8 +598,6 @@ void on_protocol_sent_ack(bool ack)
     }
     if (_pending_send)
         _measurements_send();
-    else
-        _measurements_chunk_prev_start_pos = _measurements_chunk_start_pos = 0;
 }
 
 
@@ -349,13 +633,16 @@ static void _measurements_sample_init_iteration(measurements_def_t* def, measure
         measurements_debug("%s has no init function (optional).", def->name);
         return;
     }
+    uint32_t start_ms = get_since_boot_ms();
     measurements_sensor_state_t resp = inf.init_cb(def->name, false);
+    energy_meas_phase(_measurements_index(def), ENERGY_PHASE_INIT, start_ms);
     switch(resp)
     {
         case MEASUREMENTS_SENSOR_STATE_SUCCESS:
             measurements_debug("%s successfully init'd.", def->name);
             data->num_samples_init++;
             data->is_collecting = 1;
+            energy_meas_begin(_measurements_index(def));
             break;
         case MEASUREMENTS_SENSOR_STATE_ERROR:
             measurements_debug("%s could not init, will not collect.", def->name);
@@ -386,7 +673,9 @@ static bool _measurements_sample_iteration_iteration(measurements_def_t* def, me
         // Iteration callbacks are optional
         return false;
     }
+    uint32_t start_ms = get_since_boot_ms();
     measurements_sensor_state_t resp = inf.iteration_cb(def->name);
+    energy_meas_phase(_measurements_index(def), ENERGY_PHASE_ITERATE, start_ms);
     switch (resp)
     {
         case MEASUREMENTS_SENSOR_STATE_SUCCESS:
@@ -396,6 +685,7 @@ static bool _measurements_sample_iteration_iteration(measurements_def_t* def, me
             data->num_samples_init++;
             data->num_samples_collected++;
             data->is_collecting = 0;
+            energy_meas_end(_measurements_index(def));
             return false;
         case MEASUREMENTS_SENSOR_STATE_BUSY:
             return true;
@@ -472,6 +762,8 @@ good_exit:
     measurements_debug("Min : %"PRIi64, data->value.value_64.min);
     measurements_debug("Max : %"PRIi64, data->value.value_64.max);
 
+    if (measurements_sampled)
+        measurements_sampled(data - _measurements_arr.data, MEASUREMENTS_VALUE_TYPE_I64, &new_value);
     return true;
 }
 
@@ -537,11 +829,61 @@ good_exit:
     measurements_debug("Min : %"PRIi32".%03"PRIu32, data->value.value_f.min/1000, (uint32_t)abs(data->value.value_f.min)%1000);
     measurements_debug("Max : %"PRIi32".%03"PRIu32, data->value.value_f.max/1000, (uint32_t)abs(data->value.value_f.max)%1000);
 
+    if (measurements_sampled)
+        measurements_sampled(data - _measurements_arr.data, MEASUREMENTS_VALUE_TYPE_FLOAT, &new_value);
     return true;
 }
 
 
-static bool _measurements_sample_get_iteration(measurements_def_t* def, measurements_data_t* data)
+/* The subsystem summarised the whole interval itself, so replace rather
+ * than accumulate. */
+static bool _measurements_sample_get_summary_iteration(measurements_def_t* def, measurements_data_t* data, measurements_inf_t* inf)
+{
+    if (!def || !data || !inf)
+    {
+        measurements_debug("Handed a NULL pointer.");
+        return false;
+    }
+    measurements_value_t new_value;
+    uint8_t num_samples = 0;
+    measurements_sensor_state_t resp = inf->get_summary_cb(def->name, &new_value, &num_samples);
+    data->is_collecting = 0;
+    switch (resp)
+    {
+        case MEASUREMENTS_SENSOR_STATE_SUCCESS:
+            measurements_debug("%s successfully collect'd.", def->name);
+            data->num_samples_collected++;
+            break;
+        case MEASUREMENTS_SENSOR_STATE_ERROR:
+            measurements_debug("%s could not collect.", def->name);
+            data->num_samples_collected++;
+            return false;
+        case MEASUREMENTS_SENSOR_STATE_BUSY:
+            // Sensor was busy, will retry.
+            _check_time.wait_time = 0;
+            return false;
+    }
+    if (!num_samples)
+    {
+        measurements_debug("%s summarised no samples.", def->name);
+        return false;
+    }
+    /* Sent as the one value at a samplecount of 1, so that's the mean. */
+    if (def->samplecount == 1 && num_samples > 1)
+    {
+        new_value.value_64.sum /= num_samples;
+        num_samples = 1;
+    }
+    memcpy(&data->value, &new_value, sizeof(measurements_value_t));
+    data->num_samples = num_samples;
+    measurements_debug("Sum : %"PRIi64, data->value.value_64.sum);
+    measurements_debug("Min : %"PRIi64, data->value.value_64.min);
+    measurements_debug("Max : %"PRIi64, data->value.value_64.max);
+    return true;
+}
+
+
+static bool _measurements_sample_get_value_iteration(measurements_def_t* def, measurements_data_t* data)
 {
     measurements_inf_t inf;
     if (!model_measurements_get_inf(def, data, &inf))
@@ -550,6 +892,13 @@ static bool _measurements_sample_get_iteration(measurements_def_t* def, measurem
         data->num_samples_collected++;
         return false;
     }
+    bool r;
+    if (inf.get_summary_cb && data->value_type == MEASUREMENTS_VALUE_TYPE_I64)
+    {
+        r = _measurements_sample_get_summary_iteration(def, data, &inf);
+        data->collection_time_cache = _measurements_get_collection_time(def, &inf);
+        return r;
+    }
     if (!inf.get_cb)
     {
         // Get function is non-optional
@@ -558,7 +907,6 @@ static bool _measurements_sample_get_iteration(measurements_def_t* def, measurem
         return false;
     }
 
-    bool r;
     switch(data->value_type)
     {
         case MEASUREMENTS_VALUE_TYPE_I64:
@@ -580,6 +928,121 @@ static bool _measurements_sample_get_iteration(measurements_def_t* def, measurem
 }
 
 
+static bool _measurements_sample_get_iteration(measurements_def_t* def, measurements_data_t* data)
+{
+    uint32_t start_ms = get_since_boot_ms();
+    uint8_t num_samples_collected = data->num_samples_collected;
+    bool r = _measurements_sample_get_value_iteration(def, data);
+    energy_meas_phase(_measurements_index(def), ENERGY_PHASE_COLLECT, start_ms);
+    /* Unless it was busy and will retry, the sensor is done with. */
+    if (data->num_samples_collected != num_samples_collected)
+        energy_meas_end(_measurements_index(def));
+    return r;
+}
+
+
+static bool _measurements_is_immediate(measurements_def_t* def)
+{
+    /* is_immediate is only valid if samplecount is 1 */
+    return def->is_immediate && def->samplecount == 1;
+}
+
+
+/* Since boot time the measurement's sample of the slot is collected. */
+static uint32_t _measurements_slot_collect(measurements_def_t* def, unsigned slot, uint32_t now)
+{
+    uint32_t sample_interval = def->interval * INTERVAL_TRANSMIT_MS / def->samplecount;
+    uint32_t time_since_interval = since_boot_delta(now, _last_sent_ms) + (_interval_count % def->interval) * INTERVAL_TRANSMIT_MS;
+    uint32_t offset = _measurements_is_immediate(def) ? sample_interval - 10 : sample_interval/2;
+    return now - time_since_interval + slot * sample_interval + offset;
+}
+
+
+static uint32_t _measurements_nearest_collect(measurements_def_t* def, uint32_t when, uint32_t now)
+{
+    uint32_t sample_interval = def->interval * INTERVAL_TRANSMIT_MS / def->samplecount;
+    int32_t since = (int32_t)(when - _measurements_slot_collect(def, 0, now));
+    unsigned slot = 0;
+    if (since > 0)
+        slot = (since + sample_interval/2) / sample_interval;
+    if (slot >= def->samplecount)
+        slot = def->samplecount - 1;
+    return _measurements_slot_collect(def, slot, now);
+}
+
+
+/* Those that can be grouped, gathered once a pass so following a group
+ * along doesn't scan every slot at each step. */
+static void _measurements_group_cands_update(void)
+{
+    _measurements_group_cands_count = 0;
+    if (!_measurements_group_enabled)
+        return;
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t* def = &_measurements_arr.def[i];
+        if (_measurements_def_is_active(def) && !_measurements_is_immediate(def))
+            _measurements_group_cands[_measurements_group_cands_count++] = i;
+    }
+}
+
+
+/* Measurements whose warm-ups can be made to overlap are collected at
+ * the same instant, that of the one with the longest warm-up, so the unit
+ * wakes once for them and sensors on shared power are only powered the
+ * once. Each still inits its own collection time before, and isn't moved
+ * more than a quarter of its sample interval. Returns the ms to move the
+ * slot by. */
+static int32_t _measurements_group_shift(unsigned index, unsigned slot, uint32_t now)
+{
+    measurements_def_t*  def  = &_measurements_arr.def[index];
+    measurements_data_t* data = &_measurements_arr.data[index];
+    if (!_measurements_group_enabled || _measurements_is_immediate(def) ||
+        slot >= def->samplecount)
+        return 0;
+
+    uint32_t max_shift  = def->interval * INTERVAL_TRANSMIT_MS / def->samplecount / 4;
+    uint32_t nominal    = _measurements_slot_collect(def, slot, now);
+    uint32_t collect    = nominal;
+    uint32_t warm_up    = data->collection_time_cache;
+    unsigned cur        = index;
+
+    while (true)
+    {
+        unsigned best           = MEASUREMENTS_MAX_NUMBER;
+        uint32_t best_collect   = 0;
+        uint32_t best_warm_up   = 0;
+        for (unsigned n = 0; n < _measurements_group_cands_count; n++)
+        {
+            unsigned i = _measurements_group_cands[n];
+            measurements_def_t* other_def = &_measurements_arr.def[i];
+            if (i == cur)
+                continue;
+            uint32_t other_warm_up = _measurements_arr.data[i].collection_time_cache;
+            /* Only ever towards a longer warm-up, so following on ends. */
+            if (other_warm_up < warm_up || (other_warm_up == warm_up && i > cur))
+                continue;
+            if (best != MEASUREMENTS_MAX_NUMBER && other_warm_up <= best_warm_up)
+                continue;
+            uint32_t other_collect = _measurements_nearest_collect(other_def, collect, now);
+            int32_t shift = (int32_t)(other_collect - nominal);
+            if ((uint32_t)abs(shift) > max_shift)
+                continue;
+            best            = i;
+            best_collect    = other_collect;
+            best_warm_up    = other_warm_up;
+        }
+        if (best == MEASUREMENTS_MAX_NUMBER)
+            break;
+        /* That may be grouped with a longer warm-up again. */
+        cur     = best;
+        collect = best_collect;
+        warm_up = best_warm_up;
+    }
+    return (int32_t)(collect - nominal);
+}
+
+
 static void _measurements_sample(void)
 {
     uint32_t            sample_interval;
@@ -595,6 +1058,8 @@ static void _measurements_sample(void)
     _check_time.last_checked_time = now;
     _check_time.wait_time = UINT32_MAX;
 
+    _measurements_group_cands_update();
+
     for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
     {
         measurements_def_t*  def  = &_measurements_arr.def[i];
@@ -609,14 +1074,16 @@ static void _measurements_sample(void)
         sample_interval = def->interval * INTERVAL_TRANSMIT_MS / def->samplecount;
         time_since_interval = since_boot_delta(now, _last_sent_ms) + (_interval_count % def->interval) * INTERVAL_TRANSMIT_MS;
 
-        /* is_immediate is only valid if samplecount is 1 */
-        bool is_immediate = def->is_immediate && def->samplecount == 1;
+        bool is_immediate = _measurements_is_immediate(def);
 
         if (is_immediate)
             /* Collect 10 ms before needing to send. */
             time_init_boundary = (data->num_samples_init * sample_interval) + sample_interval - 10;
         else
             time_init_boundary = (data->num_samples_init * sample_interval) + sample_interval/2;
+        /* Usually both are for the same slot, so only worked out once. */
+        int32_t init_shift = _measurements_group_shift(i, data->num_samples_init, now);
+        time_init_boundary += init_shift;
 
         if (time_init_boundary < data->collection_time_cache)
         {
@@ -629,6 +1096,10 @@ static void _measurements_sample(void)
             time_collect    = (data->num_samples_collected  * sample_interval) + sample_interval - 10;
         else
             time_collect    = (data->num_samples_collected  * sample_interval) + sample_interval/2;
+        if (data->num_samples_collected == data->num_samples_init)
+            time_collect += init_shift;
+        else
+            time_collect += _measurements_group_shift(i, data->num_samples_collected, now);
         if (time_since_interval >= time_init)
         {
             if (data->num_samples_collected < data->num_samples_init)
@@ -901,9 +1372,6 @@ static void _measurements_sleep_iteration(void)
 }
 
 
-static bool _measurements_get_reading2(measurements_def_t* def, measurements_data_t* data, measurements_reading_t* reading, measurements_value_type_t* type);
-
-
 void _measurements_check_instant_send(void)
 {
     bool to_instant_send = false;
@@ -916,51 +1384,35 @@ void _measurements_check_instant_send(void)
     if (!to_instant_send)
         return;
 
-    if (!protocol_init())
+    /* Either way they stay flagged and go first in the next uplink. */
+    static bool has_printed_held = false;
+    if (_pending_send)
     {
-        measurements_debug("Could not initialise the hex array for the protocol.");
+        if (!has_printed_held)
+            measurements_debug("Cannot instant send, there is a measurement send underway.");
+        has_printed_held = true;
         return;
     }
-
-    unsigned count = 0;
-    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
-    {
-        measurements_def_t* def = &_measurements_arr.def[i];
-        measurements_data_t* data = &_measurements_arr.data[i];
-        if (data->instant_send)
-        {
-            data->instant_send = 0;
-            /* TODO: Add a check to ensure last sent wasn't 0 seconds ago */
-            measurements_reading_t reading;
-            measurements_value_type_t type;
-            if (!_measurements_get_reading2(def, data, &reading, &type))
-            {
-                measurements_debug("Could not get measurement '%s' for instant send.", def->name);
-                continue;
-            }
-            if (!protocol_append_instant_measurement(def, &reading, type))
-            {
-                measurements_debug("Could not add measurement '%s' to array.", def->name);
-                break;
-            }
-            count++;
-        }
-    }
-    if (!count)
+    uint32_t now = get_since_boot_ms();
+    /* Add +10 as this is called before measurements_send and to ensure no negative overflow. */
+    if (since_boot_delta(_last_sent_ms + INTERVAL_TRANSMIT_MS + 10, now) <= MEASUREMENTS_MIN_TRANSMIT_MS + 10)
     {
-        measurements_debug("No measurements were added, not sending.");
+        if (!has_printed_held)
+            measurements_debug("Cannot send instant send, scheduled uplink soon.");
+        has_printed_held = true;
         return;
     }
-    if (_measurements_chunk_start_pos != MEASUREMENTS_MAX_NUMBER && _measurements_chunk_start_pos != 0)
+    has_printed_held = false;
+
+    if (!protocol_init())
     {
-        measurements_debug("Cannot instant send, there is a measurement send underway.");
+        measurements_debug("Could not initialise the hex array for the protocol.");
         return;
     }
-    uint32_t now = get_since_boot_ms();
-    /* Add +10 as this is called before measurements_send and to ensure no negative overflow. */
-    if (since_boot_delta(_last_sent_ms + INTERVAL_TRANSMIT_MS + 10, now) <= MEASUREMENTS_MIN_TRANSMIT_MS + 10)
+
+    if (!_measurements_send_pack_instant())
     {
-        measurements_debug("Cannot send instant send, scheduled uplink soon.");
+        measurements_debug("No measurements were added, not sending.");
         return;
     }
     protocol_send();
@@ -978,23 +1430,18 @@ void measurements_loop_iteration(void)
     {
         if (!has_printed_no_con)
         {
-            measurements_debug("Not connected to send, not taking readings.");
+            measurements_debug("Not connected to send, readings go to backlog.");
             has_printed_no_con = true;
-            _measurements_chunk_start_pos = _measurements_chunk_prev_start_pos = 0;
+            _measurements_send_unqueue();
             _pending_send = false;
         }
-        _measurements_iterate_callbacks();
-        return;
     }
-    uint32_t now = get_since_boot_ms();
-
-    if (has_printed_no_con)
+    else if (has_printed_no_con)
     {
-        measurements_debug("Connected to send, starting readings.");
-        _last_sent_ms = now;
+        measurements_debug("Connected to send, %u bytes of backlog.", ring_buf_get_pending(&_measurements_backlog));
         has_printed_no_con = false;
-        return;
     }
+    uint32_t now = get_since_boot_ms();
 
     if (protocol_send_ready() || _measurements_debug_mode)
         _measurements_check_instant_send();
@@ -1010,8 +1457,10 @@ void measurements_loop_iteration(void)
             _interval_count = 0;
         }
         _interval_count++;
+        energy_interval_end();
         _measurements_send();
     }
+    _measurements_backlog_send();
     uint16_t count_active = _measurements_iterate_callbacks();
     /* If no measurements require active calls. */
     if (count_active == 0)
@@ -1120,6 +1569,8 @@ void measurements_set_debug_mode(bool enable)
     else
         measurements_debug("Disabling measurements debug mode.");
     _measurements_debug_mode = enable;
+    /* No acks come in debug mode. */
+    _measurements_send_unqueue();
 }
 
 
@@ -1406,6 +1857,10 @@ static const char* measurements_type_to_str(measurements_def_type_t type)
     static const char custom_0_name[]       = MEASUREMENTS_DEF_NAME_CUSTOM_0;
     static const char custom_1_name[]       = MEASUREMENTS_DEF_NAME_CUSTOM_1;
     static const char io_reading_name[]     = MEASUREMENTS_DEF_NAME_IO_READING;
+    static const char can_name[]            = MEASUREMENTS_DEF_NAME_CAN;
+    static const char pulse_stats_name[]    = MEASUREMENTS_DEF_NAME_PULSE_STATS;
+    static const char energy_name[]         = MEASUREMENTS_DEF_NAME_ENERGY;
+    static const char mains_name[]          = MEASUREMENTS_DEF_NAME_MAINS;
 
     switch (type)
     {
@@ -1443,6 +1898,14 @@ static const char* measurements_type_to_str(measurements_def_type_t type)
             return custom_1_name;
         case IO_READING:
             return io_reading_name;
+        case CAN:
+            return can_name;
+        case PULSE_STATS:
+            return pulse_stats_name;
+        case ENERGY:
+            return energy_name;
+        case MAINS:
+            return mains_name;
         default:
             break;
     }
@@ -1611,6 +2074,38 @@ static command_response_t _measurements_interval_mins_cb(char* args)
 }
 
 
+static command_response_t _measurements_backlog_cb(char* args)
+{
+    char* p = skip_space(args);
+    if (strncmp(p, "clear", 5) == 0)
+    {
+        ring_buf_clear(&_measurements_backlog);
+        _measurements_backlog_inflight = 0;
+        _measurements_backlog_dropped = 0;
+        log_out("Backlog cleared.");
+        return COMMAND_RESP_OK;
+    }
+    else if (*p)
+    {
+        log_out("meas_backlog [clear]");
+        return COMMAND_RESP_ERR;
+    }
+    unsigned records = 0;
+    ring_buf_t walk = _measurements_backlog;
+    measurements_backlog_header_t header;
+    while (ring_buf_read(&walk, (char*)&header, sizeof(header)) == sizeof(header))
+    {
+        ring_buf_discard(&walk, header.len);
+        records++;
+    }
+    log_out("Records   : %u", records);
+    log_out("Bytes     : %u/%u", ring_buf_get_pending(&_measurements_backlog), _measurements_backlog.size - 1);
+    log_out("In flight : %u", _measurements_backlog_inflight);
+    log_out("Dropped   : %"PRIu32, _measurements_backlog_dropped);
+    return COMMAND_RESP_OK;
+}
+
+
 static command_response_t _measurements_is_immediate_cb(char* args)
 {
     char name[MEASURE_NAME_NULLED_LEN];
@@ -1648,6 +2143,28 @@ print_out:
 }
 
 
+static command_response_t _measurements_group_cb(char* args)
+{
+    char* p = skip_space(args);
+    if (*p)
+        _measurements_group_enabled = strtoul(p, NULL, 10) ? true : false;
+    log_out("Grouping: %s", _measurements_group_enabled ? "enabled" : "disabled");
+    uint32_t now = get_since_boot_ms();
+    _measurements_group_cands_update();
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t*  def  = &_measurements_arr.def[i];
+        measurements_data_t* data = &_measurements_arr.data[i];
+        if (!_measurements_def_is_active(def))
+            continue;
+        log_out("%-4s warm-up: %5"PRIu32"ms shift: %6"PRIi32"ms", def->name,
+                data->collection_time_cache,
+                _measurements_group_shift(i, data->num_samples_collected, now));
+    }
+    return COMMAND_RESP_OK;
+}
+
+
 struct cmd_link_t* measurements_add_commands(struct cmd_link_t* tail)
 {
     static struct cmd_link_t cmds[] =
@@ -1663,6 +2180,8 @@ struct cmd_link_t* measurements_add_commands(struct cmd_link_t* tail)
         { "interval_mins","Get/Set interval minutes",            _measurements_interval_mins_cb  , false , NULL },
         { "repop",        "Repopulate measurements.",            _measurements_repop_cb          , false , NULL },
         { "is_immediate", "Set/unset immediate measurements.",   _measurements_is_immediate_cb   , false , NULL },
+        { "meas_backlog", "Show/clear readings held for sending.", _measurements_backlog_cb      , false , NULL },
+        { "meas_group",   "Show/set grouping of warm-ups.",      _measurements_group_cb          , false , NULL },
     };
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
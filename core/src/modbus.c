@@ -9,6 +9,7 @@
 #include "modbus.h"
 #include "modbus_measurements.h"
 #include "modbus_mem.h"
+#include "modbus_slave.h"
 #include "uart_rings.h"
 #include "uarts.h"
 #include "common.h"
@@ -17,7 +18,7 @@
 #include "platform.h"
 #include "pinmap.h"
 
-#define MODBUS_RESP_TIMEOUT_MS 2000
+#define MODBUS_RESP_TIMEOUT_MS 2000 /* Also the ceiling for learnt timeouts. */
 #define MODBUS_SENT_TIMEOUT_MS 2000
 #define MODBUS_TX_GAP_MS        100
 
@@ -26,10 +27,22 @@
 #define MODBUS_BIN_START '{'
 #define MODBUS_BIN_STOP '}'
 
-#define MODBUS_SLOTS  (MODBUS_BLOCKS - 1)
+#define MODBUS_SLOTS  MODBUS_MAX_REGS
 
 #define MODBUS_MAX_RETRANSMITS 10
 
+#define MODBUS_HEALTH_COUNT             8
+#define MODBUS_RESP_FLOOR_T35           20      /* Learnt timeout is never less than this many T3.5s. */
+#define MODBUS_RESP_LATENCY_MUL         4       /* Learnt timeout is this many average responses. */
+#define MODBUS_BACKOFF_BASE_MS          60000
+#define MODBUS_BACKOFF_MAX_MS           3600000
+
+#define MODBUS_WRITE_SLOTS              8       /* Writes queued per bus. */
+#define MODBUS_WRITE_MAX_REGS           16      /* Registers in one write multiple frame. */
+#define MODBUS_WRITE_BATCH_MAX          32      /* address=value pairs of one mb_reg_write. */
+
+#define MODBUS_CACHE_COUNT              8
+
 /*         <               ADU                         >
             addr(1), func(1), reg(2), count(2) , crc(2)
                      <             PDU       >
@@ -41,122 +54,273 @@
 */
 
 #define MAX_MODBUS_PACKET_SIZE    127
-#define MODBUS_PACKET_BUF_SIZ     20
+#define MODBUS_PACKET_BUF_SIZ     (10 + MODBUS_WRITE_MAX_REGS * 2) /* Write multiple header, data, crc and binary stop. */
 
 #define MODBUS_REG_DESC_BUF_LEN             48
 
 
-static uint8_t modbuspacket[MAX_MODBUS_PACKET_SIZE];
-static uint8_t tx_modbuspacket[MODBUS_PACKET_BUF_SIZ];
+#ifndef MODBUS_BUS_UARTS
+#define MODBUS_BUS_UARTS { EXT_UART }
+#endif
 
-static unsigned modbuspacket_len = 0;
 
-static char _message_queue_regs[1 + sizeof(modbus_reg_t*) * MODBUS_SLOTS] = {0};
+/* Runtime only, learnt again after a reboot. */
+typedef struct
+{
+    uint16_t unit_id;
+    uint16_t latency_x8;        /* EWMA of response time in ms, *8 for precision. */
+    uint32_t backoff_start;
+    uint32_t backoff_ms;
+    uint8_t  in_use;
+    uint8_t  fails;             /* Messages dropped in a row. */
+    uint16_t good;
+    uint16_t timeouts;
+    uint16_t bad_crc;
+    uint16_t dropped;
+    uint16_t skipped;           /* Not sent as backing off. */
+} modbus_dev_health_t;
+
+
+/* A write waiting its turn in the same queue as the reads. The data is
+ * already in the device's byte/word order, as it goes on the wire. */
+typedef struct
+{
+    uint8_t  in_use;
+    uint8_t  func;
+    uint8_t  unit_id;
+    uint8_t  count;             /* Registers */
+    uint16_t reg_addr;
+    uint8_t  state;             /* modbus_reg_state_t */
+    uint8_t  report;            /* Result logged and slot freed when done, else whoever queued it frees it. */
+    uint8_t  data[MODBUS_WRITE_MAX_REGS * 2];
+} modbus_write_t;
+
+
+/* Last reply for a register, runtime only. Raw as on the wire, so
+ * registers of different types at the same address can share it. */
+typedef struct
+{
+    uint32_t time;
+    uint16_t unit_id;
+    uint16_t reg_addr;
+    uint8_t  in_use;
+    uint8_t  func;
+    uint8_t  size;              /* Bytes of raw */
+    uint8_t  state;             /* modbus_reg_state_t */
+    uint8_t  raw[4];
+} modbus_cache_t;
+
+
+/* Everything of one request/response pipeline, so each bus runs on its own. */
+typedef struct
+{
+    unsigned            uart;
+    uint8_t             packet[MAX_MODBUS_PACKET_SIZE];
+    uint8_t             tx_packet[MODBUS_PACKET_BUF_SIZ];
+    unsigned            packet_len;
+    char                queue_regs[1 + sizeof(void*) * (MODBUS_SLOTS + MODBUS_WRITE_SLOTS)];
+    ring_buf_t          queue;          /* Of modbus_reg_t* and modbus_write_t* */
+    modbus_write_t      writes[MODBUS_WRITE_SLOTS];
 
-static ring_buf_t _message_queue = RING_BUF_INIT(_message_queue_regs, sizeof(_message_queue_regs));
+    uint32_t            read_timing_init;
+    uint32_t            read_last_good;
+    uint32_t            cur_send_time;
+    uint32_t            cur_wire_ms;    /* Of the request and its expected reply. */
+    bool                cur_is_write;
+    bool                want_rx;
+    bool                binary_protocol;
+    bool                frame_timed;
 
+    uint32_t            send_start_delay;
+    uint32_t            send_stop_delay;
+    uint32_t            retransmit_count;
+    uint16_t            cur_unit_id;
+    uint32_t            t35_ms;
+    uint32_t            tx_gap;
+    uint32_t            char_us;
 
-static uint32_t modbus_read_timing_init = 0;
-static uint32_t modbus_read_last_good = 0;
-static uint32_t modbus_cur_send_time = 0;
-static bool     modbus_want_rx = false;
+    unsigned            echo_bytes;
 
-static uint32_t modbus_send_start_delay = 0;
-static uint32_t modbus_send_stop_delay = 0;
+    bool                rs485_transmitting;
+    bool                rs485_transmit_stopping;
+    uint32_t            rs485_start_transmitting;
+    uint32_t            rs485_stop_transmitting;
 
-static uint32_t modbus_retransmit_count = 0;
+    modbus_dev_health_t health[MODBUS_HEALTH_COUNT];
 
-static unsigned _echo_bytes = 0;
+    modbus_cache_t      cache[MODBUS_CACHE_COUNT];
+    uint32_t            cache_hits;
+    uint32_t            cache_misses;
+} modbus_ctx_t;
 
 
-static struct
-{
-    union
-    {
-        uint8_t  unit_id;
-        uint8_t  not_done;
-    };
-    union
-    {
-        uint16_t reg_addr;
-        uint16_t passfail;
-    };
-    union
-    {
-        uint16_t value;         /* For MODBUS_WRITE_SINGLE_HOLDING_FUNC   */
-        uint16_t num_written;   /* For MODBUS_WRITE_MULTIPLE_HOLDING_FUNC */
-    };
-} _modbus_reg_set_expected = {0};
+static const unsigned _modbus_bus_uarts[] = MODBUS_BUS_UARTS;
+
+#define MODBUS_BUS_COUNT ARRAY_SIZE(_modbus_bus_uarts)
+
+_Static_assert(ARRAY_SIZE(_modbus_bus_uarts) <= (1 + MODBUS_EXTRA_BUSES), "Too many modbus buses.");
+
+static modbus_ctx_t _modbus_ctxs[MODBUS_BUS_COUNT] = {0};
 
 
 /* By default, assume no echo. */
 bool modbus_requires_echo_removal() { return false; }
 
 
-static uint32_t _modbus_get_deci_char_time(unsigned deci_char, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
+/* Tenths of a bit per character, to support half a stop bit. */
+static unsigned _modbus_get_char_deci_bits(uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
 {
-    databits *= 10; /* *10 to support half bit. */
-    databits += 10; /* One start bit */
+    unsigned deci_bits = databits * 10;
+    deci_bits += 10; /* One start bit */
 
     switch(stop)
     {
-        case uart_stop_bits_1   : databits += 10; break;
-        case uart_stop_bits_1_5 : databits += 5;  break;
-        case uart_stop_bits_2   : databits += 20; break;
+        case uart_stop_bits_1   : deci_bits += 10; break;
+        case uart_stop_bits_1_5 : deci_bits += 5;  break;
+        case uart_stop_bits_2   : deci_bits += 20; break;
         default:
             modbus_debug("Stop bits unknown...assuming 1.");
-            databits += 10;
+            deci_bits += 10;
             break;
     }
 
     if (parity != uart_parity_none)
-        databits += 10;
+        deci_bits += 10;
 
-    unsigned bits = deci_char * databits;
+    return deci_bits;
+}
+
+
+static uint32_t _modbus_get_deci_char_time(unsigned deci_char, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
+{
+    unsigned bits = deci_char * _modbus_get_char_deci_bits(databits, parity, stop);
     uint32_t r = 1 + 1000 * bits / speed / 100;
     return r;
 }
 
 
-static void _modbus_setup_delays(unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
+static modbus_ctx_t * _modbus_get_ctx(unsigned bus)
 {
-    if (modbus_bus->binary_protocol)
+    return (bus < MODBUS_BUS_COUNT)?&_modbus_ctxs[bus]:NULL;
+}
+
+
+static modbus_ctx_t * _modbus_get_ctx_by_uart(unsigned uart)
+{
+    for (unsigned bus = 0; bus < MODBUS_BUS_COUNT; bus++)
     {
-        modbus_send_start_delay = 0;
-        modbus_send_stop_delay = _modbus_get_deci_char_time(10 /*1.0*/, speed, databits, parity, stop);
+        if (_modbus_bus_uarts[bus] == uart)
+            return &_modbus_ctxs[bus];
+    }
+    return NULL;
+}
+
+
+static modbus_ctx_t * _modbus_get_ctx_of_dev(modbus_dev_t * dev)
+{
+    return (dev)?_modbus_get_ctx(dev->bus):NULL;
+}
+
+
+static unsigned _modbus_ctx_get_bus(modbus_ctx_t * ctx)
+{
+    return ctx - _modbus_ctxs;
+}
+
+
+unsigned modbus_bus_count(void)
+{
+    return MODBUS_BUS_COUNT;
+}
+
+
+bool modbus_uart_is_bus(unsigned uart)
+{
+    return _modbus_get_ctx_by_uart(uart) != NULL;
+}
+
+
+static void _modbus_setup_delays(modbus_ctx_t * ctx, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
+{
+    if (ctx->binary_protocol)
+    {
+        ctx->send_start_delay = 0;
+        ctx->send_stop_delay = _modbus_get_deci_char_time(10 /*1.0*/, speed, databits, parity, stop);
     }
     else
     {
-        modbus_send_start_delay = _modbus_get_deci_char_time(35 /*3.5*/, speed, databits, parity, stop);
-        modbus_send_stop_delay = _modbus_get_deci_char_time(35 /*3.5*/, speed, databits, parity, stop);
+        ctx->send_start_delay = _modbus_get_deci_char_time(35 /*3.5*/, speed, databits, parity, stop);
+        ctx->send_stop_delay = _modbus_get_deci_char_time(35 /*3.5*/, speed, databits, parity, stop);
     }
-    modbus_debug("Modbus @ %s %u %u%c%s", (modbus_bus->binary_protocol)?"BIN":"RTU", speed, databits, osm_uart_parity_as_char(parity), osm_uart_stop_bits_as_str(stop));
 
-    modbus_bus->baudrate    = speed;
-    modbus_bus->databits    = databits;
-    modbus_bus->parity      = parity;
-    modbus_bus->stopbits    = stop;
+    /* RTU frames end with T3.5 of silence, let the UART time that if it can. */
+    unsigned frame_bits = 0;
+    if (!ctx->binary_protocol)
+        frame_bits = (35 /*3.5*/ * _modbus_get_char_deci_bits(databits, parity, stop) + 99) / 100;
+    ctx->frame_timed = uart_set_frame_timeout(ctx->uart, frame_bits) && frame_bits;
+    ctx->t35_ms = _modbus_get_deci_char_time(35 /*3.5*/, speed, databits, parity, stop);
+    ctx->tx_gap = (ctx->frame_timed)?ctx->t35_ms:MODBUS_TX_GAP_MS;
+    ctx->char_us = 100000 * _modbus_get_char_deci_bits(databits, parity, stop) / speed;
+    uart_ring_in_get_frame(ctx->uart);
+    modbus_debug("Modbus %u @ %s %u %u%c%s", _modbus_ctx_get_bus(ctx), (ctx->binary_protocol)?"BIN":"RTU", speed, databits, osm_uart_parity_as_char(parity), osm_uart_stop_bits_as_str(stop));
 }
 
 
-void modbus_setup(unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop, bool binary_framing)
+static void _modbus_store_comms(modbus_ctx_t * ctx, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop)
 {
-    uart_resetup(EXT_UART, speed, databits, parity, stop);
+    modbus_bus_comms_t comms = { .baudrate          = speed,
+                                 .binary_protocol   = ctx->binary_protocol,
+                                 .stopbits          = stop,
+                                 .parity            = parity,
+                                 .databits          = databits };
+    if (!modbus_bus_set_comms(_modbus_ctx_get_bus(ctx), &comms))
+        log_error("Failed to store modbus bus %u setup.", _modbus_ctx_get_bus(ctx));
+}
+
+
+static void _modbus_ctx_setup(modbus_ctx_t * ctx, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop, bool binary_framing)
+{
+    uart_resetup(ctx->uart, speed, databits, parity, stop);
+
+    ctx->binary_protocol = binary_framing;
+
+    _modbus_setup_delays(ctx, speed, databits, parity, stop);
+}
 
-    modbus_bus->binary_protocol = binary_framing;
 
-    _modbus_setup_delays(speed, databits, parity, stop);
+void modbus_setup(unsigned bus, unsigned speed, uint8_t databits, osm_uart_parity_t parity, osm_uart_stop_bits_t stop, bool binary_framing)
+{
+    modbus_ctx_t * ctx = _modbus_get_ctx(bus);
+    if (!ctx)
+        return;
+
+    _modbus_ctx_setup(ctx, speed, databits, parity, stop, binary_framing);
+    _modbus_store_comms(ctx, speed, databits, parity, stop);
 }
 
 
 
 bool modbus_setup_from_str(char * str)
 {
-    /*<BIN/RTU> <SPEED> <BITS><PARITY><STOP>
+    /*[<BUS>] <BIN/RTU> <SPEED> <BITS><PARITY><STOP>
      * EXAMPLE: RTU 115200 8N1
+     *          1 RTU 9600 8E1
      */
     char * pos = skip_space(str);
 
+    unsigned bus = 0;
+    if (isdigit((unsigned char)pos[0]))
+        bus = strtoul(pos, &pos, 10);
+
+    modbus_ctx_t * ctx = _modbus_get_ctx(bus);
+    if (!ctx)
+    {
+        log_error("No modbus bus %u.", bus);
+        return false;
+    }
+
+    pos = skip_space(pos);
+
     bool binary_framing = false;
 
     if (toupper(pos[0]) == 'R' &&
@@ -179,7 +343,7 @@ bool modbus_setup_from_str(char * str)
 
     pos+=3;
 
-    if (!uart_resetup_str(EXT_UART, skip_space(pos)))
+    if (!uart_resetup_str(ctx->uart, skip_space(pos)))
         return false;
 
     unsigned speed;
@@ -187,11 +351,12 @@ bool modbus_setup_from_str(char * str)
     osm_uart_parity_t parity;
     osm_uart_stop_bits_t stop;
 
-    uart_get_setup(EXT_UART, &speed, &databits, &parity, &stop);
+    uart_get_setup(ctx->uart, &speed, &databits, &parity, &stop);
 
-    modbus_bus->binary_protocol = binary_framing;
+    ctx->binary_protocol = binary_framing;
 
-    _modbus_setup_delays(speed, databits, parity, stop);
+    _modbus_setup_delays(ctx, speed, databits, parity, stop);
+    _modbus_store_comms(ctx, speed, databits, parity, stop);
 
     return true;
 }
@@ -199,10 +364,11 @@ bool modbus_setup_from_str(char * str)
 
 bool modbus_add_dev_from_str(char* str)
 {
-    /*<unit_id> <LSB/MSB> <LSW/MSW> <name>
+    /*<unit_id> <LSB/MSB> <LSW/MSW> <name> [<bus>]
      * (name can only be 4 char long)
      * EXAMPLES:
      * 0x1 MSB MSW TEST
+     * 0x2 MSB MSW MTR2 1
      */
     char * pos = skip_space(str);
 
@@ -236,11 +402,19 @@ bool modbus_add_dev_from_str(char* str)
 
     pos = skip_space(pos);
 
-    unsigned len = strnlen(pos, MEASURE_NAME_LEN);
+    unsigned len = 0;
+    while (len < MEASURE_NAME_LEN && pos[len] && !isspace((unsigned char)pos[len]))
+        len++;
     char name[MEASURE_NAME_NULLED_LEN];
-    strncpy(name, pos, len+1);
+    memcpy(name, pos, len);
+    name[len] = 0;
+
+    pos = skip_space(pos + len);
+    unsigned bus = 0;
+    if (isdigit((unsigned char)pos[0]))
+        bus = strtoul(pos, NULL, 10);
 
-    if (modbus_add_device(unit_id, name, byte_order, word_order))
+    if (modbus_add_device(unit_id, name, byte_order, word_order, bus))
         log_out("Added modbus device");
     else
         log_out("Failed to add modbus device.");
@@ -251,25 +425,198 @@ bad_exit:
 }
 
 
-uint32_t modbus_start_delay(void)
+static modbus_dev_health_t * _modbus_health_get(modbus_ctx_t * ctx, uint16_t unit_id, bool create)
 {
-    return modbus_send_start_delay;
+    modbus_dev_health_t * free_slot = NULL;
+    for (unsigned i = 0; i < MODBUS_HEALTH_COUNT; i++)
+    {
+        modbus_dev_health_t * health = &ctx->health[i];
+        if (!health->in_use)
+        {
+            if (!free_slot)
+                free_slot = health;
+            continue;
+        }
+        if (health->unit_id == unit_id)
+            return health;
+    }
+    if (!create || !free_slot)
+        return NULL;
+    memset(free_slot, 0, sizeof(modbus_dev_health_t));
+    free_slot->unit_id = unit_id;
+    free_slot->in_use = 1;
+    return free_slot;
 }
 
 
-uint32_t modbus_stop_delay(void)
+static uint32_t _modbus_health_timeout(modbus_ctx_t * ctx, const modbus_dev_health_t * health)
 {
-    return modbus_send_stop_delay;
+    if (!health || !health->latency_x8)
+        return MODBUS_RESP_TIMEOUT_MS;
+
+    uint32_t timeout = (uint32_t)health->latency_x8 * MODBUS_RESP_LATENCY_MUL / 8;
+    uint32_t floor = MODBUS_RESP_FLOOR_T35 * ctx->t35_ms;
+    if (timeout < floor)
+        timeout = floor;
+    if (timeout > MODBUS_RESP_TIMEOUT_MS)
+        timeout = MODBUS_RESP_TIMEOUT_MS;
+    return timeout;
+}
+
+
+/* Only read latency is learnt, writes can take a unit far longer. */
+static uint32_t _modbus_resp_timeout(modbus_ctx_t * ctx)
+{
+    if (ctx->cur_is_write)
+        return MODBUS_RESP_TIMEOUT_MS;
+    return _modbus_health_timeout(ctx, _modbus_health_get(ctx, ctx->cur_unit_id, false)) + ctx->cur_wire_ms;
+}
+
+
+/* A unit that keeps failing gets fewer retries each time. */
+static uint32_t _modbus_retry_budget(modbus_ctx_t * ctx)
+{
+    modbus_dev_health_t * health = _modbus_health_get(ctx, ctx->cur_unit_id, false);
+    if (!health)
+        return MODBUS_MAX_RETRANSMITS;
+    return (health->fails < 8)?(MODBUS_MAX_RETRANSMITS >> health->fails):0;
+}
+
+
+static bool _modbus_health_backing_off(modbus_ctx_t * ctx, uint16_t unit_id)
+{
+    modbus_dev_health_t * health = _modbus_health_get(ctx, unit_id, false);
+    if (!health || !health->backoff_ms)
+        return false;
+    if (since_boot_delta(get_since_boot_ms(), health->backoff_start) >= health->backoff_ms)
+        return false;
+    health->skipped++;
+    return true;
+}
+
+
+static void _modbus_health_reply(modbus_ctx_t * ctx, uint16_t unit_id)
+{
+    modbus_dev_health_t * health = _modbus_health_get(ctx, unit_id, true);
+    if (!health)
+        return;
+
+    if (!ctx->cur_is_write)
+    {
+        /* Time on the wire is added back per request, so isn't learnt. */
+        uint32_t latency = since_boot_delta(get_since_boot_ms(), ctx->cur_send_time);
+        latency = (latency > ctx->cur_wire_ms)?(latency - ctx->cur_wire_ms):0;
+        if (latency > MODBUS_RESP_TIMEOUT_MS)
+            latency = MODBUS_RESP_TIMEOUT_MS;
+        if (!latency)
+            latency = 1;
+        if (!health->latency_x8)
+            health->latency_x8 = latency * 8;
+        else
+            /* EWMA with alpha of 1/4 */
+            health->latency_x8 = health->latency_x8 + (int32_t)(latency * 8 - health->latency_x8) / 4;
+    }
+
+    health->good++;
+    health->fails = 0;
+    health->backoff_ms = 0;
+}
+
+
+static void _modbus_health_dropped(modbus_ctx_t * ctx)
+{
+    modbus_dev_health_t * health = _modbus_health_get(ctx, ctx->cur_unit_id, true);
+    if (!health)
+        return;
+
+    health->dropped++;
+    if (health->fails < UINT8_MAX)
+        health->fails++;
+
+    unsigned shift = health->fails - 1;
+    health->backoff_ms = (shift < 6)?(MODBUS_BACKOFF_BASE_MS << shift):MODBUS_BACKOFF_MAX_MS;
+    if (health->backoff_ms > MODBUS_BACKOFF_MAX_MS)
+        health->backoff_ms = MODBUS_BACKOFF_MAX_MS;
+    health->backoff_start = get_since_boot_ms();
+    modbus_debug("Unit 0x%"PRIx16" failing (%"PRIu8"), backing off %"PRIu32"s.", health->unit_id, health->fails, health->backoff_ms / 1000);
+}
+
+
+static void _modbus_health_log(modbus_ctx_t * ctx)
+{
+    for (unsigned i = 0; i < MODBUS_HEALTH_COUNT; i++)
+    {
+        const modbus_dev_health_t * health = &ctx->health[i];
+        if (!health->in_use)
+            continue;
+        uint32_t backoff_left = 0;
+        if (health->backoff_ms)
+        {
+            uint32_t since = since_boot_delta(get_since_boot_ms(), health->backoff_start);
+            if (since < health->backoff_ms)
+                backoff_left = (health->backoff_ms - since) / 1000;
+        }
+        log_out("- Health - 0x%"PRIx16" good:%"PRIu16" timeouts:%"PRIu16" crc:%"PRIu16,
+            health->unit_id, health->good, health->timeouts, health->bad_crc);
+        log_out("  dropped:%"PRIu16" skipped:%"PRIu16" backoff:%"PRIu32"s",
+            health->dropped, health->skipped, backoff_left);
+        log_out("  latency:%"PRIu16"ms timeout:%"PRIu32"ms + wire",
+            (uint16_t)(health->latency_x8 / 8), _modbus_health_timeout(ctx, health));
+    }
+}
+
+
+static bool _modbus_ctx_has_pending(modbus_ctx_t * ctx)
+{
+    return (ctx->want_rx || ring_buf_get_pending(&ctx->queue));
 }
 
 
 bool modbus_has_pending(void)
 {
-    return (modbus_want_rx || ring_buf_get_pending(&_message_queue));
+    for (unsigned bus = 0; bus < MODBUS_BUS_COUNT; bus++)
+    {
+        if (_modbus_ctx_has_pending(&_modbus_ctxs[bus]))
+            return true;
+    }
+    return false;
+}
+
+
+/* Adds the ADU tail to what is in tx_packet and sends it, resp_len
+ * being the ADU expected back. */
+static void _modbus_send(modbus_ctx_t * ctx, unsigned body_size, unsigned resp_len)
+{
+    uint16_t crc = modbus_crc(ctx->tx_packet, body_size);
+    ctx->tx_packet[body_size++] = crc & 0xFF;
+    ctx->tx_packet[body_size++] = crc >> 8;
+
+    ctx->want_rx = true;
+    ctx->cur_send_time = get_since_boot_ms();
+    ctx->cur_unit_id = ctx->tx_packet[0];
+    ctx->cur_is_write = (ctx->tx_packet[1] == MODBUS_WRITE_SINGLE_HOLDING_FUNC ||
+                         ctx->tx_packet[1] == MODBUS_WRITE_MULTIPLE_HOLDING_FUNC);
+    unsigned wire_chars = body_size + resp_len + ((ctx->binary_protocol)?4:0);
+    ctx->cur_wire_ms = 1 + wire_chars * ctx->char_us / 1000;
+
+    if (ctx->binary_protocol)
+    {
+        uart_ring_out(ctx->uart, (char[]){MODBUS_BIN_START}, 1);
+        ctx->tx_packet[body_size++] = MODBUS_BIN_STOP;
+        uart_ring_out(ctx->uart, (char*)ctx->tx_packet, body_size);
+        if (modbus_requires_echo_removal())
+            ctx->echo_bytes = body_size + 1;
+    }
+    else
+    {
+        uart_ring_out(ctx->uart, (char*)ctx->tx_packet, body_size); /* Frame is done with silence */
+        if (modbus_requires_echo_removal())
+            ctx->echo_bytes = body_size;
+    }
 }
 
 
-static void _modbus_do_start_read(modbus_reg_t * reg)
+static void _modbus_do_start_read(modbus_ctx_t * ctx, modbus_reg_t * reg)
 {
     uint8_t unit_id = modbus_reg_get_unit_id(reg);
 
@@ -292,60 +639,40 @@ static void _modbus_do_start_read(modbus_reg_t * reg)
     if (reg->func == MODBUS_READ_HOLDING_FUNC)
     {
         /* ADU Header (Application Data Unit) */
-        tx_modbuspacket[0] = unit_id;
+        ctx->tx_packet[0] = unit_id;
         /* ====================================== */
         /* PDU payload (Protocol Data Unit) */
-        tx_modbuspacket[1] = MODBUS_READ_HOLDING_FUNC; /*Holding*/
-        tx_modbuspacket[2] = reg->reg_addr >> 8;   /*Register read address */
-        tx_modbuspacket[3] = reg->reg_addr & 0xFF;
-        tx_modbuspacket[4] = reg_count >> 8; /*Register read count */
-        tx_modbuspacket[5] = reg_count & 0xFF;
+        ctx->tx_packet[1] = MODBUS_READ_HOLDING_FUNC; /*Holding*/
+        ctx->tx_packet[2] = reg->reg_addr >> 8;   /*Register read address */
+        ctx->tx_packet[3] = reg->reg_addr & 0xFF;
+        ctx->tx_packet[4] = reg_count >> 8; /*Register read count */
+        ctx->tx_packet[5] = reg_count & 0xFF;
         body_size = 6;
         /* ====================================== */
     }
     else if (reg->func == MODBUS_READ_INPUT_FUNC)
     {
         /* ADU Header (Application Data Unit) */
-        tx_modbuspacket[0] = unit_id;
+        ctx->tx_packet[0] = unit_id;
         /* ====================================== */
         /* PDU payload (Protocol Data Unit) */
-        tx_modbuspacket[1] = MODBUS_READ_INPUT_FUNC; /*Input*/
-        tx_modbuspacket[2] = reg->reg_addr >> 8;   /*Register read address */
-        tx_modbuspacket[3] = reg->reg_addr & 0xFF;
-        tx_modbuspacket[4] = reg_count >> 8; /*Register read count */
-        tx_modbuspacket[5] = reg_count & 0xFF;
+        ctx->tx_packet[1] = MODBUS_READ_INPUT_FUNC; /*Input*/
+        ctx->tx_packet[2] = reg->reg_addr >> 8;   /*Register read address */
+        ctx->tx_packet[3] = reg->reg_addr & 0xFF;
+        ctx->tx_packet[4] = reg_count >> 8; /*Register read count */
+        ctx->tx_packet[5] = reg_count & 0xFF;
         body_size = 6;
         /* ====================================== */
     }
-    /* ADU Tail */
-    uint16_t crc = modbus_crc(tx_modbuspacket, body_size);
-    tx_modbuspacket[body_size] = crc & 0xFF;
-    tx_modbuspacket[body_size+1] = crc >> 8;
-
-    modbus_want_rx = true;
-    modbus_cur_send_time = get_since_boot_ms();
-
-    if (modbus_bus->binary_protocol)
-    {
-        uart_ring_out(EXT_UART, (char[]){MODBUS_BIN_START}, 1);
-        tx_modbuspacket[8] = MODBUS_BIN_STOP;
-        uart_ring_out(EXT_UART, (char*)tx_modbuspacket, 9);
-        if (modbus_requires_echo_removal())
-            _echo_bytes = 10;
-    }
-    else
-    {
-        uart_ring_out(EXT_UART, (char*)tx_modbuspacket, 8); /* Frame is done with silence */
-        if (modbus_requires_echo_removal())
-            _echo_bytes = 8;
-    }
+    /* Unit, function, byte count, the registers and CRC. */
+    _modbus_send(ctx, body_size, 5 + reg_count * 2);
     reg->value_state = MB_REG_WAITING;
 }
 
 
 static bool _modbus_append_u16(uint8_t* arr, unsigned len, uint16_t v, modbus_byte_orders_t byte_order)
 {
-    if (len <= 2)
+    if (len < 2)
     {
         modbus_debug("Ran out of space in array for appending u16.");
         return false;
@@ -379,7 +706,7 @@ static bool _modbus_append_u16(uint8_t* arr, unsigned len, uint16_t v, modbus_by
 
 static bool _modbus_append_u32(uint8_t* arr, unsigned len, uint32_t v, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order)
 {
-    if (len <= 4)
+    if (len < 4)
     {
         modbus_debug("Ran out of space in array for appending u32.");
         return false;
@@ -444,7 +771,299 @@ static bool _modbus_append_value(uint8_t* arr, unsigned len, modbus_reg_type_t t
 }
 
 
-static bool _modbus_set_reg(uint16_t unit_id, uint16_t reg_addr, uint8_t func, modbus_reg_type_t type, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order, float value)
+static void _modbus_reg_cb(modbus_reg_t * reg, uint8_t * data, uint8_t size, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order);
+
+
+static unsigned _modbus_reg_size(modbus_reg_t * reg)
+{
+    switch (reg->type)
+    {
+        case MODBUS_REG_TYPE_U32    : return 4;
+        case MODBUS_REG_TYPE_I32    : return 4;
+        case MODBUS_REG_TYPE_FLOAT  : return 4;
+        default                     : return 2;
+    }
+}
+
+
+static modbus_cache_t * _modbus_cache_find(modbus_ctx_t * ctx, uint16_t unit_id, uint8_t func, uint16_t reg_addr)
+{
+    for (unsigned i = 0; i < MODBUS_CACHE_COUNT; i++)
+    {
+        modbus_cache_t * entry = &ctx->cache[i];
+        if (entry->in_use &&
+            entry->unit_id == unit_id &&
+            entry->func == func &&
+            entry->reg_addr == reg_addr)
+            return entry;
+    }
+    return NULL;
+}
+
+
+static void _modbus_cache_store(modbus_ctx_t * ctx, modbus_reg_t * reg, uint8_t * data, uint8_t size)
+{
+    uint16_t unit_id = modbus_reg_get_unit_id(reg);
+    modbus_cache_t * entry = _modbus_cache_find(ctx, unit_id, reg->func, reg->reg_addr);
+    if (!entry)
+    {
+        /* Take a free one, or the oldest. */
+        uint32_t now = get_since_boot_ms();
+        entry = &ctx->cache[0];
+        for (unsigned i = 0; i < MODBUS_CACHE_COUNT; i++)
+        {
+            modbus_cache_t * candidate = &ctx->cache[i];
+            if (!candidate->in_use)
+            {
+                entry = candidate;
+                break;
+            }
+            if (since_boot_delta(now, candidate->time) > since_boot_delta(now, entry->time))
+                entry = candidate;
+        }
+    }
+
+    entry->in_use   = 1;
+    entry->time     = get_since_boot_ms();
+    entry->unit_id  = unit_id;
+    entry->reg_addr = reg->reg_addr;
+    entry->func     = reg->func;
+    entry->state    = reg->value_state;
+    if (reg->value_state == MB_REG_READY && size && size <= sizeof(entry->raw))
+    {
+        memcpy(entry->raw, data, size);
+        entry->size = size;
+    }
+    else
+    {
+        entry->state = MB_REG_INVALID;
+        entry->size  = 0;
+    }
+}
+
+
+/* Whatever was cached from the written registers is now stale. */
+static void _modbus_cache_drop(modbus_ctx_t * ctx, uint16_t unit_id, uint16_t reg_addr, unsigned count)
+{
+    for (unsigned i = 0; i < MODBUS_CACHE_COUNT; i++)
+    {
+        modbus_cache_t * entry = &ctx->cache[i];
+        if (!entry->in_use ||
+            entry->unit_id != unit_id ||
+            entry->func != MODBUS_READ_HOLDING_FUNC)
+            continue;
+        unsigned entry_count = (entry->size > 2)?(entry->size / 2):1;
+        if (entry->reg_addr < reg_addr + count &&
+            entry->reg_addr + entry_count > reg_addr)
+            entry->in_use = 0;
+    }
+}
+
+
+static bool _modbus_cache_read(modbus_ctx_t * ctx, modbus_reg_t * reg, modbus_dev_t * dev)
+{
+    uint32_t max_age_ms = modbus_get_cache_max_age() * 1000;
+    if (!max_age_ms)
+        return false;
+
+    unsigned size = _modbus_reg_size(reg);
+    modbus_cache_t * entry = _modbus_cache_find(ctx, dev->unit_id, reg->func, reg->reg_addr);
+    if (!entry || entry->state != MB_REG_READY || entry->size < size ||
+        since_boot_delta(get_since_boot_ms(), entry->time) > max_age_ms)
+    {
+        ctx->cache_misses++;
+        return false;
+    }
+
+    _modbus_reg_cb(reg, entry->raw, size, dev->byte_order, dev->word_order);
+    if (reg->value_state != MB_REG_READY)
+    {
+        ctx->cache_misses++;
+        return false;
+    }
+    modbus_debug("\"%."STR(MODBUS_NAME_LEN)"s\" from cache.", reg->name);
+    ctx->cache_hits++;
+    return true;
+}
+
+
+/* Without a UART frame timeout replies are taken on the response gap. */
+static void _modbus_frame_log(modbus_ctx_t * ctx)
+{
+    if (ctx->frame_timed)
+        log_out("- Frame - bus %u T3.5 idle %"PRIu32"ms", _modbus_ctx_get_bus(ctx), ctx->t35_ms);
+    else
+        log_out("- Frame - bus %u response gap", _modbus_ctx_get_bus(ctx));
+}
+
+
+static void _modbus_cache_log(modbus_ctx_t * ctx)
+{
+    log_out("- Cache - bus %u hits:%"PRIu32" misses:%"PRIu32,
+        _modbus_ctx_get_bus(ctx), ctx->cache_hits, ctx->cache_misses);
+}
+
+
+static bool _modbus_is_write(modbus_ctx_t * ctx, void * msg)
+{
+    uintptr_t addr = (uintptr_t)msg;
+    return (addr >= (uintptr_t)ctx->writes &&
+            addr <  (uintptr_t)(ctx->writes + MODBUS_WRITE_SLOTS));
+}
+
+
+static modbus_write_t * _modbus_write_get(modbus_ctx_t * ctx)
+{
+    for (unsigned i = 0; i < MODBUS_WRITE_SLOTS; i++)
+    {
+        modbus_write_t * write = &ctx->writes[i];
+        if (write->in_use)
+            continue;
+        memset(write, 0, sizeof(modbus_write_t));
+        write->in_use = 1;
+        write->state = MB_REG_WAITING;
+        return write;
+    }
+    return NULL;
+}
+
+
+static unsigned _modbus_write_free_count(modbus_ctx_t * ctx)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < MODBUS_WRITE_SLOTS; i++)
+    {
+        if (!ctx->writes[i].in_use)
+            count++;
+    }
+    return count;
+}
+
+
+static void _modbus_write_done(modbus_ctx_t * ctx, modbus_write_t * write, bool success)
+{
+    write->state = (success)?MB_REG_READY:MB_REG_INVALID;
+    /* Even a failed write may have got some of the way. */
+    _modbus_cache_drop(ctx, write->unit_id, write->reg_addr, write->count);
+    for (unsigned i = 0; i < write->count; i++)
+    {
+        uint16_t reg_addr = write->reg_addr + i;
+        if (modbus_reg_write_result)
+            modbus_reg_write_result(_modbus_ctx_get_bus(ctx), write->unit_id, reg_addr, success);
+        if (write->report)
+            log_out("MB 0x%"PRIx8":0x%04"PRIx16" %s", write->unit_id, reg_addr, (success)?"written":"write failed");
+    }
+    if (write->report)
+        write->in_use = 0;
+}
+
+
+static void _modbus_do_start_write(modbus_ctx_t * ctx, modbus_write_t * write)
+{
+    modbus_debug("Writing %"PRIu8" to 0x%"PRIx8":0x%"PRIx16, write->count, write->unit_id, write->reg_addr);
+
+    unsigned body_size;
+
+    ctx->tx_packet[0] = write->unit_id;
+    ctx->tx_packet[1] = write->func;
+    ctx->tx_packet[2] = write->reg_addr >> 8;
+    ctx->tx_packet[3] = write->reg_addr & 0xFF;
+    if (write->func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
+        body_size = 4;
+    else
+    {
+        ctx->tx_packet[4] = write->count >> 8;
+        ctx->tx_packet[5] = write->count & 0xFF;
+        ctx->tx_packet[6] = write->count * 2; /* Number of databytes to follow */
+        body_size = 7;
+    }
+    memcpy(&ctx->tx_packet[body_size], write->data, write->count * 2);
+    body_size += write->count * 2;
+
+    modbus_debug("Modbus packet (%u):", body_size);
+    log_debug_data(DEBUG_MODBUS, ctx->tx_packet, body_size);
+
+    /* Both write replies are unit, function, address, value or count and CRC. */
+    _modbus_send(ctx, body_size, 8);
+}
+
+
+/* Anything queued is failed, so no write is left waiting on it. */
+static void _modbus_queue_clear(modbus_ctx_t * ctx)
+{
+    void * msg = NULL;
+    while (ring_buf_read(&ctx->queue, (char*)&msg, sizeof(msg)) == sizeof(msg))
+    {
+        if (_modbus_is_write(ctx, msg))
+            _modbus_write_done(ctx, msg, false);
+    }
+    ring_buf_clear(&ctx->queue);
+}
+
+
+/* Registers are about to move in memory, so queued reads of them are
+ * dropped as invalid. Writes carry their own data and stay queued. */
+void modbus_regs_moving(void)
+{
+    for (unsigned bus = 0; bus < MODBUS_BUS_COUNT; bus++)
+    {
+        modbus_ctx_t * ctx = &_modbus_ctxs[bus];
+        unsigned count = ring_buf_get_pending(&ctx->queue) / sizeof(void*);
+        for (unsigned n = 0; n < count; n++)
+        {
+            void * msg = NULL;
+            if (ring_buf_read(&ctx->queue, (char*)&msg, sizeof(msg)) != sizeof(msg))
+                break;
+            if (_modbus_is_write(ctx, msg))
+            {
+                ring_buf_add_data(&ctx->queue, &msg, sizeof(msg));
+                continue;
+            }
+            if (!n && ctx->want_rx)
+            {
+                /* Its reply is no longer wanted, but may still be on
+                 * the wire, so the next waits for it to end. */
+                ctx->want_rx = false;
+                ctx->packet_len = 0;
+                ctx->read_timing_init = 0;
+                ctx->read_last_good = get_since_boot_ms();
+            }
+            if (msg)
+                ((modbus_reg_t*)msg)->value_state = MB_REG_INVALID;
+        }
+    }
+}
+
+
+static void _modbus_next_message(modbus_ctx_t * ctx);
+
+
+static bool _modbus_queue_write(modbus_ctx_t * ctx, modbus_write_t * write)
+{
+    if (!ring_buf_add_data(&ctx->queue, &write, sizeof(write)))
+    {
+        modbus_debug("No queue space for write.");
+        write->in_use = 0;
+        return false;
+    }
+    if (!ctx->want_rx)
+        _modbus_next_message(ctx);
+    return true;
+}
+
+
+static bool _modbus_can_write(modbus_ctx_t * ctx)
+{
+    if (ctx == &_modbus_ctxs[0] && modbus_slave_get_unit_id())
+    {
+        modbus_debug("Modbus slave, can't write.");
+        return false;
+    }
+    return true;
+}
+
+
+static modbus_write_t * _modbus_set_reg(modbus_ctx_t * ctx, uint16_t unit_id, uint16_t reg_addr, uint8_t func, modbus_reg_type_t type, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order, float value)
 {
     unsigned reg_count = 1;
 
@@ -457,34 +1076,14 @@ static bool _modbus_set_reg(uint16_t unit_id, uint16_t reg_addr, uint8_t func, m
         case MODBUS_REG_TYPE_FLOAT  : reg_count = 2; break;
         default:
             modbus_debug("Unknown type.");
-            return false;
+            return NULL;
     }
 
-    unsigned body_size = 4;
-
-    if (func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
-    {
-        tx_modbuspacket[0] = unit_id;
-        tx_modbuspacket[1] = MODBUS_WRITE_SINGLE_HOLDING_FUNC;
-        tx_modbuspacket[2] = reg_addr >> 8;
-        tx_modbuspacket[3] = reg_addr & 0xFF;
-        body_size = 4;
-    }
-    else if (func == MODBUS_WRITE_MULTIPLE_HOLDING_FUNC)
-    {
-        tx_modbuspacket[0] = unit_id;
-        tx_modbuspacket[1] = MODBUS_WRITE_MULTIPLE_HOLDING_FUNC;
-        tx_modbuspacket[2] = reg_addr >> 8;
-        tx_modbuspacket[3] = reg_addr & 0xFF;
-        tx_modbuspacket[4] = reg_count >> 8;
-        tx_modbuspacket[5] = reg_count & 0xFF;
-        tx_modbuspacket[6] = reg_count * 2; /* Number of databytes to follow */
-        body_size = 7;
-    }
-    else
+    if (func != MODBUS_WRITE_SINGLE_HOLDING_FUNC &&
+        func != MODBUS_WRITE_MULTIPLE_HOLDING_FUNC)
     {
         modbus_debug("Unknown function.");
-        return false;
+        return NULL;
     }
 
     /* If larger sizes than type u32 and i32 are required, this will
@@ -511,58 +1110,117 @@ static bool _modbus_set_reg(uint16_t unit_id, uint16_t reg_addr, uint8_t func, m
     else
     {
         modbus_debug("Unknown type for converting value. (%d)", type);
-        return false;
+        return NULL;
+    }
+
+    if (!_modbus_can_write(ctx))
+        return NULL;
+
+    modbus_write_t * write = _modbus_write_get(ctx);
+    if (!write)
+    {
+        modbus_debug("No write slot free.");
+        return NULL;
     }
 
-    if (!_modbus_append_value(&tx_modbuspacket[body_size], MODBUS_PACKET_BUF_SIZ - body_size, type, byte_order, word_order, &value32, &body_size))
-    {
-        modbus_debug("Failed to append modbus value.");
-        return false;
-    }
+    write->func     = func;
+    write->unit_id  = unit_id;
+    write->reg_addr = reg_addr;
+    write->count    = reg_count;
+
+    unsigned body_size = 0;
+    if (!_modbus_append_value(write->data, sizeof(write->data), type, byte_order, word_order, &value32, &body_size))
+    {
+        modbus_debug("Failed to append modbus value.");
+        write->in_use = 0;
+        return NULL;
+    }
+
+    if (!_modbus_queue_write(ctx, write))
+        return NULL;
+    return write;
+}
+
+
+/* Contiguous registers from here, up to what one frame takes. */
+static unsigned _modbus_write_run_len(const modbus_reg_write_t * regs, unsigned count)
+{
+    unsigned len = 1;
+    while (len < count && len < MODBUS_WRITE_MAX_REGS &&
+           regs[len].reg_addr == regs[len - 1].reg_addr + 1)
+        len++;
+    return len;
+}
+
+
+/* Sorts the given registers and queues a write multiple for each
+ * contiguous run, results come back per register through
+ * modbus_reg_write_result and the log. All are queued or none.
+ * Returns the number of frames queued. */
+unsigned modbus_write_batch(modbus_dev_t * dev, modbus_reg_write_t * regs, unsigned count)
+{
+    modbus_ctx_t * ctx = _modbus_get_ctx_of_dev(dev);
+    if (!ctx || !regs || !count || !_modbus_can_write(ctx))
+        return 0;
 
-    if (func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
+    /* Insertion sort, batches are small. */
+    for (unsigned i = 1; i < count; i++)
     {
-        _modbus_reg_set_expected.unit_id        = unit_id;
-        _modbus_reg_set_expected.reg_addr       = reg_addr;
-        _modbus_reg_set_expected.value          = value32;
+        modbus_reg_write_t reg = regs[i];
+        unsigned j = i;
+        for (; j && regs[j - 1].reg_addr > reg.reg_addr; j--)
+            regs[j] = regs[j - 1];
+        regs[j] = reg;
     }
-    else if (func == MODBUS_WRITE_MULTIPLE_HOLDING_FUNC)
+
+    unsigned frames = 0;
+    for (unsigned i = 0; i < count; i += _modbus_write_run_len(&regs[i], count - i))
     {
-        _modbus_reg_set_expected.unit_id        = unit_id;
-        _modbus_reg_set_expected.reg_addr       = reg_addr;
-        _modbus_reg_set_expected.num_written    = reg_count;
+        if (i && regs[i].reg_addr == regs[i - 1].reg_addr)
+        {
+            modbus_debug("Register 0x%"PRIx16" given twice.", regs[i].reg_addr);
+            return 0;
+        }
+        frames++;
     }
-    else
+
+    if (frames > _modbus_write_free_count(ctx) ||
+        frames * sizeof(void*) > ring_buf_get_free(&ctx->queue))
     {
-        modbus_debug("Undefined modbus function for setting expected.");
-        return false;
+        modbus_debug("No room to queue %u writes.", frames);
+        return 0;
     }
 
-
-    uint16_t crc = modbus_crc(tx_modbuspacket, body_size);
-    tx_modbuspacket[body_size++] = crc & 0xFF;
-    tx_modbuspacket[body_size++] = crc >> 8;
-
-    modbus_debug("Modbus packet (%u):", body_size);
-    log_debug_data(DEBUG_MODBUS, tx_modbuspacket, body_size);
-
-    modbus_want_rx = true;
-    modbus_cur_send_time = get_since_boot_ms();
-    if (modbus_bus->binary_protocol)
+    for (unsigned i = 0; i < count;)
     {
-        uart_ring_out(EXT_UART, (char[]){MODBUS_BIN_START}, 1);
-        tx_modbuspacket[body_size++] = MODBUS_BIN_STOP;
+        unsigned len = _modbus_write_run_len(&regs[i], count - i);
+        modbus_write_t * write = _modbus_write_get(ctx);
+        write->func     = (len == 1)?MODBUS_WRITE_SINGLE_HOLDING_FUNC:MODBUS_WRITE_MULTIPLE_HOLDING_FUNC;
+        write->unit_id  = dev->unit_id;
+        write->reg_addr = regs[i].reg_addr;
+        write->count    = len;
+        write->report   = 1;
+        for (unsigned n = 0; n < len; n++)
+            _modbus_append_u16(&write->data[n * 2], sizeof(write->data) - n * 2, regs[i + n].value, dev->byte_order);
+        _modbus_queue_write(ctx, write);
+        i += len;
     }
-    uart_ring_out(EXT_UART, (char*)tx_modbuspacket, body_size);
-    return true;
+    return frames;
 }
 
 
 bool modbus_start_read(modbus_reg_t * reg)
 {
     modbus_dev_t * dev = modbus_reg_get_dev(reg);
+    modbus_ctx_t * ctx = _modbus_get_ctx_of_dev(dev);
+
+    if (ctx == &_modbus_ctxs[0] && modbus_slave_get_unit_id())
+    {
+        modbus_debug("Modbus slave, can't read \"%."STR(MODBUS_NAME_LEN)"s\"", reg->name);
+        return false;
+    }
 
-    if (!dev ||
+    if (!dev || !ctx ||
         !(reg->func == MODBUS_READ_HOLDING_FUNC || reg->func == MODBUS_READ_INPUT_FUNC) ||
         !(reg->type == MODBUS_REG_TYPE_U16  ||
           reg->type == MODBUS_REG_TYPE_I16  ||
@@ -574,113 +1232,332 @@ bool modbus_start_read(modbus_reg_t * reg)
         return false;
     }
 
-    if (ring_buf_is_full(&_message_queue))
+    if (_modbus_cache_read(ctx, reg, dev))
+        return true;
+
+    if (_modbus_health_backing_off(ctx, dev->unit_id))
+    {
+        modbus_debug("Unit 0x%"PRIx16" backing off, not reading \"%."STR(MODBUS_NAME_LEN)"s\"", dev->unit_id, reg->name);
+        return false;
+    }
+
+    if (ring_buf_is_full(&ctx->queue))
     {
-        if (modbus_want_rx)
+        if (ctx->want_rx)
         {
-            uint32_t delta = since_boot_delta(get_since_boot_ms(), modbus_cur_send_time);
-            if (delta < MODBUS_RESP_TIMEOUT_MS)
+            uint32_t delta = since_boot_delta(get_since_boot_ms(), ctx->cur_send_time);
+            if (delta < _modbus_resp_timeout(ctx))
             {
-                modbus_debug("No slot free.. sending to fast?? (%u/%u)", (unsigned)(ring_buf_get_pending(&_message_queue)/sizeof(modbus_reg_t*)), (unsigned)(_message_queue.size/sizeof(modbus_reg_t*)) );
+                modbus_debug("No slot free.. sending to fast?? (%u/%u)", (unsigned)(ring_buf_get_pending(&ctx->queue)/sizeof(modbus_reg_t*)), (unsigned)(ctx->queue.size/sizeof(modbus_reg_t*)) );
                 return false;
             }
         }
         else modbus_debug("No slot free, but not waiting?.. comms??");
 
         modbus_debug("Previous comms issue. Restarting slots.");
-        ring_buf_clear(&_message_queue);
+        _modbus_queue_clear(ctx);
 
-        modbus_read_last_good = 0;
-        modbus_cur_send_time = 0;
-        modbus_want_rx = false;
+        ctx->read_last_good = 0;
+        ctx->cur_send_time = 0;
+        ctx->want_rx = false;
     }
 
-    if (!ring_buf_add_data(&_message_queue, &reg, sizeof(modbus_reg_t*)))
+    if (!ring_buf_add_data(&ctx->queue, &reg, sizeof(modbus_reg_t*)))
     {
         log_error("Modbus queue error");
-        ring_buf_clear(&_message_queue);
+        _modbus_queue_clear(ctx);
         return false;
     }
 
     reg->value_state = MB_REG_WAITING;
 
-    if (modbus_want_rx)
+    if (ctx->want_rx)
     {
         modbus_debug("Deferred read of \"%."STR(MODBUS_NAME_LEN)"s\"", reg->name);
         return true;
     }
 
     modbus_debug("Immediate read");
-    _modbus_do_start_read(reg);
+    /* Whatever is at the head goes first, the reply is taken as for it. */
+    _modbus_next_message(ctx);
     return true;
 }
 
 
-static void _modbus_next_message(void)
+static void _modbus_next_message(modbus_ctx_t * ctx)
 {
-    modbus_reg_t * current_reg = NULL;
+    void * msg = NULL;
 
-    if (ring_buf_peek(&_message_queue, (char*)&current_reg, sizeof(current_reg)) != sizeof(current_reg))
-        return;
+    while (ring_buf_peek(&ctx->queue, (char*)&msg, sizeof(msg)) == sizeof(msg))
+    {
+        if (!msg)
+            return;
 
-    if (current_reg)
-        _modbus_do_start_read(current_reg);
+        /* Asked for, so sent even to a unit backing off, a reply ends that. */
+        if (_modbus_is_write(ctx, msg))
+        {
+            _modbus_do_start_write(ctx, msg);
+            return;
+        }
+
+        modbus_reg_t * current_reg = msg;
+
+        /* Don't let a dead unit hold up the queue for the others. */
+        if (!_modbus_health_backing_off(ctx, modbus_reg_get_unit_id(current_reg)))
+        {
+            _modbus_do_start_read(ctx, current_reg);
+            return;
+        }
+
+        modbus_debug("Skipping \"%."STR(MODBUS_NAME_LEN)"s\", unit backing off.", current_reg->name);
+        current_reg->value_state = MB_REG_INVALID;
+        ring_buf_discard(&ctx->queue, sizeof(msg));
+    }
 }
 
 
-static bool _modbus_has_timedout(ring_buf_t * ring)
+static bool _modbus_has_timedout(modbus_ctx_t * ctx, ring_buf_t * ring)
 {
-    uint32_t delta = (modbus_read_timing_init)?
-                    since_boot_delta(get_since_boot_ms(), modbus_read_timing_init)
+    uint32_t delta = (ctx->read_timing_init)?
+                    since_boot_delta(get_since_boot_ms(), ctx->read_timing_init)
                     :
-                    since_boot_delta(get_since_boot_ms(), modbus_cur_send_time);
+                    since_boot_delta(get_since_boot_ms(), ctx->cur_send_time);
 
-    if (delta < MODBUS_RESP_TIMEOUT_MS)
+    if (delta < _modbus_resp_timeout(ctx))
         return false;
     modbus_debug("Message timeout, dumping left overs.");
-    modbuspacket_len = 0;
-    modbus_read_timing_init = 0;
-    modbus_want_rx = false;
+
+    modbus_dev_health_t * health = _modbus_health_get(ctx, ctx->cur_unit_id, true);
+    if (health)
+        health->timeouts++;
+    ctx->packet_len = 0;
+    ctx->read_timing_init = 0;
+    ctx->want_rx = false;
     ring_buf_clear(ring);
 
-    modbus_retransmit_count++;
-    if (modbus_retransmit_count < MODBUS_MAX_RETRANSMITS)
-        _modbus_next_message();
+    ctx->retransmit_count++;
+    if (ctx->retransmit_count < _modbus_retry_budget(ctx))
+        _modbus_next_message(ctx);
     else
     {
-        modbus_reg_t * current_reg = NULL;
+        void * msg = NULL;
 
         modbus_debug("Dropping message in queue.");
-        modbus_retransmit_count = 0;
+        ctx->retransmit_count = 0;
+        _modbus_health_dropped(ctx);
 
-        if (ring_buf_read(&_message_queue, (char*)&current_reg, sizeof(current_reg)) != sizeof(current_reg) || current_reg == NULL)
+        if (ring_buf_read(&ctx->queue, (char*)&msg, sizeof(msg)) != sizeof(msg) || msg == NULL)
         {
             modbus_debug("Failed to drop message, dropping all messages.");
-            ring_buf_clear(&_message_queue);
+            _modbus_queue_clear(ctx);
         }
+        else if (_modbus_is_write(ctx, msg))
+            _modbus_write_done(ctx, msg, false);
     }
 
     return true;
 }
 
-static void _modbus_reg_cb(modbus_reg_t * reg, uint8_t * data, uint8_t size, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order);
+static void _modbus_packet_process(modbus_ctx_t * ctx);
+
+
+/* The UART has said where the frame ends, so no need to know the reply's
+ * length from its function code. */
+static void _modbus_frame_in_process(modbus_ctx_t * ctx, ring_buf_t * ring)
+{
+    unsigned len = uart_ring_in_get_frame(ctx->uart);
+
+    if (!len)
+    {
+        if (!ctx->read_timing_init && ring_buf_get_pending(ring) > ctx->echo_bytes)
+        {
+            /* Reply has started, just not finished. */
+            ctx->read_timing_init = get_since_boot_ms();
+            modbus_debug("bus received, timer started at:%"PRIu32, ctx->read_timing_init);
+        }
+        _modbus_has_timedout(ctx, ring);
+        return;
+    }
+
+    unsigned pending = ring_buf_get_pending(ring);
+    if (len > pending)
+    {
+        modbus_debug("Frame of %u but only %u pending.", len, pending);
+        len = pending;
+    }
+
+    if (modbus_requires_echo_removal() && ctx->echo_bytes)
+    {
+        unsigned discarded = ring_buf_discard(ring, (len < ctx->echo_bytes)?len:ctx->echo_bytes);
+        ctx->echo_bytes -= discarded;
+        len -= discarded;
+        if (!ctx->echo_bytes)
+            modbus_debug("Echo drained.");
+        if (!len)
+            return;
+    }
+
+    if (len < 5 || len > MAX_MODBUS_PACKET_SIZE)
+    {
+        modbus_debug("Bad frame length %u, discarded.", len);
+        ring_buf_discard(ring, len);
+        return;
+    }
+
+    modbus_debug("Frame of %u received.", len);
+    ring_buf_read(ring, (char*)ctx->packet, len);
+
+    uint8_t func = ctx->packet[1];
+    if ((func == MODBUS_READ_HOLDING_FUNC || func == MODBUS_READ_INPUT_FUNC) &&
+        (ctx->packet[2] + 5U) > len)
+    {
+        modbus_debug("Frame shorter than its byte count, discarded.");
+        return;
+    }
+    ctx->packet_len = len;
+    ctx->read_timing_init = 0;
+
+    _modbus_packet_process(ctx);
+}
+
+
+/* Without frame timing only fixed size read requests can be picked out,
+ * so slide along a byte at a time until one checks out. */
+static unsigned _modbus_slave_find_request(modbus_ctx_t * ctx, ring_buf_t * ring)
+{
+    unsigned len = (ctx->binary_protocol)?10:8;
+
+    if (ring_buf_get_pending(ring) < len)
+        return 0;
+
+    ring_buf_peek(ring, (char*)ctx->packet, len);
+
+    if (ctx->binary_protocol)
+    {
+        if (ctx->packet[0] != MODBUS_BIN_START || ctx->packet[len - 1] != MODBUS_BIN_STOP)
+        {
+            ring_buf_discard(ring, 1);
+            return 0;
+        }
+        len -= 2;
+        memmove(ctx->packet, ctx->packet + 1, len);
+    }
+
+    uint16_t crc = modbus_crc(ctx->packet, len - 2);
+    if ((ctx->packet[len-1] != (crc >> 8)) ||
+        (ctx->packet[len-2] != (crc & 0xFF)))
+    {
+        ring_buf_discard(ring, 1);
+        return 0;
+    }
+
+    ring_buf_discard(ring, (ctx->binary_protocol)?(len + 2):len);
+    return len;
+}
+
+
+static void _modbus_slave_in_process(modbus_ctx_t * ctx, ring_buf_t * ring)
+{
+    unsigned len;
+
+    if (modbus_requires_echo_removal() && ctx->echo_bytes)
+    {
+        unsigned discarded = ring_buf_discard(ring, ctx->echo_bytes);
+        ctx->echo_bytes -= discarded;
+        if (ctx->frame_timed && !ctx->echo_bytes)
+            uart_ring_in_get_frame(ctx->uart);
+        return;
+    }
+
+    if (ctx->frame_timed)
+    {
+        len = uart_ring_in_get_frame(ctx->uart);
+        if (!len)
+            return;
+        unsigned pending = ring_buf_get_pending(ring);
+        if (len > pending)
+            len = pending;
+        if (len < 4 || len > MAX_MODBUS_PACKET_SIZE)
+        {
+            ring_buf_discard(ring, len);
+            return;
+        }
+        ring_buf_read(ring, (char*)ctx->packet, len);
+
+        uint16_t crc = modbus_crc(ctx->packet, len - 2);
+        if ((ctx->packet[len-1] != (crc >> 8)) ||
+            (ctx->packet[len-2] != (crc & 0xFF)))
+        {
+            modbus_debug("Bad CRC");
+            return;
+        }
+    }
+    else
+    {
+        len = _modbus_slave_find_request(ctx, ring);
+        if (!len)
+            return;
+    }
+
+    unsigned size = MAX_MODBUS_PACKET_SIZE - ((ctx->binary_protocol)?2:0);
+    unsigned resp_len = modbus_slave_request(ctx->packet, len - 2, size);
+    if (!resp_len)
+        return;
 
-void modbus_uart_ring_in_process(ring_buf_t * ring)
+    uint16_t crc = modbus_crc(ctx->packet, resp_len);
+    ctx->packet[resp_len++] = crc & 0xFF;
+    ctx->packet[resp_len++] = crc >> 8;
+
+    if (ctx->binary_protocol)
+    {
+        uart_ring_out(ctx->uart, (char[]){MODBUS_BIN_START}, 1);
+        uart_ring_out(ctx->uart, (char*)ctx->packet, resp_len);
+        uart_ring_out(ctx->uart, (char[]){MODBUS_BIN_STOP}, 1);
+        resp_len += 2;
+    }
+    else uart_ring_out(ctx->uart, (char*)ctx->packet, resp_len);
+
+    if (modbus_requires_echo_removal())
+        ctx->echo_bytes = resp_len;
+}
+
+
+void modbus_uart_ring_in_process(unsigned uart, ring_buf_t * ring)
 {
-    if (!modbus_want_rx)
+    modbus_ctx_t * ctx = _modbus_get_ctx_by_uart(uart);
+    if (!ctx)
+        return;
+
+    if (ctx == &_modbus_ctxs[0] && modbus_slave_get_unit_id())
+    {
+        _modbus_slave_in_process(ctx, ring);
+        return;
+    }
+
+    if (!ctx->want_rx)
     {
+        /* Anything unwanted still arriving holds off the next send. */
+        if (ring_buf_get_pending(ring))
+            ctx->read_last_good = get_since_boot_ms();
         ring_buf_clear(ring);
+        uart_ring_in_get_frame(ctx->uart);
 
-        if (ring_buf_get_pending(&_message_queue))
+        if (ring_buf_get_pending(&ctx->queue))
         {
-            uint32_t delta = since_boot_delta(get_since_boot_ms(), modbus_read_last_good);
-            if (delta > MODBUS_TX_GAP_MS)
-                _modbus_next_message();
+            uint32_t delta = since_boot_delta(get_since_boot_ms(), ctx->read_last_good);
+            if (delta > ctx->tx_gap)
+                _modbus_next_message(ctx);
         }
         return;
     }
 
-    if (_modbus_has_timedout(ring))
+    if (ctx->frame_timed)
+    {
+        _modbus_frame_in_process(ctx, ring);
+        return;
+    }
+
+    if (_modbus_has_timedout(ctx, ring))
         return;
 
     unsigned len = ring_buf_get_pending(ring);
@@ -688,23 +1565,23 @@ void modbus_uart_ring_in_process(ring_buf_t * ring)
     if (!len)
         return;
 
-    if (modbus_requires_echo_removal() && _echo_bytes)
+    if (modbus_requires_echo_removal() && ctx->echo_bytes)
     {
-        unsigned discarded = ring_buf_discard(ring, _echo_bytes);
-        _echo_bytes -= discarded;
-        if (!_echo_bytes)
+        unsigned discarded = ring_buf_discard(ring, ctx->echo_bytes);
+        ctx->echo_bytes -= discarded;
+        if (!ctx->echo_bytes)
             modbus_debug("Echo drained.");
         return;
     }
 
-    if (!modbuspacket_len)
+    if (!ctx->packet_len)
     {
-        if ((!modbus_bus->binary_protocol && len > 2) || (modbus_bus->binary_protocol && len > 3))
+        if ((!ctx->binary_protocol && len > 2) || (ctx->binary_protocol && len > 3))
         {
-            modbus_read_timing_init = 0;
-            ring_buf_read(ring, (char*)modbuspacket, 1);
+            ctx->read_timing_init = 0;
+            ring_buf_read(ring, (char*)ctx->packet, 1);
 
-            if (!modbuspacket[0])
+            if (!ctx->packet[0])
             {
                 modbus_debug("Zero start");
                 return;
@@ -712,40 +1589,40 @@ void modbus_uart_ring_in_process(ring_buf_t * ring)
 
             modbus_debug("Starting reply read with : %u", len);
 
-            if (modbus_bus->binary_protocol)
+            if (ctx->binary_protocol)
             {
-                if (modbuspacket[0] != MODBUS_BIN_START)
+                if (ctx->packet[0] != MODBUS_BIN_START)
                 {
                     modbus_debug("Not binary frame start.");
                     return;
                 }
-                ring_buf_read(ring, (char*)modbuspacket, 1);
+                ring_buf_read(ring, (char*)ctx->packet, 1);
             }
 
-            ring_buf_read(ring, (char*)modbuspacket + 1, 2);
-            uint8_t func = modbuspacket[1];
+            ring_buf_read(ring, (char*)ctx->packet + 1, 2);
+            uint8_t func = ctx->packet[1];
 
             len -= 3;
-            modbus_debug("Reply, Address:%"PRIu8" Function: %"PRIu8, modbuspacket[0], func);
+            modbus_debug("Reply, Address:%"PRIu8" Function: %"PRIu8, ctx->packet[0], func);
             if (func == MODBUS_READ_HOLDING_FUNC)
             {
-                modbuspacket_len = modbuspacket[2] + 2 /* result data and crc*/;
+                ctx->packet_len = ctx->packet[2] + 2 /* result data and crc*/;
             }
             else if (func == MODBUS_READ_INPUT_FUNC)
             {
-                modbuspacket_len = modbuspacket[2] + 2 /* result data and crc*/;
+                ctx->packet_len = ctx->packet[2] + 2 /* result data and crc*/;
             }
             else if (func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
             {
-                modbuspacket_len = 5;
+                ctx->packet_len = 5;
             }
             else if (func == MODBUS_WRITE_MULTIPLE_HOLDING_FUNC)
             {
-                modbuspacket_len = 5;
+                ctx->packet_len = 5;
             }
             else if ((func & MODBUS_ERROR_MASK) == MODBUS_ERROR_MASK)
             {
-                modbuspacket_len = 2; /* Exception code is in header, so just crc*/
+                ctx->packet_len = 2; /* Exception code is in header, so just crc*/
             }
             else
             {
@@ -753,165 +1630,169 @@ void modbus_uart_ring_in_process(ring_buf_t * ring)
                 return;
             }
 
-            modbus_debug("Reply type length : %u", modbuspacket_len);
-            if (modbus_bus->binary_protocol)
-                modbuspacket_len++;
+            modbus_debug("Reply type length : %u", ctx->packet_len);
+            if (ctx->binary_protocol)
+                ctx->packet_len++;
 
-            modbus_read_timing_init = get_since_boot_ms();
-            modbus_debug("header received, timer started at:%"PRIu32, modbus_read_timing_init);
+            ctx->read_timing_init = get_since_boot_ms();
+            modbus_debug("header received, timer started at:%"PRIu32, ctx->read_timing_init);
         }
         else
         {
-            if (!modbus_read_timing_init)
+            if (!ctx->read_timing_init)
             {
                 // There is some bytes, but not enough to be a header yet
-                modbus_read_timing_init = get_since_boot_ms();
-                modbus_debug("bus received, timer started at:%"PRIu32, modbus_read_timing_init);
+                ctx->read_timing_init = get_since_boot_ms();
+                modbus_debug("bus received, timer started at:%"PRIu32, ctx->read_timing_init);
             }
-            else _modbus_has_timedout(ring);
+            else _modbus_has_timedout(ctx, ring);
             return;
         }
     }
 
-    if (!modbuspacket_len)
+    if (!ctx->packet_len)
         return;
 
-    if (len < modbuspacket_len)
+    if (len < ctx->packet_len)
     {
-        _modbus_has_timedout(ring);
+        _modbus_has_timedout(ctx, ring);
         return;
     }
 
-    modbus_read_timing_init = 0;
-    modbus_debug("Message bytes (%u) reached.", modbuspacket_len);
+    ctx->read_timing_init = 0;
+    modbus_debug("Message bytes (%u) reached.", ctx->packet_len);
 
-    ring_buf_read(ring, (char*)modbuspacket + 3, modbuspacket_len);
+    ring_buf_read(ring, (char*)ctx->packet + 3, ctx->packet_len);
 
-    if (modbus_bus->binary_protocol)
+    if (ctx->binary_protocol)
     {
-        if (modbuspacket[modbuspacket_len + 3 - 1] != MODBUS_BIN_STOP)
+        if (ctx->packet[ctx->packet_len + 3 - 1] != MODBUS_BIN_STOP)
         {
             modbus_debug("Not binary frame stopped, discarded.");
             return;
         }
-        modbuspacket_len--;
+        ctx->packet_len--;
     }
 
     // Now include the header too.
-    modbuspacket_len += 3;
+    ctx->packet_len += 3;
 
-    uint16_t crc = modbus_crc(modbuspacket, modbuspacket_len - 2);
+    _modbus_packet_process(ctx);
+}
 
-    if ( (modbuspacket[modbuspacket_len-1] != (crc >> 8)) ||
-         (modbuspacket[modbuspacket_len-2] != (crc & 0xFF)) )
-    {
-        modbus_debug("Bad CRC");
-        modbuspacket_len = 0;
-        modbus_want_rx = false;
-        return;
-    }
 
-    modbus_debug("Good CRC");
-    modbuspacket_len = 0;
-    modbus_want_rx = false;
+static bool _modbus_write_acked(modbus_ctx_t * ctx, modbus_write_t * write, unsigned len)
+{
+    uint8_t * packet = ctx->packet;
 
-    uint8_t unit_id = modbuspacket[0];
-    uint8_t func    = modbuspacket[1];
-    if (func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
+    if (packet[1] == (write->func | MODBUS_ERROR_MASK))
     {
-        if (unit_id != _modbus_reg_set_expected.unit_id)
-        {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected unit id (0x%02"PRIX8" != 0x%02"PRIX8").", unit_id, _modbus_reg_set_expected.unit_id);
-            return;
-        }
-        uint16_t reg_addr = (modbuspacket[2] << 8) | modbuspacket[3];
-        if (reg_addr != _modbus_reg_set_expected.reg_addr)
-        {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected register address (0x%04"PRIX16" != 0x%04"PRIX16").", reg_addr, _modbus_reg_set_expected.reg_addr);
-            return;
-        }
-        uint16_t value = (modbuspacket[4] << 8) | modbuspacket[5];
-        if (value != _modbus_reg_set_expected.value)
-        {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected value (0x%04"PRIX16" != 04%"PRIX16").", value, _modbus_reg_set_expected.value);
-            return;
-        }
-        modbus_debug("Received acknowledgement.");
-        _modbus_reg_set_expected.not_done = false;
-        _modbus_reg_set_expected.passfail = true;
-        return;
+        modbus_debug("Write exception: 0x%02"PRIx8, packet[2]);
+        return false;
     }
-    else if (func == MODBUS_WRITE_MULTIPLE_HOLDING_FUNC)
+    if (len < 8 || packet[0] != write->unit_id || packet[1] != write->func)
     {
-        if (unit_id != _modbus_reg_set_expected.unit_id)
-        {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected unit id (0x%02"PRIX8" != 0x%02"PRIX8").", unit_id, _modbus_reg_set_expected.unit_id);
-            return;
-        }
-        uint16_t reg_addr = (modbuspacket[2] << 8) | modbuspacket[3];
-        if (reg_addr != _modbus_reg_set_expected.reg_addr)
+        modbus_debug("Unexpected reply to write of 0x%02"PRIX8".", write->unit_id);
+        return false;
+    }
+    uint16_t reg_addr = (packet[2] << 8) | packet[3];
+    if (reg_addr != write->reg_addr)
+    {
+        modbus_debug("Unexpected register address (0x%04"PRIX16" != 0x%04"PRIX16").", reg_addr, write->reg_addr);
+        return false;
+    }
+    if (write->func == MODBUS_WRITE_SINGLE_HOLDING_FUNC)
+    {
+        if (memcmp(&packet[4], write->data, 2))
         {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected register address (0x%04"PRIX16" != 0x%04"PRIX16").", reg_addr, _modbus_reg_set_expected.reg_addr);
-            return;
+            modbus_debug("Unexpected value written.");
+            return false;
         }
-        uint16_t num_written = (modbuspacket[4] << 8) | modbuspacket[5];
-        if (num_written != _modbus_reg_set_expected.num_written)
+    }
+    else
+    {
+        uint16_t num_written = (packet[4] << 8) | packet[5];
+        if (num_written != write->count)
         {
-            _modbus_reg_set_expected.not_done = false;
-            _modbus_reg_set_expected.passfail = false;
-            modbus_debug("Unexpected num_written (0x%04"PRIX16" != 04%"PRIX16").", num_written, _modbus_reg_set_expected.num_written);
-            return;
+            modbus_debug("Unexpected num_written (%"PRIu16" != %"PRIu8").", num_written, write->count);
+            return false;
         }
-        modbus_debug("Received acknowledgement.");
-        _modbus_reg_set_expected.not_done = false;
-        _modbus_reg_set_expected.passfail = true;
+    }
+    modbus_debug("Received acknowledgement.");
+    return true;
+}
+
+
+static void _modbus_packet_process(modbus_ctx_t * ctx)
+{
+    uint16_t crc = modbus_crc(ctx->packet, ctx->packet_len - 2);
+
+    if ( (ctx->packet[ctx->packet_len-1] != (crc >> 8)) ||
+         (ctx->packet[ctx->packet_len-2] != (crc & 0xFF)) )
+    {
+        modbus_debug("Bad CRC");
+        modbus_dev_health_t * health = _modbus_health_get(ctx, ctx->cur_unit_id, true);
+        if (health)
+            health->bad_crc++;
+        ctx->packet_len = 0;
+        ctx->want_rx = false;
         return;
     }
 
-    // Good or bad, we think we have the whole message for current register, so remove it from queue.
-    modbus_reg_t * current_reg = NULL;
+    modbus_debug("Good CRC");
+    unsigned len = ctx->packet_len;
+    ctx->packet_len = 0;
+    ctx->want_rx = false;
+
+    /* Exceptions count too, the unit is there and answering. */
+    _modbus_health_reply(ctx, ctx->packet[0]);
 
-    if (ring_buf_read(&_message_queue, (char*)&current_reg, sizeof(current_reg)) != sizeof(current_reg) || current_reg == NULL)
+    // Good or bad, we think we have the whole message for the current message, so remove it from queue.
+    void * msg = NULL;
+
+    if (ring_buf_read(&ctx->queue, (char*)&msg, sizeof(msg)) != sizeof(msg) || msg == NULL)
     {
         log_error("Modbus comms issues!");
         return;
     }
 
+    if (_modbus_is_write(ctx, msg))
+    {
+        ctx->read_last_good = get_since_boot_ms();
+        ctx->retransmit_count = 0;
+        _modbus_write_done(ctx, msg, _modbus_write_acked(ctx, msg, len));
+        return;
+    }
+
+    modbus_reg_t * current_reg = msg;
+
     if (current_reg->value_state != MB_REG_WAITING)
         modbus_debug("Reg :%."STR(MODBUS_NAME_LEN)"s not waiting!", current_reg->name);
 
     current_reg->value_state = MB_REG_INVALID;
 
-    modbus_read_last_good = get_since_boot_ms();
+    ctx->read_last_good = get_since_boot_ms();
 
-    modbus_retransmit_count = 0;
+    ctx->retransmit_count = 0;
 
-    if ((modbuspacket[1] == (MODBUS_READ_HOLDING_FUNC | MODBUS_ERROR_MASK)) ||
-        (modbuspacket[1] == (MODBUS_READ_INPUT_FUNC | MODBUS_ERROR_MASK)))
+    if ((ctx->packet[1] == (MODBUS_READ_HOLDING_FUNC | MODBUS_ERROR_MASK)) ||
+        (ctx->packet[1] == (MODBUS_READ_INPUT_FUNC | MODBUS_ERROR_MASK)))
     {
-        modbus_debug("Exception: 0x%02"PRIx8, modbuspacket[2]);
+        modbus_debug("Exception: 0x%02"PRIx8, ctx->packet[2]);
+        _modbus_cache_store(ctx, current_reg, NULL, 0);
         return;
     }
 
     modbus_dev_t * dev = modbus_reg_get_dev(current_reg);
 
-    if (dev->unit_id != modbuspacket[0])
+    if (dev->unit_id != ctx->packet[0])
     {
         log_error("Modbus comms issues!");
         return;
     }
 
-    _modbus_reg_cb(current_reg, modbuspacket + 3, modbuspacket[2], dev->byte_order, dev->word_order);
+    _modbus_reg_cb(current_reg, ctx->packet + 3, ctx->packet[2], dev->byte_order, dev->word_order);
+    _modbus_cache_store(ctx, current_reg, ctx->packet + 3, ctx->packet[2]);
 }
 
 
@@ -1052,46 +1933,55 @@ static void _modbus_reg_cb(modbus_reg_t * reg, uint8_t * data, uint8_t size, mod
 }
 
 
-bool modbus_uart_ring_do_out_drain(ring_buf_t * ring)
+/* Only EXT_UART's transceiver is the platform's, any other bus's is the model's. */
+static void _modbus_set_rs485_mode(modbus_ctx_t * ctx, bool driver_enable)
 {
-    unsigned len = ring_buf_get_pending(ring);
+    if (ctx->uart == EXT_UART)
+        platform_set_rs485_mode(driver_enable);
+    else if (modbus_bus_set_rs485_mode)
+        modbus_bus_set_rs485_mode(ctx->uart, driver_enable);
+}
+
+
+bool modbus_uart_ring_do_out_drain(unsigned uart, ring_buf_t * ring)
+{
+    modbus_ctx_t * ctx = _modbus_get_ctx_by_uart(uart);
+    if (!ctx)
+        return true;
 
-    static bool rs485_transmitting = false;
-    static uint32_t rs485_start_transmitting = 0;
+    unsigned len = ring_buf_get_pending(ring);
 
     if (!len)
     {
-        if (rs485_transmitting && uart_is_tx_empty(EXT_UART))
+        if (ctx->rs485_transmitting && uart_is_tx_empty(ctx->uart))
         {
-            static bool rs485_transmit_stopping = false;
-            static uint32_t rs485_stop_transmitting = 0;
-            if (!rs485_transmit_stopping)
+            if (!ctx->rs485_transmit_stopping)
             {
-                modbus_debug("Sending complete, delay %"PRIu32"ms", modbus_stop_delay());
-                rs485_stop_transmitting = get_since_boot_ms();
-                rs485_transmit_stopping = true;
+                modbus_debug("Sending complete, delay %"PRIu32"ms", ctx->send_stop_delay);
+                ctx->rs485_stop_transmitting = get_since_boot_ms();
+                ctx->rs485_transmit_stopping = true;
             }
-            else if (since_boot_delta(get_since_boot_ms(), rs485_stop_transmitting) > modbus_stop_delay())
+            else if (since_boot_delta(get_since_boot_ms(), ctx->rs485_stop_transmitting) > ctx->send_stop_delay)
             {
-                rs485_transmitting = false;
-                rs485_transmit_stopping = false;
-                platform_set_rs485_mode(false);
+                ctx->rs485_transmitting = false;
+                ctx->rs485_transmit_stopping = false;
+                _modbus_set_rs485_mode(ctx, false);
             }
         }
         return false;
     }
 
-    if (!rs485_transmitting)
+    if (!ctx->rs485_transmitting)
     {
-        rs485_transmitting = true;
-        platform_set_rs485_mode(true);
-        rs485_start_transmitting = get_since_boot_ms();
-        modbus_debug("Data to send, delay %"PRIu32"ms", modbus_start_delay());
+        ctx->rs485_transmitting = true;
+        _modbus_set_rs485_mode(ctx, true);
+        ctx->rs485_start_transmitting = get_since_boot_ms();
+        modbus_debug("Data to send, delay %"PRIu32"ms", ctx->send_start_delay);
         return false;
     }
     else
     {
-        if (since_boot_delta(get_since_boot_ms(), rs485_start_transmitting) < modbus_start_delay())
+        if (since_boot_delta(get_since_boot_ms(), ctx->rs485_start_transmitting) < ctx->send_start_delay)
             return false;
     }
 
@@ -1102,19 +1992,31 @@ bool modbus_uart_ring_do_out_drain(ring_buf_t * ring)
 
 void modbus_init(void)
 {
-    modbus_bus_t * bus = &persist_data.model_config.modbus_bus;
-    modbus_bus_init(bus);
-    modbus_setup(bus->baudrate,
-                 bus->databits,
-                 bus->parity,
-                 bus->stopbits,
-                 bus->binary_protocol);
+    modbus_bus_init(&persist_data.model_config.modbus_bus);
+    for (unsigned bus = 0; bus < MODBUS_BUS_COUNT; bus++)
+    {
+        modbus_ctx_t * ctx = &_modbus_ctxs[bus];
+        ctx->uart = _modbus_bus_uarts[bus];
+        ctx->queue = (ring_buf_t)RING_BUF_INIT(ctx->queue_regs, sizeof(ctx->queue_regs));
+        ctx->t35_ms = 1;
+        ctx->tx_gap = MODBUS_TX_GAP_MS;
+
+        modbus_bus_comms_t comms;
+        if (!modbus_bus_get_comms(bus, &comms))
+            continue;
+        _modbus_ctx_setup(ctx,
+                          comms.baudrate,
+                          comms.databits,
+                          comms.parity,
+                          comms.stopbits,
+                          comms.binary_protocol);
+    }
 }
 
 
 static command_response_t _modbus_setup_cb(char *args)
 {
-    /*<BIN/RTU> <SPEED> <BITS><PARITY><STOP>
+    /*[<BUS>] <BIN/RTU> <SPEED> <BITS><PARITY><STOP>
      * EXAMPLE: RTU 115200 8N1
      */
     return modbus_setup_from_str(args) ? COMMAND_RESP_OK : COMMAND_RESP_ERR;
@@ -1123,14 +2025,14 @@ static command_response_t _modbus_setup_cb(char *args)
 
 static command_response_t _modbus_add_dev_cb(char * args)
 {
-    /*<unit_id> <LSB/MSB> <LSW/MSW> <name>
+    /*<unit_id> <LSB/MSB> <LSW/MSW> <name> [<bus>]
      * (name can only be 4 char long)
      * EXAMPLES:
      * 0x1 MSB MSW TEST
      */
     if (!modbus_add_dev_from_str(args))
     {
-        log_out("<unit_id> <LSB/MSB> <LSW/MSW> <name>");
+        log_out("<unit_id> <LSB/MSB> <LSW/MSW> <name> [<bus>]");
         return COMMAND_RESP_ERR;
     }
     return COMMAND_RESP_OK;
@@ -1139,13 +2041,13 @@ static command_response_t _modbus_add_dev_cb(char * args)
 
 static command_response_t _modbus_add_reg_cb(char * args)
 {
-    /*<unit_id> <reg_addr> <modbus_func> <type> <name>
+    /*<unit_id> <reg_addr> <modbus_func> <type> <name> [<bus>]
      * (name can only be 4 char long)
      * Only Modbus Function 3, Hold Read supported right now.
      * 0x1 0x16 3 F   T-Hz
      * 1 22 3 F       T-Hz
      * 0x2 0x30 3 U16 T-As
-     * 0x2 0x32 3 U32 T-Vs
+     * 0x2 0x32 3 U32 T-Vs 1
      */
     char * pos = skip_space(args);
 
@@ -1173,9 +2075,19 @@ static command_response_t _modbus_add_reg_cb(char * args)
 
     pos = skip_space(pos);
 
-    char * name = pos;
+    unsigned len = 0;
+    while (len < MODBUS_NAME_LEN && pos[len] && !isspace((unsigned char)pos[len]))
+        len++;
+    char name[MODBUS_NAME_LEN + 1];
+    memcpy(name, pos, len);
+    name[len] = 0;
 
-    modbus_dev_t * dev = modbus_get_device_by_id(unit_id);
+    pos = skip_space(pos + len);
+    unsigned bus = 0;
+    if (isdigit((unsigned char)pos[0]))
+        bus = strtoul(pos, NULL, 10);
+
+    modbus_dev_t * dev = modbus_get_device_by_id(bus, unit_id);
     if (!dev)
     {
         log_out("Unknown modbus device.");
@@ -1197,9 +2109,58 @@ static command_response_t _modbus_add_reg_cb(char * args)
 }
 
 
+static command_response_t _modbus_slave_cb(char* args)
+{
+    char * p = skip_space(args);
+    if (p[0])
+    {
+        char * np;
+        unsigned unit_id = strtoul(p, &np, 0);
+        if (np == p || !modbus_slave_set_unit_id(unit_id))
+        {
+            log_out("mb_slave [<unit id>|0]");
+            return COMMAND_RESP_ERR;
+        }
+        /* Whatever the master was doing is over, slave is only on the first bus. */
+        modbus_ctx_t * ctx = &_modbus_ctxs[0];
+        _modbus_queue_clear(ctx);
+        ctx->want_rx = false;
+        ctx->packet_len = 0;
+        ctx->read_timing_init = 0;
+        uart_ring_in_get_frame(ctx->uart);
+    }
+    modbus_slave_log();
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _modbus_cache_cb(char* args)
+{
+    char * p = skip_space(args);
+    if (p[0])
+    {
+        char * np;
+        unsigned long max_age_s = strtoul(p, &np, 0);
+        if (np == p || max_age_s > UINT8_MAX || !modbus_set_cache_max_age(max_age_s))
+        {
+            log_out("mb_cache [<max age s>|0]");
+            return COMMAND_RESP_ERR;
+        }
+    }
+    log_out("Cache max age %"PRIu8"s", modbus_get_cache_max_age());
+    return COMMAND_RESP_OK;
+}
+
+
 static command_response_t _modbus_log_cb(char* args)
 {
     modbus_log();
+    for (unsigned bus = 0; bus < MODBUS_BUS_COUNT; bus++)
+    {
+        _modbus_health_log(&_modbus_ctxs[bus]);
+        _modbus_frame_log(&_modbus_ctxs[bus]);
+        _modbus_cache_log(&_modbus_ctxs[bus]);
+    }
     return COMMAND_RESP_OK;
 }
 
@@ -1216,7 +2177,7 @@ static command_response_t _modbus_measurement_del_dev_cb(char* args)
 }
 
 
-static bool _modbus_reg_set_value(modbus_dev_t* dev, uint16_t reg_addr, modbus_reg_type_t type, float value)
+static modbus_write_t * _modbus_reg_set_value(modbus_dev_t* dev, uint16_t reg_addr, modbus_reg_type_t type, float value)
 {
     uint8_t func;
     switch (type)
@@ -1235,15 +2196,19 @@ static bool _modbus_reg_set_value(modbus_dev_t* dev, uint16_t reg_addr, modbus_r
             break;
         default:
             modbus_debug("Could not get modbus function from type (%d).", type);
-            return false;
+            return NULL;
     }
-    return _modbus_set_reg(dev->unit_id, reg_addr, func, type, dev->byte_order, dev->word_order, value);
+    modbus_ctx_t * ctx = _modbus_get_ctx_of_dev(dev);
+    if (!ctx)
+        return NULL;
+    return _modbus_set_reg(ctx, dev->unit_id, reg_addr, func, type, dev->byte_order, dev->word_order, value);
 }
 
 
 static bool _modbus_reg_set_value_is_done(void* userdata)
 {
-    return !modbus_has_pending() && !_modbus_reg_set_expected.not_done;
+    modbus_write_t * write = userdata;
+    return (write->state != MB_REG_WAITING);
 }
 
 
@@ -1343,13 +2308,15 @@ static command_response_t _modbus_set_reg_cb(char* args)
         return COMMAND_RESP_ERR;
     }
 
-    if (modbus_has_pending())
+    modbus_ctx_t * ctx = _modbus_get_ctx_of_dev(dev);
+    if (!ctx)
     {
-        modbus_log("Currently undergoing transaction.");
-        return false;
+        log_out("Device's bus %"PRIu8" is not available.", dev->bus);
+        return COMMAND_RESP_ERR;
     }
 
-    if (!_modbus_reg_set_value(dev, reg_addr, type, value))
+    modbus_write_t * write = _modbus_reg_set_value(dev, reg_addr, type, value);
+    if (!write)
     {
         log_out("Failed to set modbus register.");
         return COMMAND_RESP_ERR;
@@ -1396,17 +2363,92 @@ static command_response_t _modbus_set_reg_cb(char* args)
 
     log_out("Queued setting %s", reg_desc);
 
-    if (!main_loop_iterate_for(MODBUS_RESP_TIMEOUT_MS, _modbus_reg_set_value_is_done, NULL))
+    if (!main_loop_iterate_for(MODBUS_RESP_TIMEOUT_MS, _modbus_reg_set_value_is_done, write))
     {
+        /* Still queued, so let it report when it is done. */
+        write->report = 1;
         log_out("Timed out waiting for acknowledgement.");
         return COMMAND_RESP_ERR;
     }
 
-    if (!_modbus_reg_set_expected.not_done && _modbus_reg_set_expected.passfail)
+    if (write->state == MB_REG_READY)
         log_out("Successfully set %s", reg_desc);
     else
         log_out("Failed to set %s", reg_desc);
+    write->in_use = 0;
+
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _modbus_write_regs_cb(char* args)
+{
+    /* mb_reg_write <device_name> <reg_addr>=<value> [<reg_addr>=<value> ...] */
+    char * p = skip_space(args);
+    char * np = p;
+    while (*np && !isspace((unsigned char)*np))
+        np++;
+
+    char name[MODBUS_NAME_LEN + 1] = {0};
+    unsigned len = np - p;
+    if (!len || len > MODBUS_NAME_LEN)
+    {
+        log_out("mb_reg_write <dev> <addr>=<value> ...");
+        return COMMAND_RESP_ERR;
+    }
+    strncpy(name, p, len);
+
+    modbus_dev_t * dev = modbus_get_device_by_name(name);
+    if (!dev)
+    {
+        log_out("No device with name '%s'", name);
+        return COMMAND_RESP_ERR;
+    }
+
+    modbus_reg_write_t regs[MODBUS_WRITE_BATCH_MAX];
+    unsigned count = 0;
+
+    for (p = skip_space(np); p[0]; p = skip_space(np))
+    {
+        if (count >= MODBUS_WRITE_BATCH_MAX)
+        {
+            log_out("Over %u registers.", MODBUS_WRITE_BATCH_MAX);
+            return COMMAND_RESP_ERR;
+        }
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+            p += 2;
+        unsigned long reg_addr = strtoul(p, &np, 16);
+        if (np == p || np[0] != '=' || reg_addr > UINT16_MAX)
+        {
+            log_out("Bad register address at '%s'", p);
+            return COMMAND_RESP_ERR;
+        }
+        p = np + 1;
+        /* Negative for I16 registers. */
+        long value = strtol(p, &np, 0);
+        if (np == p || value < INT16_MIN || value > UINT16_MAX)
+        {
+            log_out("Bad value for 0x%04lx", reg_addr);
+            return COMMAND_RESP_ERR;
+        }
+        regs[count].reg_addr = reg_addr;
+        regs[count].value    = (uint16_t)value;
+        count++;
+    }
+
+    if (!count)
+    {
+        log_out("No registers given.");
+        return COMMAND_RESP_ERR;
+    }
 
+    unsigned frames = modbus_write_batch(dev, regs, count);
+    if (!frames)
+    {
+        log_out("Failed to queue writes.");
+        return COMMAND_RESP_ERR;
+    }
+    log_out("Queued %u registers in %u frames.", count, frames);
     return COMMAND_RESP_OK;
 }
 
@@ -1415,13 +2457,16 @@ struct cmd_link_t* modbus_add_commands(struct cmd_link_t* tail)
 {
     static struct cmd_link_t cmds[] =
     {
-        { "mb_setup",     "Change Modbus comms",      _modbus_setup_cb               , false , NULL },
+        { "mb_setup",     "Change Modbus bus comms",  _modbus_setup_cb               , false , NULL },
         { "mb_dev_add",   "Add modbus dev",           _modbus_add_dev_cb             , false , NULL },
         { "mb_reg_add",   "Add modbus reg",           _modbus_add_reg_cb             , false , NULL },
         { "mb_reg_del",   "Delete modbus reg",        _modbus_measurement_del_reg_cb , false , NULL },
         { "mb_dev_del",   "Delete modbus dev",        _modbus_measurement_del_dev_cb , false , NULL },
         { "mb_log",       "Show modbus setup",        _modbus_log_cb                 , false , NULL },
+        { "mb_slave",     "Modbus slave unit/map",    _modbus_slave_cb               , false , NULL },
+        { "mb_cache",     "Modbus read cache age",    _modbus_cache_cb               , false , NULL },
         { "mb_reg_set",   "Set modbus reg",           _modbus_set_reg_cb             , false , NULL },
+        { "mb_reg_write", "Queue modbus reg writes",  _modbus_write_regs_cb          , false , NULL },
     };
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
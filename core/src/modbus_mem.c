@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
 
 #include "modbus_mem.h"
 #include "modbus.h"
@@ -9,89 +10,238 @@
 #include "pinmap.h"
 
 
+/* MODBUS_BLOB_VERSION 2 was 16 byte blocks in offset linked lists,
+ * only kept to move old configs over. */
+#define MODBUS_V2_VERSION       2
+#define MODBUS_V2_BLOCK_SIZE    16
+#define MODBUS_V2_BLOCKS        ((MODBUS_MEMORY_SIZE / MODBUS_V2_BLOCK_SIZE) - 1)
+
+typedef struct
+{
+    char     name[MODBUS_NAME_LEN];
+    uint32_t value_data;
+    uint8_t  type;
+    uint8_t  func:4;
+    uint8_t  value_state:4;
+    uint16_t reg_addr;
+    uint16_t unit_id;
+    uint16_t next_reg_offset;
+} __attribute__((__packed__)) modbus_v2_reg_t;
+
+typedef struct
+{
+    char     name[MODBUS_NAME_LEN];
+    uint8_t  byte_order;
+    uint8_t  word_order;
+    uint8_t  reg_count;
+    uint8_t  bus;
+    uint16_t unit_id;
+    uint16_t first_reg_offset;
+    uint16_t next_dev_offset;
+    uint16_t __;
+} __attribute__((__packed__)) modbus_v2_dev_t;
+
+typedef struct
+{
+    uint8_t  version;
+    uint8_t  binary_protocol;
+    uint8_t  databits:4;
+    uint8_t  stopbits:2;
+    uint8_t  parity:2;
+    uint8_t  dev_count;
+    uint32_t baudrate;
+    uint16_t first_dev_offset;
+    uint16_t first_free_offset;
+    uint8_t  slave_unit_id;
+    uint16_t buses_offset;
+    uint8_t  cache_max_age_s;
+} __attribute__((__packed__)) modbus_v2_bus_t;
+
+_Static_assert((sizeof(modbus_v2_reg_t) == MODBUS_V2_BLOCK_SIZE) &&
+               (sizeof(modbus_v2_dev_t) == MODBUS_V2_BLOCK_SIZE) &&
+               (sizeof(modbus_v2_bus_t) == MODBUS_V2_BLOCK_SIZE),
+               "Modbus v2 blocks broken.");
+
+
 modbus_bus_t * modbus_bus = NULL;
 
+/* Registers as used, in the same order as in the blob. */
+static modbus_reg_t _modbus_regs[MODBUS_MAX_REGS];
+/* Indices into _modbus_regs sorted by name. */
+static uint8_t      _modbus_reg_by_name[MODBUS_MAX_REGS];
 
-static uintptr_t _modbus_get_offset(void * ptr)
+
+static modbus_dev_t * _modbus_get_devs(modbus_bus_t * bus)
 {
-    return ((uintptr_t)ptr) - ((uintptr_t)modbus_bus);
+    return (modbus_dev_t*)bus->data;
 }
 
 
-static void * _modbus_get_from_offset(uintptr_t offset)
+static unsigned _modbus_get_recs_start(modbus_bus_t * bus)
 {
-    return (void*)(((uintptr_t)modbus_bus) + offset);
+    return bus->dev_count * sizeof(modbus_dev_t);
 }
 
 
-static void _modbus_free(void * block)
+static modbus_reg_rec_t * _modbus_get_recs(modbus_bus_t * bus)
 {
-    modbus_free_t * freed = block;
+    return (modbus_reg_rec_t*)&bus->data[_modbus_get_recs_start(bus)];
+}
 
-    memset(freed, 0, sizeof(modbus_free_t));
 
-    if (modbus_bus->first_free_offset)
-        freed->next_free_offset = modbus_bus->first_free_offset;
+static unsigned _modbus_get_names_start(modbus_bus_t * bus)
+{
+    return _modbus_get_recs_start(bus) + bus->reg_count * sizeof(modbus_reg_rec_t);
+}
+
 
-    modbus_bus->first_free_offset = _modbus_get_offset(freed);
+static unsigned _modbus_get_used(modbus_bus_t * bus)
+{
+    return _modbus_get_names_start(bus) + bus->names_len;
 }
 
 
-static void* _modbus_allocate_block(void)
+/* Opens a gap in the data, moving everything after it up. */
+static bool _modbus_data_insert(unsigned offset, unsigned len)
 {
-    if (!modbus_bus || !modbus_bus->first_free_offset)
+    unsigned used = _modbus_get_used(modbus_bus);
+    if (used + len > sizeof(modbus_bus->data))
     {
         modbus_debug("Modbus memory full.");
-        return NULL;
+        return false;
     }
+    memmove(&modbus_bus->data[offset + len], &modbus_bus->data[offset], used - offset);
+    return true;
+}
+
+
+static void _modbus_data_remove(unsigned offset, unsigned len)
+{
+    unsigned used = _modbus_get_used(modbus_bus);
+    memmove(&modbus_bus->data[offset], &modbus_bus->data[offset + len], used - offset - len);
+    memset(&modbus_bus->data[used - len], 0, len);
+}
 
-    modbus_free_t * freed = _modbus_get_from_offset(modbus_bus->first_free_offset);
 
-    modbus_bus->first_free_offset = freed->next_free_offset;
+static unsigned _modbus_get_dev_index(modbus_dev_t * dev)
+{
+    return dev - _modbus_get_devs(modbus_bus);
+}
 
-    return freed;
+
+/* Of the device's first register, both in the blob and _modbus_regs. */
+static unsigned _modbus_get_first_reg_index(modbus_bus_t * bus, unsigned dev_index)
+{
+    modbus_dev_t * devs = _modbus_get_devs(bus);
+    unsigned index = 0;
+    for (unsigned n = 0; n < dev_index; n++)
+        index += devs[n].reg_count;
+    return index;
 }
 
 
-static modbus_dev_t * _modbus_get_first_dev2(modbus_bus_t* bus)
+static unsigned _modbus_get_name_offset(modbus_bus_t * bus, unsigned reg_index)
 {
-    if (!bus || !bus->first_dev_offset)
-        return NULL;
+    modbus_reg_rec_t * recs = _modbus_get_recs(bus);
+    unsigned offset = 0;
+    for (unsigned n = 0; n < reg_index; n++)
+        offset += recs[n].name_len + 1;
+    return offset;
+}
+
 
-    return _modbus_get_from_offset(bus->first_dev_offset);
+static void _modbus_reg_from_rec(modbus_reg_t * reg, modbus_reg_rec_t * rec, const char * name, modbus_dev_t * dev)
+{
+    memset(reg, 0, sizeof(modbus_reg_t));
+    memcpy(reg->name, name, rec->name_len + 1);
+    reg->type       = rec->type;
+    reg->func       = (rec->input)?MODBUS_READ_INPUT_FUNC:MODBUS_READ_HOLDING_FUNC;
+    reg->reg_addr   = rec->reg_addr;
+    reg->unit_id    = dev->unit_id;
+    reg->bus        = dev->bus;
 }
 
 
-static modbus_dev_t * _modbus_get_first_dev(void)
+static void _modbus_reg_index_build(void)
 {
-    return _modbus_get_first_dev2(modbus_bus);
+    for (unsigned i = 0; i < modbus_bus->reg_count; i++)
+    {
+        unsigned j = i;
+        for (; j && strncmp(_modbus_regs[_modbus_reg_by_name[j - 1]].name, _modbus_regs[i].name, MODBUS_NAME_LEN) > 0; j--)
+            _modbus_reg_by_name[j] = _modbus_reg_by_name[j - 1];
+        _modbus_reg_by_name[j] = i;
+    }
 }
 
 
-static modbus_dev_t * _modbus_get_next_dev(modbus_dev_t * dev)
+static void _modbus_regs_load(void)
 {
-    if (!dev || !dev->next_dev_offset)
-        return NULL;
+    modbus_dev_t * devs = _modbus_get_devs(modbus_bus);
+    modbus_reg_rec_t * recs = _modbus_get_recs(modbus_bus);
+    const char * name = (const char*)&modbus_bus->data[_modbus_get_names_start(modbus_bus)];
+    unsigned index = 0;
 
-    return _modbus_get_from_offset(dev->next_dev_offset);
+    memset(_modbus_regs, 0, sizeof(_modbus_regs));
+    for (unsigned d = 0; d < modbus_bus->dev_count; d++)
+    {
+        for (unsigned n = 0; n < devs[d].reg_count; n++, index++)
+        {
+            _modbus_reg_from_rec(&_modbus_regs[index], &recs[index], name, &devs[d]);
+            name += recs[index].name_len + 1;
+        }
+    }
+    _modbus_reg_index_build();
 }
 
 
-static modbus_reg_t * _modbus_get_first_reg(modbus_dev_t * dev)
+bool modbus_bus_get_comms(unsigned bus, modbus_bus_comms_t * comms)
 {
-    if (!dev || !dev->first_reg_offset)
-        return NULL;
+    if (!modbus_bus || !comms || bus > MODBUS_EXTRA_BUSES)
+        return false;
+
+    if (!bus)
+    {
+        comms->baudrate         = modbus_bus->baudrate;
+        comms->binary_protocol  = modbus_bus->binary_protocol;
+        comms->databits         = modbus_bus->databits;
+        comms->parity           = modbus_bus->parity;
+        comms->stopbits         = modbus_bus->stopbits;
+        return true;
+    }
 
-    return _modbus_get_from_offset(dev->first_reg_offset);
+    modbus_bus_comms_t * stored = &modbus_bus->buses.comms[bus - 1];
+    if (!stored->baudrate)
+    {
+        /* Never setup, so the same as the default. */
+        memset(comms, 0, sizeof(modbus_bus_comms_t));
+        comms->baudrate         = MODBUS_SPEED;
+        comms->databits         = MODBUS_DATABITS;
+        comms->parity           = MODBUS_PARITY;
+        comms->stopbits         = MODBUS_STOP;
+        return true;
+    }
+    memcpy(comms, stored, sizeof(modbus_bus_comms_t));
+    return true;
 }
 
 
-static modbus_reg_t * _modbus_get_next_reg(modbus_reg_t * reg)
+bool modbus_bus_set_comms(unsigned bus, modbus_bus_comms_t * comms)
 {
-    if (!reg || !reg->next_reg_offset)
-        return NULL;
+    if (!modbus_bus || !comms || bus > MODBUS_EXTRA_BUSES)
+        return false;
 
-    return _modbus_get_from_offset(reg->next_reg_offset);
+    if (!bus)
+    {
+        modbus_bus->baudrate        = comms->baudrate;
+        modbus_bus->binary_protocol = comms->binary_protocol;
+        modbus_bus->databits        = comms->databits;
+        modbus_bus->parity          = comms->parity;
+        modbus_bus->stopbits        = comms->stopbits;
+        return true;
+    }
+
+    memcpy(&modbus_bus->buses.comms[bus - 1], comms, sizeof(modbus_bus_comms_t));
+    return true;
 }
 
 
@@ -100,25 +250,42 @@ void modbus_log()
     if (!modbus_bus)
         return;
 
-    log_out("Modbus @ %s %"PRIu32" %u%c%s", (modbus_bus->binary_protocol)?"BIN":"RTU", modbus_bus->baudrate, modbus_bus->databits, osm_uart_parity_as_char(modbus_bus->parity), osm_uart_stop_bits_as_str(modbus_bus->stopbits));
-
-    modbus_dev_t * dev = _modbus_get_first_dev();
-    while(dev)
+    for (unsigned bus = 0; bus < modbus_bus_count(); bus++)
     {
-        char byte_char = 'M';
-        char word_char = 'M';
-        if (dev->byte_order == MODBUS_BYTE_ORDER_LSB)
-            byte_char = 'L';
-        if (dev->word_order == MODBUS_WORD_ORDER_LSW)
-            word_char = 'L';
-        log_out("- Device - 0x%"PRIx16" \"%."STR(MODBUS_NAME_LEN)"s\" %cSB %cSW", dev->unit_id, dev->name, byte_char, word_char);
-        modbus_reg_t * reg = _modbus_get_first_reg(dev);
-        while(reg)
+        modbus_bus_comms_t comms;
+        if (!modbus_bus_get_comms(bus, &comms))
+            continue;
+        if (!bus)
+            log_out("Modbus @ %s %"PRIu32" %u%c%s", (comms.binary_protocol)?"BIN":"RTU", comms.baudrate, comms.databits, osm_uart_parity_as_char(comms.parity), osm_uart_stop_bits_as_str(comms.stopbits));
+        else
+            log_out("Modbus bus %u @ %s %"PRIu32" %u%c%s", bus, (comms.binary_protocol)?"BIN":"RTU", comms.baudrate, comms.databits, osm_uart_parity_as_char(comms.parity), osm_uart_stop_bits_as_str(comms.stopbits));
+        if (!bus && modbus_bus->slave_unit_id)
+            log_out("Slave unit 0x%02"PRIx8, modbus_bus->slave_unit_id);
+        if (!bus && modbus_bus->cache_max_age_s)
+            log_out("Cache max age %"PRIu8"s", modbus_bus->cache_max_age_s);
+
+        modbus_dev_t * devs = _modbus_get_devs(modbus_bus);
+        unsigned reg_index = 0;
+        for (unsigned d = 0; d < modbus_bus->dev_count; d++)
         {
-            log_out("  - Reg - 0x%"PRIx16" (F:%"PRIu8") \"%."STR(MODBUS_NAME_LEN)"s\" %s", reg->reg_addr, reg->func, reg->name, modbus_reg_type_get_str(reg->type));
-            reg = _modbus_get_next_reg(reg);
+            modbus_dev_t * dev = &devs[d];
+            unsigned first = reg_index;
+            reg_index += dev->reg_count;
+            if (dev->bus != bus)
+                continue;
+            char byte_char = 'M';
+            char word_char = 'M';
+            if (dev->byte_order == MODBUS_BYTE_ORDER_LSB)
+                byte_char = 'L';
+            if (dev->word_order == MODBUS_WORD_ORDER_LSW)
+                word_char = 'L';
+            log_out("- Device - 0x%"PRIx16" \"%."STR(MODBUS_NAME_LEN)"s\" %cSB %cSW", dev->unit_id, dev->name, byte_char, word_char);
+            for (unsigned n = first; n < reg_index; n++)
+            {
+                modbus_reg_t * reg = &_modbus_regs[n];
+                log_out("  - Reg - 0x%"PRIx16" (F:%"PRIu8") \"%."STR(MODBUS_NAME_LEN)"s\" %s", reg->reg_addr, reg->func, reg->name, modbus_reg_type_get_str(reg->type));
+            }
         }
-        dev = _modbus_get_next_dev(dev);
     }
 }
 
@@ -194,61 +361,51 @@ static uint32_t _modbus_reg_get(modbus_reg_t * reg)
 }
 
 
-modbus_dev_t * modbus_get_device_by_id(unsigned unit_id)
+unsigned modbus_get_device_count(void)
+{
+    return (modbus_bus)?modbus_bus->dev_count:0;
+}
+
+
+/* Unit ids are only unique on a bus. */
+modbus_dev_t * modbus_get_device_by_id(unsigned bus, unsigned unit_id)
 {
-    modbus_dev_t * dev = _modbus_get_first_dev();
-    while(dev)
+    if (!modbus_bus)
+        return NULL;
+    modbus_dev_t * devs = _modbus_get_devs(modbus_bus);
+    for (unsigned n = 0; n < modbus_bus->dev_count; n++)
     {
-        if (dev->unit_id == unit_id)
-            return dev;
-        dev = _modbus_get_next_dev(dev);
+        if (devs[n].bus == bus && devs[n].unit_id == unit_id)
+            return &devs[n];
     }
     return NULL;
 }
 
 
-static modbus_dev_t * _modbus_get_device_by_name(modbus_bus_t* bus, char * name)
+modbus_dev_t * modbus_get_device_by_name(char * name)
 {
-    if (!name)
+    if (!modbus_bus || !name)
         return NULL;
     unsigned name_len = strlen(name);
     if (name_len > MODBUS_NAME_LEN)
         return NULL;
-    modbus_dev_t * dev = _modbus_get_first_dev2(bus);
-    while(dev)
+    modbus_dev_t * devs = _modbus_get_devs(modbus_bus);
+    for (unsigned n = 0; n < modbus_bus->dev_count; n++)
     {
-        if (strncmp(name, dev->name, MODBUS_NAME_LEN) == 0)
-            return dev;
-        dev = _modbus_get_next_dev(dev);
+        if (strncmp(name, devs[n].name, MODBUS_NAME_LEN) == 0)
+            return &devs[n];
     }
     return NULL;
 }
 
 
-modbus_dev_t * modbus_get_device_by_name(char * name)
-{
-    return _modbus_get_device_by_name(modbus_bus, name);
-}
-
-
 modbus_reg_t * modbus_dev_get_reg_by_name(modbus_dev_t * dev, char * name)
 {
-    if (!dev || !name)
-        return NULL;
-
-    unsigned name_len = strlen(name);
-    if (name_len > MODBUS_NAME_LEN)
+    if (!dev)
         return NULL;
 
-    modbus_reg_t * reg = _modbus_get_first_reg(dev);
-    while(reg)
-    {
-        if (strncmp(name, reg->name, MODBUS_NAME_LEN) == 0)
-            return reg;
-        reg = _modbus_get_next_reg(reg);
-    }
-
-    return NULL;
+    modbus_reg_t * reg = modbus_get_reg(name);
+    return (reg && reg->bus == dev->bus && reg->unit_id == dev->unit_id)?reg:NULL;
 }
 
 
@@ -262,12 +419,13 @@ uint16_t       modbus_dev_get_unit_id(modbus_dev_t * dev)
 
 bool           modbus_for_each_dev(bool (exit_cb)(modbus_dev_t * dev, void * userdata), void * userdata)
 {
-    modbus_dev_t * dev = _modbus_get_first_dev();
-    while(dev)
+    if (!modbus_bus)
+        return false;
+    modbus_dev_t * devs = _modbus_get_devs(modbus_bus);
+    for (unsigned n = 0; n < modbus_bus->dev_count; n++)
     {
-        if (exit_cb(dev, userdata))
+        if (exit_cb(&devs[n], userdata))
             return true;
-        dev = _modbus_get_next_dev(dev);
     }
     return false;
 }
@@ -275,12 +433,13 @@ bool           modbus_for_each_dev(bool (exit_cb)(modbus_dev_t * dev, void * use
 
 bool           modbus_dev_for_each_reg(modbus_dev_t * dev, bool (exit_cb)(modbus_reg_t * reg, void * userdata), void * userdata)
 {
-    modbus_reg_t * reg = _modbus_get_first_reg(dev);
-    while(reg)
+    if (!dev || !modbus_bus)
+        return false;
+    unsigned first = _modbus_get_first_reg_index(modbus_bus, _modbus_get_dev_index(dev));
+    for (unsigned n = first; n < first + dev->reg_count; n++)
     {
-        if (exit_cb(reg, userdata))
+        if (exit_cb(&_modbus_regs[n], userdata))
             return true;
-        reg = _modbus_get_next_reg(reg);
     }
     return false;
 }
@@ -294,58 +453,62 @@ uint16_t          modbus_reg_get_unit_id(modbus_reg_t * reg)
 }
 
 
-
-void           modbus_dev_del(modbus_dev_t * dev)
+static void _modbus_reg_remove(modbus_dev_t * dev, unsigned index)
 {
-    if (!dev)
-        return;
+    modbus_regs_moving();
 
-    modbus_reg_t * reg = _modbus_get_first_reg(dev);
-    while(reg)
-    {
-        modbus_reg_t * next_reg = _modbus_get_next_reg(reg);
+    unsigned name_len = _modbus_get_recs(modbus_bus)[index].name_len + 1;
+    _modbus_data_remove(_modbus_get_names_start(modbus_bus) + _modbus_get_name_offset(modbus_bus, index), name_len);
+    modbus_bus->names_len -= name_len;
+    _modbus_data_remove(_modbus_get_recs_start(modbus_bus) + index * sizeof(modbus_reg_rec_t), sizeof(modbus_reg_rec_t));
+    modbus_bus->reg_count--;
+    dev->reg_count--;
+
+    memmove(&_modbus_regs[index], &_modbus_regs[index + 1], (modbus_bus->reg_count - index) * sizeof(modbus_reg_t));
+    memset(&_modbus_regs[modbus_bus->reg_count], 0, sizeof(modbus_reg_t));
+}
 
-        _modbus_free(reg);
 
-        reg = next_reg;
-    }
+void           modbus_dev_del(modbus_dev_t * dev)
+{
+    if (!dev || !modbus_bus)
+        return;
 
-    modbus_dev_t * mem_dev = _modbus_get_first_dev();
-    if (dev == mem_dev)
+    unsigned dev_index = _modbus_get_dev_index(dev);
+    if (dev_index >= modbus_bus->dev_count)
     {
-        modbus_bus->first_dev_offset = dev->next_dev_offset;
-        _modbus_free(dev);
+        modbus_debug("Failed to find device!");
         return;
     }
 
-    while (mem_dev->next_dev_offset)
-    {
-        modbus_dev_t* next_dev = _modbus_get_next_dev(mem_dev);
-        if (next_dev == dev)
-        {
-            mem_dev->next_dev_offset = dev->next_dev_offset;
-            _modbus_free(dev);
-            return;
-        }
-        mem_dev = next_dev;
-    }
-    modbus_debug("Failed to find device!");
+    unsigned first = _modbus_get_first_reg_index(modbus_bus, dev_index);
+    while (dev->reg_count)
+        _modbus_reg_remove(dev, first + dev->reg_count - 1);
+
+    _modbus_data_remove(dev_index * sizeof(modbus_dev_t), sizeof(modbus_dev_t));
+    modbus_bus->dev_count--;
+    _modbus_reg_index_build();
 }
 
 
 modbus_reg_t* modbus_get_reg(char * name)
 {
-    if (!name)
+    if (!modbus_bus || !name || strlen(name) > MODBUS_NAME_LEN)
         return NULL;
 
-    modbus_dev_t * dev = _modbus_get_first_dev();
-    while(dev)
+    unsigned lo = 0;
+    unsigned hi = modbus_bus->reg_count;
+    while (lo < hi)
     {
-        modbus_reg_t * reg = modbus_dev_get_reg_by_name(dev, name);
-        if (reg)
+        unsigned mid = (lo + hi) / 2;
+        modbus_reg_t * reg = &_modbus_regs[_modbus_reg_by_name[mid]];
+        int cmp = strncmp(name, reg->name, MODBUS_NAME_LEN);
+        if (!cmp)
             return reg;
-
-        dev = _modbus_get_next_dev(dev);
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
     return NULL;
 }
@@ -353,44 +516,33 @@ modbus_reg_t* modbus_get_reg(char * name)
 
 void modbus_reg_del(modbus_reg_t * reg)
 {
-    if (!reg)
+    if (!reg || !modbus_bus)
         return;
 
-    modbus_dev_t * dev = modbus_reg_get_dev(reg);
-
-    if (!dev)
-        modbus_debug("Failed to find device of register!");
-
-    modbus_reg_t * dev_reg = _modbus_get_first_reg(dev);
-
-    if (dev_reg == reg)
+    if (reg < _modbus_regs || reg >= &_modbus_regs[modbus_bus->reg_count])
     {
-        dev->first_reg_offset = dev_reg->next_reg_offset;
-        _modbus_free(reg);
+        modbus_debug("Failed to find register!");
         return;
     }
 
-    while(dev_reg)
+    modbus_dev_t * dev = modbus_reg_get_dev(reg);
+    if (!dev)
     {
-        modbus_reg_t * next_reg = _modbus_get_next_reg(dev_reg);
-
-        if (next_reg == reg)
-        {
-            dev_reg->next_reg_offset = reg->next_reg_offset;
-            _modbus_free(reg);
-            return;
-        }
-
-        dev_reg = next_reg;
+        modbus_debug("Failed to find device of register!");
+        return;
     }
 
-    modbus_debug("Failed to find register in device!");
+    _modbus_reg_remove(dev, reg - _modbus_regs);
+    _modbus_reg_index_build();
 }
 
 
-modbus_dev_t * modbus_add_device(unsigned unit_id, char *name, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order)
+modbus_dev_t * modbus_add_device(unsigned unit_id, char *name, modbus_byte_orders_t byte_order, modbus_word_orders_t word_order, unsigned bus)
 {
-    if (!name || !unit_id)
+    if (!modbus_bus || !name || !unit_id || bus >= modbus_bus_count())
+        return NULL;
+
+    if (modbus_get_device_by_id(bus, unit_id))
         return NULL;
 
     unsigned len = strlen(name);
@@ -401,25 +553,50 @@ modbus_dev_t * modbus_add_device(unsigned unit_id, char *name, modbus_byte_order
     if (modbus_get_device_by_name(name))
         return NULL;
 
-    modbus_dev_t * dev = _modbus_allocate_block();
-    if (!dev)
+    if (modbus_bus->dev_count >= MODBUS_MAX_DEVS)
+    {
+        modbus_debug("Too many devices.");
         return NULL;
+    }
 
+    /* Goes after the last device, so no register moves index. */
+    unsigned offset = _modbus_get_recs_start(modbus_bus);
+    if (!_modbus_data_insert(offset, sizeof(modbus_dev_t)))
+        return NULL;
+
+    modbus_dev_t * dev = (modbus_dev_t*)&modbus_bus->data[offset];
     memset(dev, 0, sizeof(modbus_dev_t));
     memcpy(dev->name, name, len);
     dev->unit_id = unit_id;
     dev->byte_order = byte_order;
     dev->word_order = word_order;
-    dev->next_dev_offset = modbus_bus->first_dev_offset;
-    modbus_bus->first_dev_offset = _modbus_get_offset(dev);
-    modbus_debug("Added device 0x%"PRIx16" \"%."STR(MODBUS_NAME_LEN)"s\"", unit_id, name);
+    dev->bus = bus;
+    modbus_bus->dev_count++;
+    modbus_debug("Added device 0x%"PRIx16" \"%."STR(MODBUS_NAME_LEN)"s\" on bus %u", unit_id, name, bus);
     return dev;
 }
 
 
+/* Past any at the same address, the device's registers being sorted. */
+static unsigned _modbus_reg_upper_bound(unsigned first, unsigned count, uint16_t reg_addr)
+{
+    unsigned lo = first;
+    unsigned hi = first + count;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (_modbus_regs[mid].reg_addr <= reg_addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
 bool           modbus_dev_add_reg(modbus_dev_t * dev, char * name, modbus_reg_type_t type, uint8_t func, uint16_t reg_addr)
 {
-    if (!dev || !name)
+    if (!dev || !name || !modbus_bus)
         return false;
 
     unsigned name_len = strlen(name);
@@ -430,31 +607,59 @@ bool           modbus_dev_add_reg(modbus_dev_t * dev, char * name, modbus_reg_ty
         return false;
     }
 
+    if (!name_len)
+    {
+        modbus_debug("No name");
+        return false;
+    }
+
     if (func != MODBUS_READ_HOLDING_FUNC && func != MODBUS_READ_INPUT_FUNC)
     {
         modbus_debug("Unsupported func");
         return false;
     }
 
-    if (modbus_dev_get_reg_by_name(dev, name))
+    if (type == MODBUS_REG_TYPE_INVALID || type > MODBUS_REG_TYPE_MAX)
+    {
+        modbus_debug("Unsupported type");
         return false;
+    }
 
-    modbus_reg_t * dst_reg = _modbus_allocate_block();
-    if (!dst_reg)
+    /* Measurement names, so unique across devices. */
+    if (modbus_get_reg(name))
         return false;
 
-    memset(dst_reg, 0, sizeof(modbus_reg_t));
-    memcpy(dst_reg->name, name, name_len);
-    dst_reg->reg_addr    = reg_addr;
-    dst_reg->type        = type;
-    dst_reg->func        = func;
-    dst_reg->value_data  = 0;
-    dst_reg->value_state = 0;
-    dst_reg->unit_id     = dev->unit_id;
-    dst_reg->next_reg_offset = dev->first_reg_offset;
-
-    dev->first_reg_offset = _modbus_get_offset(dst_reg);
+    if (modbus_bus->reg_count >= MODBUS_MAX_REGS ||
+        _modbus_get_used(modbus_bus) + sizeof(modbus_reg_rec_t) + name_len > sizeof(modbus_bus->data))
+    {
+        modbus_debug("Modbus memory full.");
+        return false;
+    }
 
+    unsigned first = _modbus_get_first_reg_index(modbus_bus, _modbus_get_dev_index(dev));
+    unsigned index = _modbus_reg_upper_bound(first, dev->reg_count, reg_addr);
+
+    modbus_regs_moving();
+
+    unsigned name_offset = _modbus_get_names_start(modbus_bus) + _modbus_get_name_offset(modbus_bus, index);
+    _modbus_data_insert(name_offset, name_len);
+    memcpy(&modbus_bus->data[name_offset], name, name_len);
+    modbus_bus->names_len += name_len;
+
+    unsigned rec_offset = _modbus_get_recs_start(modbus_bus) + index * sizeof(modbus_reg_rec_t);
+    _modbus_data_insert(rec_offset, sizeof(modbus_reg_rec_t));
+    modbus_reg_rec_t * rec = (modbus_reg_rec_t*)&modbus_bus->data[rec_offset];
+    memset(rec, 0, sizeof(modbus_reg_rec_t));
+    rec->reg_addr   = reg_addr;
+    rec->type       = type;
+    rec->input      = (func == MODBUS_READ_INPUT_FUNC);
+    rec->name_len   = name_len - 1;
+    modbus_bus->reg_count++;
+    dev->reg_count++;
+
+    memmove(&_modbus_regs[index + 1], &_modbus_regs[index], (modbus_bus->reg_count - 1 - index) * sizeof(modbus_reg_t));
+    _modbus_reg_from_rec(&_modbus_regs[index], rec, name, dev);
+    _modbus_reg_index_build();
     return true;
 }
 
@@ -535,7 +740,22 @@ modbus_dev_t    * modbus_reg_get_dev(modbus_reg_t * reg)
     if (!reg)
         return NULL;
 
-    return modbus_get_device_by_id(reg->unit_id);
+    return modbus_get_device_by_id(reg->bus, reg->unit_id);
+}
+
+
+uint8_t modbus_get_cache_max_age(void)
+{
+    return (modbus_bus)?modbus_bus->cache_max_age_s:0;
+}
+
+
+bool modbus_set_cache_max_age(uint8_t max_age_s)
+{
+    if (!modbus_bus)
+        return false;
+    modbus_bus->cache_max_age_s = max_age_s;
+    return true;
 }
 
 
@@ -547,28 +767,197 @@ modbus_reg_state_t modbus_reg_get_state(modbus_reg_t * reg)
 }
 
 
+static void _modbus_blob_reset(void)
+{
+    memset(modbus_bus, 0, sizeof(modbus_bus_t));
+    modbus_bus->version     = MODBUS_BLOB_VERSION;
+    modbus_bus->baudrate    = MODBUS_SPEED;
+    modbus_bus->databits    = MODBUS_DATABITS;
+    modbus_bus->parity      = MODBUS_PARITY;
+    modbus_bus->stopbits    = MODBUS_STOP;
+    modbus_bus->binary_protocol = false;
+}
+
+
+static bool _modbus_blob_is_valid(void)
+{
+    if (modbus_bus->dev_count > MODBUS_MAX_DEVS ||
+        modbus_bus->reg_count > MODBUS_MAX_REGS ||
+        _modbus_get_used(modbus_bus) > sizeof(modbus_bus->data))
+        return false;
+
+    if (_modbus_get_first_reg_index(modbus_bus, modbus_bus->dev_count) != modbus_bus->reg_count)
+        return false;
+
+    return (_modbus_get_name_offset(modbus_bus, modbus_bus->reg_count) == modbus_bus->names_len);
+}
+
+
+static bool _modbus_v2_offset_is_valid(uint16_t offset)
+{
+    return (offset >= MODBUS_V2_BLOCK_SIZE &&
+            offset <= (MODBUS_MEMORY_SIZE - MODBUS_V2_BLOCK_SIZE) &&
+            !(offset % MODBUS_V2_BLOCK_SIZE));
+}
+
+
+static unsigned _modbus_v2_dev_pos(modbus_dev_t * devs, unsigned dev_count, modbus_reg_t * reg)
+{
+    for (unsigned n = 0; n < dev_count; n++)
+    {
+        if (devs[n].bus == reg->bus && devs[n].unit_id == reg->unit_id)
+            return n;
+    }
+    return dev_count;
+}
+
+
+/* Everything is taken out before the new layout is written over the old. */
+static void _modbus_migrate_v2(void)
+{
+    uint8_t * base = (uint8_t*)modbus_bus;
+    modbus_v2_bus_t old;
+    memcpy(&old, base, sizeof(old));
+
+    modbus_buses_t buses = {0};
+    if (_modbus_v2_offset_is_valid(old.buses_offset))
+        memcpy(&buses, base + old.buses_offset, sizeof(buses));
+
+    modbus_dev_t devs[MODBUS_MAX_DEVS];
+    unsigned dev_count = 0;
+    unsigned reg_count = 0;
+    unsigned steps = 0;
+
+    uint16_t dev_offset = old.first_dev_offset;
+    while (_modbus_v2_offset_is_valid(dev_offset) && dev_count < MODBUS_MAX_DEVS && steps++ < MODBUS_V2_BLOCKS)
+    {
+        modbus_v2_dev_t * old_dev = (modbus_v2_dev_t*)(base + dev_offset);
+        modbus_dev_t * dev = &devs[dev_count++];
+        memset(dev, 0, sizeof(modbus_dev_t));
+        memcpy(dev->name, old_dev->name, MODBUS_NAME_LEN);
+        dev->unit_id    = old_dev->unit_id;
+        dev->byte_order = old_dev->byte_order;
+        dev->word_order = old_dev->word_order;
+        dev->bus        = old_dev->bus;
+
+        uint16_t reg_offset = old_dev->first_reg_offset;
+        while (_modbus_v2_offset_is_valid(reg_offset) && reg_count < MODBUS_MAX_REGS && steps++ < MODBUS_V2_BLOCKS)
+        {
+            modbus_v2_reg_t * old_reg = (modbus_v2_reg_t*)(base + reg_offset);
+            reg_offset = old_reg->next_reg_offset;
+            if (!old_reg->name[0])
+                continue;
+            modbus_reg_t * reg = &_modbus_regs[reg_count++];
+            memset(reg, 0, sizeof(modbus_reg_t));
+            memcpy(reg->name, old_reg->name, MODBUS_NAME_LEN);
+            reg->type       = old_reg->type;
+            reg->func       = old_reg->func;
+            reg->reg_addr   = old_reg->reg_addr;
+            reg->unit_id    = dev->unit_id;
+            reg->bus        = dev->bus;
+            dev->reg_count++;
+        }
+        dev_offset = old_dev->next_dev_offset;
+    }
+
+    /* Version 2 added to the front, put them back in the order added. */
+    for (unsigned n = 0; n < dev_count / 2; n++)
+    {
+        modbus_dev_t dev = devs[n];
+        devs[n] = devs[dev_count - 1 - n];
+        devs[dev_count - 1 - n] = dev;
+    }
+
+    for (unsigned i = 1; i < reg_count; i++)
+    {
+        modbus_reg_t reg = _modbus_regs[i];
+        unsigned pos = _modbus_v2_dev_pos(devs, dev_count, &reg);
+        unsigned j = i;
+        for (; j; j--)
+        {
+            modbus_reg_t * prev = &_modbus_regs[j - 1];
+            unsigned prev_pos = _modbus_v2_dev_pos(devs, dev_count, prev);
+            if (prev_pos < pos || (prev_pos == pos && prev->reg_addr <= reg.reg_addr))
+                break;
+            _modbus_regs[j] = *prev;
+        }
+        _modbus_regs[j] = reg;
+    }
+
+    /* Version 2 allowed the same name on different devices, now it is the
+     * measurement name, so only the first added is kept. */
+    unsigned kept = 0;
+    for (unsigned n = 0; n < reg_count; n++)
+    {
+        modbus_reg_t * reg = &_modbus_regs[n];
+        bool is_dup = false;
+        for (unsigned i = 0; i < kept && !is_dup; i++)
+            is_dup = !strncmp(_modbus_regs[i].name, reg->name, MODBUS_NAME_LEN);
+        if (is_dup)
+        {
+            unsigned pos = _modbus_v2_dev_pos(devs, dev_count, reg);
+            modbus_debug("Dropped duplicate register \"%."STR(MODBUS_NAME_LEN)"s\" of device 0x%"PRIx16, reg->name, reg->unit_id);
+            if (pos < dev_count)
+                devs[pos].reg_count--;
+            continue;
+        }
+        if (kept != n)
+            _modbus_regs[kept] = *reg;
+        kept++;
+    }
+    reg_count = kept;
+
+    _modbus_blob_reset();
+    modbus_bus->binary_protocol = old.binary_protocol;
+    modbus_bus->databits        = old.databits;
+    modbus_bus->stopbits        = old.stopbits;
+    modbus_bus->parity          = old.parity;
+    modbus_bus->baudrate        = old.baudrate;
+    modbus_bus->slave_unit_id   = old.slave_unit_id;
+    modbus_bus->cache_max_age_s = old.cache_max_age_s;
+    memcpy(&modbus_bus->buses, &buses, sizeof(modbus_buses_t));
+
+    modbus_bus->dev_count = dev_count;
+    memcpy(modbus_bus->data, devs, dev_count * sizeof(modbus_dev_t));
+
+    /* Each is at most half what it was, so all fits. */
+    modbus_bus->reg_count = reg_count;
+    modbus_reg_rec_t * recs = _modbus_get_recs(modbus_bus);
+    char * names = (char*)&modbus_bus->data[_modbus_get_names_start(modbus_bus)];
+    for (unsigned n = 0; n < reg_count; n++)
+    {
+        modbus_reg_t * reg = &_modbus_regs[n];
+        unsigned name_len = strnlen(reg->name, MODBUS_NAME_LEN);
+        recs[n].reg_addr    = reg->reg_addr;
+        recs[n].type        = reg->type;
+        recs[n].input       = (reg->func == MODBUS_READ_INPUT_FUNC);
+        recs[n].name_len    = name_len - 1;
+        memcpy(names, reg->name, name_len);
+        names += name_len;
+        modbus_bus->names_len += name_len;
+    }
+    modbus_debug("Moved %u devices and %u registers from version 2", dev_count, reg_count);
+}
+
+
 void modbus_bus_init(modbus_bus_t * bus)
 {
     modbus_bus = bus;
 
-    if (modbus_bus->version == MODBUS_BLOB_VERSION)
+    if (modbus_bus->version == MODBUS_BLOB_VERSION && _modbus_blob_is_valid())
     {
         modbus_debug("Loaded modbus defs");
     }
+    else if (modbus_bus->version == MODBUS_V2_VERSION)
+    {
+        _modbus_migrate_v2();
+    }
     else
     {
         modbus_debug("Failed to load modbus defs");
-        memset(modbus_bus, 0, sizeof(modbus_bus_t));
-        modbus_bus->version = MODBUS_BLOB_VERSION;
-        modbus_bus->baudrate    = MODBUS_SPEED;
-        modbus_bus->databits    = MODBUS_DATABITS;
-        modbus_bus->parity      = MODBUS_PARITY;
-        modbus_bus->stopbits    = MODBUS_STOP;
-        modbus_bus->binary_protocol = false;
-        modbus_bus->first_free_offset = _modbus_get_offset(modbus_bus->blocks);
-        for(unsigned n = 0; n < (MODBUS_BLOCKS-1) /*Last is zeroed*/; n++)
-            modbus_bus->blocks[n].next_free_offset = _modbus_get_offset(&modbus_bus->blocks[n+1]);
+        _modbus_blob_reset();
     }
+    _modbus_regs_load();
 }
 
 
@@ -576,70 +965,11 @@ void modbus_bus_init(modbus_bus_t * bus)
  *        false if same      */
 bool modbus_persist_config_cmp(modbus_bus_t* d0, modbus_bus_t* d1)
 {
-    /* Is bus different */
-    if (d0->version                 != d1->version              ||
-        d0->binary_protocol         != d1->binary_protocol      ||
-        d0->databits                != d1->databits             ||
-        d0->stopbits                != d1->stopbits             ||
-        d0->parity                  != d1->parity               ||
-        d0->dev_count               != d1->dev_count            ||
-        d0->baudrate                != d1->baudrate             ||
-        d0->first_dev_offset        != d1->first_dev_offset     ||
-        d0->first_free_offset       != d1->first_free_offset    )
-    {
+    if (memcmp(d0, d1, offsetof(modbus_bus_t, data)) != 0)
         return true;
-    }
 
-    modbus_dev_t* d0dev = (modbus_dev_t*)_modbus_get_first_dev2(d0);
-    modbus_dev_t* d1dev = (modbus_dev_t*)_modbus_get_first_dev2(d1);
-    modbus_reg_t* d0reg;
-    modbus_reg_t* d1reg;
-    unsigned recursion_count = 0;
-    while (recursion_count < MODBUS_BLOCKS)
-    {
-        if (!d0dev && !d1dev)
-        {
-            break;
-        }
-        if ((!d0dev && d1dev) || (d0dev && !d1dev))
-        {
-            return true;
-        }
-        /* Only remaining is both d0dev and d1dev exist */
-        if (!(d0dev && d1dev && memcmp(d0dev, d1dev, sizeof(modbus_dev_t)) == 0))
-        {
-            return true;
-        }
-        d0reg = _modbus_get_first_reg(d0dev);
-        d1reg = _modbus_get_first_reg(d1dev);
-        while(recursion_count < MODBUS_BLOCKS)
-        {
-            if ((!d0reg && d1reg) || (d0reg && !d1reg))
-            {
-                return true;
-            }
-            if (!d0reg && !d1reg)
-            {
-                break;
-            }
-            bool reg_is_same =
-                memcmp(d0reg->name, d1reg->name, sizeof(char) * MODBUS_NAME_LEN) == 0 &&
-                d0reg->type == d1reg->type &&
-                d0reg->func == d1reg->func &&
-                d0reg->reg_addr == d1reg->reg_addr &&
-                d0reg->unit_id == d1reg->unit_id &&
-                d0reg->next_reg_offset == d1reg->next_reg_offset;
-            if (!reg_is_same)
-            {
-                return true;
-            }
-            d0reg = _modbus_get_next_reg(d0reg);
-            d1reg = _modbus_get_next_reg(d1reg);
-            recursion_count++;
-        }
-        d0dev = _modbus_get_next_dev(d0dev);
-        d1dev = _modbus_get_next_dev(d1dev);
-        recursion_count++;
-    }
-    return recursion_count >= MODBUS_BLOCKS;
+    unsigned used = _modbus_get_used(d0);
+    if (used > sizeof(d0->data))
+        return true;
+    return (memcmp(d0->data, d1->data, used) != 0);
 }
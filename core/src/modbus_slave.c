@@ -0,0 +1,226 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "modbus_slave.h"
+#include "modbus.h"
+#include "modbus_mem.h"
+#include "measurements_mem.h"
+#include "common.h"
+#include "log.h"
+
+
+#define MODBUS_SLAVE_LAST_COUNT             32
+#define MODBUS_SLAVE_MAX_UNIT_ID            247
+
+#define MODBUS_SLAVE_ERROR_MASK             0x80
+#define MODBUS_SLAVE_EXCEPTION_FUNC         1
+#define MODBUS_SLAVE_EXCEPTION_ADDR         2
+#define MODBUS_SLAVE_EXCEPTION_VALUE        3
+
+#define MODBUS_SLAVE_NAN                    0x7FC00000
+#define MODBUS_SLAVE_NO_AGE                 0xFFFF
+
+
+/* Measurement data only keeps the interval's sum/min/max, so the last
+ * single sample of each is kept here while being a slave. */
+typedef struct
+{
+    float       value;
+    uint32_t    sample_ms;
+    uint8_t     index;
+    uint8_t     in_use;
+} modbus_slave_last_t;
+
+
+static modbus_slave_last_t _modbus_slave_last[MODBUS_SLAVE_LAST_COUNT] = {0};
+
+
+uint8_t modbus_slave_get_unit_id(void)
+{
+    return (modbus_bus)?modbus_bus->slave_unit_id:0;
+}
+
+
+bool modbus_slave_set_unit_id(uint8_t unit_id)
+{
+    if (!modbus_bus || unit_id > MODBUS_SLAVE_MAX_UNIT_ID)
+        return false;
+
+    modbus_bus->slave_unit_id = unit_id;
+    memset(_modbus_slave_last, 0, sizeof(_modbus_slave_last));
+    return true;
+}
+
+
+static modbus_slave_last_t * _modbus_slave_get_last(unsigned index)
+{
+    for (unsigned i = 0; i < MODBUS_SLAVE_LAST_COUNT; i++)
+    {
+        modbus_slave_last_t * last = &_modbus_slave_last[i];
+        if (last->in_use && last->index == index)
+            return last;
+    }
+    return NULL;
+}
+
+
+void measurements_sampled(unsigned index, measurements_value_type_t type, measurements_reading_t* value)
+{
+    if (!modbus_slave_get_unit_id() || !value || index > UINT8_MAX)
+        return;
+
+    modbus_slave_last_t * slot = _modbus_slave_get_last(index);
+    if (!slot)
+    {
+        /* Take a free one, or the one longest without a sample. */
+        uint32_t now = get_since_boot_ms();
+        slot = &_modbus_slave_last[0];
+        for (unsigned i = 0; i < MODBUS_SLAVE_LAST_COUNT; i++)
+        {
+            modbus_slave_last_t * last = &_modbus_slave_last[i];
+            if (!last->in_use)
+            {
+                slot = last;
+                break;
+            }
+            if (since_boot_delta(now, last->sample_ms) > since_boot_delta(now, slot->sample_ms))
+                slot = last;
+        }
+    }
+
+    slot->value     = (type == MEASUREMENTS_VALUE_TYPE_FLOAT)?(value->v_f32 / 1000.f):(float)value->v_i64;
+    slot->sample_ms = get_since_boot_ms();
+    slot->index     = index;
+    slot->in_use    = 1;
+}
+
+
+static uint16_t _modbus_slave_float_word(float value, unsigned word)
+{
+    uint32_t raw;
+    memcpy(&raw, &value, sizeof(raw));
+    return (word)?(raw & 0xFFFF):(raw >> 16);
+}
+
+
+static uint16_t _modbus_slave_nan_word(unsigned word)
+{
+    return (word)?(MODBUS_SLAVE_NAN & 0xFFFF):(MODBUS_SLAVE_NAN >> 16);
+}
+
+
+/* Straight from the measurement's data, nothing is copied into a map. */
+static uint16_t _modbus_slave_get_reg(unsigned addr)
+{
+    unsigned index = addr / MODBUS_SLAVE_BLOCK_REGS;
+    unsigned field = addr % MODBUS_SLAVE_BLOCK_REGS;
+
+    measurements_data_t * data;
+    if (!measurements_get_by_index(index, NULL, &data))
+        return 0;
+
+    modbus_slave_last_t * last = _modbus_slave_get_last(index);
+
+    switch (field)
+    {
+        case MODBUS_SLAVE_REG_LAST:
+        case MODBUS_SLAVE_REG_LAST + 1:
+        {
+            unsigned word = field - MODBUS_SLAVE_REG_LAST;
+            return (last)?_modbus_slave_float_word(last->value, word):_modbus_slave_nan_word(word);
+        }
+        case MODBUS_SLAVE_REG_MIN:
+        case MODBUS_SLAVE_REG_MIN + 1:
+        case MODBUS_SLAVE_REG_MAX:
+        case MODBUS_SLAVE_REG_MAX + 1:
+        {
+            unsigned word = field % 2;
+            bool is_min = (field < MODBUS_SLAVE_REG_MAX);
+            if (!data->num_samples)
+                return _modbus_slave_nan_word(word);
+            if (data->value_type == MEASUREMENTS_VALUE_TYPE_FLOAT)
+                return _modbus_slave_float_word(((is_min)?data->value.value_f.min:data->value.value_f.max) / 1000.f, word);
+            if (data->value_type == MEASUREMENTS_VALUE_TYPE_I64)
+                return _modbus_slave_float_word((float)((is_min)?data->value.value_64.min:data->value.value_64.max), word);
+            return _modbus_slave_nan_word(word);
+        }
+        case MODBUS_SLAVE_REG_AGE:
+        {
+            if (!last)
+                return MODBUS_SLAVE_NO_AGE;
+            uint32_t age = since_boot_delta(get_since_boot_ms(), last->sample_ms) / 1000;
+            return (age < MODBUS_SLAVE_NO_AGE)?age:(MODBUS_SLAVE_NO_AGE - 1);
+        }
+        case MODBUS_SLAVE_REG_SAMPLES:
+            return data->num_samples;
+        default:
+            return 0;
+    }
+}
+
+
+static unsigned _modbus_slave_exception(uint8_t * packet, uint8_t code)
+{
+    modbus_debug("Slave exception %"PRIu8" for function %"PRIu8, code, packet[1]);
+    packet[1] |= MODBUS_SLAVE_ERROR_MASK;
+    packet[2] = code;
+    return 3;
+}
+
+
+/* Given a request without its CRC, the response is written over it, again
+ * without CRC. Returns the response length, 0 for no response. */
+unsigned modbus_slave_request(uint8_t * packet, unsigned len, unsigned size)
+{
+    uint8_t unit_id = modbus_slave_get_unit_id();
+
+    if (!unit_id || len < 2 || packet[0] != unit_id)
+        return 0;
+
+    uint8_t func = packet[1];
+    if (func != MODBUS_READ_HOLDING_FUNC && func != MODBUS_READ_INPUT_FUNC)
+        return _modbus_slave_exception(packet, MODBUS_SLAVE_EXCEPTION_FUNC);
+
+    if (len != 6)
+        return _modbus_slave_exception(packet, MODBUS_SLAVE_EXCEPTION_VALUE);
+
+    unsigned start = (packet[2] << 8) | packet[3];
+    unsigned count = (packet[4] << 8) | packet[5];
+
+    if (!count || count > (size - 5) / 2)
+        return _modbus_slave_exception(packet, MODBUS_SLAVE_EXCEPTION_VALUE);
+
+    if (start + count > MEASUREMENTS_MAX_NUMBER * MODBUS_SLAVE_BLOCK_REGS)
+        return _modbus_slave_exception(packet, MODBUS_SLAVE_EXCEPTION_ADDR);
+
+    modbus_debug("Slave read of %u from 0x%04x", count, start);
+
+    packet[2] = count * 2;
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint16_t reg = _modbus_slave_get_reg(start + i);
+        packet[3 + i * 2] = reg >> 8;
+        packet[4 + i * 2] = reg & 0xFF;
+    }
+    return 3 + count * 2;
+}
+
+
+void modbus_slave_log(void)
+{
+    uint8_t unit_id = modbus_slave_get_unit_id();
+    if (!unit_id)
+    {
+        log_out("Modbus slave off");
+        return;
+    }
+    log_out("Modbus slave unit 0x%02"PRIx8", %u registers each:", unit_id, MODBUS_SLAVE_BLOCK_REGS);
+    log_out("Last(F) Min(F) Max(F) Age(s) Samples");
+    for (unsigned i = 0; i < MEASUREMENTS_MAX_NUMBER; i++)
+    {
+        measurements_def_t * def;
+        if (!measurements_get_by_index(i, &def, NULL))
+            continue;
+        log_out("0x%04x %."STR(MEASURE_NAME_LEN)"s", i * MODBUS_SLAVE_BLOCK_REGS, def->name);
+    }
+}
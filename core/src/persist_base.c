@@ -2,14 +2,22 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <stddef.h>
 
 #include "config.h"
 #include "log.h"
 #include "common.h"
 #include "platform.h"
+#include "platform_model.h"
+#include "modbus.h"
 #include "persist_config.h"
 
 
+#define PERSIST_IMG_LINE_SIZE           45  /* 60 chars of base64, within LOG_LINELEN */
+#define PERSIST_IMG_DUMP_LINES          12
+
+
 
 char * persist_get_serial_number(void)
 {
@@ -58,11 +66,201 @@ static command_response_t _wipe_cb(char* args)
 }
 
 
+/* Staging for a config image being loaded. Dumps are read straight from
+ * the live config, so never touch it. */
+static persist_img_t        _persist_img;
+static unsigned             _persist_img_pos                = 0;
+static persist_img_header_t _persist_img_dump_header;
+
+
+static void _persist_img_dump_header_fill(void)
+{
+    uint16_t crc = modbus_crc((uint8_t*)&persist_data, sizeof(persist_storage_t));
+    crc = modbus_crc_continue(crc, (uint8_t*)&persist_measurements, sizeof(persist_measurements_storage_t));
+    _persist_img_dump_header = (persist_img_header_t)
+    {
+        .magic              = PERSIST_IMG_MAGIC,
+        .img_version        = PERSIST_IMG_VERSION,
+        .persist_version    = PERSIST_VERSION,
+        .persist_size       = sizeof(persist_storage_t),
+        .measurements_size  = sizeof(persist_measurements_storage_t),
+        .crc                = crc,
+    };
+}
+
+
+/* Of the image laid out as persist_img_t, without it being in memory. */
+static void _persist_img_dump_read(unsigned offset, uint8_t* buf, unsigned len)
+{
+    static const struct
+    {
+        unsigned    offset;
+        unsigned    size;
+    } parts[] =
+    {
+        { offsetof(persist_img_t, header),          sizeof(persist_img_header_t) },
+        { offsetof(persist_img_t, data),            sizeof(persist_storage_t) },
+        { offsetof(persist_img_t, measurements),    sizeof(persist_measurements_storage_t) },
+    };
+    const uint8_t* srcs[] = { (uint8_t*)&_persist_img_dump_header, (uint8_t*)&persist_data, (uint8_t*)&persist_measurements };
+
+    for (unsigned n = 0; n < ARRAY_SIZE(parts) && len; n++)
+    {
+        unsigned end = parts[n].offset + parts[n].size;
+        if (offset >= end)
+            continue;
+        unsigned part_len = MIN(len, end - offset);
+        memcpy(buf, srcs[n] + (offset - parts[n].offset), part_len);
+        buf += part_len;
+        offset += part_len;
+        len -= part_len;
+    }
+}
+
+
+static command_response_t _persist_img_dump_cb(char* args)
+{
+    unsigned offset = strtoul(skip_space(args), NULL, 10);
+    /* CRC is of the config when the dump started, it changing after fails the load. */
+    if (!offset)
+        _persist_img_dump_header_fill();
+    if (offset >= sizeof(persist_img_t))
+    {
+        log_out("Offset beyond image of %u bytes.", (unsigned)sizeof(persist_img_t));
+        return COMMAND_RESP_ERR;
+    }
+    /* Image is bigger than the CMD UART out ring, so given in chunks. */
+    log_out("Image: %u", (unsigned)sizeof(persist_img_t));
+    uint8_t chunk[PERSIST_IMG_LINE_SIZE];
+    char line[BASE64_ENCODED_LEN(PERSIST_IMG_LINE_SIZE) + 1];
+    for (unsigned n = 0; n < PERSIST_IMG_DUMP_LINES && offset < sizeof(persist_img_t); n++)
+    {
+        unsigned len = MIN(PERSIST_IMG_LINE_SIZE, sizeof(persist_img_t) - offset);
+        _persist_img_dump_read(offset, chunk, len);
+        base64_encode(chunk, len, line, sizeof(line));
+        log_out("%s", line);
+        offset += len;
+    }
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _persist_img_add_cb(char* args)
+{
+    char* pos;
+    unsigned offset = strtoul(skip_space(args), &pos, 10);
+    pos = skip_space(pos);
+    if (offset != _persist_img_pos && offset)
+    {
+        log_out("Expected image offset %u.", _persist_img_pos);
+        return COMMAND_RESP_ERR;
+    }
+    int len = base64_decode(pos, strlen(pos), ((uint8_t*)&_persist_img) + offset, sizeof(persist_img_t) - offset);
+    if (len < 0)
+    {
+        _persist_img_pos = 0;
+        log_out("Invalid image chunk.");
+        return COMMAND_RESP_ERR;
+    }
+    _persist_img_pos = offset + len;
+    log_out("Image %u/%u", _persist_img_pos, (unsigned)sizeof(persist_img_t));
+    return COMMAND_RESP_OK;
+}
+
+
+static bool _persist_img_check(void)
+{
+    persist_img_header_t* header = &_persist_img.header;
+    if (_persist_img_pos != sizeof(persist_img_t))
+    {
+        log_out("Image incomplete, %u of %u bytes.", _persist_img_pos, (unsigned)sizeof(persist_img_t));
+        return false;
+    }
+    if (header->magic != PERSIST_IMG_MAGIC || header->img_version != PERSIST_IMG_VERSION)
+    {
+        log_out("Not a known config image.");
+        return false;
+    }
+    if (header->persist_version     != PERSIST_VERSION                          ||
+        header->persist_size        != sizeof(persist_storage_t)                ||
+        header->measurements_size   != sizeof(persist_measurements_storage_t)   ||
+        _persist_img.data.version   != PERSIST_VERSION                          )
+    {
+        log_out("Image for config version %"PRIu16", have %u.", header->persist_version, PERSIST_VERSION);
+        return false;
+    }
+    if (modbus_crc((uint8_t*)&_persist_img.data, sizeof(persist_img_t) - sizeof(persist_img_header_t)) != header->crc)
+    {
+        log_out("Image CRC mismatch.");
+        return false;
+    }
+    if (strncmp(_persist_img.data.model_name, persist_data.model_name, MODEL_NAME_LEN) != 0)
+    {
+        log_out("Image for model \"%."STR(MODEL_NAME_LEN)"s\".", _persist_img.data.model_name);
+        return false;
+    }
+    return true;
+}
+
+
+/* Return true  if different
+ *        false if same      */
+static bool _persist_img_cmp(void)
+{
+    return (model_persist_config_cmp(&persist_data.model_config, &_persist_img.data.model_config) ||
+            memcmp(&persist_measurements, &_persist_img.measurements, sizeof(persist_measurements_storage_t)) != 0);
+}
+
+
+static command_response_t _persist_img_load_cb(char* args)
+{
+    bool valid = _persist_img_check();
+    _persist_img_pos = 0;
+    if (!valid)
+        return COMMAND_RESP_ERR;
+
+    /* Comms credentials are this unit's, a clone joining as the unit the
+     * image came from would take over its session. Kept before comparing
+     * so they play no part in it or the check of flash. */
+    memcpy(&_persist_img.data.model_config.comms_config, &persist_data.model_config.comms_config, sizeof(comms_config_t));
+
+    if (!_persist_img_cmp())
+    {
+        log_out("Config already matches image.");
+        return COMMAND_RESP_OK;
+    }
+
+    /* Serial number, firmware state and comms belong to this unit, not the image. */
+    persist_data.log_debug_mask = _persist_img.data.log_debug_mask;
+    memcpy(&persist_data.model_config, &_persist_img.data.model_config, sizeof(persist_model_config_t));
+    memcpy(&persist_measurements, &_persist_img.measurements, sizeof(persist_measurements_storage_t));
+    persist_commit();
+
+    persist_storage_t* flash_data = platform_get_raw_persist();
+    persist_measurements_storage_t* flash_measurements = platform_get_measurements_raw_persist();
+    if (!flash_data || !flash_measurements ||
+        model_persist_config_cmp(&flash_data->model_config, &_persist_img.data.model_config) ||
+        memcmp(flash_measurements, &_persist_img.measurements, sizeof(persist_measurements_storage_t)) != 0)
+    {
+        log_out("Config in flash failed to match image.");
+        return COMMAND_RESP_ERR;
+    }
+
+    /* Sensors and measurements are setup from config at boot. */
+    platform_raw_msg("Config image loaded");
+    platform_reset_sys();
+    return COMMAND_RESP_OK;
+}
+
+
 struct cmd_link_t* persist_config_add_commands(struct cmd_link_t* tail)
 {
     static struct cmd_link_t cmds[] = {{ "save",         "Save config",             _persist_commit_cb             , false , NULL },
                                        { "reset",        "Reset device.",           _reset_cb                      , false , NULL },
-                                       { "wipe",         "Factory Reset",           _wipe_cb                       , false , NULL }};
+                                       { "wipe",         "Factory Reset",           _wipe_cb                       , false , NULL },
+                                       { "cfg_dump",     "Dump config image chunk", _persist_img_dump_cb           , false , NULL },
+                                       { "cfg+",         "Add config image chunk",  _persist_img_add_cb            , false , NULL },
+                                       { "cfg@",         "Load added config image", _persist_img_load_cb           , false , NULL }};
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
 
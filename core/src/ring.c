@@ -52,6 +52,13 @@ unsigned ring_buf_get_pending(ring_buf_t * ring_buf)
 }
 
 
+unsigned ring_buf_get_free(ring_buf_t * ring_buf)
+{
+    /* One slot is always kept empty so full and empty can be told apart. */
+    return ring_buf->size - 1 - ring_buf_get_pending(ring_buf);
+}
+
+
 bool      ring_buf_is_full(ring_buf_t * ring_buf)
 {
     /* So we know it's got data, we never let write pos catch read pos*/
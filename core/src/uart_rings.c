@@ -17,6 +17,7 @@
 
 
 #define UART_RATE_LIMIT_MS              250
+#define UART_OUT_WAIT_MS                100
 
 
 typedef char dma_uart_buf_t[DMA_DATA_PCK_SZ];
@@ -30,6 +31,12 @@ char line_buffer[CMD_LINELEN];
 
 static dma_uart_buf_t uart_dma_buf[UART_CHANNELS_COUNT];
 
+/* Running byte counts, written only by the receiving side (ISR/thread)
+ * and only by the consumer for taken, so no locking is needed. */
+static volatile unsigned _uart_in_total[UART_CHANNELS_COUNT]      = {0};
+static volatile unsigned _uart_frame_ends[UART_CHANNELS_COUNT]    = {0};
+static unsigned          _uart_frame_taken[UART_CHANNELS_COUNT]   = {0};
+
 
 bool uart_ring_out_busy(unsigned uart)
 {
@@ -52,6 +59,15 @@ bool uart_rings_out_busy(void)
 }
 
 
+unsigned uart_ring_in_get_free(unsigned uart)
+{
+    if (uart >= UART_CHANNELS_COUNT)
+        return 0;
+
+    return ring_buf_get_free(&ring_in_bufs[uart]);
+}
+
+
 unsigned uart_ring_in(unsigned uart, const char* s, unsigned len)
 {
     if (uart >= UART_CHANNELS_COUNT)
@@ -63,8 +79,34 @@ unsigned uart_ring_in(unsigned uart, const char* s, unsigned len)
         if (!ring_buf_add(ring, s[n]))
         {
             log_error("UART-in %u full", uart);
+            _uart_in_total[uart] += n;
             return n;
         }
+    _uart_in_total[uart] += len;
+    return len;
+}
+
+
+/* Called by the port when the line has been idle for the frame timeout. */
+void uart_ring_in_frame_end(unsigned uart)
+{
+    if (uart >= UART_CHANNELS_COUNT)
+        return;
+
+    _uart_frame_ends[uart] = _uart_in_total[uart];
+}
+
+
+/* Length of the bytes received up to the last frame end, if not taken
+ * already. Frames ended but not taken are given together. */
+unsigned uart_ring_in_get_frame(unsigned uart)
+{
+    if (uart >= UART_CHANNELS_COUNT)
+        return 0;
+
+    unsigned ends = _uart_frame_ends[uart];
+    unsigned len = ends - _uart_frame_taken[uart];
+    _uart_frame_taken[uart] = ends;
     return len;
 }
 
@@ -141,6 +183,12 @@ void uart_ring_in_drain(unsigned uart)
 
     if (uart == CMD_UART)
     {
+        /* Leave pipelined commands queued until the previous responses
+         * have mostly gone out, rather than dropping response bytes. */
+        ring_buf_t * out_ring = &ring_out_bufs[uart];
+        if (out_ring->size > 1 && ring_buf_get_free(out_ring) < out_ring->size / 2)
+            return;
+
         len = ring_buf_readline(ring, line_buffer, CMD_LINELEN);
 
         if (len)
@@ -197,6 +245,28 @@ static void uart_ring_out_drain(unsigned uart)
 }
 
 
+/* For long output from the main loop, send what is queued until len more
+ * fits, rather than fill the ring and drop the rest. */
+bool uart_ring_out_wait(unsigned uart, unsigned len)
+{
+    if (uart >= UART_CHANNELS_COUNT)
+        return false;
+
+    ring_buf_t * ring = &ring_out_bufs[uart];
+    if (ring->size <= 1)
+        return true;
+
+    uint32_t start = get_since_boot_ms();
+    while (ring_buf_get_free(ring) < len)
+    {
+        if (since_boot_delta(get_since_boot_ms(), start) > UART_OUT_WAIT_MS)
+            return false;
+        uart_ring_out_drain(uart);
+    }
+    return true;
+}
+
+
 void uart_rings_in_drain()
 {
     for(unsigned n = 0; n < UART_CHANNELS_COUNT; n++)
@@ -206,6 +276,7 @@ void uart_rings_in_drain()
 
 void uart_rings_out_drain()
 {
+    log_defer_drain();
     for(unsigned n = 0; n < UART_CHANNELS_COUNT; n++)
         uart_ring_out_drain(n);
 }
@@ -253,6 +324,7 @@ void uart_rings_in_wipe(unsigned uart)
     if (uart < UART_CHANNELS_COUNT)
     {
         _uart_rings_wipe(&ring_in_bufs[uart]);
+        _uart_frame_taken[uart] = _uart_frame_ends[uart];
     }
 }
 
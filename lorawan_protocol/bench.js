@@ -0,0 +1,42 @@
+// Decoder throughput over the corpus, one frame at a time, batched and
+// packed into one buffer.
+const path = require("path");
+const protocol = require("./protocol");
+const test = require("./test");
+
+var file = process.argv[2] || path.join(__dirname, "corpus", "hexblob.txt");
+var rounds = parseInt(process.argv[3] || "20000");
+var frames = test.Load_corpus(file).frames;
+var packed = protocol.Pack(frames);
+
+var frame_count = frames.length * rounds;
+var byte_count = packed.length * rounds;
+
+
+function Bench(name, fn)
+{
+    // Warm up so the JIT has settled.
+    for (var i = 0; i < rounds / 10; i++)
+        fn();
+    var start = process.hrtime.bigint();
+    for (var i = 0; i < rounds; i++)
+        fn();
+    var secs = Number(process.hrtime.bigint() - start) / 1e9;
+    console.log(name.padEnd(8) + ": " +
+                Math.round(frame_count / secs).toLocaleString() + " frames/s, " +
+                (byte_count / secs / 1e6).toFixed(1) + " MB/s");
+}
+
+
+Bench("Decode", function ()
+{
+    for (var i = 0; i < frames.length; i++)
+        protocol.Decode(0, frames[i], {});
+});
+Bench("Batch", function () { protocol.Decode_batch(frames); });
+Bench("Packed", function () { protocol.Decode_packed(packed); });
+Bench("Each", function ()
+{
+    for (var i = 0; i < frames.length; i++)
+        protocol.Decode_each(frames[i], 0, frames[i].length, function () {});
+});
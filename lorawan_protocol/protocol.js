@@ -4,6 +4,25 @@
 //  - variables contains the device variables e.g. {"calibration": "3.5"} (both the key / value are of type string)
 // The function must return an object, e.g. {"temperature": 22.5}
 
+// The bytes can be an Array, Buffer or Uint8Array. Nothing is copied, the
+// decoders read in place from pos.
+
+// Size of each PROTOCOL_SEND_TYPE_* value, as protocols/src/hexblob.c sends.
+var VALUE_SIZES = [];
+VALUE_SIZES[0x01] = 1;
+VALUE_SIZES[0x02] = 2;
+VALUE_SIZES[0x03] = 4;
+VALUE_SIZES[0x04] = 8;
+VALUE_SIZES[0x11] = 1;
+VALUE_SIZES[0x12] = 2;
+VALUE_SIZES[0x13] = 4;
+VALUE_SIZES[0x14] = 8;
+VALUE_SIZES[0x15] = 4;
+VALUE_SIZES[0x20] = 8;
+
+var TWO_POW_32 = 0x100000000;
+
+
 function Decode_u8(bytes, pos)
 {
     return bytes[pos];
@@ -18,86 +37,101 @@ function Decode_u16(bytes, pos)
 
 function Decode_u32(bytes, pos)
 {
-    return (Decode_u16(bytes, pos + 2) << 16) | Decode_u16(bytes, pos);
+    // Multiply the top byte, a shift would make it negative.
+    return bytes[pos + 3] * 0x1000000 + ((bytes[pos + 2] << 16) | Decode_u16(bytes, pos));
+}
+
+
+// Digits of a 64 bit value held as two unsigned 32 bit halves. Done in
+// 16 bit limbs so every step stays exact in a double.
+function U64_to_string(hi, lo)
+{
+    var limbs = [hi >>> 16, hi & 0xFFFF, lo >>> 16, lo & 0xFFFF];
+    var str = "";
+    while (limbs[0] || limbs[1] || limbs[2] || limbs[3])
+    {
+        var rem = 0;
+        for (var i = 0; i < 4; i++)
+        {
+            var cur = rem * 0x10000 + limbs[i];
+            limbs[i] = Math.floor(cur / 10000);
+            rem = cur % 10000;
+        }
+        var digits = String(rem);
+        if (limbs[0] || limbs[1] || limbs[2] || limbs[3])
+            digits = "0000".substring(digits.length) + digits;
+        str = digits + str;
+    }
+    return str || "0";
 }
 
 
+// 64 bit values are Numbers while a double holds them exactly, beyond
+// that they are decimal strings.
 function Decode_u64(bytes, pos)
 {
-    return (Decode_u32(bytes, pos + 4) << 32 | Decode_u32(bytes, pos));
+    var lo = Decode_u32(bytes, pos);
+    var hi = Decode_u32(bytes, pos + 4);
+    var val = hi * TWO_POW_32 + lo;
+    if (Number.isSafeInteger(val))
+        return val;
+    return U64_to_string(hi, lo);
 }
 
 
 function Decode_i8(bytes, pos)
 {
-    var UINT8_MAX = 256;
-    var val;
-    pos, val = Decode_u8(bytes, pos);
-    if (val > UINT8_MAX / 2)
-    {
-        val -= UINT8_MAX;
-    }
-    return (pos, val);
+    var val = Decode_u8(bytes, pos);
+    return (val & 0x80) ? val - 0x100 : val;
 }
 
 
 function Decode_i16(bytes, pos)
 {
-    var UINT16_MAX = 0xFFFF;
-    var val;
-    pos, val = Decode_u16(bytes, pos);
-    if (val & 0x8000)
-    {
-        val -= (UINT16_MAX + 1);
-    }
-    return (pos, val);
+    var val = Decode_u16(bytes, pos);
+    return (val & 0x8000) ? val - 0x10000 : val;
 }
 
 
 function Decode_i32(bytes, pos)
 {
-    var UINT32_MAX = 0xFFFFFFFF;
-    var val;
-    pos, val = Decode_u32(bytes, pos);
-    if (val > UINT32_MAX / 2)
-    {
-        val -= (UINT32_MAX + 1);
-    }
-    return (pos, val);
+    return (bytes[pos + 3] << 24) | (bytes[pos + 2] << 16) | Decode_u16(bytes, pos);
 }
 
 
 function Decode_i64(bytes, pos)
 {
-    var UINT64_MAX = 0xFFFFFFFFFFFFFFFF;
-    var val;
-    pos, val = Decode_u64(bytes, pos);
-    if (val > UINT64_MAX / 2)
-    {
-        val -= (UINT64_MAX - 1);
-    }
-    return (pos, val);
+    var lo = Decode_u32(bytes, pos);
+    var hi = Decode_i32(bytes, pos + 4);
+    var val = hi * TWO_POW_32 + lo;
+    if (Number.isSafeInteger(val))
+        return val;
+    if (hi >= 0)
+        return U64_to_string(hi, lo);
+    // Two's complement negate for the magnitude.
+    lo = (~lo + 1) >>> 0;
+    hi = (~hi + (lo ? 0 : 1)) >>> 0;
+    return "-" + U64_to_string(hi, lo);
 }
 
 
+// Floats are sent as thousandths in an int32.
 function Decode_float(bytes, pos)
 {
     return Decode_i32(bytes, pos) / 1000;
 }
 
 
-function Decode_double(bytes, pos)
-{
-    return Decode_i64(bytes, pos) / 1000;
-}
-
-
+// Strings are sent as 8 bytes, NUL padded.
 function Decode_string(bytes, pos)
 {
     var val = "";
     for (var i = 0; i < 8; i++)
     {
-        val += String.fromCharCode(bytes[pos+i]);
+        var c = bytes[pos + i];
+        if (!c)
+            break;
+        val += String.fromCharCode(c);
     }
     return val;
 }
@@ -125,8 +159,6 @@ function Decode_value(value_type, bytes, pos)
             return Decode_i64(bytes, pos);
         case 0x15:
             return Decode_float(bytes, pos);
-        case 0x16:
-            return Decode_double(bytes, pos);
         case 0x20:
             return Decode_string(bytes, pos);
         default:
@@ -135,38 +167,6 @@ function Decode_value(value_type, bytes, pos)
 }
 
 
-function Value_sizes(value_type)
-{
-    switch (value_type)
-    {
-        case 0x01:
-            return 1;
-        case 0x02:
-            return 2;
-        case 0x03:
-            return 4;
-        case 0x04:
-            return 8;
-        case 0x11:
-            return 1;
-        case 0x12:
-            return 2;
-        case 0x13:
-            return 4;
-        case 0x14:
-            return 8;
-        case 0x15:
-            return 4;
-        case 0x16:
-            return 8;
-        case 0x20:
-            return 8;
-        default:
-            return false;
-    }
-}
-
-
 function Error_lookup(err)
 {
     switch (err)
@@ -185,91 +185,183 @@ function Error_lookup(err)
 }
 
 
-function Decode(fPort, bytes, variables)
+// Results of a batch of commands: count in the top byte, then a bit per
+// command set if it went OK.
+function Cmds_results(value)
 {
-    var pos = 0;
-    var obj = {};
+    var count = Math.floor(value / 0x1000000);
+    var ok = [];
+    for (var i = 0; i < count; i++)
+    {
+        ok.push(Math.floor(value / Math.pow(2, i)) % 2 == 1);
+    }
+    return { count: count, ok: ok };
+}
+
+
+function Decode_name(bytes, pos)
+{
+    var name = "";
+    for (var i = 0; i < 4; i++)
+    {
+        if (bytes[pos + i] != 0)
+        {
+            name += String.fromCharCode(bytes[pos + i]);
+        }
+    }
+    name = name.trim();
+    return name.replace(" ", "_");
+}
 
+
+// Calls cb(name, data_type, mean, min, max) for each measurement of the
+// frame in bytes[start, end), min and max only being there for averaged
+// ones. Returns false if the frame is not whole or is of an unknown
+// version, having given what came before the fault.
+function Decode_each(bytes, start, end, cb)
+{
+    var pos = start;
     var protocol_version = bytes[pos++];
 
     if (protocol_version != 1 && protocol_version != 2)
     {
-        return obj;
+        return false;
     }
 
-    var name;
-    while(pos < bytes.length)
+    while (pos < end)
     {
-        name = "";
-        for (var i = 0; i < 4; i++)
+        if (pos + 6 > end)
         {
-            if (bytes[pos] != 0)
-            {
-                name += String.fromCharCode(bytes[pos]);
-            }
-            pos++;
+            return false;
         }
-        name = name.trim();
-        name = name.replace(" ", "_");
+        var name = Decode_name(bytes, pos);
+        pos += 4;
         var data_type = bytes[pos++];
-        var value_type, func;
-        var mean, min, max;
-        var next_size;
+        var count;
         switch (data_type)
         {
             // Single measurement
             case 1:
-                value_type = bytes[pos++];
-                next_size = Value_sizes(value_type);
-                if (next_size + pos > bytes.length)
-                {
-                    return obj;
-                }
-                mean = Decode_value(value_type, bytes, pos);
-                pos += next_size;
-                if (name == "ERR")
-                    mean = Error_lookup(mean);
-                obj[name] = mean;
+                count = 1;
                 break;
             // Multiple measurement
             case 2:
-                value_type = bytes[pos++];
-                next_size = Value_sizes(value_type);
-                if (next_size + pos > bytes.length)
-                {
-                    return obj;
-                }
-                mean = Decode_value(value_type, bytes, pos);
-                pos += next_size;
-                obj[name] = mean;
-
-                value_type = bytes[pos++];
-                next_size = Value_sizes(value_type);
-                if (next_size + pos > bytes.length)
-                {
-                    return obj;
-                }
-                min = Decode_value(value_type, bytes, pos);
-                pos += next_size;
-                obj[name+"_min"] = min;
-
-                value_type = bytes[pos++];
-                next_size = Value_sizes(value_type);
-                if (next_size + pos > bytes.length)
-                {
-                    return obj;
-                }
-                max = Decode_value(value_type, bytes, pos);
-                pos += next_size;
-                obj[name+"_max"] = max;
+                count = 3;
                 break;
             default:
-                return obj;
+                return false;
+        }
+        var values = [undefined, undefined, undefined];
+        for (var i = 0; i < count; i++)
+        {
+            var value_type = bytes[pos++];
+            var next_size = VALUE_SIZES[value_type];
+            if (!next_size || next_size + pos > end)
+            {
+                return false;
+            }
+            values[i] = Decode_value(value_type, bytes, pos);
+            pos += next_size;
         }
+        cb(name, data_type, values[0], values[1], values[2]);
     }
+    return true;
+}
+
+
+function Decode_frame(bytes, start, end)
+{
+    var obj = {};
+    // Readings held while not connected follow an "AGE" (seconds ago) reading.
+    var target = obj;
+    Decode_each(bytes, start, end, function (name, data_type, mean, min, max)
+    {
+        if (data_type == 2)
+        {
+            target[name] = mean;
+            target[name+"_min"] = min;
+            target[name+"_max"] = max;
+            return;
+        }
+        if (name == "ERR")
+            mean = Error_lookup(mean);
+        if (name == "CMDS")
+            mean = Cmds_results(mean);
+        if (name == "AGE")
+        {
+            if (!obj.backlog)
+                obj.backlog = [];
+            target = {};
+            obj.backlog.push(target);
+        }
+        target[name] = mean;
+    });
     return obj;
 }
 
+
+function Decode(fPort, bytes, variables)
+{
+    return Decode_frame(bytes, 0, bytes.length);
+}
+
+
+// Decodes an array of frames, each as Decode would.
+function Decode_batch(frames)
+{
+    var objs = new Array(frames.length);
+    for (var i = 0; i < frames.length; i++)
+    {
+        objs[i] = Decode_frame(frames[i], 0, frames[i].length);
+    }
+    return objs;
+}
+
+
+// Frames packed back to back into one buffer, each after its length as a
+// little endian uint16. They are decoded in place, without slicing.
+function Decode_packed(bytes)
+{
+    var objs = [];
+    var pos = 0;
+    while (pos + 2 <= bytes.length)
+    {
+        var len = Decode_u16(bytes, pos);
+        pos += 2;
+        if (pos + len > bytes.length)
+        {
+            break;
+        }
+        objs.push(Decode_frame(bytes, pos, pos + len));
+        pos += len;
+    }
+    return objs;
+}
+
+
+// Packs frames into one Uint8Array for Decode_packed.
+function Pack(frames)
+{
+    var total = 0;
+    for (var i = 0; i < frames.length; i++)
+    {
+        total += 2 + frames[i].length;
+    }
+    var packed = new Uint8Array(total);
+    var pos = 0;
+    for (var i = 0; i < frames.length; i++)
+    {
+        var frame = frames[i];
+        packed[pos++] = frame.length & 0xFF;
+        packed[pos++] = frame.length >> 8;
+        for (var j = 0; j < frame.length; j++)
+        {
+            packed[pos++] = frame[j];
+        }
+    }
+    return packed;
+}
+
 // Encode encodes the given object into an array of bytes.
 //  - fPort contains the LoRaWAN fPort number
 //  - obj is an object, e.g. {"temperature": 22.5}
@@ -337,4 +429,4 @@ function Encode(fPort, obj, variables)
     return bytes;
 }
 
-module.exports = { Decode, Encode }
+module.exports = { Decode, Encode, Decode_each, Decode_frame, Decode_batch, Decode_packed, Pack }
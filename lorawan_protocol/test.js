@@ -0,0 +1,82 @@
+// Cross-validates the decoder against frames encoded by the firmware's
+// protocol, see tests/protocol_test.c. Each corpus line is the frame in
+// hex then the JSON it should decode to.
+const fs = require("fs");
+const path = require("path");
+const protocol = require("./protocol");
+
+const NORMAL  = "\x1b[39m";
+const OKGREEN = "\x1b[92m";
+const BADRED  = "\x1b[91m";
+
+
+function Canonical(value)
+{
+    if (Array.isArray(value))
+        return "[" + value.map(Canonical).join(",") + "]";
+    if (value !== null && typeof value === "object")
+        return "{" + Object.keys(value).sort().map(function (key)
+        {
+            return JSON.stringify(key) + ":" + Canonical(value[key]);
+        }).join(",") + "}";
+    return JSON.stringify(value);
+}
+
+
+function Load_corpus(file)
+{
+    var frames = [];
+    var expected = [];
+    var lines = fs.readFileSync(file, "utf8").split("\n");
+    for (var i = 0; i < lines.length; i++)
+    {
+        var line = lines[i].trim();
+        if (!line.length || line[0] == "#")
+            continue;
+        var split = line.indexOf(" ");
+        frames.push(Buffer.from(line.substring(0, split), "hex"));
+        expected.push(JSON.parse(line.substring(split + 1)));
+    }
+    return { frames: frames, expected: expected };
+}
+
+
+function Check(test, expected, got)
+{
+    var e = Canonical(expected);
+    var g = Canonical(got);
+    if (e == g)
+    {
+        console.log(OKGREEN + test + " " + e + " - pass" + NORMAL);
+        return true;
+    }
+    console.log(BADRED + test + " " + e + " != " + g + " FAIL" + NORMAL);
+    return false;
+}
+
+
+function Run(file)
+{
+    var corpus = Load_corpus(file);
+    var ok = true;
+
+    for (var i = 0; i < corpus.frames.length; i++)
+    {
+        ok &= Check("Decode", corpus.expected[i], protocol.Decode(0, corpus.frames[i], {}));
+    }
+
+    var batch = protocol.Decode_batch(corpus.frames);
+    var packed = protocol.Decode_packed(protocol.Pack(corpus.frames));
+    ok &= Check("Batch", corpus.expected, batch);
+    ok &= Check("Packed", corpus.expected, packed);
+    return ok;
+}
+
+
+module.exports = { Load_corpus }
+
+if (require.main === module)
+{
+    var file = process.argv[2] || path.join(__dirname, "corpus", "hexblob.txt");
+    process.exit(Run(file) ? 0 : 1);
+}
@@ -24,9 +24,9 @@ void env00_debug_mode_enable_all(void) {}
 
 bool env00_uart_ring_done_in_process(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
+    if (modbus_uart_is_bus(uart))
     {
-        modbus_uart_ring_in_process(ring);
+        modbus_uart_ring_in_process(uart, ring);
         return true;
     }
 
@@ -62,8 +62,8 @@ bool env00_measurements_get_inf(measurements_def_t * def, measurements_data_t* d
 
 bool env00_uart_ring_do_out_drain(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
-        return modbus_uart_ring_do_out_drain(ring);
+    if (modbus_uart_is_bus(uart))
+        return modbus_uart_ring_do_out_drain(uart, ring);
     return true;
 }
 
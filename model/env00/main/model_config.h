@@ -14,7 +14,7 @@
 
 #define CMD_LINELEN 128
 
-#define UART_0_IN_BUF_SIZE  CMD_LINELEN
+#define UART_0_IN_BUF_SIZE  (CMD_LINELEN * 4)
 #define UART_0_OUT_BUF_SIZE 2048
 
 #define UART_1_IN_BUF_SIZE  256
@@ -62,6 +62,7 @@
 #define W1_PULSE_2_IO                       5
 #define W1_PULSE_2_EXTI                     EXTI12
 #define W1_PULSE_2_EXTI_IRQ                 NVIC_EXTI15_10_IRQ
+#define W1_PULSE_2_HW_TIM                   { TIM1, RCC_TIM1, NVIC_TIM1_UP_TIM16_IRQ, GPIO_AF1, PULSECOUNT_HW_INPUT_ETR }
 /* UNUSED
 #define W1_PULSE_2_ISR                      exti15_10_isr
  */
@@ -4,6 +4,7 @@ env01c_SOURCES := \
            $(OSM_DIR)/core/src/log.c \
            $(OSM_DIR)/core/src/uart_rings.c \
            $(OSM_DIR)/core/src/cmd.c \
+           $(OSM_DIR)/core/src/cmd_batch.c \
            $(OSM_DIR)/core/src/io.c \
            $(OSM_DIR)/core/src/ring.c \
            $(OSM_DIR)/core/src/modbus_mem.c \
@@ -12,7 +13,9 @@ env01c_SOURCES := \
            $(OSM_DIR)/core/src/modbus.c \
            $(OSM_DIR)/core/src/measurements.c \
            $(OSM_DIR)/core/src/measurements_mem.c \
+           $(OSM_DIR)/core/src/energy.c \
            $(OSM_DIR)/core/src/modbus_measurements.c \
+           $(OSM_DIR)/core/src/modbus_slave.c \
            $(OSM_DIR)/ports/stm/src/update.c \
            $(OSM_DIR)/core/src/adcs.c \
            $(OSM_DIR)/core/src/common.c \
@@ -26,9 +29,12 @@ env01c_SOURCES := \
            $(OSM_DIR)/sensors/src/htu21d.c \
            $(OSM_DIR)/sensors/src/ds18b20.c \
            $(OSM_DIR)/sensors/src/pulsecount.c \
+           $(OSM_DIR)/sensors/src/pulsecount_stats.c \
            $(OSM_DIR)/sensors/src/veml7700.c \
            $(OSM_DIR)/sensors/src/sai.c \
            $(OSM_DIR)/sensors/src/cc.c \
+           $(OSM_DIR)/sensors/src/mains.c \
+           $(OSM_DIR)/sensors/src/mains_calc.c \
            $(OSM_DIR)/ports/stm/src/bat.c \
            $(OSM_DIR)/sensors/src/can_impl.c \
            $(OSM_DIR)/sensors/src/fw.c \
@@ -4,6 +4,7 @@
 
 #include "measurements.h"
 #include "config.h"
+#include "can_impl.h"
 #include "pinmap.h"
 #include "cc.h"
 #include "rak3172.h"
@@ -26,7 +27,7 @@
 #define ENV01C_PERSIST_RAW_DATA            ((const uint8_t*)ENV01C_PAGE2ADDR(ENV01C_FLASH_CONFIG_PAGE))
 #define ENV01C_PERSIST_RAW_MEASUREMENTS    ((const uint8_t*)ENV01C_PAGE2ADDR(ENV01C_FLASH_MEASUREMENTS_PAGE))
 
-#define ENV01C_PERSIST_VERSION             3
+#define ENV01C_PERSIST_VERSION             4
 
 #define ENV01C_PERSIST_MODEL_CONFIG_T      persist_env01c_config_v1_t
 
@@ -34,7 +35,7 @@
 
 #define CMD_LINELEN 128
 
-#define UART_0_IN_BUF_SIZE  CMD_LINELEN
+#define UART_0_IN_BUF_SIZE  (CMD_LINELEN * 4)
 #define UART_0_OUT_BUF_SIZE 2048
 
 #define UART_1_IN_BUF_SIZE  256
@@ -73,5 +74,8 @@ typedef struct
     /* 16 byte boundary ---- */
     uint32_t                sai_no_buf;
     uint8_t                 _____[16-(sizeof(uint32_t)%16)];
-    /* 7 x 16 bytes          */
+    /* 16 byte boundary ---- */
+    can_impl_config_t       can_config;
+    /* 16 byte boundary ---- */
+    /* 18 x 16 bytes         */
 } persist_env01c_config_v1_t;
@@ -68,6 +68,7 @@
 #define W1_PULSE_2_IO                       2
 #define W1_PULSE_2_EXTI                     EXTI5
 #define W1_PULSE_2_EXTI_IRQ                 NVIC_EXTI9_5_IRQ
+#define W1_PULSE_2_HW_TIM                   { TIM3, RCC_TIM3, NVIC_TIM3_IRQ, GPIO_AF2, PULSECOUNT_HW_INPUT_TI2 }
 #define W1_PULSE_2_ISR                      exti9_5_isr
 
 
@@ -9,6 +9,7 @@ penguin_SOURCES := \
     $(OSM_DIR)/ports/linux/src/i2c.c \
     $(OSM_DIR)/ports/linux/src/w1.c \
     $(OSM_DIR)/ports/linux/src/pulsecount.c \
+    $(OSM_DIR)/sensors/src/pulsecount_stats.c \
     $(OSM_DIR)/ports/linux/src/sai.c \
     $(OSM_DIR)/ports/linux/src/peripherals.c \
     $(OSM_DIR)/ports/linux/src/io_watch.c \
@@ -17,6 +18,7 @@ penguin_SOURCES := \
     $(OSM_DIR)/core/src/log.c \
     $(OSM_DIR)/core/src/uart_rings.c \
     $(OSM_DIR)/core/src/cmd.c \
+    $(OSM_DIR)/core/src/cmd_batch.c \
     $(OSM_DIR)/core/src/io.c \
     $(OSM_DIR)/core/src/ring.c \
     $(OSM_DIR)/core/src/modbus.c \
@@ -25,7 +27,9 @@ penguin_SOURCES := \
     $(OSM_DIR)/core/src/persist_base.c \
     $(OSM_DIR)/core/src/measurements.c \
     $(OSM_DIR)/core/src/measurements_mem.c \
+    $(OSM_DIR)/core/src/energy.c \
     $(OSM_DIR)/core/src/modbus_measurements.c \
+    $(OSM_DIR)/core/src/modbus_slave.c \
     $(OSM_DIR)/ports/linux/src/update.c \
     $(OSM_DIR)/core/src/adcs.c \
     $(OSM_DIR)/core/src/common.c \
@@ -37,8 +41,11 @@ penguin_SOURCES := \
     $(OSM_DIR)/sensors/src/ds18b20.c \
     $(OSM_DIR)/sensors/src/veml7700.c \
     $(OSM_DIR)/sensors/src/ftma.c \
+    $(OSM_DIR)/sensors/src/ftma_conv.c \
     $(OSM_DIR)/ports/linux/src/bat.c \
     $(OSM_DIR)/sensors/src/cc.c \
+    $(OSM_DIR)/sensors/src/mains.c \
+    $(OSM_DIR)/sensors/src/mains_calc.c \
     $(OSM_DIR)/sensors/src/can_impl.c \
     $(OSM_DIR)/sensors/src/fw.c \
     $(MODEL_DIR)/penguin/penguin.c \
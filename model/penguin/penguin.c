@@ -12,11 +12,13 @@ typedef int iso_is_annoying_go_away_pls_t;
 #include "uart_rings.h"
 #include "hpm.h"
 #include "cc.h"
+#include "mains.h"
 #include "bat.h"
 #include "modbus_measurements.h"
 #include "ds18b20.h"
 #include "htu21d.h"
 #include "pulsecount.h"
+#include "energy.h"
 #include "veml7700.h"
 #include "sai.h"
 #include "fw.h"
@@ -40,6 +42,7 @@ void penguin_persist_config_model_init(persist_penguin_config_v1_t* model_config
     cc_setup_default_mem(model_config->cc_configs, sizeof(cc_config_t) * ADC_CC_COUNT);
     ftma_setup_default_mem(model_config->ftma_configs, sizeof(ftma_config_t) * ADC_FTMA_COUNT);
     model_config->sai_no_buf = SAI_DEFAULT_NO_BUF;
+    can_impl_setup_default_mem(&model_config->can_config, sizeof(can_impl_config_t));
 }
 
 
@@ -54,7 +57,8 @@ bool penguin_persist_config_cmp(persist_penguin_config_v1_t* d0, persist_penguin
         memcmp(d0->cc_configs, d1->cc_configs, sizeof(cc_config_t) * ADC_CC_COUNT) == 0 &&
         memcmp(d0->ios_state, d1->ios_state, sizeof(uint16_t) * IOS_COUNT) == 0 &&
         memcmp(d0->sai_cal_coeffs, d1->sai_cal_coeffs, sizeof(float) * SAI_NUM_CAL_COEFFS) == 0 &&
-        d0->sai_no_buf == d1->sai_no_buf );
+        d0->sai_no_buf == d1->sai_no_buf &&
+        memcmp(&d0->can_config, &d1->can_config, sizeof(can_impl_config_t)) == 0 );
 }
 
 
@@ -84,9 +88,9 @@ void penguin_post_init(void)
 
 bool penguin_uart_ring_done_in_process(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
+    if (modbus_uart_is_bus(uart))
     {
-        modbus_uart_ring_in_process(ring);
+        modbus_uart_ring_in_process(uart, ring);
         return true;
     }
     else if (uart == HPM_UART)
@@ -101,8 +105,8 @@ bool penguin_uart_ring_done_in_process(unsigned uart, ring_buf_t * ring)
 
 bool penguin_uart_ring_do_out_drain(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
-        return modbus_uart_ring_do_out_drain(ring);
+    if (modbus_uart_is_bus(uart))
+        return modbus_uart_ring_do_out_drain(uart, ring);
     return true;
 }
 
@@ -125,15 +129,19 @@ bool penguin_measurements_get_inf(measurements_def_t * def, measurements_data_t*
         case PM25:          hpm_pm25_inf_init(inf);    break;
         case MODBUS:        modbus_inf_init(inf);      break;
         case CURRENT_CLAMP: cc_inf_init(inf);          break;
+        case MAINS:         mains_inf_init(inf);       break;
         case W1_PROBE:      ds18b20_inf_init(inf);     break;
         case HTU21D_TMP:    htu21d_temp_inf_init(inf); break;
         case HTU21D_HUM:    htu21d_humi_inf_init(inf); break;
         case BAT_MON:       bat_inf_init(inf);         break;
         case PULSE_COUNT:   pulsecount_inf_init(inf);  break;
+        case PULSE_STATS:   pulsecount_stats_inf_init(inf); break;
+        case ENERGY:        energy_inf_init(inf);      break;
         case LIGHT:         veml7700_inf_init(inf);    break;
         case SOUND:         sai_inf_init(inf);         break;
         case FTMA:          ftma_inf_init(inf);        break;
         case IO_READING:    ios_inf_init(inf);         break;
+        case CAN:           can_impl_inf_init(inf);    break;
         default:
             log_error("Unknown measurements type! : 0x%"PRIx8, def->type);
             return false;
@@ -162,18 +170,32 @@ void penguin_measurements_repopulate(void)
     measurements_repop_indiv(MEASUREMENTS_CURRENT_CLAMP_1_NAME, 0,  25, CURRENT_CLAMP   );
     measurements_repop_indiv(MEASUREMENTS_CURRENT_CLAMP_2_NAME, 0,  25, CURRENT_CLAMP   );
     measurements_repop_indiv(MEASUREMENTS_CURRENT_CLAMP_3_NAME, 0,  25, CURRENT_CLAMP   );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_FREQ_NAME,      0,  1,  MAINS           );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_THD_1_NAME,     0,  1,  MAINS           );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_THD_2_NAME,     0,  1,  MAINS           );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_THD_3_NAME,     0,  1,  MAINS           );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_PHASE_2_NAME,   0,  1,  MAINS           );
+    measurements_repop_indiv(MEASUREMENTS_MAINS_PHASE_3_NAME,   0,  1,  MAINS           );
     measurements_repop_indiv(MEASUREMENTS_W1_PROBE_NAME_1,      0,  5,  W1_PROBE        );
     measurements_repop_indiv(MEASUREMENTS_HTU21D_TEMP,          1,  2,  HTU21D_TMP      );
     measurements_repop_indiv(MEASUREMENTS_HTU21D_HUMI,          1,  2,  HTU21D_HUM      );
     measurements_repop_indiv(MEASUREMENTS_BATMON_NAME,          1,  5,  BAT_MON         );
     measurements_repop_indiv(MEASUREMENTS_PULSE_COUNT_NAME_1,   0,  1,  PULSE_COUNT     );
     measurements_repop_indiv(MEASUREMENTS_PULSE_COUNT_NAME_2,   0,  1,  PULSE_COUNT     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_RATE_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_RATE_NAME_2,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_IVAL_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_IVAL_NAME_2,    0,  2,  PULSE_STATS     );
     measurements_repop_indiv(MEASUREMENTS_LIGHT_NAME,           1,  5,  LIGHT           );
     measurements_repop_indiv(MEASUREMENTS_SOUND_NAME,           1,  5,  SOUND           );
     measurements_repop_indiv(MEASUREMENTS_FTMA_1_NAME,          0,  25, FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_2_NAME,          0,  25, FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_3_NAME,          0,  25, FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_4_NAME,          0,  25, FTMA            );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_AWAKE_NAME,    0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_TX_NAME,       0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_FLASH_NAME,    0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_SENSE_NAME,    0,  1,  ENERGY          );
 }
 
 
@@ -181,10 +203,12 @@ void penguin_cmds_add_all(struct cmd_link_t* tail)
 {
     tail = bat_add_commands(tail);
     tail = cc_add_commands(tail);
+    tail = mains_add_commands(tail);
     tail = can_impl_add_commands(tail);
     tail = sai_add_commands(tail);
     tail = persist_config_add_commands(tail);
     tail = measurements_add_commands(tail);
+    tail = energy_add_commands(tail);
     tail = ios_add_commands(tail);
     tail = debug_mode_add_commands(tail);
     tail = modbus_add_commands(tail);
@@ -221,32 +245,48 @@ unsigned penguin_measurements_add_defaults(measurements_def_t * measurements_arr
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_CURRENT_CLAMP_1_NAME, 0,  25, CURRENT_CLAMP   );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_CURRENT_CLAMP_2_NAME, 0,  25, CURRENT_CLAMP   );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_CURRENT_CLAMP_3_NAME, 0,  25, CURRENT_CLAMP   );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_FREQ_NAME,      0,  1,  MAINS           );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_THD_1_NAME,     0,  1,  MAINS           );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_THD_2_NAME,     0,  1,  MAINS           );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_THD_3_NAME,     0,  1,  MAINS           );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_PHASE_2_NAME,   0,  1,  MAINS           );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_MAINS_PHASE_3_NAME,   0,  1,  MAINS           );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_W1_PROBE_NAME_1,      0,  5,  W1_PROBE        );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_HTU21D_TEMP,          1,  2,  HTU21D_TMP      );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_HTU21D_HUMI,          1,  2,  HTU21D_HUM      );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_BATMON_NAME,          1,  5,  BAT_MON         );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_COUNT_NAME_1,   0,  1,  PULSE_COUNT     );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_COUNT_NAME_2,   0,  1,  PULSE_COUNT     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_RATE_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_RATE_NAME_2,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_IVAL_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_IVAL_NAME_2,    0,  2,  PULSE_STATS     );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_LIGHT_NAME,           1,  5,  LIGHT           );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_SOUND_NAME,           1,  5,  SOUND           );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_1_NAME,          0,  25, FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_2_NAME,          0,  25, FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_3_NAME,          0,  25, FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_4_NAME,          0,  25, FTMA            );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_AWAKE_NAME,    0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_TX_NAME,       0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_FLASH_NAME,    0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_SENSE_NAME,    0,  1,  ENERGY          );
     return pos;
 }
 
 
-static unsigned _penguin_pids[5] = {0};
+static unsigned _penguin_pids[6] = {0};
 
 
 void penguin_linux_spawn_fakes(void)
 {
     peripherals_add_cmd(&_penguin_pids[0]);
     peripherals_add_modbus(EXT_UART , &_penguin_pids[1]);
+    peripherals_add_modbus2(EXT2_UART);
     peripherals_add_hpm(HPM_UART    , &_penguin_pids[2]);
     peripherals_add_w1(1000000      , &_penguin_pids[3]);
     peripherals_add_i2c(2000000     , &_penguin_pids[4]);
+    peripherals_add_can(2000000     , &_penguin_pids[5]);
 }
 
 
@@ -4,11 +4,12 @@
 
 #include "measurements.h"
 #include "config.h"
+#include "can_impl.h"
 #include "cc.h"
 #include "ftma.h"
 #include "linux_comms.h"
 
-#define PERSIST_VERSION  1
+#define PERSIST_VERSION  2
 #define FLASH_PAGE_SIZE 2048
 #define FW_MAX_SIZE (1024*100)
 #define NEW_FW_ADDR 0x800000
@@ -16,7 +17,7 @@
 
 #define CMD_LINELEN 128
 
-#define UART_0_IN_BUF_SIZE  CMD_LINELEN
+#define UART_0_IN_BUF_SIZE  (CMD_LINELEN * 4)
 #define UART_0_OUT_BUF_SIZE 2048
 
 #define UART_1_IN_BUF_SIZE  256
@@ -28,6 +29,9 @@
 #define UART_3_IN_BUF_SIZE  128
 #define UART_3_OUT_BUF_SIZE 128
 
+#define UART_4_IN_BUF_SIZE  128
+#define UART_4_OUT_BUF_SIZE 128
+
 #define IOS_COUNT           10
 #define ADC_CC_COUNT        3
 #define ADC_FTMA_COUNT      4
@@ -58,7 +62,9 @@ typedef struct
     uint32_t                sai_no_buf;
     uint8_t                 ______[16-(sizeof(uint32_t)%16)];
     /* 16 byte boundary ---- */
-    /* 8 x 16 bytes          */
+    can_impl_config_t       can_config;
+    /* 16 byte boundary ---- */
+    /* 19 x 16 bytes         */
 } persist_penguin_config_v1_t;
 
 #define persist_model_config_t        persist_penguin_config_v1_t
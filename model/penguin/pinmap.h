@@ -5,8 +5,11 @@
 #define COMMS_UART 1
 #define HPM_UART   2
 #define EXT_UART   3
+#define EXT2_UART  4
 
-#define UART_CHANNELS_COUNT 4
+#define UART_CHANNELS_COUNT 5
+
+#define MODBUS_BUS_UARTS { EXT_UART, EXT2_UART }
 
 #define ADC_COUNT 10
 
@@ -45,7 +48,9 @@ char uart_1_out_buf[UART_1_OUT_BUF_SIZE];\
 char uart_2_in_buf[UART_2_IN_BUF_SIZE];  \
 char uart_2_out_buf[UART_2_OUT_BUF_SIZE];\
 char uart_3_in_buf[UART_3_IN_BUF_SIZE];  \
-char uart_3_out_buf[UART_3_OUT_BUF_SIZE];
+char uart_3_out_buf[UART_3_OUT_BUF_SIZE];\
+char uart_4_in_buf[UART_4_IN_BUF_SIZE];  \
+char uart_4_out_buf[UART_4_OUT_BUF_SIZE];
 
 #define UART_IN_RINGS                                   \
 {                                                       \
@@ -53,6 +58,7 @@ char uart_3_out_buf[UART_3_OUT_BUF_SIZE];
     RING_BUF_INIT(uart_1_in_buf, sizeof(uart_1_in_buf)),\
     RING_BUF_INIT(uart_2_in_buf, sizeof(uart_2_in_buf)),\
     RING_BUF_INIT(uart_3_in_buf, sizeof(uart_3_in_buf)),\
+    RING_BUF_INIT(uart_4_in_buf, sizeof(uart_4_in_buf)),\
 }
 
 #define UART_OUT_RINGS                                    \
@@ -60,7 +66,8 @@ char uart_3_out_buf[UART_3_OUT_BUF_SIZE];
     RING_BUF_INIT(uart_0_out_buf, sizeof(uart_0_out_buf)),\
     RING_BUF_INIT(uart_1_out_buf, sizeof(uart_1_out_buf)),\
     RING_BUF_INIT(uart_2_out_buf, sizeof(uart_2_out_buf)),\
-    RING_BUF_INIT(uart_3_out_buf, sizeof(uart_3_out_buf)),}
+    RING_BUF_INIT(uart_3_out_buf, sizeof(uart_3_out_buf)),\
+    RING_BUF_INIT(uart_4_out_buf, sizeof(uart_4_out_buf)),}
 
 #define IOS_PORT_N_PINS            \
 {                                  \
@@ -15,6 +15,7 @@
 #include "ds18b20.h"
 #include "htu21d.h"
 #include "pulsecount.h"
+#include "energy.h"
 #include "veml7700.h"
 #include "sai.h"
 #include "fw.h"
@@ -51,6 +52,7 @@ void sens01_persist_config_model_init(persist_model_config_t* model_config)
     ftma_setup_default_mem(model_config->ftma_configs, sizeof(ftma_config_t));
     lw_config_init(&model_config->comms_config);
     model_config->sai_no_buf = SAI_DEFAULT_NO_BUF;
+    can_impl_setup_default_mem(&model_config->can_config, sizeof(can_impl_config_t));
 }
 
 
@@ -66,7 +68,8 @@ bool sens01_persist_config_cmp(persist_sens01_config_v1_t* d0, persist_sens01_co
         memcmp(d0->ftma_configs, d1->ftma_configs, sizeof(ftma_config_t) * ADC_FTMA_COUNT) == 0 &&
         memcmp(d0->ios_state, d1->ios_state, sizeof(uint16_t) * IOS_COUNT) == 0 &&
         memcmp(d0->sai_cal_coeffs, d1->sai_cal_coeffs, sizeof(float) * SAI_NUM_CAL_COEFFS) == 0 &&
-        d0->sai_no_buf == d1->sai_no_buf );
+        d0->sai_no_buf == d1->sai_no_buf &&
+        memcmp(&d0->can_config, &d1->can_config, sizeof(can_impl_config_t)) == 0 );
 }
 
 
@@ -95,9 +98,9 @@ void sens01_post_init(void)
 
 bool sens01_uart_ring_done_in_process(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
+    if (modbus_uart_is_bus(uart))
     {
-        modbus_uart_ring_in_process(ring);
+        modbus_uart_ring_in_process(uart, ring);
         return true;
     }
     else if (uart == HPM_UART)
@@ -112,8 +115,8 @@ bool sens01_uart_ring_done_in_process(unsigned uart, ring_buf_t * ring)
 
 bool sens01_uart_ring_do_out_drain(unsigned uart, ring_buf_t * ring)
 {
-    if (uart == EXT_UART)
-        return modbus_uart_ring_do_out_drain(ring);
+    if (modbus_uart_is_bus(uart))
+        return modbus_uart_ring_do_out_drain(uart, ring);
     return true;
 }
 
@@ -145,10 +148,13 @@ bool sens01_measurements_get_inf(measurements_def_t * def, measurements_data_t*
         case HTU21D_HUM:    htu21d_humi_inf_init(inf); break;
         case BAT_MON:       bat_inf_init(inf);         break;
         case PULSE_COUNT:   pulsecount_inf_init(inf);  break;
+        case PULSE_STATS:   pulsecount_stats_inf_init(inf); break;
+        case ENERGY:        energy_inf_init(inf);      break;
         case LIGHT:         veml7700_inf_init(inf);    break;
         case SOUND:         sai_inf_init(inf);         break;
         case FTMA:          ftma_inf_init(inf);        break;
         case IO_READING:    ios_inf_init(inf);         break;
+        case CAN:           can_impl_inf_init(inf);    break;
         default:
             log_error("Unknown measurements type! : 0x%"PRIx8, def->type);
             return false;
@@ -172,12 +178,20 @@ void sens01_measurements_repopulate(void)
     measurements_repop_indiv(MEASUREMENTS_BATMON_NAME,          1,  5,  BAT_MON         );
     measurements_repop_indiv(MEASUREMENTS_PULSE_COUNT_NAME_1,   0,  1,  PULSE_COUNT     );
     measurements_repop_indiv(MEASUREMENTS_PULSE_COUNT_NAME_2,   0,  1,  PULSE_COUNT     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_RATE_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_RATE_NAME_2,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_IVAL_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_repop_indiv(MEASUREMENTS_PULSE_IVAL_NAME_2,    0,  2,  PULSE_STATS     );
     measurements_repop_indiv(MEASUREMENTS_LIGHT_NAME,           1,  5,  LIGHT           );
     measurements_repop_indiv(MEASUREMENTS_SOUND_NAME,           1,  5,  SOUND           );
     measurements_repop_indiv(MEASUREMENTS_FTMA_1_NAME,          0,  5,  FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_2_NAME,          0,  5,  FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_3_NAME,          0,  5,  FTMA            );
     measurements_repop_indiv(MEASUREMENTS_FTMA_4_NAME,          0,  5,  FTMA            );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_AWAKE_NAME,    0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_TX_NAME,       0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_FLASH_NAME,    0,  1,  ENERGY          );
+    measurements_repop_indiv(MEASUREMENTS_ENERGY_SENSE_NAME,    0,  1,  ENERGY          );
 }
 
 
@@ -189,6 +203,7 @@ void sens01_cmds_add_all(struct cmd_link_t* tail)
     tail = sai_add_commands(tail);
     tail = persist_config_add_commands(tail);
     tail = measurements_add_commands(tail);
+    tail = energy_add_commands(tail);
     tail = ios_add_commands(tail);
     tail = debug_mode_add_commands(tail);
     tail = modbus_add_commands(tail);
@@ -237,11 +252,19 @@ unsigned sens01_measurements_add_defaults(measurements_def_t * measurements_arr)
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_BATMON_NAME,          1,  5,  BAT_MON         );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_COUNT_NAME_1,   0,  1,  PULSE_COUNT     );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_COUNT_NAME_2,   0,  1,  PULSE_COUNT     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_RATE_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_RATE_NAME_2,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_IVAL_NAME_1,    0,  2,  PULSE_STATS     );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_PULSE_IVAL_NAME_2,    0,  2,  PULSE_STATS     );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_LIGHT_NAME,           1,  5,  LIGHT           );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_SOUND_NAME,           1,  5,  SOUND           );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_1_NAME,          0,  5,  FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_2_NAME,          0,  5,  FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_3_NAME,          0,  5,  FTMA            );
     measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_FTMA_4_NAME,          0,  5,  FTMA            );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_AWAKE_NAME,    0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_TX_NAME,       0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_FLASH_NAME,    0,  1,  ENERGY          );
+    measurements_setup_default(&measurements_arr[pos++], MEASUREMENTS_ENERGY_SENSE_NAME,    0,  1,  ENERGY          );
     return pos;
 }
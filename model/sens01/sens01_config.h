@@ -4,6 +4,7 @@
 
 #include "measurements.h"
 #include "config.h"
+#include "can_impl.h"
 #include "pinmap.h"
 #include "ftma.h"
 #include "rak4270.h"
@@ -26,7 +27,7 @@
 #define SENS01_PERSIST_RAW_DATA            ((const uint8_t*)SENS01_PAGE2ADDR(SENS01_FLASH_CONFIG_PAGE))
 #define SENS01_PERSIST_RAW_MEASUREMENTS    ((const uint8_t*)SENS01_PAGE2ADDR(SENS01_FLASH_MEASUREMENTS_PAGE))
 
-#define SENS01_PERSIST_VERSION             3
+#define SENS01_PERSIST_VERSION             4
 
 #define SENS01_PERSIST_MODEL_CONFIG_T      persist_sens01_config_v1_t
 
@@ -34,7 +35,7 @@
 
 #define CMD_LINELEN 128
 
-#define UART_0_IN_BUF_SIZE  CMD_LINELEN
+#define UART_0_IN_BUF_SIZE  (CMD_LINELEN * 4)
 #define UART_0_OUT_BUF_SIZE 2048
 
 #define UART_1_IN_BUF_SIZE  256
@@ -73,7 +74,9 @@ typedef struct
     uint32_t                sai_no_buf;
     uint8_t                 _____[16-(sizeof(uint32_t)%16)];
     /* 16 byte boundary ---- */
-    /* 7 x 16 bytes          */
+    can_impl_config_t       can_config;
+    /* 16 byte boundary ---- */
+    /* 18 x 16 bytes         */
 } persist_sens01_config_v1_t;
 
 #define FTMA_RESISTOR_S_OHM                                 30
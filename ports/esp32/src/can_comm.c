@@ -25,3 +25,15 @@ void can_comm_enable(bool enabled)
 void can_comm_send(can_comm_packet_t* pkt)
 {
 }
+
+
+bool can_comm_set_filters(can_comm_filter_t* filters, unsigned count)
+{
+    return false;
+}
+
+
+uint32_t can_comm_get_dropped(void)
+{
+    return 0;
+}
@@ -153,6 +153,12 @@ void platform_adc_set_num_data(unsigned num_data)
 }
 
 
+uint32_t platform_adc_get_sample_period_ns(void)
+{
+    return 0;
+}
+
+
 void platform_hpm_enable(bool enable)
 {
 }
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 
@@ -24,8 +25,25 @@
 #define SVRUSR_LEN 12
 #define SVRPW_LEN  32
 
-#define JSON_BUF_SIZE  1024
-#define JSON_CLOSE_SIZE 2
+#define PROTOCOL_BUF_SIZE               2048
+/* Closing the record and closing the batch, plus the NUL vsnprintf wants. */
+#define PROTOCOL_CLOSE_SIZE             3
+/* Publish early when a batch leaves less than this for the next interval. */
+#define PROTOCOL_BATCH_MIN_FREE         384
+#define PROTOCOL_BATCH_MAX              15
+#define PROTOCOL_PUBLISH_TIMEOUT_MS     10000
+
+#define PROTOCOL_ENCODING_JSON          0
+#define PROTOCOL_ENCODING_CBOR          1
+
+#define CBOR_MAJOR_UINT                 0
+#define CBOR_MAJOR_NINT                 1
+#define CBOR_MAJOR_TEXT                 3
+#define CBOR_MAJOR_TAG                  6
+#define CBOR_INDEFINITE_MAP             0xBF
+#define CBOR_INDEFINITE_ARRAY           0x9F
+#define CBOR_BREAK                      0xFF
+#define CBOR_TAG_DECIMAL_FRACTION       4
 
 static char _mac[16] = {0};
 
@@ -41,8 +59,21 @@ static volatile bool _cmd_ready = false;
 static bool _wifi_started = false;
 static bool _mqtt_started = false;
 
-static char _json_buf[JSON_BUF_SIZE];
-static unsigned _json_buf_pos = 0;
+/* Measurements are held here as one record per interval until a batch
+ * is published and, with QoS 1, acked by the broker. Only closed records,
+ * up to _pub_closed_pos, are kept if an interval is abandoned part way.
+ * None of them are acked to the measurements until the whole batch is,
+ * and a batch that fails is nacked and dropped as one. */
+static char _pub_buf[PROTOCOL_BUF_SIZE];
+static unsigned _pub_buf_pos = 0;
+static unsigned _pub_closed_pos = 0;
+static unsigned _pub_records = 0;
+/* An append ran out of room, so the batch can take no more intervals. */
+static bool _pub_full = false;
+
+static int _pub_inflight_id = 0;
+static uint32_t _pub_inflight_ms = 0;
+static volatile int _pub_acked_id = 0;
 
 
 typedef struct
@@ -51,7 +82,9 @@ typedef struct
     uint8_t  authmode;
     uint16_t autostart:1;
     uint16_t fwd_uart:1;
-    uint16_t _:14;
+    uint16_t encoding:2;
+    uint16_t batch:4;
+    uint16_t _:8;
     char ssid[SSID_LEN];
     char password[WFPW_LEN];
     char svr[SVR_LEN];
@@ -97,15 +130,6 @@ static bool _mqtt_send(const char * topic, const char * value, unsigned len)
 }
 
 
-static bool _mqtt_meas_send(void)
-{
-    char topic[64];
-    snprintf(topic, sizeof(topic), "osm/%s/measurements", _mac);
-    topic[sizeof(topic)-1] = 0;
-    return _mqtt_send(topic, _json_buf, 0);
-}
-
-
 static osm_wifi_config_t* _wifi_get_config(void)
 {
     comms_config_t* comms_config = &persist_data.model_config.comms_config;
@@ -148,6 +172,9 @@ static void _mqtt_event_handler(void *handler_args, esp_event_base_t base, int32
             _has_mqtt = false;
             comms_debug("MQTT disconnected.");
             break;
+        case MQTT_EVENT_PUBLISHED:
+            _pub_acked_id = event->msg_id;
+            break;
         case MQTT_EVENT_DATA:
             comms_debug("MQTT Data %.*s", event->topic_len, event->topic);
             if (_cmd_ready)
@@ -290,14 +317,47 @@ void protocol_system_init(void)
 }
 
 
+static unsigned _protocol_get_encoding(void)
+{
+    osm_wifi_config_t* osm_config = _wifi_get_config();
+    return osm_config ? osm_config->encoding : PROTOCOL_ENCODING_JSON;
+}
+
+
+static unsigned _protocol_get_batch(void)
+{
+    osm_wifi_config_t* osm_config = _wifi_get_config();
+    if (!osm_config || !osm_config->batch)
+        return 1;
+    return osm_config->batch;
+}
+
+
+static bool _protocol_is_batched(void)
+{
+    return _protocol_get_batch() > 1;
+}
+
+
+static void _protocol_buf_reset(void)
+{
+    _pub_buf_pos = 0;
+    _pub_closed_pos = 0;
+    _pub_records = 0;
+    _pub_full = false;
+}
+
 
 static bool _protocol_append_v(char * fmt, va_list ap)
 {
-    unsigned available = JSON_BUF_SIZE - _json_buf_pos;
-    unsigned r = vsnprintf(_json_buf + _json_buf_pos, available, fmt, ap);
-    if ((r + JSON_CLOSE_SIZE) >= available)
+    unsigned available = PROTOCOL_BUF_SIZE - _pub_buf_pos;
+    unsigned r = vsnprintf(_pub_buf + _pub_buf_pos, available, fmt, ap);
+    if ((r + PROTOCOL_CLOSE_SIZE) >= available)
+    {
+        _pub_full = true;
         return false;
-    _json_buf_pos += r;
+    }
+    _pub_buf_pos += r;
     return true;
 }
 
@@ -313,19 +373,118 @@ static bool _protocol_append(char * fmt, ...)
 }
 
 
+static bool _protocol_append_bytes(const void * data, unsigned len)
+{
+    if ((_pub_buf_pos + len + PROTOCOL_CLOSE_SIZE) > PROTOCOL_BUF_SIZE)
+    {
+        _pub_full = true;
+        return false;
+    }
+    memcpy(_pub_buf + _pub_buf_pos, data, len);
+    _pub_buf_pos += len;
+    return true;
+}
+
+
+static bool _cbor_append_head(uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    unsigned len;
+    major <<= 5;
+    if (value < 24)
+    {
+        head[0] = major | value;
+        len = 1;
+    }
+    else if (value <= UINT8_MAX)
+    {
+        head[0] = major | 24;
+        len = 2;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        head[0] = major | 25;
+        len = 3;
+    }
+    else if (value <= UINT32_MAX)
+    {
+        head[0] = major | 26;
+        len = 5;
+    }
+    else
+    {
+        head[0] = major | 27;
+        len = 9;
+    }
+    for (unsigned n = len - 1; n; n--)
+    {
+        head[n] = value & 0xFF;
+        value >>= 8;
+    }
+    return _protocol_append_bytes(head, len);
+}
+
+
+static bool _cbor_append_int(int64_t value)
+{
+    if (value < 0)
+        return _cbor_append_head(CBOR_MAJOR_NINT, (uint64_t)(-1 - value));
+    return _cbor_append_head(CBOR_MAJOR_UINT, value);
+}
+
+
+static bool _cbor_append_text(const char * str)
+{
+    unsigned len = strlen(str);
+    return _cbor_append_head(CBOR_MAJOR_TEXT, len) &&
+           _protocol_append_bytes(str, len);
+}
+
+
+/* Floats are held as thousandths, so send them as an exact decimal
+ * fraction, [-3, mantissa], rather than rounding through a float. */
+static bool _cbor_append_milli(int32_t value)
+{
+    return _cbor_append_head(CBOR_MAJOR_TAG, CBOR_TAG_DECIMAL_FRACTION) &&
+           _protocol_append_bytes((uint8_t[]){0x82}, 1) &&
+           _cbor_append_int(-3) &&
+           _cbor_append_int(value);
+}
+
+
 bool protocol_init(void)
 {
-    if (!_has_mqtt)
+    if (!_has_mqtt || _pub_inflight_id)
         return false;
-    _json_buf_pos = 0;
+    /* Anything after the last closed record is an abandoned interval. */
+    _pub_buf_pos = _pub_closed_pos;
+    bool batched = _protocol_is_batched();
+    if (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR)
+    {
+        if (batched && !_pub_records &&
+            !_protocol_append_bytes((uint8_t[]){CBOR_INDEFINITE_ARRAY}, 1))
+            return false;
+        return _protocol_append_bytes((uint8_t[]){CBOR_INDEFINITE_MAP}, 1);
+    }
+    if (batched)
+    {
+        if (!_protocol_append(_pub_records ? "," : "["))
+            return false;
+    }
     return _protocol_append("{");
 }
 
 
+bool protocol_init_backlog(void)
+{
+    return protocol_init();
+}
+
+
 static bool _protocol_append_meas(char * fmt, ...) PRINTF_FMT_CHECK(1, 2);
 static bool _protocol_append_meas(char * fmt, ...)
 {
-    if (_json_buf[_json_buf_pos - 1] != '{')
+    if (_pub_buf[_pub_buf_pos - 1] != '{')
         if (!_protocol_append(","))
             return false;
     va_list ap;
@@ -338,12 +497,16 @@ static bool _protocol_append_meas(char * fmt, ...)
 
 static bool _protocol_append_data_type_float(const char * name, int32_t value)
 {
+    if (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR)
+        return _cbor_append_text(name) && _cbor_append_milli(value);
     return _protocol_append_meas("\"%s\" : %"PRId32".%03ld", name, value/1000, labs(value%1000));
 }
 
 
 static bool _protocol_append_data_type_i64(const char * name, int64_t value)
 {
+    if (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR)
+        return _cbor_append_text(name) && _cbor_append_int(value);
     return _protocol_append_meas("\"%s\" : %"PRId64, name, value);
 }
 
@@ -353,7 +516,7 @@ static bool _protocol_append_value_type_float(const char * name, measurements_da
     if (data->num_samples == 1)
         return _protocol_append_data_type_float(name, data->value.value_f.sum);
     bool r = true;
-    unsigned init_pos = _json_buf_pos;
+    unsigned init_pos = _pub_buf_pos;
     int32_t mean = data->value.value_f.sum / data->num_samples;
     char tmp[MEASURE_NAME_NULLED_LEN + 4];
     r &= _protocol_append_data_type_float(name, mean);
@@ -363,7 +526,7 @@ static bool _protocol_append_value_type_float(const char * name, measurements_da
     r &= _protocol_append_data_type_float(tmp, data->value.value_f.max);
     if (!r)
     {
-        _json_buf_pos = init_pos;
+        _pub_buf_pos = init_pos;
         return false;
     }
     return true;
@@ -373,9 +536,9 @@ static bool _protocol_append_value_type_float(const char * name, measurements_da
 static bool _protocol_append_value_type_i64(const char * name, measurements_data_t* data)
 {
     if (data->num_samples == 1)
-        return _protocol_append_data_type_i64(name, data->value.value_f.sum);
+        return _protocol_append_data_type_i64(name, data->value.value_64.sum);
     bool r = true;
-    unsigned init_pos = _json_buf_pos;
+    unsigned init_pos = _pub_buf_pos;
     int64_t mean = data->value.value_64.sum / data->num_samples;
     char tmp[MEASURE_NAME_NULLED_LEN + 4];
     r &= _protocol_append_data_type_i64(name, mean);
@@ -385,7 +548,7 @@ static bool _protocol_append_value_type_i64(const char * name, measurements_data
     r &= _protocol_append_data_type_i64(tmp, data->value.value_64.max);
     if (!r)
     {
-        _json_buf_pos = init_pos;
+        _pub_buf_pos = init_pos;
         return false;
     }
     return r;
@@ -395,6 +558,14 @@ static bool _protocol_append_value_type_i64(const char * name, measurements_data
 
 static bool _protocol_append_value_type_str(const char * name, measurements_data_t* data)
 {
+    if (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR)
+    {
+        unsigned init_pos = _pub_buf_pos;
+        if (_cbor_append_text(name) && _cbor_append_text(data->value.value_s.str))
+            return true;
+        _pub_buf_pos = init_pos;
+        return false;
+    }
     return _protocol_append_meas("\"%s\" : \"%s\"", name, data->value.value_s.str);
 }
 
@@ -422,25 +593,132 @@ bool        protocol_append_measurement(measurements_def_t* def, measurements_da
 
 bool        protocol_append_instant_measurement(measurements_def_t* def, measurements_reading_t* reading, measurements_value_type_t type) { return false; }
 
+/* MQTT holds no backlog, so nothing is captured to store. */
+unsigned    protocol_get_records(int8_t** records) { return 0; }
+bool        protocol_append_backlog(uint32_t age_s, int8_t* records, unsigned len) { return false; }
+
+
+static void _protocol_sent_ack(bool acked)
+{
+    if (on_protocol_sent_ack)
+        on_protocol_sent_ack(acked);
+}
+
+
+/* The record closes were reserved for by every append, so cannot fail. */
+static void _protocol_close_record(void)
+{
+    if (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR)
+        _pub_buf[_pub_buf_pos++] = CBOR_BREAK;
+    else
+        _pub_buf[_pub_buf_pos++] = '}';
+    _pub_closed_pos = _pub_buf_pos;
+    _pub_records++;
+}
+
+
+/* Every interval in the batch is nacked together and dropped with it.
+ * Counters that were not acked carry on to the next record. */
+static void _protocol_batch_fail(void)
+{
+    if (!_pub_records)
+        return;
+    comms_debug("Dropping batch of %u records.", _pub_records);
+    _pub_inflight_id = 0;
+    _protocol_buf_reset();
+    _protocol_sent_ack(false);
+}
+
+
+/* With QoS 0 being queued is all the ack there is, else the batch is
+ * kept, and not acked, until the broker's ack for it. If it can't be
+ * queued it is kept for _protocol_publish_iteration() to try again. */
+static bool _protocol_publish(void)
+{
+    bool cbor = (_protocol_get_encoding() == PROTOCOL_ENCODING_CBOR);
+    unsigned len = _pub_closed_pos;
+    if (_protocol_is_batched())
+        _pub_buf[len++] = cbor ? CBOR_BREAK : ']';
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), "osm/%s/measurements%s", _mac, cbor ? "/cbor" : "");
+    topic[sizeof(topic)-1] = 0;
+
+    int msg_id = esp_mqtt_client_enqueue(_client, topic, _pub_buf, len, _qos, false, true);
+    if (msg_id < 0)
+    {
+        log_error("Fail to queue MQTT \"%s\"", topic);
+        return false;
+    }
+    comms_debug("Queued MQTT \"%s\" (%d) of %u records, %u bytes", topic, msg_id, _pub_records, len);
+    if (!_qos)
+    {
+        _protocol_buf_reset();
+        _protocol_sent_ack(true);
+        return true;
+    }
+    _pub_inflight_id = msg_id;
+    _pub_inflight_ms = get_since_boot_ms();
+    return true;
+}
+
+
+static bool _protocol_batch_due(void)
+{
+    return _pub_records >= _protocol_get_batch() || _pub_full ||
+           (PROTOCOL_BUF_SIZE - _pub_closed_pos) < PROTOCOL_BATCH_MIN_FREE;
+}
+
 
 void        protocol_debug(void)
 {
-    protocol_send();
+    _protocol_close_record();
+    if (!_protocol_publish())
+        _protocol_batch_fail();
 }
 
+
+/* An interval not yet due is neither acked nor nacked, the measurements
+ * keep it as sent until the batch it is in is. */
 void        protocol_send(void)
 {
-    if (!_protocol_append("}"))
+    _protocol_close_record();
+    if (!_protocol_batch_due())
+    {
+        comms_debug("Batched %u of %u.", _pub_records, _protocol_get_batch());
         return;
-    _mqtt_meas_send();
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    comms_debug("batch complete.");
+    }
+    _protocol_publish();
 }
 
 
-bool        protocol_send_ready(void) { return _has_mqtt; }
+/* Not while a batch is in flight, or due but still to be queued. */
+bool        protocol_send_ready(void)
+{
+    return _has_mqtt && !_pub_inflight_id && !(_pub_records && _protocol_batch_due());
+}
 bool        protocol_send_allowed(void) { return _has_mqtt; }
-void        protocol_reset(void) {}
+
+
+void        protocol_reset(void)
+{
+    _pub_buf_pos = _pub_closed_pos;
+    if (_pub_inflight_id || (_pub_records && _protocol_batch_due()))
+        _protocol_batch_fail();
+}
+
+
+/* Before the framing changes, send what is held as it was framed. */
+static void _protocol_flush(void)
+{
+    if (_pub_inflight_id || !_pub_records)
+        /* Already queued as it was, or nothing to send. */
+        return;
+    _pub_buf_pos = _pub_closed_pos;
+    /* Can't be kept, the next record would be framed differently. */
+    if (!_has_mqtt || !_protocol_publish())
+        _protocol_batch_fail();
+}
 
 
 bool protocol_get_connected(void)
@@ -449,6 +727,31 @@ bool protocol_get_connected(void)
 }
 
 
+static void _protocol_publish_iteration(void)
+{
+    if (_pub_inflight_id)
+    {
+        if (_pub_acked_id == _pub_inflight_id)
+        {
+            comms_debug("MQTT published (%d)", _pub_inflight_id);
+            _pub_inflight_id = 0;
+            _protocol_buf_reset();
+            _protocol_sent_ack(true);
+        }
+        else if (since_boot_delta(get_since_boot_ms(), _pub_inflight_ms) > PROTOCOL_PUBLISH_TIMEOUT_MS)
+        {
+            comms_debug("MQTT publish (%d) timed out.", _pub_inflight_id);
+            _protocol_batch_fail();
+        }
+        return;
+    }
+    /* Retry a batch that was due but could not be queued. */
+    if (_has_mqtt && _pub_records && _protocol_batch_due() &&
+        _pub_buf_pos == _pub_closed_pos)
+        _protocol_publish();
+}
+
+
 void protocol_loop_iteration(void)
 {
     if (!_wifi_started)
@@ -465,6 +768,8 @@ void protocol_loop_iteration(void)
     else if (!_mqtt_started)
         _mqtt_start();
 
+    _protocol_publish_iteration();
+
     if (!_cmd_ready)
         return;
     command_response_t resp = cmds_process(_cmd, strlen(_cmd));
@@ -630,6 +935,63 @@ static command_response_t _fwd_cb(char *args)
 }
 
 
+static command_response_t _encoding_cb(char *args)
+{
+    static const char * encodings[] = {"json", "cbor"};
+    osm_wifi_config_t* osm_config = _wifi_get_config();
+    if (!osm_config)
+        return COMMAND_RESP_ERR;
+    char * p = skip_space(args);
+    if (*p)
+    {
+        unsigned n;
+        for (n = 0; n < ARRAY_SIZE(encodings); n++)
+        {
+            if (!strcmp(encodings[n], p))
+                break;
+        }
+        if (n == ARRAY_SIZE(encodings))
+        {
+            log_out("Unknown encoding: %s", p);
+            return COMMAND_RESP_ERR;
+        }
+        if (n != osm_config->encoding)
+        {
+            /* Records already batched are in the old encoding. */
+            _protocol_flush();
+            osm_config->encoding = n;
+        }
+    }
+    log_out("MQTT encoding : %s", encodings[osm_config->encoding]);
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _batch_cb(char *args)
+{
+    osm_wifi_config_t* osm_config = _wifi_get_config();
+    if (!osm_config)
+        return COMMAND_RESP_ERR;
+    char * p = skip_space(args);
+    if (*p)
+    {
+        char * end;
+        unsigned long batch = strtoul(p, &end, 10);
+        if (end == p || !batch || batch > PROTOCOL_BATCH_MAX)
+        {
+            log_out("Batch must be 1 to %u.", PROTOCOL_BATCH_MAX);
+            return COMMAND_RESP_ERR;
+        }
+        if ((batch > 1) != _protocol_is_batched())
+            /* A lone record and a batch are framed differently. */
+            _protocol_flush();
+        osm_config->batch = batch;
+    }
+    log_out("MQTT intervals per publish : %u", _protocol_get_batch());
+    return COMMAND_RESP_OK;
+}
+
+
 static command_response_t _esp_comms_cb(char *args)
 {
     struct cmd_link_t cmds[] =
@@ -642,6 +1004,8 @@ static command_response_t _esp_comms_cb(char *args)
         { "mqtt_pw",   "Get/Set MQTT password", _mqtt_pw_cb                       , false , NULL },
         { "autostart",   "Get/Set connection auto start", _auto_start_cb                       , false , NULL },
         { "uart_fwd", "Enable/Disable UART MQTT forwarding", _fwd_cb, false , NULL },
+        { "encoding", "Get/Set measurements encoding, json/cbor", _encoding_cb, false , NULL },
+        { "batch", "Get/Set intervals per measurements publish", _batch_cb, false , NULL },
     };
     command_response_t r = COMMAND_RESP_ERR;
     if (args[0])
@@ -22,6 +22,12 @@ static QueueHandle_t uart_queues[UART_CHANNELS_COUNT];
 
 static TaskHandle_t uart_task_handles[UART_CHANNELS_COUNT];
 
+static volatile bool uart_frame_timed[UART_CHANNELS_COUNT] = {0};
+static uint8_t uart_frame_symbols[UART_CHANNELS_COUNT] = {0};
+
+#define UART_TOUT_SYMBOLS_DEFAULT   10
+#define UART_TOUT_SYMBOLS_MAX       126
+
 static void uart_event_task(void *arg)
 {
     unsigned uart = (uintptr_t)arg;
@@ -36,17 +42,27 @@ static void uart_event_task(void *arg)
         {
             if (event.type == UART_DATA)
             {
-                int read = uart_read_bytes(channel->uart, tmp, MIN(event.size,sizeof(tmp)), portMAX_DELAY);
-                for(int i=0; i < read; i++)
+                size_t left = event.size;
+                while (left)
                 {
-                    char c = tmp[i];
-                    uart_ring_in(uart, &c, 1);
-                    if (c == '\n' || c == '\r')
+                    int read = uart_read_bytes(channel->uart, tmp, MIN(left,sizeof(tmp)), portMAX_DELAY);
+                    if (read <= 0)
+                        break;
+                    left -= read;
+                    for(int i=0; i < read; i++)
                     {
-                        sleep_debug("Waking up.");
-                        sleep_exit_sleep_mode();
+                        char c = tmp[i];
+                        uart_ring_in(uart, &c, 1);
+                        if (c == '\n' || c == '\r')
+                        {
+                            sleep_debug("Waking up.");
+                            sleep_exit_sleep_mode();
+                        }
                     }
                 }
+                /* The driver's RX timeout gives this, the line has gone idle. */
+                if (event.timeout_flag && uart_frame_timed[uart])
+                    uart_ring_in_frame_end(uart);
             }
         }
     }
@@ -64,6 +80,9 @@ static void uart_setup(unsigned uart)
 
     uart_set_pin(channel->uart, channel->tx_pin, channel->rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 
+    if (uart_frame_timed[uart])
+        uart_set_rx_timeout(channel->uart, uart_frame_symbols[uart]);
+
     channel->enabled = 1;
 
     xTaskCreate(uart_event_task, "uart_event_task", 2048, (void*)(uintptr_t)uart, 12, &uart_task_handles[uart]);
@@ -200,6 +219,33 @@ bool uart_get_setup(unsigned uart, unsigned * speed, uint8_t * databits, osm_uar
 }
 
 
+bool uart_set_frame_timeout(unsigned uart, unsigned bits)
+{
+    if (uart >= UART_CHANNELS_COUNT || !uart)
+        return false;
+
+    const uart_channel_t * channel = &uart_channels[uart];
+
+    /* The driver's timeout is in whole characters and can't be off, it's how data is given. */
+    unsigned char_bits = 1 /*start*/ + ((unsigned)channel->config.data_bits + 5);
+    char_bits += (channel->config.stop_bits == UART_STOP_BITS_2)?2:1;
+    if (channel->config.parity != UART_PARITY_DISABLE)
+        char_bits++;
+
+    unsigned symbols = (bits)?((bits + char_bits - 1) / char_bits):UART_TOUT_SYMBOLS_DEFAULT;
+    if (symbols > UART_TOUT_SYMBOLS_MAX)
+        symbols = UART_TOUT_SYMBOLS_MAX;
+
+    if (uart_set_rx_timeout(channel->uart, symbols) != ESP_OK)
+        return false;
+
+    uart_frame_symbols[uart] = symbols;
+    uart_frame_timed[uart] = (bits)?true:false;
+    uart_debug(uart, "Frame timeout %u bits (%u chars)", bits, symbols);
+    return true;
+}
+
+
 bool uart_resetup_str(unsigned uart, char * str)
 {
     uint32_t         speed;
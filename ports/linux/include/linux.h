@@ -21,6 +21,7 @@ void uart_rs485_cb(char* in, unsigned len)  __attribute__((weak));
 
 void i2c_linux_deinit(void) __attribute__((weak));
 void w1_linux_deinit(void) __attribute__((weak));
+void can_linux_deinit(void) __attribute__((weak));
 
 void sys_tick_handler(void) __attribute__((weak));
 
@@ -35,6 +36,7 @@ bool socket_connect(char* path, int* _socketfd);
 
 bool peripherals_add_uart_tty_bridge(char * pty_name, unsigned uart);
 void linux_uart_proc(unsigned uart, char* in, unsigned len);
+int linux_uart_frame_poll(void);
 
 unsigned linux_spawn(const char * rel_path);
 
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+
+import sys
+import os
+import time
+import struct
+import socket_server_base as socket_server
+
+
+"""
+This program uses sockets to provide a fake CAN bus. Frames are
+periodically broadcast to the connected firmware and frames sent by the
+firmware are logged.
+
+Frame format (16 bytes, little endian):
+    uint32  id
+    uint8   flags   (bit 0: extended ID, bit 1: remote request)
+    uint8   length
+    uint8   _[2]
+    uint8   data[8]
+"""
+
+CAN_FRAME_FMT                   = "<IBBxx8s"
+CAN_FRAME_SIZE                  = struct.calcsize(CAN_FRAME_FMT)
+CAN_FLAG_EXT                    = 1 << 0
+CAN_FLAG_RTR                    = 1 << 1
+
+CAN_DEFAULT_ID                  = 0x123
+CAN_DEFAULT_PERIOD              = 1.0
+CAN_DEFAULT_TEMPERATURE         = 25.12
+
+
+class can_frame_t(object):
+    def __init__(self, id_, data, ext=False, rtr=False):
+        self.id_ = id_
+        self.data = bytes(data)
+        self.ext = ext
+        self.rtr = rtr
+
+    def pack(self):
+        flags = (CAN_FLAG_EXT if self.ext else 0) | (CAN_FLAG_RTR if self.rtr else 0)
+        return struct.pack(CAN_FRAME_FMT, self.id_, flags, len(self.data), self.data.ljust(8, b'\0'))
+
+    @staticmethod
+    def unpack(raw):
+        id_, flags, length, data = struct.unpack(CAN_FRAME_FMT, raw)
+        return can_frame_t(id_, data[:min(length, 8)], bool(flags & CAN_FLAG_EXT), bool(flags & CAN_FLAG_RTR))
+
+    def __str__(self):
+        return f"0x{self.id_:x}{' EXT' if self.ext else ''}{' RTR' if self.rtr else ''} [{', '.join(['%02x' % d for d in self.data])}]"
+
+
+class can_server_t(socket_server.socket_server_t):
+    def __init__(self, socket_loc, id_, period, temperature, log_file=None, logger=None):
+        super().__init__(socket_loc, log_file=log_file, logger=logger)
+        self.info(f"CAN SERVER INITIALISED")
+        self._id = id_
+        self._period = period
+        self._temperature = temperature
+        self._counter = 0
+        self._pending = {}
+
+    def _frame(self):
+        """ Example node, byte 0-1 temperature (signed, x100), byte 2 counter. """
+        data = struct.pack("<hB", round(self._temperature * 100), self._counter & 0xFF)
+        self._counter += 1
+        return can_frame_t(self._id, data)
+
+    def _process(self, client, raw_data):
+        fd = client.fileno()
+        raw_data = self._pending.pop(fd, b'') + raw_data
+        while len(raw_data) >= CAN_FRAME_SIZE:
+            frame = can_frame_t.unpack(raw_data[:CAN_FRAME_SIZE])
+            raw_data = raw_data[CAN_FRAME_SIZE:]
+            self.info(f"CAN << OSM {frame}")
+        if raw_data:
+            self._pending[fd] = raw_data
+
+    def run_forever(self):
+        next_send = time.monotonic() + self._period
+        try:
+            while not self._done:
+                events = self._selector.select(timeout=max(0, next_send - time.monotonic()))
+                for key, mask in events:
+                    callback = key.data
+                    callback(key.fileobj, mask)
+                if time.monotonic() >= next_send:
+                    next_send += self._period
+                    if self._clients:
+                        frame = self._frame()
+                        self.debug(f"CAN >> OSM {frame}")
+                        self._send_to_all_clients(frame.pack())
+        except KeyboardInterrupt:
+            print(self.__class__.__name__ + " : Caught keyboard interrupt, exiting")
+        finally:
+            self._selector.close()
+
+
+def main():
+    import argparse
+
+    def get_args():
+        parser = argparse.ArgumentParser(description='Fake CAN bus server.' )
+        parser.add_argument("-i", "--id", help='The CAN ID of the example frame.', type=lambda x: int(x, 0), default=CAN_DEFAULT_ID)
+        parser.add_argument("-p", "--period", help='Seconds between example frames.', type=float, default=CAN_DEFAULT_PERIOD)
+        parser.add_argument("-t", "--temperature", help='The temperature sent in the example frame.', type=float, default=CAN_DEFAULT_TEMPERATURE)
+        return parser.parse_args()
+
+    args = get_args()
+
+    can_loc = os.getenv("LOC")
+    if not can_loc:
+        can_loc = "/tmp/osm/"
+    path = os.path.join(can_loc, "can_socket")
+    can_sock = can_server_t(path, args.id, args.period, args.temperature)
+    can_sock.run_forever()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
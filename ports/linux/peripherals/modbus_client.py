@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+import os
+import sys
+import struct
+import logging
+from pymodbus.version import version
+if version.major < 3:
+    from pymodbus.client.sync import ModbusSerialClient
+else:
+    from pymodbus.client import ModbusSerialClient
+
+
+# Each measurement slot is this many registers, see core/include/modbus_slave.h
+MODBUS_SLAVE_BLOCK_REGS = 8
+MODBUS_SLAVE_NO_AGE     = 0xFFFF
+
+
+class modbus_client_t(object):
+    """ Polls an OSM in modbus slave mode ("mb_slave <unit id>").
+        Nothing else should have the port open, so not while modbus_server.py is running on it. """
+    def __init__(self, port, unit_id, baudrate=9600, logger=None):
+        if logger is None:
+            logging.basicConfig(format='%(asctime)-15s %(levelname)-8s %(message)s')
+            self._logger = log = logging.getLogger()
+            if "DEBUG" in os.environ:
+                log.setLevel(logging.DEBUG)
+            else:
+                log.setLevel(logging.CRITICAL)
+        else:
+            self._logger = logger
+        self._unit_id = unit_id
+        if version.major < 3:
+            self._client = ModbusSerialClient(method="rtu", port=port, baudrate=baudrate, timeout=1)
+        else:
+            self._client = ModbusSerialClient(port=port, baudrate=baudrate, timeout=1)
+        self._client.connect()
+
+    def _read(self, addr, count):
+        if version.major < 3:
+            resp = self._client.read_holding_registers(addr, count, unit=self._unit_id)
+        else:
+            resp = self._client.read_holding_registers(addr, count, slave=self._unit_id)
+        if resp.isError():
+            self._logger.error("Read of %u at 0x%04x failed: %s" % (count, addr, resp))
+            return None
+        return resp.registers
+
+    @staticmethod
+    def _float(regs, offset):
+        return struct.unpack(">f", struct.pack(">HH", regs[offset], regs[offset + 1]))[0]
+
+    def read_slot(self, slot):
+        regs = self._read(slot * MODBUS_SLAVE_BLOCK_REGS, MODBUS_SLAVE_BLOCK_REGS)
+        if regs is None:
+            return None
+        age = regs[6]
+        return { "last"     : self._float(regs, 0),
+                 "min"      : self._float(regs, 2),
+                 "max"      : self._float(regs, 4),
+                 "age"      : None if age == MODBUS_SLAVE_NO_AGE else age,
+                 "samples"  : regs[7] }
+
+    def close(self):
+        self._client.close()
+
+
+def main(args):
+    if len(args) < 3:
+        print("%s <unit id> <slot> [<slot> ...]" % args[0])
+        return -1
+    mb_loc = os.getenv("LOC")
+    if not mb_loc:
+        mb_loc = "/tmp/osm/"
+    client = modbus_client_t(os.path.join(mb_loc, "UART_EXT_slave"), int(args[1], 0))
+    for slot in args[2:]:
+        print(slot, client.read_slot(int(slot, 0)))
+    client.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
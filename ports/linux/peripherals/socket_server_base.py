@@ -17,9 +17,14 @@ class socket_server_t(object):
         if os.path.exists(socket_loc):
             os.unlink(socket_loc)
         self._server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-        self._server.bind(socket_loc)
+        # The firmware waits on the socket appearing, so only once listening.
+        bind_loc = socket_loc + ".bind"
+        if os.path.exists(bind_loc):
+            os.unlink(bind_loc)
+        self._server.bind(bind_loc)
         self._server.setblocking(False)
         self._server.listen(5)
+        os.rename(bind_loc, socket_loc)
 
         self._selector = selectors.PollSelector()
         self._selector.register(self._server, selectors.EVENT_READ, self._new_client_callback)
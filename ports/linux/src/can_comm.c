@@ -1,20 +1,181 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "can_comm.h"
 
+#include "common.h"
+#include "log.h"
+#include "linux.h"
+
+
+#define CAN_SERVER_LOC                                              "can_socket"
+#define CAN_COMM_BUFFER_NUM                                         10
+#define CAN_COMM_RECV_RETRY_US                                      10000
+
+#define CAN_LINUX_FLAG_EXT                                          (1 << 0)
+#define CAN_LINUX_FLAG_RTR                                          (1 << 1)
+
+
+/* Frame as exchanged with peripherals/can_server.py */
+typedef struct
+{
+    uint32_t            id;
+    uint8_t             flags;
+    uint8_t             length;
+    uint8_t             _[2];
+    can_comm_data_t     data;
+} __attribute__((__packed__)) can_linux_frame_t;
+
+
+static char             _can_comm_frame_buf[(sizeof(can_comm_frame_t) * CAN_COMM_BUFFER_NUM) + 1];
+ring_buf_t              can_comm_ring_data                      = RING_BUF_INIT(_can_comm_frame_buf, sizeof(_can_comm_frame_buf));
+static volatile bool    _can_comm_enabled                       = false;
+static volatile uint32_t _can_comm_dropped                      = 0;
+static can_comm_filter_t _can_comm_filters[CAN_COMM_FILTER_COUNT] = {0};
+static bool             _can_comm_connected                     = false;
+static int              _can_comm_socketfd;
+static pthread_t        _can_comm_thread_id;
+static volatile bool    _can_comm_running                       = false;
+
+
+/* Emulates the hardware acceptance filter banks. */
+static bool _can_comm_filter_match(can_comm_header_t* header)
+{
+    bool any_enabled = false;
+    for (unsigned i = 0; i < CAN_COMM_FILTER_COUNT; i++)
+    {
+        can_comm_filter_t* filter = &_can_comm_filters[i];
+        if (!filter->enabled)
+            continue;
+        any_enabled = true;
+        if ((bool)filter->ext != header->ext)
+            continue;
+        if ((header->id & filter->mask) == (filter->id & filter->mask))
+            return true;
+    }
+    return !any_enabled;
+}
+
+
+static void _can_comm_new_data(can_linux_frame_t* raw)
+{
+    can_comm_frame_t frame = {0};
+    frame.header.id     = raw->id;
+    frame.header.ext    = raw->flags & CAN_LINUX_FLAG_EXT;
+    frame.header.rtr    = raw->flags & CAN_LINUX_FLAG_RTR;
+    frame.header.length = MIN(raw->length, CAN_COMM_MAX_DATA_SIZE);
+    memcpy(frame.data, raw->data, frame.header.length);
+
+    if (!_can_comm_enabled || !_can_comm_filter_match(&frame.header))
+        return;
+
+    if (ring_buf_get_free(&can_comm_ring_data) < sizeof(can_comm_frame_t))
+    {
+        _can_comm_dropped++;
+        return;
+    }
+    ring_buf_add_data(&can_comm_ring_data, &frame, sizeof(can_comm_frame_t));
+}
+
+
+static void* _can_comm_thread_proc(void* vargp)
+{
+    can_linux_frame_t raw;
+    unsigned got = 0;
+    while (_can_comm_running && !linux_threads_deinit)
+    {
+        int r = recv(_can_comm_socketfd, ((uint8_t*)&raw) + got, sizeof(raw) - got, 0);
+        if (r == 0)
+            break;
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != ENOMEM)
+            {
+                log_error("Fake CAN socket failed (%d), stopping.", errno);
+                break;
+            }
+            /* Transient, don't spin on it. */
+            linux_usleep(CAN_COMM_RECV_RETRY_US);
+            continue;
+        }
+        got += r;
+        if (got < sizeof(raw))
+            continue;
+        got = 0;
+        linux_port_debug("CAN << 0x%"PRIx32" len:%"PRIu8, raw.id, raw.length);
+        _can_comm_new_data(&raw);
+    }
+    return NULL;
+}
+
 
 void can_comm_init(void)
 {
-    ;
+    char osm_can_loc[LOCATION_LEN];
+    concat_osm_location(osm_can_loc, LOCATION_LEN, CAN_SERVER_LOC);
+    _can_comm_connected = socket_connect(osm_can_loc, &_can_comm_socketfd);
+    if (!_can_comm_connected)
+    {
+        log_error("Fake CAN failed to connect to socket.");
+        return;
+    }
+    _can_comm_running = true;
+    pthread_create(&_can_comm_thread_id, NULL, _can_comm_thread_proc, NULL);
+}
+
+
+void can_linux_deinit(void)
+{
+    if (!_can_comm_connected)
+        return;
+    _can_comm_running = false;
+    pthread_join(_can_comm_thread_id, NULL);
+    close(_can_comm_socketfd);
+    _can_comm_connected = false;
 }
 
 
 void can_comm_enable(bool enabled)
 {
+    _can_comm_enabled = enabled;
+}
+
+
+bool can_comm_set_filters(can_comm_filter_t* filters, unsigned count)
+{
+    if (count > CAN_COMM_FILTER_COUNT)
+        return false;
+    memset(_can_comm_filters, 0, sizeof(_can_comm_filters));
+    memcpy(_can_comm_filters, filters, sizeof(can_comm_filter_t) * count);
+    return true;
+}
+
+
+uint32_t can_comm_get_dropped(void)
+{
+    return _can_comm_dropped;
 }
 
 
 void can_comm_send(can_comm_packet_t* pkt)
 {
+    can_debug("Sending %"PRIu32" len:%u ext:%"PRIu8" rtr:%"PRIu8, pkt->header.id, pkt->header.length, (uint8_t)pkt->header.ext, (uint8_t)pkt->header.rtr);
+    log_debug_data(DEBUG_CAN, pkt->data, pkt->header.length);
+    if (!_can_comm_connected)
+        return;
+    can_linux_frame_t raw = {0};
+    raw.id     = pkt->header.id;
+    raw.flags  = (pkt->header.ext ? CAN_LINUX_FLAG_EXT : 0) | (pkt->header.rtr ? CAN_LINUX_FLAG_RTR : 0);
+    raw.length = MIN(pkt->header.length, CAN_COMM_MAX_DATA_SIZE);
+    memcpy(raw.data, pkt->data, raw.length);
+    if (send(_can_comm_socketfd, &raw, sizeof(raw), 0) != sizeof(raw))
+        log_error("Failed to send CAN frame to fake CAN bus.");
 }
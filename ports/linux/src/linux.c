@@ -30,6 +30,7 @@
 #include "measurements.h"
 #include "platform_model.h"
 #include "pinmap.h"
+#include "energy.h"
 
 #define LINUX_PTY_BUF_SIZ       64
 #define LINUX_PTY_NAME_SIZE     16
@@ -41,6 +42,7 @@
 
 #define LINUX_PERSIST_FILE_LOC  "osm.img"
 #define LINUX_REBOOT_FILE_LOC   "reboot.dat"
+#define LINUX_ENERGY_FILE_LOC   "energy.csv"
 
 bool linux_has_reset = false;
 
@@ -381,13 +383,18 @@ static void _linux_load_fd_file(void)
         {
             fd_t* fd = &fd_list[i];
             if (!fd->name[0] || !isascii(fd->name[0]))
-                continue;
-            if (strnlen(fd->name, LINUX_PTY_NAME_SIZE-1) != name_len)
-                continue;
-            if (strncmp(fd->name, name, name_len) != 0)
+            {
+                /* A bridge added by the model, kept for when it is again. */
+                strncpy(fd->name, name, LINUX_PTY_NAME_SIZE);
+                fd->type = LINUX_FD_TYPE_PTY;
+                fd->cb = NULL;
+            }
+            else if (strnlen(fd->name, LINUX_PTY_NAME_SIZE-1) != name_len ||
+                     strncmp(fd->name, name, name_len) != 0)
                 continue;
             fd->pty.master_fd = master_fd;
             fd->pty.slave_fd = slave_fd;
+            break;
         }
     }
     fclose(osm_reboot_file);
@@ -399,7 +406,7 @@ static void _linux_rm_fd_file(void)
 {
     char osm_reboot_loc[LOCATION_LEN];
     concat_osm_location(osm_reboot_loc, LOCATION_LEN, LINUX_REBOOT_FILE_LOC);
-    remove(LINUX_REBOOT_FILE_LOC);
+    remove(osm_reboot_loc);
 }
 
 
@@ -530,6 +537,7 @@ static void _linux_exit(int err)
     fprintf(stdout, "Cleaning up before exit...\n");
     i2c_linux_deinit();
     w1_linux_deinit();
+    can_linux_deinit();
     _linux_cleanup_fd_handlers();
     model_linux_close_fakes();
     fprintf(stdout, "Finished.\n");
@@ -602,13 +610,16 @@ bool peripherals_add_uart_tty_bridge(char * pty_name, unsigned uart)
     for (uint32_t i = 0; i < ARRAY_SIZE(fd_list); i++)
     {
         fd_t* fd = &fd_list[i];
-        if (!fd->name[0] || !isascii(fd->name[0]))
+        bool reopened = (fd->type == LINUX_FD_TYPE_PTY && strncmp(fd->name, pty_name, LINUX_PTY_NAME_SIZE) == 0);
+        if (reopened || !fd->name[0] || !isascii(fd->name[0]))
         {
             strncpy(fd->name, pty_name, LINUX_PTY_NAME_SIZE);
             fd->type = LINUX_FD_TYPE_PTY;
             fd->pty.uart = uart;
             fd->cb = linux_uart_proc;
-            _linux_setup_pty(fd->name, &fd->pty.master_fd, &fd->pty.slave_fd);
+            /* Kept over a reset, as is the symlink to it. */
+            if (!reopened)
+                _linux_setup_pty(fd->name, &fd->pty.master_fd, &fd->pty.slave_fd);
             linux_port_debug("UART %u is now %s%s_slave", uart, ret_static_file_location(), pty_name);
             _linux_setup_poll();
             return true;
@@ -620,7 +631,8 @@ bool peripherals_add_uart_tty_bridge(char * pty_name, unsigned uart)
 
 void _linux_iterate(void)
 {
-    int ready = poll(pfds, nfds, 1000);
+    int frame_ms = linux_uart_frame_poll();
+    int ready = poll(pfds, nfds, (frame_ms < 0)?1000:frame_ms);
     if (linux_threads_deinit)
         return;
     if (ready == -1 && _linux_running)
@@ -799,6 +811,7 @@ void platform_reset_sys(void)
     fprintf(stdout, "Cleaning up before exit...\n");
     i2c_linux_deinit();
     w1_linux_deinit();
+    can_linux_deinit();
     model_linux_close_fakes();
 
     char link_addr[128];
@@ -864,12 +877,50 @@ bool platform_persist_commit(persist_storage_t* persist_data, persist_measuremen
         memcpy(&_linux_persist_mem.persist_data, persist_data, sizeof(persist_storage_t));
     if (persist_measurements != &_linux_persist_mem.persist_measurements)
         memcpy(&_linux_persist_mem.persist_measurements, persist_measurements, sizeof(persist_measurements_storage_t));
+    uint32_t start_ms = get_since_boot_ms();
     fwrite(&_linux_persist_mem, sizeof(_linux_persist_mem), 1, mem_file);
     fclose(mem_file);
+    energy_add(ENERGY_FLASH, since_boot_delta(get_since_boot_ms(), start_ms));
     return true;
 }
 
 
+/* One row per interval, then one per measurement, so it can be loaded
+ * as is to find where the time awake went. */
+void energy_trace(const energy_interval_t* interval)
+{
+    char energy_loc[LOCATION_LEN];
+    concat_osm_location(energy_loc, LOCATION_LEN, LINUX_ENERGY_FILE_LOC);
+    FILE* energy_file = fopen(energy_loc, "a");
+    if (!energy_file)
+        return;
+    uint32_t now = get_since_boot_ms();
+    if (!ftell(energy_file))
+        fprintf(energy_file, "time_ms,name,ms,init_ms,iterate_ms,collect_ms,collects\n");
+    uint32_t sleep_ms = interval->source_ms[ENERGY_SLEEP];
+    fprintf(energy_file, "%"PRIu32",interval,%"PRIu32",,,,\n", now, interval->duration_ms);
+    fprintf(energy_file, "%"PRIu32",awake,%"PRIu32",,,,\n", now, (interval->duration_ms > sleep_ms)?(interval->duration_ms - sleep_ms):0);
+    fprintf(energy_file, "%"PRIu32",sleep,%"PRIu32",,,,\n", now, sleep_ms);
+    fprintf(energy_file, "%"PRIu32",tx,%"PRIu32",,,,\n", now, interval->source_ms[ENERGY_TX]);
+    fprintf(energy_file, "%"PRIu32",flash,%"PRIu32",,,,\n", now, interval->source_ms[ENERGY_FLASH]);
+    fprintf(energy_file, "%"PRIu32",unaccounted,%"PRIu32",,,,\n", now, interval->unaccounted_ms);
+    for (unsigned i = 0; i < ENERGY_MEAS_MAX; i++)
+    {
+        const energy_meas_t* meas = &interval->meas[i];
+        const char* name = energy_meas_name(i);
+        if (!name)
+            continue;
+        fprintf(energy_file, "%"PRIu32",%s,%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu16"\n",
+            now, name, meas->active_ms,
+            meas->phase_ms[ENERGY_PHASE_INIT],
+            meas->phase_ms[ENERGY_PHASE_ITERATE],
+            meas->phase_ms[ENERGY_PHASE_COLLECT],
+            meas->collects);
+    }
+    fclose(energy_file);
+}
+
+
 void platform_persist_wipe(void)
 {
     memset(&_linux_persist_mem, 0, sizeof(persist_mem_t));
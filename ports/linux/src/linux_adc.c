@@ -288,3 +288,10 @@ void platform_adc_set_num_data(unsigned num_data)
 {
     _adcs_num_data = num_data;
 }
+
+
+uint32_t platform_adc_get_sample_period_ns(void)
+{
+    /* The fake waves are made as if the whole buffer took a second. */
+    return (_adcs_num_data)?(1000000000 / _adcs_num_data):0;
+}
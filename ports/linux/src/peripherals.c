@@ -12,14 +12,17 @@
 #define FAKE_HPM_SERVER     "peripherals/hpm_virtual.py"
 #define FAKE_MODBUS_SERVER  "peripherals/modbus_server.py"
 #define FAKE_CMD_SERVER     "peripherals/command_server.py"
+#define FAKE_CAN_SERVER     "peripherals/can_server.py"
 
 
 #define FAKE_HPM_TTY           "UART_HPM"
 #define FAKE_MODBUS_TTY        "UART_EXT"
+#define FAKE_MODBUS2_TTY       "UART_EXT2"
 #define FAKE_CMD_TTY           "UART_CMD"
 
 #define FAKE_I2C_SOCKET        "i2c_socket"
 #define FAKE_1W_SOCKET         "w1_socket"
+#define FAKE_CAN_SOCKET        "can_socket"
 
 
 void peripherals_add_modbus(unsigned uart, unsigned* pid)
@@ -29,6 +32,13 @@ void peripherals_add_modbus(unsigned uart, unsigned* pid)
 }
 
 
+/* Just the port, what is on the second bus is up to whoever opens it. */
+void peripherals_add_modbus2(unsigned uart)
+{
+    peripherals_add_uart_tty_bridge(FAKE_MODBUS2_TTY, uart);
+}
+
+
 void peripherals_add_hpm(unsigned uart, unsigned* pid)
 {
     peripherals_add_uart_tty_bridge(FAKE_HPM_TTY, uart);
@@ -56,6 +66,14 @@ void peripherals_add_i2c(unsigned timeout_us, unsigned* pid)
 }
 
 
+void peripherals_add_can(unsigned timeout_us, unsigned* pid)
+{
+    char can_socket[LOCATION_LEN];
+    concat_osm_location(can_socket, LOCATION_LEN, FAKE_CAN_SOCKET);
+    peripherals_add(FAKE_CAN_SERVER, can_socket, timeout_us, pid);
+}
+
+
 bool peripherals_add(const char * app_rel_path, const char * ready_path, unsigned timeout_us, unsigned* pid)
 {
     unlink(ready_path);
@@ -1,11 +1,62 @@
 #include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "pulsecount.h"
+#include "pulsecount_stats.h"
+
+#include "log.h"
+#include "common.h"
+#include "pinmap.h"
+#include "linux.h"
 
 
 #define PULSECOUNT_COLLECTION_TIME_MS       1000;
 
 
+/* No pulses on Linux but those added with pulse_add. */
+typedef struct
+{
+    char                name[MEASURE_NAME_NULLED_LEN];
+    unsigned            io;
+    uint32_t            count;
+    uint32_t            send_count;
+    char                rate_name[MEASURE_NAME_NULLED_LEN];
+    char                ival_name[MEASURE_NAME_NULLED_LEN];
+    pulsecount_edges_t  edges;
+    pulsecount_stats_t  stats[PULSECOUNT_STATS_COUNT];
+} pulsecount_instance_t;
+
+
+static pulsecount_instance_t _pulsecount_instances[] =
+{
+    { MEASUREMENTS_PULSE_COUNT_NAME_1, W1_PULSE_1_IO, 0, 0, MEASUREMENTS_PULSE_RATE_NAME_1, MEASUREMENTS_PULSE_IVAL_NAME_1, {{0}, 0, 0}, {{0}} },
+    { MEASUREMENTS_PULSE_COUNT_NAME_2, W1_PULSE_2_IO, 0, 0, MEASUREMENTS_PULSE_RATE_NAME_2, MEASUREMENTS_PULSE_IVAL_NAME_2, {{0}, 0, 0}, {{0}} },
+};
+
+
+static void _pulsecount_instance_reset(pulsecount_instance_t* instance)
+{
+    instance->count = 0;
+    instance->send_count = 0;
+    memset((void*)&instance->edges, 0, sizeof(instance->edges));
+    memset(instance->stats, 0, sizeof(instance->stats));
+    for (unsigned k = 0; k < PULSECOUNT_STATS_COUNT; k++)
+        instance->stats[k].start_ms = get_since_boot_ms();
+}
+
+
+static pulsecount_instance_t* _pulsecount_get_by_io(unsigned io)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        if (_pulsecount_instances[i].io == io)
+            return &_pulsecount_instances[i];
+    }
+    return NULL;
+}
+
+
 void pulsecount_init(void)
 {
 }
@@ -13,6 +64,9 @@ void pulsecount_init(void)
 
 void pulsecount_enable(unsigned io, bool enable, io_pupd_t pupd, io_special_t edge)
 {
+    pulsecount_instance_t* instance = _pulsecount_get_by_io(io);
+    if (instance)
+        _pulsecount_instance_reset(instance);
     if (enable)
         pulsecount_init();
 }
@@ -20,6 +74,12 @@ void pulsecount_enable(unsigned io, bool enable, io_pupd_t pupd, io_special_t ed
 
 void pulsecount_log()
 {
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* instance = &_pulsecount_instances[i];
+        if (io_is_pulsecount_now(instance->io))
+            log_out("IO %02u : pulsecount %"PRIu32, instance->io, instance->count);
+    }
 }
 
 
@@ -34,20 +94,48 @@ static measurements_sensor_state_t _pulsecount_collection_time(char* name, uint3
 }
 
 
+static bool _pulsecount_get_instance(pulsecount_instance_t** instance, char* name)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        if (strncmp(name, inst->name, MEASURE_NAME_LEN) == 0 && io_is_pulsecount_now(inst->io))
+        {
+            *instance = inst;
+            return true;
+        }
+    }
+    return false;
+}
+
+
 static measurements_sensor_state_t _pulsecount_begin(char* name, bool in_isolation)
 {
+    pulsecount_instance_t* instance;
+    if (!_pulsecount_get_instance(&instance, name))
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
     return MEASUREMENTS_SENSOR_STATE_SUCCESS;
 }
 
 
 static measurements_sensor_state_t _pulsecount_get(char* name, measurements_reading_t* value)
 {
-    return MEASUREMENTS_SENSOR_STATE_ERROR;
+    pulsecount_instance_t* instance;
+    if (!value || !_pulsecount_get_instance(&instance, name))
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    instance->send_count = instance->count;
+    value->v_i64 = (int64_t)instance->send_count;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
 }
 
 
 static void _pulsecount_ack(char* name)
 {
+    pulsecount_instance_t* instance;
+    if (!_pulsecount_get_instance(&instance, name))
+        return;
+    instance->count -= instance->send_count;
+    instance->send_count = 0;
 }
 
 
@@ -67,7 +155,110 @@ void     pulsecount_inf_init(measurements_inf_t* inf)
 }
 
 
+static bool _pulsecount_get_stats_instance(pulsecount_instance_t** instance, char* name, pulsecount_stats_kind_t* kind)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        bool rate = strncmp(name, inst->rate_name, MEASURE_NAME_LEN) == 0;
+        if ((rate || strncmp(name, inst->ival_name, MEASURE_NAME_LEN) == 0) && io_is_pulsecount_now(inst->io))
+        {
+            *instance = inst;
+            *kind = (rate)?PULSECOUNT_STATS_RATE:PULSECOUNT_STATS_IVAL;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void pulsecount_drain(void)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        if (io_is_pulsecount_now(inst->io))
+            pulsecount_stats_drain(&inst->edges, inst->stats);
+    }
+}
+
+
+static measurements_sensor_state_t _pulsecount_stats_get_summary(char* name, measurements_value_t* value, uint8_t* num_samples)
+{
+    pulsecount_instance_t* instance;
+    pulsecount_stats_kind_t kind;
+    if (!value || !num_samples || !_pulsecount_get_stats_instance(&instance, name, &kind))
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    pulsecount_stats_drain(&instance->edges, instance->stats);
+    if (!pulsecount_stats_summary(&instance->stats[kind], get_since_boot_ms(), kind, value, num_samples))
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _pulsecount_stats_get(char* name, measurements_reading_t* value)
+{
+    if (!value)
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    measurements_value_t summary;
+    uint8_t num_samples;
+    measurements_sensor_state_t r = _pulsecount_stats_get_summary(name, &summary, &num_samples);
+    if (r == MEASUREMENTS_SENSOR_STATE_SUCCESS)
+        value->v_i64 = summary.value_64.sum / num_samples;
+    return r;
+}
+
+
+static void _pulsecount_stats_ack(char* name)
+{
+    pulsecount_instance_t* instance;
+    pulsecount_stats_kind_t kind;
+    if (!_pulsecount_get_stats_instance(&instance, name, &kind))
+        return;
+    pulsecount_stats_drain(&instance->edges, instance->stats);
+    pulsecount_stats_restart(&instance->stats[kind], get_since_boot_ms());
+}
+
+
+void     pulsecount_stats_inf_init(measurements_inf_t* inf)
+{
+    inf->collection_time_cb = _pulsecount_collection_time;
+    inf->get_cb             = _pulsecount_stats_get;
+    inf->get_summary_cb     = _pulsecount_stats_get_summary;
+    inf->acked_cb           = _pulsecount_stats_ack;
+    inf->value_type_cb      = _pulsecount_value_type;
+}
+
+
+static command_response_t _pulse_add_cb(char* args)
+{
+    /* <io> <count> [<gap us>]
+     * Edges as if the last was now and each gap us after the one before,
+     * written to the ring as the edge interrupt would.
+     */
+    char* p;
+    unsigned io = strtoul(args, &p, 10);
+    pulsecount_instance_t* instance = _pulsecount_get_by_io(io);
+    if (p == args || !instance || !io_is_pulsecount_now(io))
+    {
+        log_out("pulse_add <io> <count> [<gap us>] on a pulsecount IO");
+        return COMMAND_RESP_ERR;
+    }
+    unsigned count = strtoul(p, &p, 10);
+    unsigned gap_us = strtoul(p, NULL, 10);
+    uint32_t now = (uint32_t)linux_get_current_us();
+    for (unsigned n = 0; n < count; n++)
+    {
+        instance->count++;
+        pulsecount_edges_add(&instance->edges, now - (count - 1 - n) * gap_us);
+    }
+    log_out("IO %02u : pulsecount %"PRIu32, io, instance->count);
+    return COMMAND_RESP_OK;
+}
+
+
 struct cmd_link_t* pulsecount_add_commands(struct cmd_link_t* tail)
 {
-    return tail;
+    static struct cmd_link_t cmds[] = {{ "pulse_add",   "Add fake pulses to a pulsecount IO", _pulse_add_cb , false , NULL }};
+    return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
@@ -10,6 +10,7 @@
 #include "common.h"
 #include "uart_rings.h"
 #include "measurements.h"
+#include "energy.h"
 #include "adcs.h"
 #include "platform.h"
 #include "linux.h"
@@ -76,7 +77,10 @@ bool sleep_for_ms(uint32_t ms)
     count = (ms * 1000) / (SLEEP_LSI_CLK_FREQ_KHZ * (1 << div_shift));
 turn_on_sleep:
     _sleep_before_sleep();
+    /* Only the time actually asleep, not turning things off and back on. */
+    uint32_t    asleep_time = get_since_boot_ms();
     linux_usleep(ms * 1000);
+    energy_add(ENERGY_SLEEP, since_boot_delta(get_since_boot_ms(), asleep_time));
     _sleep_on_wakeup();
     sleep_debug("Woken back up after %"PRIu32"ms.", since_boot_delta(get_since_boot_ms(), before_time));
     return true;
@@ -10,19 +10,33 @@
 #include "sleep.h"
 #include "log.h"
 #include "pinmap.h"
+#include "common.h"
 
 
+#ifdef EXT2_UART
+#define UART_CHANNELS_LINUX_EXT2                                                                \
+    { UART_4_SPEED, UART_4_DATABITS, UART_4_PARITY, UART_4_STOP, true, 0}, /* UART 4 2nd 485 */
+#else
+#define UART_CHANNELS_LINUX_EXT2
+#endif
+
 #define UART_CHANNELS_LINUX                                                                     \
 {                                                                                               \
     { UART_2_SPEED, UART_2_DATABITS, UART_2_PARITY, UART_2_STOP, true, 0}, /* UART 0 Debug */   \
     { UART_3_SPEED, UART_3_DATABITS, UART_3_PARITY, UART_3_STOP, true, 0}, /* UART 1 LoRa */    \
     { UART_1_SPEED, UART_1_DATABITS, UART_1_PARITY, UART_1_STOP, true, 0}, /* UART 2 HPM */     \
     { UART_4_SPEED, UART_4_DATABITS, UART_4_PARITY, UART_4_STOP, true, 0}, /* UART 3 485 */     \
+    UART_CHANNELS_LINUX_EXT2                                                                    \
 }
 
 
 static uart_channel_t uart_channels[] = UART_CHANNELS_LINUX;
 
+/* Inter-byte timer standing in for the USART receiver timeout. */
+static uint32_t _uart_frame_timeout_ms[UART_CHANNELS_COUNT] = {0};
+static uint32_t _uart_last_rx_ms[UART_CHANNELS_COUNT]       = {0};
+static bool     _uart_in_frame[UART_CHANNELS_COUNT]         = {0};
+
 
 void linux_uart_proc(unsigned uart, char* in, unsigned len)
 {
@@ -30,6 +44,11 @@ void linux_uart_proc(unsigned uart, char* in, unsigned len)
         return;
 
     uart_ring_in(uart, in, len);
+    if (_uart_frame_timeout_ms[uart])
+    {
+        _uart_last_rx_ms[uart] = get_since_boot_ms();
+        _uart_in_frame[uart] = true;
+    }
     for (unsigned i = 0; i < len; i++)
     {
         if (in[i] == '\n' || in[i] == '\r')
@@ -41,6 +60,30 @@ void linux_uart_proc(unsigned uart, char* in, unsigned len)
 }
 
 
+/* Ends any frames idle long enough, returns ms until the next could end or -1. */
+int linux_uart_frame_poll(void)
+{
+    int next = -1;
+    uint32_t now = get_since_boot_ms();
+    for (unsigned uart = 0; uart < UART_CHANNELS_COUNT; uart++)
+    {
+        if (!_uart_in_frame[uart])
+            continue;
+        uint32_t idle = since_boot_delta(now, _uart_last_rx_ms[uart]);
+        if (idle >= _uart_frame_timeout_ms[uart])
+        {
+            _uart_in_frame[uart] = false;
+            uart_ring_in_frame_end(uart);
+            continue;
+        }
+        int left = _uart_frame_timeout_ms[uart] - idle;
+        if (next < 0 || left < next)
+            next = left;
+    }
+    return next;
+}
+
+
 void uarts_setup(void)
 {
 }
@@ -108,6 +151,23 @@ bool uart_get_setup(unsigned uart, unsigned * speed, uint8_t * databits, osm_uar
 }
 
 
+bool uart_set_frame_timeout(unsigned uart, unsigned bits)
+{
+    if (uart >= UART_CHANNELS_COUNT)
+        return false;
+
+    unsigned baud = uart_channels[uart].baud;
+    if (!baud)
+        return false;
+
+    /* Only millisecond resolution here, so round up. */
+    _uart_frame_timeout_ms[uart] = (bits)?((bits * 1000 + baud - 1) / baud):0;
+    _uart_in_frame[uart] = false;
+    uart_debug(uart, "Frame timeout %u bits (%"PRIu32"ms)", bits, _uart_frame_timeout_ms[uart]);
+    return true;
+}
+
+
 bool uart_resetup_str(unsigned uart, char * str)
 {
     uint32_t         speed;
@@ -70,9 +70,11 @@
 #define MODBUS_TIM      TIM2
 #define MODBUS_RST_TIM  RST_TIM2
 
-#define CAN_RCC_TIM     RCC_TIM3
-#define CAN_TIM         TIM3
-#define CAN_RST_TIM     RST_TIM3
+/* LPUART1 has no receiver timeout, this one-shot stands in for it. */
+#define UART_FRAME_TIM          TIM7
+#define UART_FRAME_RCC_TIM      RCC_TIM7
+#define UART_FRAME_TIM_IRQ      NVIC_TIM7_IRQ
+#define UART_FRAME_TIM_ISR      tim7_isr
 
 
 #define SAI_PORT_N_PINS                    \
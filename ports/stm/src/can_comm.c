@@ -8,7 +8,6 @@
 
 #include <libopencm3/stm32/can.h>
 #include <libopencm3/stm32/rcc.h>
-#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
 
 #include "can_comm.h"
@@ -18,6 +17,13 @@
 
 
 #define CAN_COMM_BUFFER_NUM                                         10
+#define CAN_COMM_FIFO                                               0
+#define CAN_COMM_FILTER_BANK_NUM                                    14
+
+/* 32 bit filter bank register layout. */
+#define CAN_COMM_FILTER_STD_SHIFT                                   21
+#define CAN_COMM_FILTER_EXT_SHIFT                                   3
+#define CAN_COMM_FILTER_IDE                                         (1 << 2)
 
 
 typedef struct
@@ -35,27 +41,15 @@ typedef struct
 static can_comm_config_t _can_comm_config                       = CAN_CONFIG;
 
 
-static can_comm_data_t  _can_comm_data_arr[CAN_COMM_BUFFER_NUM] = {0};
-ring_buf_t              can_comm_ring_data                      = RING_BUF_INIT((volatile char *)_can_comm_data_arr, sizeof(can_comm_data_t));
+static char             _can_comm_frame_buf[(sizeof(can_comm_frame_t) * CAN_COMM_BUFFER_NUM) + 1];
+ring_buf_t              can_comm_ring_data                      = RING_BUF_INIT(_can_comm_frame_buf, sizeof(_can_comm_frame_buf));
 static bool             _can_comm_enabled                       = false;
+static volatile uint32_t _can_comm_dropped                      = 0;
 
 
-static void _can_comm_clk_init(void)
+static void _can_comm_accept_all(void)
 {
-    rcc_periph_clock_enable(CAN_RCC_TIM);
-
-    timer_disable_counter(CAN_TIM);
-
-    timer_set_mode(CAN_TIM,
-                   TIM_CR1_CKD_CK_INT,
-                   TIM_CR1_CMS_EDGE,
-                   TIM_CR1_DIR_UP);
-
-    timer_set_prescaler(CAN_TIM, rcc_ahb_frequency / 10000-1);//-1 because it starts at zero, and interrupts on the overflow
-    timer_set_period(CAN_TIM, 5);
-    timer_enable_preload(CAN_TIM);
-    timer_continuous_mode(CAN_TIM);
-    timer_enable_irq(CAN_TIM, TIM_DIER_CC1IE);
+    can_filter_id_mask_32bit_init(0, 0, 0, CAN_COMM_FIFO, true);
 }
 
 
@@ -143,45 +137,55 @@ void can_comm_init(void)
 
     gpio_clear(can_stdby->port, can_stdby->pins);
 
-    /*
-     Must use a timer as STM32L451 does not support CAN interrupts, UGH!
-    */
-    _can_comm_clk_init();
+    _can_comm_accept_all();
+
     if (_can_comm_enabled)
-        timer_enable_counter(CAN_TIM);
+        can_enable_irq(_can_comm_config.unit, CAN_IER_FMPIE0);
 
-    nvic_enable_irq(NVIC_TIM3_IRQ);
+    nvic_enable_irq(NVIC_CAN1_RX0_IRQ);
 }
 
 
-static bool _can_comm_new_data(can_comm_packet_t* pkt)
+static void _can_comm_new_data(can_comm_packet_t* pkt)
 {
-    // Need to check if length is size of packet or the size of data.
-    if (!ring_buf_add_data(&can_comm_ring_data, &pkt->header, sizeof(can_comm_header_t)))
-        return false;
-    return ring_buf_add_data(&can_comm_ring_data, pkt->data, pkt->header.length);
+    /* Only queue whole frames so the reader never sees half a frame. */
+    if (ring_buf_get_free(&can_comm_ring_data) < sizeof(can_comm_frame_t))
+    {
+        _can_comm_dropped++;
+        return;
+    }
+    can_comm_frame_t frame = {.header = pkt->header};
+    memcpy(frame.data, pkt->data, pkt->header.length);
+    ring_buf_add_data(&can_comm_ring_data, &frame, sizeof(can_comm_frame_t));
 }
 
 
-void tim3_isr(void)
+void can1_rx0_isr(void)
 {
-    timer_clear_flag(CAN_TIM, TIM_SR_CC1IF);
+    uint32_t unit = _can_comm_config.unit;
 
-    can_comm_packet_t pkt;
-    uint8_t data[CAN_COMM_MAX_DATA_SIZE];
-    pkt.data = data;
+    if (CAN_RF0R(unit) & CAN_RF0R_FOVR0)
+    {
+        /* Hardware FIFO overran before it was emptied. */
+        CAN_RF0R(unit) = CAN_RF0R_FOVR0;
+        _can_comm_dropped++;
+    }
 
-    can_receive(_can_comm_config.unit, 0, false, &pkt.header.id, &pkt.header.ext, &pkt.header.rtr, &pkt.header.fmi, &pkt.header.length, pkt.data, NULL);
+    while (CAN_RF0R(unit) & CAN_RF0R_FMP0_MASK)
+    {
+        can_comm_packet_t pkt;
+        uint8_t data[CAN_COMM_MAX_DATA_SIZE];
+        pkt.data = data;
 
-    can_fifo_release(_can_comm_config.unit, 0);
+        can_receive(unit, CAN_COMM_FIFO, false, &pkt.header.id, &pkt.header.ext, &pkt.header.rtr, &pkt.header.fmi, &pkt.header.length, pkt.data, NULL);
 
-    if (pkt.header.length > CAN_COMM_MAX_DATA_SIZE)
-        pkt.header.length = CAN_COMM_MAX_DATA_SIZE;
+        can_fifo_release(unit, CAN_COMM_FIFO);
 
-    // Unused bool func
-    _can_comm_new_data(&pkt);
-    if (!_can_comm_enabled)
-        timer_disable_counter(CAN_TIM);
+        if (pkt.header.length > CAN_COMM_MAX_DATA_SIZE)
+            pkt.header.length = CAN_COMM_MAX_DATA_SIZE;
+
+        _can_comm_new_data(&pkt);
+    }
 }
 
 
@@ -189,7 +193,50 @@ void can_comm_enable(bool enabled)
 {
     _can_comm_enabled = enabled;
     if (enabled)
-        timer_enable_counter(CAN_TIM);
+        can_enable_irq(_can_comm_config.unit, CAN_IER_FMPIE0);
+    else
+        can_disable_irq(_can_comm_config.unit, CAN_IER_FMPIE0);
+}
+
+
+bool can_comm_set_filters(can_comm_filter_t* filters, unsigned count)
+{
+    if (count > CAN_COMM_FILTER_BANK_NUM)
+        return false;
+    unsigned bank = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        can_comm_filter_t* filter = &filters[i];
+        if (!filter->enabled)
+            continue;
+        uint32_t id, mask;
+        if (filter->ext)
+        {
+            id   = ((filter->id   & CAN_COMM_EXT_ID_MASK) << CAN_COMM_FILTER_EXT_SHIFT) | CAN_COMM_FILTER_IDE;
+            mask = ((filter->mask & CAN_COMM_EXT_ID_MASK) << CAN_COMM_FILTER_EXT_SHIFT) | CAN_COMM_FILTER_IDE;
+        }
+        else
+        {
+            id   = (filter->id   & CAN_COMM_STD_ID_MASK) << CAN_COMM_FILTER_STD_SHIFT;
+            mask = ((filter->mask & CAN_COMM_STD_ID_MASK) << CAN_COMM_FILTER_STD_SHIFT) | CAN_COMM_FILTER_IDE;
+        }
+        can_debug("Filter bank %u id:0x%"PRIx32" mask:0x%"PRIx32, bank, id, mask);
+        can_filter_id_mask_32bit_init(bank++, id, mask, CAN_COMM_FIFO, true);
+    }
+    if (!bank)
+    {
+        _can_comm_accept_all();
+        bank = 1;
+    }
+    for (; bank < CAN_COMM_FILTER_BANK_NUM; bank++)
+        can_filter_id_mask_32bit_init(bank, 0, 0, CAN_COMM_FIFO, false);
+    return true;
+}
+
+
+uint32_t can_comm_get_dropped(void)
+{
+    return _can_comm_dropped;
 }
 
 
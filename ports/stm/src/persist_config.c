@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "config.h"
 #include "log.h"
@@ -20,11 +21,33 @@ persist_storage_t               persist_data __attribute__((aligned (16)));
 persist_measurements_storage_t  persist_measurements __attribute__((aligned (16)));
 
 
+/* The version before had no CAN config, which was added to the end of
+ * the model config, the rest is laid out as it was. */
+static bool _persist_migrate_pre_can(persist_storage_t* persist_data_raw)
+{
+    if (persist_data_raw->version != PERSIST_VERSION - 1)
+        return false;
+    unsigned prefix = offsetof(persist_storage_t, model_config) + offsetof(persist_model_config_t, can_config);
+    memcpy(&persist_data, persist_data_raw, prefix);
+    can_impl_setup_default_mem(&persist_data.model_config.can_config, sizeof(can_impl_config_t));
+    memcpy(&persist_data.config_count, ((uint8_t*)persist_data_raw) + prefix, sizeof(persist_data.config_count));
+    persist_data.version = PERSIST_VERSION;
+    log_error("Persistent data moved from version %u.", PERSIST_VERSION - 1);
+    return true;
+}
+
+
 bool persistent_init(void)
 {
     persist_storage_t* persist_data_raw = platform_get_raw_persist();
     persist_measurements_storage_t* persist_measurements_raw = platform_get_measurements_raw_persist();
 
+    if (persist_data_raw && persist_measurements_raw && _persist_migrate_pre_can(persist_data_raw))
+    {
+        memcpy(&persist_measurements, persist_measurements_raw, sizeof(persist_measurements));
+        return true;
+    }
+
     if (!persist_data_raw || !persist_measurements_raw || persist_data_raw->version != PERSIST_VERSION)
     {
         log_error("Persistent data version unknown.");
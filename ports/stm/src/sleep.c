@@ -15,6 +15,7 @@
 #include "common.h"
 #include "uart_rings.h"
 #include "measurements.h"
+#include "energy.h"
 #include "pinmap.h"
 #include "adcs.h"
 #include "i2c.h"
@@ -139,8 +140,11 @@ bool sleep_for_ms(uint32_t ms)
     count16 = count;
 turn_on_sleep:
     _sleep_before_sleep();
+    /* Only the time actually asleep, not turning things off and back on. */
+    uint32_t    asleep_time = get_since_boot_ms();
     _sleep_setup_tim(count16, (div_shift << LPTIM_CFGR_PRESC_SHIFT));
     _sleep_enter_sleep_mode();
+    energy_add(ENERGY_SLEEP, since_boot_delta(get_since_boot_ms(), asleep_time));
     _sleep_on_wakeup();
     sleep_debug("Woken back up after %"PRIu32"ms.", since_boot_delta(get_since_boot_ms(), before_time));
     return true;
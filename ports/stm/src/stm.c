@@ -19,8 +19,10 @@
 #include "platform_model.h"
 #include "comms.h"
 #include "sleep.h"
+#include "common.h"
 
 #include "adcs.h"
+#include "energy.h"
 
 
 #define ADC_CCR_PRESCALE_1     0x0  /* 0b0000 */
@@ -230,11 +232,20 @@ persist_measurements_storage_t* platform_get_measurements_raw_persist(void)
 }
 
 
+/* Erases stall the core for tens of ms, the biggest cost of a save. */
+static void _stm_flash_erase_page(uint32_t page)
+{
+    uint32_t start_ms = get_since_boot_ms();
+    flash_erase_page(page);
+    energy_add(ENERGY_FLASH, since_boot_delta(get_since_boot_ms(), start_ms));
+}
+
+
 bool platform_persist_commit(persist_storage_t* persist_data, persist_measurements_storage_t* persist_measurements)
 {
     flash_unlock();
-    flash_erase_page(FLASH_CONFIG_PAGE);
-    flash_erase_page(FLASH_MEASUREMENTS_PAGE);
+    _stm_flash_erase_page(FLASH_CONFIG_PAGE);
+    _stm_flash_erase_page(FLASH_MEASUREMENTS_PAGE);
     flash_set_data(PERSIST_RAW_DATA, persist_data, sizeof(persist_storage_t));
     flash_set_data(PERSIST_RAW_MEASUREMENTS, persist_measurements, sizeof(persist_measurements_storage_t));
     flash_lock();
@@ -246,8 +257,8 @@ bool platform_persist_commit(persist_storage_t* persist_data, persist_measuremen
 void platform_persist_wipe(void)
 {
     flash_unlock();
-    flash_erase_page(FLASH_CONFIG_PAGE);
-    flash_erase_page(FLASH_MEASUREMENTS_PAGE);
+    _stm_flash_erase_page(FLASH_CONFIG_PAGE);
+    _stm_flash_erase_page(FLASH_MEASUREMENTS_PAGE);
     flash_lock();
 }
 
@@ -255,7 +266,7 @@ void platform_persist_wipe(void)
 bool platform_overwrite_fw_page(uintptr_t dst, unsigned abs_page, uint8_t* fw_page)
 {
     flash_unlock();
-    flash_erase_page(abs_page);
+    _stm_flash_erase_page(abs_page);
     flash_program(dst, fw_page, FLASH_PAGE_SIZE);
     flash_lock();
 
@@ -350,6 +361,13 @@ void platform_adc_set_num_data(unsigned num_data)
 }
 
 
+uint32_t platform_adc_get_sample_period_ns(void)
+{
+    /* As _stm_setup_adc_unit(), (640.5 + 12.5) cycles of (80Mhz / 64). */
+    return (653 * 64 * 1000) / 80;
+}
+
+
 void platform_hpm_enable(bool enable)
 {
     port_n_pins_t port_n_pin = HPM_EN_PIN;
@@ -7,6 +7,7 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/syscfg.h>
 #include <libopencm3/cm3/nvic.h>
 
@@ -24,6 +25,11 @@ static uart_channel_t uart_channels[UART_CHANNELS_COUNT] = UART_CHANNELS;
 
 static volatile bool uart_doing_dma[UART_CHANNELS_COUNT] = {0};
 
+static uint32_t _uart_frame_timeout_bits[UART_CHANNELS_COUNT] = {0};
+
+/* The UART timed by UART_FRAME_TIM, or zero for none. */
+static volatile unsigned _uart_frame_tim_uart = 0;
+
 
 static uint32_t _uart_get_parity(osm_uart_parity_t parity)
 {
@@ -105,6 +111,87 @@ static void uart_up(const uart_channel_t * channel)
 }
 
 
+/* LPUART has no receiver timeout, so a one-shot timer is restarted on
+ * each byte received and ends the frame when it runs out. */
+static void _uart_frame_tim_up(const uart_channel_t * channel, uint32_t bits)
+{
+    timer_disable_counter(UART_FRAME_TIM);
+    timer_disable_irq(UART_FRAME_TIM, TIM_DIER_UIE);
+
+    if (!bits)
+    {
+        _uart_frame_tim_uart = 0;
+        return;
+    }
+
+    uint32_t us = (uint32_t)(((uint64_t)bits * 1000000 + channel->baud - 1) / channel->baud);
+    if (us > UINT16_MAX)
+        us = UINT16_MAX;
+
+    rcc_periph_clock_enable(UART_FRAME_RCC_TIM);
+    timer_set_mode(UART_FRAME_TIM,
+                   TIM_CR1_CKD_CK_INT,
+                   TIM_CR1_CMS_EDGE,
+                   TIM_CR1_DIR_UP);
+    timer_set_prescaler(UART_FRAME_TIM, rcc_ahb_frequency / 1000000-1);
+    timer_set_period(UART_FRAME_TIM, us);
+    timer_one_shot_mode(UART_FRAME_TIM);
+    /* Only running out interrupts, not the restarts. */
+    timer_update_on_overflow(UART_FRAME_TIM);
+    timer_generate_event(UART_FRAME_TIM, TIM_EGR_UG);
+    timer_clear_flag(UART_FRAME_TIM, TIM_SR_UIF);
+
+    _uart_frame_tim_uart = channel - uart_channels;
+
+    nvic_set_priority(UART_FRAME_TIM_IRQ, channel->priority);
+    nvic_enable_irq(UART_FRAME_TIM_IRQ);
+    timer_enable_irq(UART_FRAME_TIM, TIM_DIER_UIE);
+}
+
+
+static void _uart_frame_tim_restart(void)
+{
+    TIM_CNT(UART_FRAME_TIM) = 0;
+    timer_enable_counter(UART_FRAME_TIM);
+}
+
+
+// cppcheck-suppress unusedFunction ; System handler
+void UART_FRAME_TIM_ISR(void)
+{
+    if (!timer_get_flag(UART_FRAME_TIM, TIM_SR_UIF))
+        return;
+    timer_clear_flag(UART_FRAME_TIM, TIM_SR_UIF);
+    if (_uart_frame_tim_uart)
+        uart_ring_in_frame_end(_uart_frame_tim_uart);
+}
+
+
+/* RTOR is 24 bits. */
+static void _uart_frame_timeout_up(const uart_channel_t * channel, uint32_t bits)
+{
+    uint32_t usart = channel->usart;
+
+    if (usart == LPUART1)
+    {
+        _uart_frame_tim_up(channel, bits);
+        return;
+    }
+
+    if (!bits)
+    {
+        USART_CR1(usart) &= ~USART_CR1_RTOIE;
+        USART_CR2(usart) &= ~USART_CR2_RTOEN;
+        return;
+    }
+
+    USART_RTOR(usart) = bits & 0xFFFFFF;
+    USART_ICR(usart) = USART_ICR_RTOCF;
+    USART_CR2(usart) |= USART_CR2_RTOEN;
+    USART_CR1(usart) |= USART_CR1_RTOIE;
+}
+
+
 static void uart_setup(uart_channel_t * channel)
 {
     rcc_periph_clock_enable(PORT_TO_RCC(channel->gpioport));
@@ -123,6 +210,7 @@ static void uart_setup(uart_channel_t * channel)
     nvic_enable_irq(channel->irqn);
     usart_enable(channel->usart);
     usart_enable_rx_interrupt(channel->usart);
+    _uart_frame_timeout_up(channel, _uart_frame_timeout_bits[channel - uart_channels]);
 
     if (channel->dma_irqn)
     {
@@ -145,6 +233,8 @@ void uart_enable(unsigned uart, bool enable)
 
     if (!enable)
     {
+        if (channel->usart == LPUART1)
+            _uart_frame_tim_up(channel, 0);
         usart_disable_rx_interrupt(channel->usart);
         usart_disable(channel->usart);
         rcc_periph_clock_disable(channel->uart_clk);
@@ -193,6 +283,9 @@ void uart_resetup(unsigned uart, unsigned speed, uint8_t databits, osm_uart_pari
     channel->stop = stop;
 
     uart_up(channel);
+    /* The stand in receiver timeout is timed from the baud rate. */
+    if (channel->enabled && channel->usart == LPUART1)
+        _uart_frame_tim_up(channel, _uart_frame_timeout_bits[uart]);
 
     uart_debug(uart, "%u %"PRIu8"%c%s",
             (unsigned)channel->baud, channel->databits, osm_uart_parity_as_char(channel->parity), osm_uart_stop_bits_as_str(channel->stop));
@@ -222,6 +315,23 @@ extern bool uart_get_setup(unsigned uart, unsigned * speed, uint8_t * databits,
 }
 
 
+bool uart_set_frame_timeout(unsigned uart, unsigned bits)
+{
+    if (uart >= UART_CHANNELS_COUNT || !uart)
+        return false;
+
+    uart_channel_t * channel = &uart_channels[uart];
+
+    _uart_frame_timeout_bits[uart] = bits;
+
+    if (channel->enabled)
+        _uart_frame_timeout_up(channel, bits);
+
+    uart_debug(uart, "Frame timeout %u bits", bits);
+    return true;
+}
+
+
 bool uart_resetup_str(unsigned uart, char * str)
 {
     uint32_t         speed;
@@ -270,12 +380,21 @@ static void process_serial(unsigned uart)
     if (!channel->enabled)
         return;
 
+    /* Idle after the last byte, so anything already in the ring is the frame. */
+    if (USART_ISR(channel->usart) & USART_ISR_RTOF)
+    {
+        USART_ICR(channel->usart) = USART_ICR_RTOCF;
+        uart_ring_in_frame_end(uart);
+    }
+
     char c;
 
     if (!uart_getc(channel->usart, &c))
         return;
 
     uart_ring_in(uart, &c, 1);
+    if (uart == _uart_frame_tim_uart)
+        _uart_frame_tim_restart();
     if (c == '\n' || c == '\r')
     {
         sleep_debug("Waking up.");
@@ -6,14 +6,21 @@
 #include "base_types.h"
 #include "measurements.h"
 
+/* Most commands a batch's results can report, one bit each. */
+#define PROTOCOL_CMD_RESULTS_MAX    24
+
 void        protocol_system_init(void);
 
 bool        protocol_init(void);
+bool        protocol_init_backlog(void);
 bool        protocol_append_measurement(measurements_def_t* def, measurements_data_t* data);
 bool        protocol_append_instant_measurement(measurements_def_t* def, measurements_reading_t* reading, measurements_value_type_t type);
 void        protocol_debug(void);
 void        protocol_send(void);
 void        protocol_send_error_code(uint8_t err_code);
+void        protocol_send_cmd_results(uint8_t count, uint32_t ok_mask);
+unsigned    protocol_get_records(int8_t** records);
+bool        protocol_append_backlog(uint32_t age_s, int8_t* records, unsigned len);
 
 void        protocol_loop_iteration(void);
 
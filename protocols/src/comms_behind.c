@@ -15,3 +15,10 @@ bool        protocol_get_id(char* str, uint8_t len) { return comms_get_id(str, l
 struct cmd_link_t* protocol_add_commands(struct cmd_link_t* tail)   { return comms_add_commands(tail); }
 
 void        protocol_power_down(void)   { comms_power_down(); }
+
+/* Weak, so a model or comms that wants the acks itself still can. */
+__attribute__((weak)) void on_comms_sent_ack(bool acked)
+{
+    if (on_protocol_sent_ack)
+        on_protocol_sent_ack(acked);
+}
@@ -6,12 +6,17 @@
 #include "log.h"
 #include "measurements.h"
 #include "comms.h"
+#include "protocol.h"
 #include "platform_model.h"
 
 static int8_t                       _measurements_hex_arr[PROTOCOL_HEX_ARRAY_SIZE]   = {0};
 
 #define PROTOCOL_SEND_STR_LEN               8
 #define PROTOCOL_ERR_CODE_NAME                  "ERR"
+#define PROTOCOL_BACKLOG_AGE_NAME               "AGE"
+#define PROTOCOL_CMD_RESULTS_NAME               "CMDS"
+/* Name, datatype, value type and up to a uint32 of seconds. */
+#define PROTOCOL_BACKLOG_AGE_SIZE               (MEASURE_NAME_LEN + 1 + 1 + sizeof(uint32_t))
 
 
 #define PROTOCOL_SEND_IS_SIGNED             0x10
@@ -57,7 +62,8 @@ static bool _protocol_append_i8(int8_t val)
 
     if (_protocol_ctx.pos >= _protocol_ctx.buflen)
     {
-        log_error("Protocol buffer is full.");
+        /* Expected while packing, the caller tries elsewhere. */
+        measurements_debug("Protocol buffer is full.");
         return false;
     }
     _protocol_ctx.buf[_protocol_ctx.pos++] = val;
@@ -255,16 +261,17 @@ bool protocol_append_measurement(measurements_def_t* def, measurements_data_t* d
 }
 
 
-static bool _protocol_append_error_code(uint8_t err_code)
+/* A single integer reading the firmware makes up itself. */
+static bool _protocol_append_single(const char* name_str, int64_t value)
 {
     unsigned before_pos = _protocol_ctx.pos;
 
     bool r = false;
-    char name[MEASURE_NAME_NULLED_LEN] = PROTOCOL_ERR_CODE_NAME;
+    char name[MEASURE_NAME_NULLED_LEN] = {0};
+    strncpy(name, name_str, MEASURE_NAME_LEN);
     r |= !_protocol_append_i32(*(int32_t*)name);
     r |= !_protocol_append_i8(MEASUREMENTS_DATATYPE_SINGLE);
-    int64_t err_code64 = err_code;
-    r |= !_protocol_append_data_type_i64(&err_code64);
+    r |= !_protocol_append_data_type_i64(&value);
     if (r)
     {
         _protocol_ctx.pos = before_pos;
@@ -280,7 +287,20 @@ bool protocol_append_instant_measurement(measurements_def_t* def, measurements_r
         .value_type     = type,
         .num_samples    = 1,
     };
-    memcpy(&data.value, reading, sizeof(measurements_value_type_t));
+    switch(type)
+    {
+        case MEASUREMENTS_VALUE_TYPE_I64:
+            data.value.value_64.sum = reading->v_i64;
+            break;
+        case MEASUREMENTS_VALUE_TYPE_FLOAT:
+            data.value.value_f.sum = reading->v_f32;
+            break;
+        case MEASUREMENTS_VALUE_TYPE_STR:
+            strncpy(data.value.value_s.str, reading->v_str, MEASUREMENTS_VALUE_STR_LEN - 1);
+            break;
+        default:
+            break;
+    }
     return protocol_append_measurement(def, &data);
 }
 
@@ -303,9 +323,30 @@ static bool _protocol_init(int8_t* buf, unsigned buflen)
 }
 
 
+/* What fits in an uplink at the current data rate, capped to the array. */
+static unsigned _protocol_get_mtu(void)
+{
+    unsigned mtu = comms_get_mtu();
+    if (!mtu || mtu > PROTOCOL_HEX_ARRAY_SIZE)
+        return PROTOCOL_HEX_ARRAY_SIZE;
+    return mtu;
+}
+
+
 bool protocol_init(void)
 {
-    return _protocol_init(_measurements_hex_arr, PROTOCOL_HEX_ARRAY_SIZE);
+    return _protocol_init(_measurements_hex_arr, _protocol_get_mtu());
+}
+
+
+/* As protocol_init, but leaving room for the age the records are sent
+ * behind later. */
+bool protocol_init_backlog(void)
+{
+    unsigned mtu = _protocol_get_mtu();
+    if (mtu <= PROTOCOL_BACKLOG_AGE_SIZE + 1)
+        return false;
+    return _protocol_init(_measurements_hex_arr, mtu - PROTOCOL_BACKLOG_AGE_SIZE);
 }
 
 
@@ -315,6 +356,34 @@ static unsigned _protocol_get_length(void)
 }
 
 
+unsigned    protocol_get_records(int8_t** records)
+{
+    /* Skip the payload version. */
+    if (!_protocol_ctx.buf || _protocol_ctx.pos < 1)
+        return 0;
+    *records = _protocol_ctx.buf + 1;
+    return _protocol_ctx.pos - 1;
+}
+
+
+/* Records of an earlier interval, after an age measurement (in seconds)
+ * marking where they start. Only appended whole. */
+bool        protocol_append_backlog(uint32_t age_s, int8_t* records, unsigned len)
+{
+    unsigned before_pos = _protocol_ctx.pos;
+
+    if (!_protocol_append_single(PROTOCOL_BACKLOG_AGE_NAME, age_s) ||
+        (_protocol_ctx.pos + len) > _protocol_ctx.buflen)
+    {
+        _protocol_ctx.pos = before_pos;
+        return false;
+    }
+    memcpy(_protocol_ctx.buf + _protocol_ctx.pos, records, len);
+    _protocol_ctx.pos += len;
+    return true;
+}
+
+
 void        protocol_debug(void)
 {
     for (unsigned j = 0; j < _protocol_get_length(); j++)
@@ -328,7 +397,7 @@ void        protocol_send(void)
 }
 
 
-void        protocol_send_error_code(uint8_t err_code)
+static void _protocol_send_single(const char* name, int64_t value)
 {
     /* Immediate sent, so temporary use a different memory buffer for protocol. */
     int8_t arr[15] = {0};
@@ -339,7 +408,24 @@ void        protocol_send_error_code(uint8_t err_code)
         comms_debug("Could not init memory protocol.");
         return;
     }
-    _protocol_append_error_code(err_code);
+    _protocol_append_single(name, value);
     comms_send(arr, _protocol_get_length());
     _protocol_ctx = org; /* Restore normal memory buffer for protocol. */
 }
+
+
+void        protocol_send_error_code(uint8_t err_code)
+{
+    _protocol_send_single(PROTOCOL_ERR_CODE_NAME, err_code);
+}
+
+
+/* Results of a batch of commands in one reading: the count in the top
+ * byte, then a bit per command, set if it went OK. */
+void        protocol_send_cmd_results(uint8_t count, uint32_t ok_mask)
+{
+    if (count > PROTOCOL_CMD_RESULTS_MAX)
+        count = PROTOCOL_CMD_RESULTS_MAX;
+    ok_mask &= (1UL << PROTOCOL_CMD_RESULTS_MAX) - 1;
+    _protocol_send_single(PROTOCOL_CMD_RESULTS_NAME, ((int64_t)count << PROTOCOL_CMD_RESULTS_MAX) | ok_mask);
+}
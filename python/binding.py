@@ -12,6 +12,7 @@ import weakref
 import string
 import random
 import json
+import base64
 
 
 MODBUS_REG_SET_ADDR_SUCCESSFUL_PATTERN = "Successfully set (?P<dev_name>.{1,4})\((?P<unit_id>0x[0-9]+)\):(?P<reg_addr>0x[0-9A-Fa-f]+) = (?P<type>(U16)|(I16)|(U32)|(I32)|(FLOAT)):(?P<value>[0-9]+.[0-9]+)"
@@ -20,6 +21,15 @@ MODBUS_REG_SET_NAME_SUCCESSFUL_PATTERN = "Successfully set (?P<dev_name>.{1,4})\
 _RESPONSE_BEGIN = "============{"
 _RESPONSE_END = "}============"
 
+_CMD_LINELEN = 128
+_CMD_BATCH_SEPARATOR = ";"
+_CMD_SEQ_TAG = "#"
+_CMD_SEQ_MOD = 100000
+_START_LINE = "----start----"
+_CFG_IMG_CHUNK = 72
+_TAGGED_RESPONSE_BEGIN_PATTERN = re.escape(_RESPONSE_BEGIN + _CMD_SEQ_TAG) + r"(?P<seq>[0-9]+)$"
+_TAGGED_RESPONSE_END_PATTERN = re.escape(_RESPONSE_END + _CMD_SEQ_TAG) + r"(?P<seq>[0-9]+) (?P<resp>OK|ERR) (?P<free>[0-9]+)$"
+
 
 def app_key_generator(size=32, chars=string.hexdigits):
     """ Technically this will do upper and lowercase letters so the
@@ -217,10 +227,11 @@ class low_level_dev_t(object):
         self._log_obj = log_obj
         self.fileno = serial_obj.fileno
 
-    def write(self, msg):
+    def write(self, msg, delay=0.2):
         self._log_obj.send(msg)
         self._serial.write(("%s\n" % msg).encode())
-        time.sleep(0.2)
+        if delay:
+            time.sleep(delay)
 
     def read(self):
         try:
@@ -256,6 +267,106 @@ class low_level_dev_t(object):
             now = time.monotonic()
         return msgs
 
+class cmd_result_t(object):
+    def __init__(self, cmd):
+        self.cmd = cmd
+        self.ok = None
+        self.lines = []
+
+    def __str__(self):
+        return f'{self.cmd}: {"OK" if self.ok else "ERR"} {self.lines}'
+
+
+class pipeline_t(object):
+    """
+    Streams commands tagged "#<seq> <cmd>" and matches the tagged
+    responses to them. The bytes in flight (sent but not answered) are
+    kept within the free space the firmware reports for its CMD UART
+    input ring, as it only removes a line from the ring before answering.
+    """
+    def __init__(self, ll):
+        self._ll = ll
+        self._seq = 0
+        self._window = None
+
+    def restarted(self):
+        """ The firmware reset, its ring may be a different size now. """
+        self._window = None
+
+    @staticmethod
+    def _seq_before(a: int, b: int) -> bool:
+        """ Sequence numbers wrap, so a is older if up to half way behind. """
+        return 0 < (b - a) % _CMD_SEQ_MOD < _CMD_SEQ_MOD // 2
+
+    def run(self, cmds: list, timeout: float = 1.5) -> list:
+        results = [cmd_result_t(cmd) for cmd in cmds]
+        in_flight = {}
+        in_flight_bytes = 0
+        current = None
+        n = 0
+        deadline = time.monotonic() + timeout
+        while n < len(results) or in_flight:
+            while n < len(results):
+                seq = (self._seq + 1) % _CMD_SEQ_MOD
+                line = f"{_CMD_SEQ_TAG}{seq} {results[n].cmd}"
+                size = len(line) + 1
+                # Until the window is known, only one command in flight.
+                window = self._window if self._window is not None else size
+                if in_flight and in_flight_bytes + size > window:
+                    break
+                self._seq = seq
+                self._ll.write(line, delay=0)
+                in_flight[self._seq] = (results[n], size)
+                in_flight_bytes += size
+                n += 1
+            now = time.monotonic()
+            if now > deadline:
+                debug_print("Pipeline timeout.")
+                break
+            r = select.select([self._ll], [], [], deadline - now)
+            if not r[0]:
+                continue
+            msg = self._ll.read()
+            if msg is None:
+                continue
+            msg = msg.strip("\n\r")
+            if _START_LINE in msg:
+                # Reset, nothing in flight will be answered.
+                debug_print("OSM reset'ed, pipeline restarted.")
+                self.restarted()
+                for result, size in in_flight.values():
+                    result.ok = False
+                in_flight = {}
+                in_flight_bytes = 0
+                current = None
+                continue
+            begin = re.match(_TAGGED_RESPONSE_BEGIN_PATTERN, msg)
+            if begin:
+                current = in_flight.get(int(begin.group("seq")), None)
+                continue
+            end = re.match(_TAGGED_RESPONSE_END_PATTERN, msg)
+            if end:
+                seq = int(end.group("seq"))
+                # Answered in order, so anything older lost its end line.
+                for lost in [k for k in in_flight if self._seq_before(k, seq)]:
+                    result, size = in_flight.pop(lost)
+                    result.ok = False
+                    in_flight_bytes -= size
+                entry = in_flight.pop(seq, None)
+                if entry:
+                    result, size = entry
+                    result.ok = end.group("resp") == "OK"
+                    in_flight_bytes -= size
+                    if self._window is None:
+                        self._window = int(end.group("free"))
+                current = None
+                deadline = time.monotonic() + timeout
+                continue
+            if current:
+                current[0].lines += [msg]
+        return results
+
+
 class io_t(dev_child_t):
     def __init__(self, parent, index):
         super().__init__(parent)
@@ -342,6 +453,7 @@ class dev_base_t(object):
         self._log = self._log_obj.emit
         self._ll = low_level_dev_t(self._serial_obj, self._log_obj)
         self.fileno = self._ll.fileno
+        self._pipeline = pipeline_t(self._ll)
 
     def drain(self):
         while True:
@@ -464,7 +576,9 @@ class dev_t(dev_base_t):
         return self.do_cmd(f"ftma_name {name} {meas}")
 
     def get_meas_timeout(self, meas):
-        line = self.do_cmd(f"get_meas_to {meas}")
+        return self._parse_meas_timeout(meas, self.do_cmd(f"get_meas_to {meas}"))
+
+    def _parse_meas_timeout(self, meas, line):
         if line.startswith(meas):
             parts = line.split(":")
             if len(parts) == 2:
@@ -519,6 +633,32 @@ class dev_t(dev_base_t):
         debug_print("No response start found.")
         return None
 
+    def do_cmd_batch(self, cmds: list, timeout: float = 1.5) -> list:
+        """ Send several commands per line, separated by ';', keeping each
+        line inside the firmware's command line length. The firmware stops
+        a line at the first failing command. """
+        lines = []
+        line = ""
+        for cmd in cmds:
+            if line and len(line) + len(cmd) + 1 >= _CMD_LINELEN:
+                lines += [line]
+                line = ""
+            line = f"{line}{_CMD_BATCH_SEPARATOR}{cmd}" if line else cmd
+        if line:
+            lines += [line]
+        r = []
+        for line in lines:
+            resp = self.do_cmd_multi(line, timeout)
+            if resp is None:
+                return None
+            r += resp
+        return r
+
+    def do_cmds_pipelined(self, cmds: list, timeout: float = 1.5) -> list:
+        """ Stream commands without waiting for each response, returns a
+        cmd_result_t per command in the same order. """
+        return self._pipeline.run(cmds, timeout)
+
     def read_ftma_coeffs(self, meas):
         coeffs = self.do_cmd(f"ftma_coeff {meas}")
         print(coeffs)
@@ -564,7 +704,7 @@ class dev_t(dev_base_t):
 
         if lines:
             for line in lines:
-                if line.startswith("Modbus"):
+                if line.startswith("Modbus @"):
                     bus_config = line.split()[2:]
                 elif line.startswith("- Device"):
                     unit_id, name, byteorder, wordorder = line.split()[3:]
@@ -604,18 +744,18 @@ class dev_t(dev_base_t):
         if r:
             return int(r[-1])
 
-    def modbus_dev_add(self, slave_id: int, device: str, is_msb: bool, is_msw: bool) -> bool:
+    def modbus_dev_add(self, slave_id: int, device: str, is_msb: bool, is_msw: bool, bus: int = 0) -> bool:
         is_msb = "MSB" if is_msb else "LSB"
         is_msw = "MSW" if is_msw else "LSW"
-        r = self.do_cmd(f"mb_dev_add {slave_id} {is_msb} {is_msw} {device}", timeout=3)
+        r = self.do_cmd(f"mb_dev_add {slave_id} {is_msb} {is_msw} {device} {bus}", timeout=3)
         return "Added modbus device" in r
 
-    def modbus_reg_add(self, slave_id: int, reg: modbus_reg_t) -> bool:
+    def modbus_reg_add(self, slave_id: int, reg: modbus_reg_t, bus: int = 0) -> bool:
         if not isinstance(reg, modbus_reg_t):
             self._log("Registers should be an object of register")
             return False
         r = self.do_cmd(
-            f"mb_reg_add {slave_id} {hex(reg.address)} {reg.func} {reg.mb_type_} {reg.name}")
+            f"mb_reg_add {slave_id} {hex(reg.address)} {reg.func} {reg.mb_type_} {reg.name} {bus}")
         if r:
             reg.timeout = self.get_meas_timeout(reg.name)
         self._children[reg.name] = reg
@@ -625,14 +765,23 @@ class dev_t(dev_base_t):
         is_bin = "BIN" if is_bin else "RTU"
         self.do_cmd(f"mb_setup {is_bin} {baudrate} {bits}{parity}{stopbits}")
 
-    def setup_modbus_dev(self, slave_id: int, device: str, is_msb: bool, is_msw: bool, regs: list) -> bool:
-        if not self.modbus_dev_add(slave_id, device, is_msb, is_msw):
+    def setup_modbus_dev(self, slave_id: int, device: str, is_msb: bool, is_msw: bool, regs: list, bus: int = 0) -> bool:
+        if not self.modbus_dev_add(slave_id, device, is_msb, is_msw, bus):
             self._log("Could not add device.")
             return False
-        for reg in regs:
-            self.modbus_reg_add(slave_id, reg)
+        cmds  = [f"mb_reg_add {slave_id} {hex(reg.address)} {reg.func} {reg.mb_type_} {reg.name} {bus}" for reg in regs]
+        cmds += [f"get_meas_to {reg.name}" for reg in regs]
+        results = self.do_cmds_pipelined(cmds, timeout=3)
+        added, timeouts = results[:len(regs)], results[len(regs):]
+        r = True
+        for reg, add, to in zip(regs, added, timeouts):
+            if not add.ok:
+                self._log(f"Could not add register {reg.name}.")
+                r = False
+                continue
+            reg.timeout = self._parse_meas_timeout(reg.name, "".join(to.lines))
             self._children[reg.name] = reg
-        return True
+        return r
 
     def modbus_dev_del(self, device: str):
         self.do_cmd(f"mb_dev_del {device}")
@@ -711,18 +860,61 @@ class dev_t(dev_base_t):
         r = self.do_cmd("fw@ %04x" % crc)
         assert "FW added" in r
 
-    def reset(self, timeout=5):
-        self._ll.write('reset')
+    def config_dump(self) -> bytes:
+        """ Binary image of the config, see persist_img_t in firmware. """
+        data = b""
+        size = None
+        while size is None or len(data) < size:
+            r = self.do_cmd_multi(f"cfg_dump {len(data)}")
+            if not r:
+                return None
+            chunk = b""
+            for line in r:
+                if line.startswith("Image: "):
+                    size = int(line.split()[1])
+                elif re.match("^[A-Za-z0-9+/]+={0,2}$", line):
+                    chunk += base64.b64decode(line)
+            if size is None or not chunk:
+                return None
+            data += chunk
+        return data
+
+    def config_load(self, data: bytes, timeout=5) -> bool:
+        """ Load an image from config_dump(), the device resets to apply it. """
+        cmds = []
+        for n in range(0, len(data), _CFG_IMG_CHUNK):
+            chunk = base64.b64encode(data[n:n + _CFG_IMG_CHUNK]).decode()
+            cmds += [f"cfg+ {n} {chunk}"]
+        for result in self.do_cmds_pipelined(cmds):
+            if not result.ok:
+                debug_print(f"Config chunk failed : {result}")
+                return False
+        self._ll.write("cfg@")
+        # Only answered if not loaded, otherwise it resets.
+        return self._wait_for_start(timeout, {"Config already matches" : True,
+                                              _RESPONSE_END : False})
+
+    def _wait_for_start(self, timeout, others={}):
         end_time = time.time() + timeout
         while time.time() < end_time:
             r = select.select([self],[],[], 1)
             if len(r[0]):
                 line = self._ll.read()
-                if '----start----' in line:
+                if line is None:
+                    continue
+                if _START_LINE in line:
                     debug_print("OSM reset'ed")
+                    self._pipeline.restarted()
                     return True
+                for other, result in others.items():
+                    if other in line:
+                        return result
         return False
 
+    def reset(self, timeout=5):
+        self._ll.write('reset')
+        return self._wait_for_start(timeout)
+
 
 class dev_debug_t(dev_base_t):
     def __init__(self, port):
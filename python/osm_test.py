@@ -202,6 +202,23 @@ class test_framework_t(object):
                  self._bool_check("Device EUI is a valid type.",
                                   isinstance(deveui, str) and deveui=="LINUX-DEV", True))
 
+    def _check_config_image(self):
+        img = self._vosm_conn.config_dump()
+        app_key = self._vosm_conn.app_key
+        dev_eui = self._vosm_conn.dev_eui
+        self._vosm_conn.app_key = "OTHER-APP"
+        self._vosm_conn.dev_eui = "OTHER-DEV"
+        self._vosm_conn.interval_mins = 5
+        self._vosm_conn.save()
+        passed = self._bool_check("Config image loaded.", self._vosm_conn.config_load(img, 10), True)
+        passed &= self._check_interval_mins_val()
+        passed &= self._str_check("Application key kept over config image.", self._vosm_conn.app_key, "OTHER-APP")
+        passed &= self._str_check("Device EUI kept over config image.", self._vosm_conn.dev_eui, "OTHER-DEV")
+        self._vosm_conn.app_key = app_key
+        self._vosm_conn.dev_eui = dev_eui
+        self._vosm_conn.save()
+        return passed
+
     def _check_cc_val(self):
         passed = True
         cc_g = self._vosm_conn.print_cc_gain
@@ -234,6 +251,7 @@ class test_framework_t(object):
         self._vosm_conn.interval_mins = 1
         passed &= self._check_interval_mins_val()
         passed &= self._check_lora_config_val()
+        passed &= self._check_config_image()
         passed &= self._check_cc_val()
         self._vosm_conn.measurements_enable(False)
         self._vosm_conn.PM10.interval = 1
@@ -1,6 +1,49 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "measurements.h"
+#include "can_comm.h"
+
+
+#define CAN_IMPL_SIGNAL_COUNT                               8
+
+
+/* Signal extracted from a received frame as a measurement:
+ *   value = raw(data[byte_offset...], bit_length) * scale
+ * Frames of another DLC are ignored, 0 as configs before had it is any. */
+typedef struct
+{
+    uint32_t    id;
+    float       scale;
+    char        name[MEASURE_NAME_NULLED_LEN];
+    uint8_t     byte_offset;
+    uint8_t     bit_length;
+    uint8_t     ext:1;
+    uint8_t     is_signed:1;
+    uint8_t     is_big_endian:1;
+    uint8_t     dlc:4;
+    uint8_t     _:1;
+} __attribute__((__packed__)) can_impl_signal_t;
+
+
+typedef struct
+{
+    can_comm_filter_t   filters[CAN_COMM_FILTER_COUNT];
+    /* 16 byte boundary ---- */
+    can_impl_signal_t   signals[CAN_IMPL_SIGNAL_COUNT];
+    /* 16 byte boundary ---- */
+} __attribute__((__packed__)) can_impl_config_t;
+
+_Static_assert((sizeof(can_comm_filter_t) * CAN_COMM_FILTER_COUNT) % 16 == 0 &&
+               sizeof(can_impl_signal_t) == 16,
+               "CAN config blocks broken.");
+
+
 extern void can_impl_init(void);
-extern void can_impl_send(uint32_t id, uint8_t* data, unsigned len);
+extern bool can_impl_send(uint32_t id, uint8_t* data, unsigned len);
 extern void can_impl_send_example(void);
+extern void can_impl_inf_init(measurements_inf_t* inf);
+extern void can_impl_setup_default_mem(can_impl_config_t* memory, unsigned size);
 extern struct cmd_link_t* can_impl_add_commands(struct cmd_link_t* tail);
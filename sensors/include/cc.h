@@ -5,6 +5,9 @@
 #include "measurements.h"
 
 
+#define CC_RESISTOR_OHM                     22
+
+
 typedef struct
 {
     uint32_t midpoint;
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+
+#define FTMA_CONV_FRAC_BITS             16
+/* Input is normalised to this many bits of a whole, microvolts fit in 22. */
+#define FTMA_CONV_IN_BITS               22
+
+
+/* Coefficients pre-scaled for a fixed point Horner of normalised microvolts
+ * giving microamps, which is the f32 format of a milliamp measurement. */
+typedef struct
+{
+    int64_t     coeffs[FTMA_NUM_COEFFS];    /* Q FTMA_CONV_FRAC_BITS */
+    bool        is_fixed;                   /* Else too big for fixed point, done in float. */
+    float       float_coeffs[FTMA_NUM_COEFFS];
+} ftma_conv_t;
+
+
+extern void     ftma_conv_setup(ftma_conv_t* conv, const float coeffs[FTMA_NUM_COEFFS]);
+extern int32_t  ftma_conv_float(const float coeffs[FTMA_NUM_COEFFS], uint32_t uV);
+extern int32_t  ftma_conv_uV(const ftma_conv_t* conv, uint32_t uV);
+extern void     ftma_conv_batch(const ftma_conv_t* convs, const uint32_t* uVs, int32_t* uAs, unsigned count);
+
+extern bool     ftma_avgs(const uint16_t* samples, unsigned num_samples, unsigned num_channels, uint32_t* avgs);
@@ -0,0 +1,8 @@
+#pragma once
+
+
+#include "measurements.h"
+
+
+extern void                         mains_inf_init(measurements_inf_t* inf);
+extern struct cmd_link_t*           mains_add_commands(struct cmd_link_t* tail);
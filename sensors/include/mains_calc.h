@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define MAINS_MAX_CHANNELS              4
+/* Fundamental and harmonics up to this one, those under Nyquist. */
+#define MAINS_HARMONICS                 5
+
+
+typedef struct
+{
+    float       amplitudes[MAINS_HARMONICS];    /* Peak, in ADC steps, [0] is the fundamental. */
+    float       phase;                          /* Of the fundamental, radians. */
+    float       thd;                            /* Percent of the fundamental. */
+    uint8_t     harmonic_count;
+    bool        is_valid;                       /* Else too little signal. */
+} mains_channel_t;
+
+
+typedef struct
+{
+    float           freq_hz;
+    unsigned        num_channels;
+    mains_channel_t channels[MAINS_MAX_CHANNELS];
+} mains_result_t;
+
+
+extern bool     mains_calc(const uint16_t* samples, unsigned num_samples, unsigned num_channels, float sample_period_s, mains_result_t* result);
+extern bool     mains_calc_phase_deg(const mains_result_t* result, unsigned channel, unsigned ref_channel, float* phase_deg);
@@ -6,12 +6,34 @@
 #include "io.h"
 
 
+#define PULSECOUNT_HW_INPUT_NONE            0
+#define PULSECOUNT_HW_INPUT_ETR             1   /* Timer external trigger, external clock mode 2. */
+#define PULSECOUNT_HW_INPUT_TI2             2   /* Timer channel 2, input captured. */
+
+#define PULSECOUNT_HW_TIM_NONE              { 0, 0, 0, 0, PULSECOUNT_HW_INPUT_NONE }
+
+
+/* Timer the pulse IO can be routed to, so pulses are counted or timed in
+ * hardware. */
+typedef struct
+{
+    uint32_t            tim;
+    uint32_t            rcc;
+    uint8_t             irq;
+    uint8_t             af;
+    uint8_t             input;
+} pulsecount_hw_tim_t;
+
+
 extern void     pulsecount_init(void);
 
 extern void     pulsecount_enable(unsigned io, bool enable, io_pupd_t pupd, io_special_t edge);
 
 extern void     pulsecount_inf_init(measurements_inf_t* inf);
+extern void     pulsecount_stats_inf_init(measurements_inf_t* inf);
 
 struct cmd_link_t* pulsecount_add_commands(struct cmd_link_t* tail);
 
 extern void     pulsecount_isr(uint32_t exti_group);
+
+extern void     pulsecount_drain(void) __attribute__((weak));
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "measurements.h"
+
+
+#define PULSECOUNT_EDGES_RING_SIZE          64  /* Power of 2 */
+#define PULSECOUNT_STATS_WINDOW_MS          100
+
+
+/* Each measurement of an IO keeps its own, so one's ack leaves the other's. */
+typedef enum
+{
+    PULSECOUNT_STATS_RATE,
+    PULSECOUNT_STATS_IVAL,
+    PULSECOUNT_STATS_COUNT,
+} pulsecount_stats_kind_t;
+
+
+/* Edge times in us. The edge interrupt only writes the time and moves
+ * the head on, the main loop reduces them into the stats. */
+typedef struct
+{
+    volatile uint32_t   us[PULSECOUNT_EDGES_RING_SIZE];
+    volatile uint32_t   head;
+    uint32_t            tail;
+} pulsecount_edges_t;
+
+
+/* Inter-pulse intervals since the stats were last sent. */
+typedef struct
+{
+    uint32_t            start_ms;
+    uint32_t            last_us;
+    uint32_t            pulses;
+    uint32_t            intervals;
+    uint64_t            sum_us;
+    uint32_t            min_us;
+    uint32_t            max_us;
+    bool                has_last;
+} pulsecount_stats_t;
+
+
+static inline void pulsecount_edges_add(pulsecount_edges_t* edges, uint32_t us)
+{
+    uint32_t head = edges->head;
+    edges->us[head % PULSECOUNT_EDGES_RING_SIZE] = us;
+    edges->head = head + 1;
+}
+
+
+extern void     pulsecount_stats_drain(pulsecount_edges_t* edges, pulsecount_stats_t* stats);
+extern void     pulsecount_stats_window(pulsecount_stats_t* stats, uint32_t pulses, uint32_t elapsed_us);
+extern void     pulsecount_stats_restart(pulsecount_stats_t* stats, uint32_t now);
+extern bool     pulsecount_stats_summary(const pulsecount_stats_t* stats, uint32_t now, pulsecount_stats_kind_t kind, measurements_value_t* value, uint8_t* num_samples);
@@ -1,11 +1,90 @@
 #include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "can_impl.h"
 
 #include "common.h"
-#include "can_comm.h"
+#include "log.h"
+#include "persist_config.h"
+
+
+#define CAN_IMPL_COLLECTION_TIME_MS                         0
+#define CAN_IMPL_SIGNAL_MAX_AGE_MS                          (5 * 60 * 1000)
+#define CAN_IMPL_SIGNAL_MAX_BITS                            32
+
+
+typedef struct
+{
+    float       value;
+    uint32_t    time;
+    bool        valid;
+} can_impl_signal_state_t;
+
+
+static can_impl_config_t*       _can_impl_config                                = NULL;
+static can_impl_signal_state_t  _can_impl_signal_states[CAN_IMPL_SIGNAL_COUNT]  = {0};
+static uint32_t                 _can_impl_rx_count                              = 0;
+static uint32_t                 _can_impl_rx_unmatched                          = 0;
+
+
+static can_impl_signal_t* _can_impl_get_signal(char* name, unsigned* index)
+{
+    if (!name)
+        return NULL;
+    unsigned name_len = strnlen(name, MEASURE_NAME_NULLED_LEN);
+    for (unsigned i = 0; i < CAN_IMPL_SIGNAL_COUNT; i++)
+    {
+        can_impl_signal_t* signal = &_can_impl_config->signals[i];
+        if (!signal->name[0])
+            continue;
+        if (strnlen(signal->name, MEASURE_NAME_NULLED_LEN) != name_len)
+            continue;
+        if (strncmp(signal->name, name, name_len) == 0)
+        {
+            if (index)
+                *index = i;
+            return signal;
+        }
+    }
+    return NULL;
+}
+
+
+static void _can_impl_apply_filters(void)
+{
+    if (!can_comm_set_filters(_can_impl_config->filters, CAN_COMM_FILTER_COUNT))
+        can_debug("Failed to apply filters.");
+}
+
+
+void can_impl_setup_default_mem(can_impl_config_t* memory, unsigned size)
+{
+    if (sizeof(can_impl_config_t) > size)
+    {
+        log_error("CAN config memory too small.");
+        return;
+    }
+    memset(memory, 0, sizeof(can_impl_config_t));
+}
+
 
 void can_impl_init(void)
 {
+    _can_impl_config = &persist_data.model_config.can_config;
+    for (unsigned i = 0; i < CAN_IMPL_SIGNAL_COUNT; i++)
+    {
+        can_impl_signal_t* signal = &_can_impl_config->signals[i];
+        if (signal->bit_length > CAN_IMPL_SIGNAL_MAX_BITS ||
+            signal->byte_offset >= CAN_COMM_MAX_DATA_SIZE ||
+            signal->dlc > CAN_COMM_MAX_DATA_SIZE ||
+            !isascii(signal->name[0]))
+            memset(signal, 0, sizeof(can_impl_signal_t));
+    }
     can_comm_init();
+    _can_impl_apply_filters();
     can_comm_enable(true);
 }
 
@@ -32,25 +111,132 @@ void can_impl_send_example(void)
 }
 
 
-static void _can_impl_parse_pkt(can_comm_packet_t* pkt) { }
+static bool _can_impl_signal_extract(can_impl_signal_t* signal, can_comm_frame_t* frame, float* value)
+{
+    unsigned num_bytes = (signal->bit_length + 7) / 8;
+    if (signal->dlc && frame->header.length != signal->dlc)
+        return false;
+    if (!num_bytes || signal->byte_offset + num_bytes > frame->header.length)
+        return false;
+
+    uint64_t raw = 0;
+    for (unsigned i = 0; i < num_bytes; i++)
+    {
+        uint8_t byte = frame->data[signal->byte_offset + i];
+        if (signal->is_big_endian)
+            raw = (raw << 8) | byte;
+        else
+            raw |= (uint64_t)byte << (8 * i);
+    }
+    uint64_t mask = (1ULL << signal->bit_length) - 1;
+    raw &= mask;
+
+    if (signal->is_signed && (raw & (1ULL << (signal->bit_length - 1))))
+        *value = (float)(int64_t)(raw | ~mask) * signal->scale;
+    else
+        *value = (float)raw * signal->scale;
+    return true;
+}
+
+
+static void _can_impl_parse_pkt(can_comm_frame_t* frame)
+{
+    _can_impl_rx_count++;
+    bool matched = false;
+    for (unsigned i = 0; i < CAN_IMPL_SIGNAL_COUNT; i++)
+    {
+        can_impl_signal_t* signal = &_can_impl_config->signals[i];
+        if (!signal->name[0] ||
+            signal->id != frame->header.id ||
+            (bool)signal->ext != frame->header.ext)
+            continue;
+        matched = true;
+        can_impl_signal_state_t* state = &_can_impl_signal_states[i];
+        if (!_can_impl_signal_extract(signal, frame, &state->value))
+        {
+            can_debug("Frame DLC %"PRIu8" wrong for signal '%s'.", frame->header.length, signal->name);
+            continue;
+        }
+        state->time  = get_since_boot_ms();
+        state->valid = true;
+    }
+    if (!matched)
+        _can_impl_rx_unmatched++;
+}
 
 
 void can_drain_array(void)
 {
-    can_comm_packet_t pkt;
-    can_comm_data_t data;
-    pkt.data = data;
-    unsigned n;
-    unsigned header_size = sizeof(can_comm_header_t);
-    n = ring_buf_read(&can_comm_ring_data, (char*)&pkt.header, header_size);
-    if (n != header_size)
-        // Not finished writing to buffer?
-        return;
-    n = ring_buf_read(&can_comm_ring_data, (char*)pkt.data, pkt.header.length);
-    if (n != pkt.header.length)
-        // Not finished writing to buffer?
-        return;
-    _can_impl_parse_pkt(&pkt);
+    can_comm_frame_t frame;
+    while (ring_buf_get_pending(&can_comm_ring_data) >= sizeof(can_comm_frame_t))
+    {
+        ring_buf_read(&can_comm_ring_data, (char*)&frame, sizeof(can_comm_frame_t));
+        can_debug("Received 0x%"PRIx32" len:%"PRIu8, frame.header.id, frame.header.length);
+        _can_impl_parse_pkt(&frame);
+    }
+}
+
+
+static measurements_sensor_state_t _can_impl_collection_time(char* name, uint32_t* collection_time)
+{
+    if (!collection_time)
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    *collection_time = CAN_IMPL_COLLECTION_TIME_MS;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _can_impl_begin(char* name, bool in_isolation)
+{
+    if (!_can_impl_get_signal(name, NULL))
+    {
+        can_debug("'%s' does not match any CAN signal.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _can_impl_get(char* name, measurements_reading_t* value)
+{
+    if (!value)
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    unsigned index;
+    if (!_can_impl_get_signal(name, &index))
+    {
+        can_debug("'%s' does not match any CAN signal.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    /* Drain anything queued so the value is as fresh as possible. */
+    can_drain_array();
+    can_impl_signal_state_t* state = &_can_impl_signal_states[index];
+    if (!state->valid)
+    {
+        can_debug("No frame received for '%s'.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    if (since_boot_delta(get_since_boot_ms(), state->time) > CAN_IMPL_SIGNAL_MAX_AGE_MS)
+    {
+        can_debug("Value for '%s' is stale.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    value->v_f32 = to_f32_from_float(state->value);
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_value_type_t _can_impl_value_type(char* name)
+{
+    return MEASUREMENTS_VALUE_TYPE_FLOAT;
+}
+
+
+void can_impl_inf_init(measurements_inf_t* inf)
+{
+    inf->collection_time_cb = _can_impl_collection_time;
+    inf->init_cb            = _can_impl_begin;
+    inf->get_cb             = _can_impl_get;
+    inf->value_type_cb      = _can_impl_value_type;
 }
 
 
@@ -61,8 +247,235 @@ static command_response_t _can_impl_cb(char* args)
 }
 
 
+/* Leaves end at pos if there was no number. */
+static uint32_t _can_impl_parse_u32(char* pos, char** end)
+{
+    char* start = skip_space(pos);
+    uint32_t v = strtoul(start, end, 0);
+    if (*end == start)
+        *end = pos;
+    return v;
+}
+
+
+static command_response_t _can_impl_filter_cb(char* args)
+{
+    /* <index> <id> <mask> [EXT]
+     * <index> OFF
+     *    0   0x100 0x7F0
+     *    1   0x18FF0000 0x1FFF0000 EXT
+     *    1   OFF
+     */
+    char* pos = skip_space(args);
+    if (*pos)
+    {
+        char* np;
+        unsigned index = strtoul(pos, &np, 10);
+        if (np == pos || index >= CAN_COMM_FILTER_COUNT)
+        {
+            log_out("Filter index must be 0 - %u.", CAN_COMM_FILTER_COUNT - 1);
+            return COMMAND_RESP_ERR;
+        }
+        can_comm_filter_t* filter = &_can_impl_config->filters[index];
+        pos = skip_space(np);
+        if (toupper((unsigned char)pos[0]) == 'O')
+            memset(filter, 0, sizeof(can_comm_filter_t));
+        else
+        {
+            /* Both parsed before either is set, so a bad command leaves the bank. */
+            uint32_t id = _can_impl_parse_u32(pos, &np);
+            if (np == pos)
+            {
+                log_out("No filter ID given.");
+                return COMMAND_RESP_ERR;
+            }
+            pos = np;
+            uint32_t mask = _can_impl_parse_u32(pos, &np);
+            if (np == pos)
+            {
+                log_out("No filter mask given.");
+                return COMMAND_RESP_ERR;
+            }
+            pos = skip_space(np);
+            filter->id = id;
+            filter->mask = mask;
+            filter->ext = (toupper((unsigned char)pos[0]) == 'E');
+            filter->enabled = 1;
+        }
+        _can_impl_apply_filters();
+    }
+    for (unsigned i = 0; i < CAN_COMM_FILTER_COUNT; i++)
+    {
+        can_comm_filter_t* filter = &_can_impl_config->filters[i];
+        if (filter->enabled)
+            log_out("%u: ID 0x%08"PRIx32" MASK 0x%08"PRIx32" %s", i, filter->id, filter->mask, filter->ext ? "EXT" : "STD");
+        else
+            log_out("%u: OFF", i);
+    }
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _can_impl_sig_add_cb(char* args)
+{
+    /* <name> <id> <byte_offset> <bit_length> <scale> [flags] [dlc]
+     * flags: S - signed, B - big endian, X - extended ID
+     *  CTMP 0x123 0 16 0.01 S 3
+     *  CRPM 0x18FF0010 2 16 0.125 BX
+     */
+    char* pos = skip_space(args);
+    char* name = pos;
+    pos = strchr(pos, ' ');
+    if (!pos)
+    {
+        log_out("<name> <id> <byte_offset> <bit_length> <scale> [flags] [dlc]");
+        return COMMAND_RESP_ERR;
+    }
+    *pos++ = '\0';
+    unsigned name_len = strlen(name);
+    if (!name_len || name_len > MEASURE_NAME_LEN)
+    {
+        log_out("Name must be 1 - %u characters.", MEASURE_NAME_LEN);
+        return COMMAND_RESP_ERR;
+    }
+
+    can_impl_signal_t new_signal = {0};
+    char* np;
+    new_signal.id = _can_impl_parse_u32(pos, &np);
+    if (np == pos)
+    {
+        log_out("No CAN ID given.");
+        return COMMAND_RESP_ERR;
+    }
+    pos = np;
+    unsigned byte_offset = _can_impl_parse_u32(pos, &np);
+    if (np == pos || byte_offset >= CAN_COMM_MAX_DATA_SIZE)
+    {
+        log_out("Byte offset must be 0 - %u.", CAN_COMM_MAX_DATA_SIZE - 1);
+        return COMMAND_RESP_ERR;
+    }
+    pos = np;
+    unsigned bit_length = _can_impl_parse_u32(pos, &np);
+    if (np == pos || !bit_length || bit_length > CAN_IMPL_SIGNAL_MAX_BITS)
+    {
+        log_out("Bit length must be 1 - %u.", CAN_IMPL_SIGNAL_MAX_BITS);
+        return COMMAND_RESP_ERR;
+    }
+    new_signal.byte_offset = byte_offset;
+    new_signal.bit_length = bit_length;
+    pos = skip_space(np);
+    new_signal.scale = strtof(pos, &np);
+    if (np == pos)
+        new_signal.scale = 1.f;
+    for (pos = skip_space(np); *pos && !isspace((unsigned char)*pos) && !isdigit((unsigned char)*pos); pos++)
+    {
+        switch (toupper((unsigned char)*pos))
+        {
+            case 'S': new_signal.is_signed     = 1; break;
+            case 'B': new_signal.is_big_endian = 1; break;
+            case 'X': new_signal.ext           = 1; break;
+            default:
+                log_out("Unknown flag '%c'.", *pos);
+                return COMMAND_RESP_ERR;
+        }
+    }
+    pos = skip_space(pos);
+    unsigned dlc = CAN_COMM_MAX_DATA_SIZE;
+    if (*pos)
+    {
+        dlc = strtoul(pos, &np, 10);
+        if (np == pos || !dlc || dlc > CAN_COMM_MAX_DATA_SIZE)
+        {
+            log_out("DLC must be 1 - %u.", CAN_COMM_MAX_DATA_SIZE);
+            return COMMAND_RESP_ERR;
+        }
+        new_signal.dlc = dlc;
+    }
+    if (byte_offset + ((bit_length + 7) / 8) > dlc)
+    {
+        log_out("Signal does not fit in a frame of DLC %u.", dlc);
+        return COMMAND_RESP_ERR;
+    }
+    memcpy(new_signal.name, name, name_len);
+
+    unsigned index;
+    can_impl_signal_t* signal = _can_impl_get_signal(name, &index);
+    if (!signal)
+    {
+        for (index = 0; index < CAN_IMPL_SIGNAL_COUNT; index++)
+        {
+            if (!_can_impl_config->signals[index].name[0])
+                break;
+        }
+        if (index == CAN_IMPL_SIGNAL_COUNT)
+        {
+            log_out("No free CAN signal slots.");
+            return COMMAND_RESP_ERR;
+        }
+        measurements_def_t def = {0};
+        memcpy(def.name, name, name_len);
+        def.interval     = 1;
+        def.samplecount  = 1;
+        def.type         = CAN;
+        def.is_immediate = 0;
+        if (!measurements_add(&def))
+        {
+            log_out("Failed to add CAN signal to measurements.");
+            return COMMAND_RESP_ERR;
+        }
+    }
+    _can_impl_config->signals[index] = new_signal;
+    memset(&_can_impl_signal_states[index], 0, sizeof(can_impl_signal_state_t));
+    log_out("Added CAN signal %s", new_signal.name);
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _can_impl_sig_del_cb(char* args)
+{
+    char* name = skip_space(args);
+    unsigned index;
+    if (!_can_impl_get_signal(name, &index))
+    {
+        log_out("Unknown CAN signal '%s'.", name);
+        return COMMAND_RESP_ERR;
+    }
+    measurements_del(name);
+    memset(&_can_impl_config->signals[index], 0, sizeof(can_impl_signal_t));
+    memset(&_can_impl_signal_states[index], 0, sizeof(can_impl_signal_state_t));
+    log_out("Deleted CAN signal %s", name);
+    return COMMAND_RESP_OK;
+}
+
+
+static command_response_t _can_impl_sigs_cb(char* args)
+{
+    uint32_t now = get_since_boot_ms();
+    for (unsigned i = 0; i < CAN_IMPL_SIGNAL_COUNT; i++)
+    {
+        can_impl_signal_t* signal = &_can_impl_config->signals[i];
+        if (!signal->name[0])
+            continue;
+        can_impl_signal_state_t* state = &_can_impl_signal_states[i];
+        log_out("%.*s: 0x%"PRIx32"%s [%"PRIu8":%"PRIu8"] x%f %s%s DLC:%u", MEASURE_NAME_LEN, signal->name,
+            signal->id, signal->ext ? "X" : "", signal->byte_offset, signal->bit_length,
+            signal->scale, signal->is_signed ? "S" : "U", signal->is_big_endian ? "B" : "L",
+            signal->dlc ? (unsigned)signal->dlc : CAN_COMM_MAX_DATA_SIZE);
+        if (state->valid)
+            log_out("  = %f (%"PRIu32"ms ago)", state->value, since_boot_delta(now, state->time));
+    }
+    log_out("RX: %"PRIu32" Unmatched: %"PRIu32" Dropped: %"PRIu32,
+        _can_impl_rx_count, _can_impl_rx_unmatched, can_comm_get_dropped());
+    return COMMAND_RESP_OK;
+}
+
+
 struct cmd_link_t* can_impl_add_commands(struct cmd_link_t* tail)
 {
-    static struct cmd_link_t cmds[] = {{ "can_impl",     "Send example CAN message", _can_impl_cb                  , false , NULL }};
+    static struct cmd_link_t cmds[] = {{ "can_impl",     "Send example CAN message", _can_impl_cb                  , false , NULL },
+                                       { "can_filter",   "Get/set CAN filter bank",  _can_impl_filter_cb           , false , NULL },
+                                       { "can_sig_add",  "Add CAN signal meas",      _can_impl_sig_add_cb          , false , NULL },
+                                       { "can_sig_del",  "Delete CAN signal meas",   _can_impl_sig_del_cb          , false , NULL },
+                                       { "can_sigs",     "Show CAN signals/stats",   _can_impl_sigs_cb             , false , NULL }};
     return add_commands(tail, cmds, ARRAY_SIZE(cmds));
 }
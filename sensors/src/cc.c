@@ -20,8 +20,6 @@
 #define CC_TIMEOUT_MS                       2000
 #define CC_NUM_SAMPLES                      ADCS_NUM_SAMPLES
 
-#define CC_RESISTOR_OHM                     22
-
 
 typedef struct
 {
@@ -5,6 +5,7 @@
 #include <ctype.h>
 
 #include "ftma.h"
+#include "ftma_conv.h"
 
 #include "adcs.h"
 #include "common.h"
@@ -30,9 +31,9 @@
                                                               { MEASUREMENTS_FTMA_3_NAME , FTMA_DEFAULT_COEFFS } , \
                                                               { MEASUREMENTS_FTMA_4_NAME , FTMA_DEFAULT_COEFFS }   }
 
-#define FTMA_LOWER_THRESHOLD                                2.f // mA
+#define FTMA_LOWER_THRESHOLD_UA                             2000
 
-#define FTMA_UPPER_THRESHOLD                                22.f // mA
+#define FTMA_UPPER_THRESHOLD_UA                             22000
 
 
 
@@ -43,6 +44,10 @@ static uint8_t          _ftma_num_channels                      = ARRAY_SIZE(_ft
 static bool             _ftma_is_running                        = false;
 static uint32_t         _ftma_start_time                        = 0;
 static bool             _ftma_channel_inited[ADC_FTMA_COUNT]    = {false};
+static ftma_conv_t      _ftma_convs[ADC_FTMA_COUNT];
+/* All channels are converted together, each waits here until its get. */
+static int32_t          _ftma_values_uA[ADC_FTMA_COUNT]         = {0};
+static bool             _ftma_value_ready[ADC_FTMA_COUNT]       = {false};
 
 
 static void _ftma_auto_release(void)
@@ -88,21 +93,9 @@ static bool _ftma_get_index_by_name(char* name, uint8_t* index)
 }
 
 
-static float _ftma_conv(uint32_t uV, uint8_t index)
+static void _ftma_conv_update(uint8_t index)
 {
-    /* Coeffs: A + Bx + Cx^2 + Dx^3 + ... */
-    float result = 0;
-    float* coeffs = _ftma_config[index].coeffs;
-    for (uint8_t i = 0; i < FTMA_NUM_COEFFS; i++)
-    {
-        float midval = 1.f;
-        for (uint8_t j = 0; j < i; j++)
-        {
-            midval *= (float)uV / 1000000.f;
-        }
-        result += midval * coeffs[i];
-    }
-    return result * 1000.f;
+    ftma_conv_setup(&_ftma_convs[index], _ftma_config[index].coeffs);
 }
 
 
@@ -157,6 +150,7 @@ static measurements_sensor_state_t _ftma_begin(char* name, bool in_isolation)
     }
     _ftma_is_running = true;
     _ftma_start_time = get_since_boot_ms();
+    memset(_ftma_value_ready, 0, sizeof(_ftma_value_ready));
     adc_debug("ADC successfully started for FTMA.");
 good_exit:
     _ftma_channel_inited[index] = true;
@@ -164,6 +158,47 @@ good_exit:
 }
 
 
+/* One pass over the ADC's samples for every channel, then one batch
+ * through the fixed point conversion. */
+static measurements_sensor_state_t _ftma_collect_all(void)
+{
+    const uint16_t* samples;
+    adcs_resp_t resp = adcs_collect_raw(&samples, ADCS_KEY_FTMA, &_ftma_collection_time);
+    switch(resp)
+    {
+        case ADCS_RESP_FAIL:
+            adc_debug("FTMA ADC failed on collecting.");
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        case ADCS_RESP_WAIT:
+            return MEASUREMENTS_SENSOR_STATE_BUSY;
+        case ADCS_RESP_OK:
+            break;
+    }
+
+    uint32_t avgs[ADC_FTMA_COUNT];
+    if (!ftma_avgs(samples, FTMA_NUM_SAMPLES, _ftma_num_channels, avgs))
+    {
+        adc_debug("Unable to average FTMA samples.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    uint32_t uVs[ADC_FTMA_COUNT];
+    for (uint8_t i = 0; i < _ftma_num_channels; i++)
+    {
+        adc_debug("FTMA%"PRIu8" Raw: %"PRIu32, i + 1, avgs[i]);
+        if (!adcs_to_mV(avgs[i], &uVs[i]))
+        {
+            adc_debug("Unable to convert to mV.");
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        }
+    }
+    ftma_conv_batch(_ftma_convs, uVs, _ftma_values_uA, _ftma_num_channels);
+    for (uint8_t i = 0; i < _ftma_num_channels; i++)
+        _ftma_value_ready[i] = true;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
 static measurements_sensor_state_t _ftma_get(char* name, measurements_reading_t* value)
 {
     if (!name || !value)
@@ -185,44 +220,35 @@ static measurements_sensor_state_t _ftma_get(char* name, measurements_reading_t*
         return MEASUREMENTS_SENSOR_STATE_ERROR;
     }
 
-    uint32_t avg;
-    adcs_resp_t resp = adcs_collect_avg(&avg, _ftma_num_channels, FTMA_NUM_SAMPLES, index, ADCS_KEY_FTMA, &_ftma_collection_time);
-    switch(resp)
+    if (!_ftma_value_ready[index])
     {
-        case ADCS_RESP_FAIL:
-            _ftma_is_running = false;
-            _ftma_channel_inited[index] = false;
-            _ftma_auto_release();
-            adc_debug("FTMA ADC failed on collecting AVG.");
-            return MEASUREMENTS_SENSOR_STATE_ERROR;
-        case ADCS_RESP_WAIT:
+        measurements_sensor_state_t state = _ftma_collect_all();
+        if (state == MEASUREMENTS_SENSOR_STATE_BUSY)
             return MEASUREMENTS_SENSOR_STATE_BUSY;
-        case ADCS_RESP_OK:
-            _ftma_is_running = false;
+        _ftma_is_running = false;
+        if (state != MEASUREMENTS_SENSOR_STATE_SUCCESS)
+        {
             _ftma_channel_inited[index] = false;
             _ftma_auto_release();
-            break;
-    }
-    adc_debug("FTMA Raw: %"PRIu32, avg);
-    uint32_t mV;
-    if (!adcs_to_mV(avg, &mV))
-    {
-        adc_debug("Unable to convert to mV.");
-        return MEASUREMENTS_SENSOR_STATE_ERROR;
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        }
     }
-    adc_debug("FTMA: %"PRIu32".%03"PRIu32"mV", mV/1000, mV%1000);
-    float fin_val = _ftma_conv(mV, index);
-    if (fin_val < FTMA_LOWER_THRESHOLD)
+    _ftma_channel_inited[index] = false;
+    _ftma_value_ready[index] = false;
+    _ftma_auto_release();
+
+    int32_t uA = _ftma_values_uA[index];
+    if (uA < FTMA_LOWER_THRESHOLD_UA)
     {
-        adc_debug("%s: %f < %f (short circuit?)", name, fin_val, FTMA_LOWER_THRESHOLD);
+        adc_debug("%s: %"PRIi32"uA < %"PRIi32"uA (short circuit?)", name, uA, (int32_t)FTMA_LOWER_THRESHOLD_UA);
         return MEASUREMENTS_SENSOR_STATE_ERROR;
     }
-    if (fin_val > FTMA_UPPER_THRESHOLD)
+    if (uA > FTMA_UPPER_THRESHOLD_UA)
     {
-        adc_debug("%s: %f > %f", name, fin_val, FTMA_UPPER_THRESHOLD);
+        adc_debug("%s: %"PRIi32"uA > %"PRIi32"uA", name, uA, (int32_t)FTMA_UPPER_THRESHOLD_UA);
         return MEASUREMENTS_SENSOR_STATE_ERROR;
     }
-    value->v_f32 = to_f32_from_float(fin_val);
+    value->v_f32 = uA;
     return MEASUREMENTS_SENSOR_STATE_SUCCESS;
 }
 
@@ -283,6 +309,8 @@ void ftma_init(void)
         ftma_setup_default_mem(_default_conf, sizeof(ftma_config_t) * ADC_FTMA_COUNT);
         _ftma_config = _default_conf;
     }
+    for (uint8_t i = 0; i < ADC_FTMA_COUNT; i++)
+        _ftma_conv_update(i);
 }
 
 
@@ -385,6 +413,7 @@ static command_response_t _ftma_coeff_cb(char* args)
                 ftma->coeffs[i++] = A;
             for (; i < FTMA_NUM_COEFFS; i++)
                 ftma->coeffs[i] = strtod(p, &p);
+            _ftma_conv_update(index);
             log_out("Set new coefficients for '%s'", args);
         }
     }
@@ -394,6 +423,8 @@ static command_response_t _ftma_coeff_cb(char* args)
     {
         log_out("%c: %.06f", 'A'+i, ftma->coeffs[i]);
     }
+    if (!_ftma_convs[index].is_fixed)
+        log_out("Too large for fixed point, done in float.");
     return COMMAND_RESP_OK;
 }
 
@@ -0,0 +1,101 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "ftma_conv.h"
+
+
+#define FTMA_CONV_IN_MAX                (((uint32_t)1 << FTMA_CONV_IN_BITS) - 1)
+/* Each partial sum of the Horner is under the sum of the coefficients,
+ * which keeps its product with the input inside 63 bits. */
+#define FTMA_CONV_COEFF_MAX             ((double)((int64_t)1 << (63 - FTMA_CONV_IN_BITS - FTMA_CONV_FRAC_BITS - 3)))
+
+
+/* Coeffs are A + Bx + Cx^2 + Dx^3 with x in volts, giving milliamps.
+ * For x = uV / 2^22 it is A' + B'x + C'x^2 + D'x^3 where each is times
+ * (2^22 / 1000000)^power, and times 1000000 for microamps. */
+void ftma_conv_setup(ftma_conv_t* conv, const float coeffs[FTMA_NUM_COEFFS])
+{
+    if (!conv || !coeffs)
+        return;
+
+    memcpy(conv->float_coeffs, coeffs, sizeof(conv->float_coeffs));
+    conv->is_fixed = true;
+
+    double scale = 1000000.;
+    for (unsigned i = 0; i < FTMA_NUM_COEFFS; i++)
+    {
+        double scaled = (double)coeffs[i] * scale;
+        if (scaled >= FTMA_CONV_COEFF_MAX || scaled <= -FTMA_CONV_COEFF_MAX)
+            conv->is_fixed = false;
+        else
+            conv->coeffs[i] = (int64_t)(scaled * (1 << FTMA_CONV_FRAC_BITS) + ((scaled < 0)?-0.5:0.5));
+        scale *= (double)((uint32_t)1 << FTMA_CONV_IN_BITS) / 1000000.;
+    }
+}
+
+
+/* As it always was, kept for coefficients too big for fixed point. */
+int32_t ftma_conv_float(const float coeffs[FTMA_NUM_COEFFS], uint32_t uV)
+{
+    float result = 0;
+    for (uint8_t i = 0; i < FTMA_NUM_COEFFS; i++)
+    {
+        float midval = 1.f;
+        for (uint8_t j = 0; j < i; j++)
+        {
+            midval *= (float)uV / 1000000.f;
+        }
+        result += midval * coeffs[i];
+    }
+    /* Milliamps, then to f32 as to_f32_from_float() does. */
+    return (int32_t)(result * 1000.f * 1000.f);
+}
+
+
+int32_t ftma_conv_uV(const ftma_conv_t* conv, uint32_t uV)
+{
+    if (!conv->is_fixed || uV > FTMA_CONV_IN_MAX)
+        return ftma_conv_float(conv->float_coeffs, uV);
+
+    int64_t acc = conv->coeffs[FTMA_NUM_COEFFS - 1];
+    for (int i = FTMA_NUM_COEFFS - 2; i >= 0; i--)
+        acc = ((acc * (int64_t)uV + ((int64_t)1 << (FTMA_CONV_IN_BITS - 1))) >> FTMA_CONV_IN_BITS) + conv->coeffs[i];
+
+    acc = (acc + ((int64_t)1 << (FTMA_CONV_FRAC_BITS - 1))) >> FTMA_CONV_FRAC_BITS;
+    if (acc > INT32_MAX)
+        return INT32_MAX;
+    if (acc < INT32_MIN)
+        return INT32_MIN;
+    return (int32_t)acc;
+}
+
+
+void ftma_conv_batch(const ftma_conv_t* convs, const uint32_t* uVs, int32_t* uAs, unsigned count)
+{
+    for (unsigned n = 0; n < count; n++)
+        uAs[n] = ftma_conv_uV(&convs[n], uVs[n]);
+}
+
+
+/* Samples are interleaved by channel, as the ADC leaves them. Each
+ * channel's average is given as ADC value * 1000, as adcs_collect_avgs()
+ * does. */
+bool ftma_avgs(const uint16_t* samples, unsigned num_samples, unsigned num_channels, uint32_t* avgs)
+{
+    if (!samples || !avgs || !num_channels)
+        return false;
+
+    unsigned per_channel = num_samples / num_channels;
+    if (!per_channel)
+        return false;
+
+    for (unsigned c = 0; c < num_channels; c++)
+    {
+        const uint16_t* sample = &samples[c];
+        uint64_t sum = 0;
+        for (unsigned n = 0; n < per_channel; n++, sample += num_channels)
+            sum += *sample;
+        avgs[c] = (sum * 1000) / per_channel;
+    }
+    return true;
+}
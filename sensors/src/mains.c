@@ -0,0 +1,336 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "mains.h"
+#include "mains_calc.h"
+
+#include "adcs.h"
+#include "cc.h"
+#include "common.h"
+#include "log.h"
+#include "persist_config.h"
+#include "pinmap.h"
+#include "platform.h"
+
+
+#define MAINS_DEFAULT_COLLECTION_TIME       1000
+#define MAINS_NUM_SAMPLES                   ADCS_NUM_SAMPLES
+#define MAINS_TIMEOUT_MS                    3000
+
+
+typedef enum
+{
+    MAINS_VALUE_FREQ,
+    MAINS_VALUE_THD,
+    MAINS_VALUE_PHASE,
+} mains_value_t;
+
+
+typedef struct
+{
+    char*           name;
+    mains_value_t   value;
+    uint8_t         clamp;
+} mains_meas_t;
+
+
+/* Phases are of each clamp against CC1. */
+static const mains_meas_t _mains_meas[] =
+{
+    { MEASUREMENTS_MAINS_FREQ_NAME,     MAINS_VALUE_FREQ,   0 },
+    { MEASUREMENTS_MAINS_THD_1_NAME,    MAINS_VALUE_THD,    0 },
+    { MEASUREMENTS_MAINS_THD_2_NAME,    MAINS_VALUE_THD,    1 },
+    { MEASUREMENTS_MAINS_THD_3_NAME,    MAINS_VALUE_THD,    2 },
+    { MEASUREMENTS_MAINS_PHASE_2_NAME,  MAINS_VALUE_PHASE,  1 },
+    { MEASUREMENTS_MAINS_PHASE_3_NAME,  MAINS_VALUE_PHASE,  2 },
+};
+
+#define MAINS_MEAS_COUNT                    ARRAY_SIZE(_mains_meas)
+
+
+static adcs_type_t      _mains_clamps[ADC_CC_COUNT]         = ADC_TYPES_ALL_CC;
+static bool             _mains_is_running                   = false;
+static uint32_t         _mains_start_time                   = 0;
+static bool             _mains_inited[MAINS_MEAS_COUNT]     = {false};
+/* One capture gives all of them, each waits here until its get. */
+static bool             _mains_ready[MAINS_MEAS_COUNT]      = {false};
+static mains_result_t   _mains_result;
+
+
+static void _mains_auto_release(void)
+{
+    for (unsigned i = 0; i < MAINS_MEAS_COUNT; i++)
+    {
+        if (_mains_inited[i])
+            return;
+    }
+    adcs_release(ADCS_KEY_MAINS);
+}
+
+
+static bool _mains_get_index_by_name(char* name, unsigned* index)
+{
+    if (!name || !index)
+        return false;
+
+    for (unsigned i = 0; i < MAINS_MEAS_COUNT; i++)
+    {
+        if (strncmp(_mains_meas[i].name, name, MEASURE_NAME_LEN) == 0)
+        {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static measurements_sensor_state_t _mains_get_collection_time(char* name, uint32_t* collection_time)
+{
+    if (!collection_time)
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    /* As cc.c, the last capture's time would leave no slack for the next. */
+    *collection_time = MAINS_DEFAULT_COLLECTION_TIME;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _mains_begin(char* name, bool in_isolation)
+{
+    unsigned index;
+    if (!_mains_get_index_by_name(name, &index))
+    {
+        adc_debug("'%s' is not a mains measurement.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    if (_mains_inited[index])
+    {
+        adc_debug("Mains is already inited.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    if (_mains_is_running)
+    {
+        /* Join the capture already going, unless it has run too long. */
+        if (since_boot_delta(get_since_boot_ms(), _mains_start_time) > MAINS_TIMEOUT_MS)
+        {
+            adc_debug("ADC been running too long.");
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        }
+        goto good_exit;
+    }
+    adcs_resp_t resp = adcs_begin(_mains_clamps, ADC_CC_COUNT, MAINS_NUM_SAMPLES, ADCS_KEY_MAINS);
+    switch (resp)
+    {
+        case ADCS_RESP_FAIL:
+            adc_debug("ADC begin failed.");
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        case ADCS_RESP_WAIT:
+            return MEASUREMENTS_SENSOR_STATE_BUSY;
+        case ADCS_RESP_OK:
+            break;
+    }
+    _mains_is_running = true;
+    _mains_start_time = get_since_boot_ms();
+    memset(_mains_ready, 0, sizeof(_mains_ready));
+    adc_debug("ADC successfully started for mains.");
+good_exit:
+    _mains_inited[index] = true;
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static float _mains_sample_period_s(uint32_t time_taken)
+{
+    uint32_t period_ns = platform_adc_get_sample_period_ns();
+    if (period_ns)
+        return period_ns / 1000000000.f;
+    /* Not known by the platform, so from how long the capture took. */
+    return time_taken / 1000.f / MAINS_NUM_SAMPLES;
+}
+
+
+static measurements_sensor_state_t _mains_collect(void)
+{
+    const uint16_t* samples;
+    uint32_t time_taken;
+    adcs_resp_t resp = adcs_collect_raw(&samples, ADCS_KEY_MAINS, &time_taken);
+    switch(resp)
+    {
+        case ADCS_RESP_FAIL:
+            adc_debug("Mains ADC failed on collecting.");
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        case ADCS_RESP_WAIT:
+            return MEASUREMENTS_SENSOR_STATE_BUSY;
+        case ADCS_RESP_OK:
+            break;
+    }
+
+    if (!mains_calc(samples, MAINS_NUM_SAMPLES, ADC_CC_COUNT, _mains_sample_period_s(time_taken), &_mains_result))
+    {
+        adc_debug("No mains wave found.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    adc_debug("Mains %.03fHz", _mains_result.freq_hz);
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _mains_get(char* name, measurements_reading_t* value)
+{
+    if (!name || !value)
+    {
+        adc_debug("Handed NULL pointer.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    unsigned index;
+    if (!_mains_get_index_by_name(name, &index))
+    {
+        adc_debug("Could not get index of '%s'.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    if (!_mains_inited[index])
+    {
+        adc_debug("'%s' is not inited.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+
+    if (!_mains_ready[index])
+    {
+        measurements_sensor_state_t state = _mains_collect();
+        if (state == MEASUREMENTS_SENSOR_STATE_BUSY)
+            return MEASUREMENTS_SENSOR_STATE_BUSY;
+        _mains_is_running = false;
+        if (state != MEASUREMENTS_SENSOR_STATE_SUCCESS)
+        {
+            _mains_inited[index] = false;
+            _mains_auto_release();
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+        }
+        for (unsigned i = 0; i < MAINS_MEAS_COUNT; i++)
+            _mains_ready[i] = true;
+    }
+    _mains_inited[index] = false;
+    _mains_ready[index] = false;
+    _mains_auto_release();
+
+    const mains_meas_t* meas = &_mains_meas[index];
+    if (meas->clamp >= _mains_result.num_channels)
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    float result;
+    switch (meas->value)
+    {
+        case MAINS_VALUE_FREQ:
+            result = _mains_result.freq_hz;
+            break;
+        case MAINS_VALUE_THD:
+            if (!_mains_result.channels[meas->clamp].is_valid)
+            {
+                adc_debug("%s: no signal on CC%"PRIu8, name, meas->clamp + 1);
+                return MEASUREMENTS_SENSOR_STATE_ERROR;
+            }
+            result = _mains_result.channels[meas->clamp].thd;
+            break;
+        case MAINS_VALUE_PHASE:
+            if (!mains_calc_phase_deg(&_mains_result, meas->clamp, 0, &result))
+            {
+                adc_debug("%s: no signal on CC1 or CC%"PRIu8, name, meas->clamp + 1);
+                return MEASUREMENTS_SENSOR_STATE_ERROR;
+            }
+            break;
+        default:
+            return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    value->v_f32 = to_f32_from_float(result);
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_value_type_t _mains_value_type(char* name)
+{
+    return MEASUREMENTS_VALUE_TYPE_FLOAT;
+}
+
+
+void mains_inf_init(measurements_inf_t* inf)
+{
+    inf->collection_time_cb = _mains_get_collection_time;
+    inf->init_cb            = _mains_begin;
+    inf->get_cb             = _mains_get;
+    inf->value_type_cb      = _mains_value_type;
+}
+
+
+/* RMS of a peak in ADC steps, with the clamp's gain as cc.c has it. */
+static float _mains_amps_rms(unsigned clamp, float amplitude)
+{
+    cc_config_t* config = &persist_data.model_config.cc_configs[clamp];
+    uint32_t uV;
+    if (!config->int_max_mV || !adcs_to_mV((uint32_t)(amplitude * 1000.f / (float)M_SQRT2), &uV))
+        return 0.f;
+    return (uV / 1000.f) * config->ext_max_mA / config->int_max_mV / CC_RESISTOR_OHM / 1000.f;
+}
+
+
+static void _mains_print(void)
+{
+    log_out("Frequency: %.03fHz", _mains_result.freq_hz);
+    for (unsigned c = 0; c < _mains_result.num_channels; c++)
+    {
+        mains_channel_t* channel = &_mains_result.channels[c];
+        if (!channel->is_valid)
+        {
+            log_out("CC%u: No signal", c + 1);
+            continue;
+        }
+        float phase_deg;
+        if (mains_calc_phase_deg(&_mains_result, c, 0, &phase_deg))
+            log_out("CC%u: %.03fA THD %.02f%% Phase %.01fdeg", c + 1, _mains_amps_rms(c, channel->amplitudes[0]), channel->thd, phase_deg);
+        else
+            log_out("CC%u: %.03fA THD %.02f%%", c + 1, _mains_amps_rms(c, channel->amplitudes[0]), channel->thd);
+
+        char line[LOG_LINELEN];
+        unsigned len = snprintf(line, sizeof(line), "CC%u harmonics:", c + 1);
+        for (unsigned h = 1; h < channel->harmonic_count && len < sizeof(line); h++)
+            len += snprintf(line + len, sizeof(line) - len, " %u:%.02f%%", h + 1, 100.f * channel->amplitudes[h] / channel->amplitudes[0]);
+        log_out("%s", line);
+    }
+}
+
+
+static command_response_t _mains_cb(char* args)
+{
+    if (_mains_is_running)
+    {
+        log_out("Mains measurement in progress.");
+        return COMMAND_RESP_ERR;
+    }
+    if (adcs_begin(_mains_clamps, ADC_CC_COUNT, MAINS_NUM_SAMPLES, ADCS_KEY_MAINS) != ADCS_RESP_OK)
+    {
+        log_out("ADC is busy.");
+        return COMMAND_RESP_ERR;
+    }
+    bool r = (adcs_wait_done(MAINS_TIMEOUT_MS, ADCS_KEY_MAINS) == ADCS_RESP_OK &&
+              _mains_collect() == MEASUREMENTS_SENSOR_STATE_SUCCESS);
+    adcs_release(ADCS_KEY_MAINS);
+    if (!r)
+    {
+        log_out("Could not measure mains.");
+        return COMMAND_RESP_ERR;
+    }
+    _mains_print();
+    return COMMAND_RESP_OK;
+}
+
+
+struct cmd_link_t* mains_add_commands(struct cmd_link_t* tail)
+{
+    static struct cmd_link_t cmds[] = {{ "mains",       "Mains frequency, harmonics and phase", _mains_cb , false , NULL }};
+    return add_commands(tail, cmds, ARRAY_SIZE(cmds));
+}
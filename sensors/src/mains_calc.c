@@ -0,0 +1,170 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mains_calc.h"
+
+
+#define MAINS_MIN_PER_CHANNEL           32
+#define MAINS_MIN_CROSSINGS             3
+/* Less RMS than this, in ADC steps, is taken as no wave at all. */
+#define MAINS_MIN_RMS                   2.f
+
+
+static inline float _mains_sample(const uint16_t* samples, unsigned num_channels, unsigned channel, unsigned n, float mean)
+{
+    return (float)samples[n * num_channels + channel] - mean;
+}
+
+
+/* Rising zero crossings, interpolated between samples. Hysteresis keeps
+ * noise around zero from making more. */
+static bool _mains_crossings(const uint16_t* samples, unsigned per_channel, unsigned num_channels, unsigned channel, float mean, float hysteresis, float* first, float* last, unsigned* count)
+{
+    bool armed = false;
+    float prev = _mains_sample(samples, num_channels, channel, 0, mean);
+
+    *count = 0;
+    for (unsigned n = 1; n < per_channel; n++)
+    {
+        float y = _mains_sample(samples, num_channels, channel, n, mean);
+        if (y < -hysteresis)
+            armed = true;
+        else if (armed && prev < 0.f && y >= 0.f)
+        {
+            float t = (n - 1) + (-prev / (y - prev));
+            if (!*count)
+                *first = t;
+            *last = t;
+            (*count)++;
+            armed = false;
+        }
+        prev = y;
+    }
+    return (*count >= MAINS_MIN_CROSSINGS);
+}
+
+
+/* Goertzel for any frequency, not just whole bins, w in radians per
+ * sample. Amplitude is the peak, phase is at the start of the window. */
+static void _mains_goertzel(const uint16_t* samples, unsigned num_channels, unsigned channel, float mean, unsigned start, unsigned len, float w, float* amplitude, float* phase)
+{
+    float cw = cosf(w);
+    float sw = sinf(w);
+    float coeff = 2.f * cw;
+    float s1 = 0.f;
+    float s2 = 0.f;
+
+    for (unsigned n = start; n < start + len; n++)
+    {
+        float s0 = _mains_sample(samples, num_channels, channel, n, mean) + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s0;
+    }
+
+    float re = s1 - cw * s2;
+    float im = sw * s2;
+    *amplitude = 2.f * sqrtf(re * re + im * im) / len;
+    *phase = atan2f(im, re) - w * (len - 1);
+}
+
+
+/* Samples are interleaved by channel, as the ADC leaves them. The
+ * frequency comes from the channel with the most signal, then each
+ * channel's harmonics are taken over the same whole number of cycles. */
+bool mains_calc(const uint16_t* samples, unsigned num_samples, unsigned num_channels, float sample_period_s, mains_result_t* result)
+{
+    if (!samples || !result || !num_channels || num_channels > MAINS_MAX_CHANNELS || sample_period_s <= 0.f)
+        return false;
+
+    unsigned per_channel = num_samples / num_channels;
+    if (per_channel < MAINS_MIN_PER_CHANNEL)
+        return false;
+
+    memset(result, 0, sizeof(mains_result_t));
+    result->num_channels = num_channels;
+
+    float means[MAINS_MAX_CHANNELS];
+    float rmss[MAINS_MAX_CHANNELS];
+    unsigned ref = 0;
+    for (unsigned c = 0; c < num_channels; c++)
+    {
+        uint32_t sum = 0;
+        for (unsigned n = 0; n < per_channel; n++)
+            sum += samples[n * num_channels + c];
+        means[c] = (float)sum / per_channel;
+
+        float sum_sq = 0.f;
+        for (unsigned n = 0; n < per_channel; n++)
+        {
+            float y = _mains_sample(samples, num_channels, c, n, means[c]);
+            sum_sq += y * y;
+        }
+        rmss[c] = sqrtf(sum_sq / per_channel);
+        if (rmss[c] > rmss[ref])
+            ref = c;
+    }
+
+    if (rmss[ref] < MAINS_MIN_RMS)
+        return false;
+
+    float first;
+    float last;
+    unsigned count;
+    if (!_mains_crossings(samples, per_channel, num_channels, ref, means[ref], rmss[ref] / 2.f, &first, &last, &count))
+        return false;
+
+    /* Radians per sample of a channel, each is num_channels conversions. */
+    float w1 = 2.f * (float)M_PI * (count - 1) / (last - first);
+    result->freq_hz = w1 / (2.f * (float)M_PI * sample_period_s * num_channels);
+
+    /* Whole cycles, so little of one harmonic leaks into the next. */
+    unsigned start = (unsigned)ceilf(first);
+    unsigned len = (unsigned)ceilf(last) - start;
+
+    for (unsigned c = 0; c < num_channels; c++)
+    {
+        mains_channel_t* channel = &result->channels[c];
+        for (unsigned h = 1; h <= MAINS_HARMONICS; h++)
+        {
+            float w = w1 * h;
+            if (w >= (float)M_PI)
+                break;
+            float phase;
+            _mains_goertzel(samples, num_channels, c, means[c], start, len, w, &channel->amplitudes[h - 1], &phase);
+            if (h == 1)
+                /* Sampled c conversions after the first channel. */
+                channel->phase = phase - w1 * c / num_channels;
+            channel->harmonic_count = h;
+        }
+
+        channel->is_valid = (channel->amplitudes[0] >= MAINS_MIN_RMS * (float)M_SQRT2);
+        if (!channel->is_valid)
+            continue;
+
+        float sum_sq = 0.f;
+        for (unsigned h = 1; h < channel->harmonic_count; h++)
+            sum_sq += channel->amplitudes[h] * channel->amplitudes[h];
+        channel->thd = 100.f * sqrtf(sum_sq) / channel->amplitudes[0];
+    }
+    return true;
+}
+
+
+/* Of the channel's fundamental ahead of the reference's, -180 to 180. */
+bool mains_calc_phase_deg(const mains_result_t* result, unsigned channel, unsigned ref_channel, float* phase_deg)
+{
+    if (!result || !phase_deg || channel >= result->num_channels || ref_channel >= result->num_channels)
+        return false;
+
+    if (!result->channels[channel].is_valid || !result->channels[ref_channel].is_valid)
+        return false;
+
+    float diff = fmodf(result->channels[channel].phase - result->channels[ref_channel].phase, 2.f * (float)M_PI);
+    if (diff > (float)M_PI)
+        diff -= 2.f * (float)M_PI;
+    else if (diff <= -(float)M_PI)
+        diff += 2.f * (float)M_PI;
+    *phase_deg = diff * 180.f / (float)M_PI;
+    return true;
+}
@@ -6,29 +6,46 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
 
 #include "log.h"
 #include "pinmap.h"
 #include "common.h"
 #include "io.h"
 #include "pulsecount.h"
+#include "pulsecount_stats.h"
 #include "platform_model.h"
 
 
 #define PULSECOUNT_COLLECTION_TIME_MS       1000;
 
+#ifndef W1_PULSE_1_HW_TIM
+#define W1_PULSE_1_HW_TIM                   PULSECOUNT_HW_TIM_NONE
+#endif
+#ifndef W1_PULSE_2_HW_TIM
+#define W1_PULSE_2_HW_TIM                   PULSECOUNT_HW_TIM_NONE
+#endif
+
 #define PULSECOUNT_INSTANCES   {                                       \
     { { MEASUREMENTS_PULSE_COUNT_NAME_1, W1_PULSE_1_IO} ,              \
         W1_PULSE_1_PORT_N_PINS , W1_PULSE_1_EXTI,                      \
         W1_PULSE_1_EXTI_IRQ,                                           \
+        W1_PULSE_1_HW_TIM,                                             \
         IO_SPECIAL_PULSECOUNT_RISING_EDGE,                             \
-        0, 0 },                                                        \
+        MEASUREMENTS_PULSE_RATE_NAME_1,                                \
+        MEASUREMENTS_PULSE_IVAL_NAME_1,                                \
+        0, false, false, 0, 0, 0, 0, 0, {{0}, 0, 0}, {{0}} },          \
     { { MEASUREMENTS_PULSE_COUNT_NAME_2, W1_PULSE_2_IO} ,              \
         W1_PULSE_2_PORT_N_PINS , W1_PULSE_2_EXTI,                      \
         W1_PULSE_2_EXTI_IRQ,                                           \
+        W1_PULSE_2_HW_TIM,                                             \
         IO_SPECIAL_PULSECOUNT_RISING_EDGE,                             \
-        0, 0 }                                                         \
+        MEASUREMENTS_PULSE_RATE_NAME_2,                                \
+        MEASUREMENTS_PULSE_IVAL_NAME_2,                                \
+        0, false, false, 0, 0, 0, 0, 0, {{0}, 0, 0}, {{0}} }           \
 }
 
 
@@ -38,9 +55,20 @@ typedef struct
     port_n_pins_t       pnp;
     uint32_t            exti;
     uint8_t             exti_irq;
+    pulsecount_hw_tim_t hw_tim;
     io_special_t        edge;
-    volatile uint32_t   count;
+    char                rate_name[MEASURE_NAME_NULLED_LEN];
+    char                ival_name[MEASURE_NAME_NULLED_LEN];
     uint32_t            send_count;
+    bool                hw;         /* Pin is on the timer */
+    bool                capture;    /* Timer times edges, rather than counts them */
+    volatile uint32_t   hw_overflows;
+    volatile uint32_t   missed;
+    uint32_t            base;
+    uint32_t            window_count;
+    uint32_t            window_ms;
+    pulsecount_edges_t  edges;
+    pulsecount_stats_t  stats[PULSECOUNT_STATS_COUNT];
 } pulsecount_instance_t;
 
 
@@ -58,24 +86,216 @@ static bool _pulsecount_get_pupd(pulsecount_instance_t* inst, uint8_t* pupd)
 }
 
 
+/* Counter of pulses counted by the timer, extended to 32 bits with
+ * the overflows counted by its update interrupt. */
+static uint32_t _pulsecount_hw_read(pulsecount_instance_t* inst)
+{
+    uint32_t tim = inst->hw_tim.tim;
+    uint32_t overflows, cnt;
+    do
+    {
+        overflows = inst->hw_overflows;
+        cnt = TIM_CNT(tim) & 0xFFFF;
+    }
+    while (overflows != inst->hw_overflows);
+    /* Wrapped, but the update interrupt hasn't run yet. */
+    if ((TIM_SR(tim) & TIM_SR_UIF) && cnt < 0x8000)
+        overflows++;
+    return (overflows << 16) | cnt;
+}
+
+
+/* Every edge is written to the ring unless counted by the timer. */
+static uint32_t _pulsecount_read(pulsecount_instance_t* inst)
+{
+    if (inst->hw && !inst->capture)
+        return _pulsecount_hw_read(inst) - inst->base;
+    return inst->edges.head + inst->missed - inst->base;
+}
+
+
+/* SysTick counts down to each ms, so gives how far into it an edge is. */
+static uint32_t _pulsecount_now_us(void)
+{
+    uint32_t reload = STK_RVR + 1;
+    uint32_t ms, val;
+    do
+    {
+        ms = get_since_boot_ms();
+        val = STK_CVR;
+    }
+    while (ms != get_since_boot_ms());
+    /* Wrapped, but the tick interrupt hasn't run yet. */
+    if ((SCB_ICSR & SCB_ICSR_PENDSTSET) && val > reload / 2)
+        ms++;
+    return ms * 1000 + (reload - 1 - val) * 1000 / reload;
+}
+
+
+/* The capture is of the timer at 1MHz, extended to 32 bits as the count. */
+static void _pulsecount_capture_isr(pulsecount_instance_t* inst)
+{
+    uint32_t tim = inst->hw_tim.tim;
+    if (!timer_get_flag(tim, TIM_SR_CC2IF))
+        return;
+    uint32_t ccr = TIM_CCR2(tim) & 0xFFFF;
+    uint32_t overflows = inst->hw_overflows;
+    if (timer_get_flag(tim, TIM_SR_UIF) && ccr < 0x8000)
+        overflows++;
+    if (timer_get_flag(tim, TIM_SR_CC2OF))
+    {
+        /* An edge came before the one before was read, so has no time. */
+        timer_clear_flag(tim, TIM_SR_CC2OF);
+        inst->missed++;
+    }
+    pulsecount_edges_add(&inst->edges, (overflows << 16) | ccr);
+}
+
+
+static void _pulsecount_hw_isr(uint32_t tim)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        if (inst->hw && inst->capture && inst->hw_tim.tim == tim)
+            _pulsecount_capture_isr(inst);
+    }
+    if (!timer_get_flag(tim, TIM_SR_UIF))
+        return;
+    timer_clear_flag(tim, TIM_SR_UIF);
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        if (inst->hw && inst->hw_tim.tim == tim)
+            inst->hw_overflows++;
+    }
+}
+
+
+// cppcheck-suppress unusedFunction ; System handler
+void tim1_up_tim16_isr(void)
+{
+    _pulsecount_hw_isr(TIM1);
+}
+
+
+// cppcheck-suppress unusedFunction ; System handler
+void tim3_isr(void)
+{
+    _pulsecount_hw_isr(TIM3);
+}
+
+
 void pulsecount_isr(uint32_t exti_group)
 {
     for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
     {
         pulsecount_instance_t* inst = &_pulsecount_instances[i];
         /* Check IO is in pulsecount mode. */
-        if (!io_is_pulsecount_now(inst->info.io))
+        if (!io_is_pulsecount_now(inst->info.io) || inst->hw)
             continue;
         /* Ensure the EXTI for pulsecount is the one to be triggered */
         uint32_t exti_state = exti_get_flag_status(inst->exti);
         if (!exti_state)
             continue;
         exti_reset_request(inst->exti);
-        __sync_add_and_fetch(&inst->count, 1);
+        pulsecount_edges_add(&inst->edges, _pulsecount_now_us());
     }
 }
 
 
+static void _pulsecount_hw_stop(pulsecount_instance_t* instance)
+{
+    if (!instance->hw)
+        return;
+    timer_disable_counter(instance->hw_tim.tim);
+    timer_disable_irq(instance->hw_tim.tim, TIM_DIER_UIE | TIM_DIER_CC2IE);
+    nvic_disable_irq(instance->hw_tim.irq);
+    TIM_SMCR(instance->hw_tim.tim) = 0;
+    if (instance->capture)
+        timer_ic_disable(instance->hw_tim.tim, TIM_IC2);
+    rcc_periph_clock_disable(instance->hw_tim.rcc);
+    instance->hw = false;
+    instance->capture = false;
+}
+
+
+/* Route the pin to a timer. The external trigger input can only be
+ * counted, the timer clocked by it, so pulses don't each take an
+ * interrupt. Channel 2 is captured, the interrupt only writing the
+ * timer's count to the ring, so the edges are timed to the us. */
+static bool _pulsecount_init_hw(pulsecount_instance_t* instance, uint8_t pupd)
+{
+    pulsecount_hw_tim_t* hw_tim = &instance->hw_tim;
+    uint32_t tim = hw_tim->tim;
+    if (!tim)
+        return false;
+
+    switch(hw_tim->input)
+    {
+        case PULSECOUNT_HW_INPUT_ETR:
+            /* External trigger input can't count both edges. */
+            if (instance->edge == IO_SPECIAL_PULSECOUNT_BOTH_EDGE)
+                return false;
+            break;
+        case PULSECOUNT_HW_INPUT_TI2:
+            break;
+        default:
+            return false;
+    }
+
+    exti_disable_request(instance->exti);
+
+    rcc_periph_clock_enable(PORT_TO_RCC(instance->pnp.port));
+    gpio_mode_setup(instance->pnp.port, GPIO_MODE_AF, pupd, instance->pnp.pins);
+    gpio_set_af(instance->pnp.port, hw_tim->af, instance->pnp.pins);
+
+    rcc_periph_clock_enable(hw_tim->rcc);
+    timer_disable_counter(tim);
+    timer_set_mode(tim, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+    timer_set_period(tim, 0xFFFF);
+
+    bool capture = (hw_tim->input == PULSECOUNT_HW_INPUT_TI2);
+    if (!capture)
+    {
+        /* External clock mode 2 */
+        timer_set_prescaler(tim, 0);
+        timer_slave_set_filter(tim, TIM_IC_CK_INT_N_8);
+        timer_slave_set_polarity(tim, (instance->edge == IO_SPECIAL_PULSECOUNT_FALLING_EDGE)?TIM_ET_FALLING:TIM_ET_RISING);
+        TIM_SMCR(tim) |= TIM_SMCR_ECE;
+    }
+    else
+    {
+        /* Internal clock, input capture on TI2 */
+        enum tim_ic_pol pol;
+        switch(instance->edge)
+        {
+            case IO_SPECIAL_PULSECOUNT_FALLING_EDGE: pol = TIM_IC_FALLING; break;
+            case IO_SPECIAL_PULSECOUNT_BOTH_EDGE:    pol = TIM_IC_BOTH;    break;
+            default:                                 pol = TIM_IC_RISING;  break;
+        }
+        timer_ic_set_input(tim, TIM_IC2, TIM_IC_IN_TI2);
+        timer_ic_set_filter(tim, TIM_IC2, TIM_IC_CK_INT_N_8);
+        timer_ic_set_polarity(tim, TIM_IC2, pol);
+        //-1 because it starts at zero
+        timer_set_prescaler(tim, rcc_ahb_frequency / 1000000-1);
+        timer_ic_enable(tim, TIM_IC2);
+    }
+
+    timer_generate_event(tim, TIM_EGR_UG);
+    timer_clear_flag(tim, TIM_SR_UIF | TIM_SR_CC2IF | TIM_SR_CC2OF);
+    instance->hw_overflows = 0;
+    instance->hw = true;
+    instance->capture = capture;
+    timer_enable_irq(tim, TIM_DIER_UIE | (capture ? TIM_DIER_CC2IE : 0));
+    nvic_enable_irq(hw_tim->irq);
+    timer_enable_counter(tim);
+
+    pulsecount_debug("Pulsecount '%s' enabled on timer %s", instance->info.name, capture ? "capture" : "clock");
+    return true;
+}
+
+
 static void _pulsecount_init_instance(pulsecount_instance_t* instance)
 {
     if (!instance)
@@ -99,6 +319,24 @@ static void _pulsecount_init_instance(pulsecount_instance_t* instance)
 
     model_setup_pulse_pupd(&pupd);
 
+    _pulsecount_hw_stop(instance);
+    instance->send_count = 0;
+    instance->missed = 0;
+    instance->base = 0;
+    instance->window_count = 0;
+    instance->window_ms = get_since_boot_ms();
+    memset((void*)&instance->edges, 0, sizeof(instance->edges));
+    memset(instance->stats, 0, sizeof(instance->stats));
+    for (unsigned k = 0; k < PULSECOUNT_STATS_COUNT; k++)
+        instance->stats[k].start_ms = instance->window_ms;
+
+    if (io_is_pulsecount_hw(instance->info.io))
+    {
+        if (_pulsecount_init_hw(instance, pupd))
+            return;
+        pulsecount_debug("Pulsecount '%s' has no timer for edge, using EXTI.", instance->info.name);
+    }
+
     uint8_t trig;
     switch(instance->edge)
     {
@@ -123,9 +361,6 @@ static void _pulsecount_init_instance(pulsecount_instance_t* instance)
     exti_set_trigger(instance->exti, trig);
     exti_enable_request(instance->exti);
 
-    instance->count = 0;
-    instance->send_count = 0;
-
     nvic_enable_irq(instance->exti_irq);
     pulsecount_debug("Pulsecount '%s' enabled", instance->info.name);
 }
@@ -162,9 +397,13 @@ static void _pulsecount_shutdown_instance(pulsecount_instance_t* instance)
         pulsecount_debug("IO is not pulsecount.");
         return;
     }
-    exti_disable_request(instance->exti);
-    nvic_disable_irq(instance->exti_irq);
-    instance->count = 0;
+    if (instance->hw)
+        _pulsecount_hw_stop(instance);
+    else
+    {
+        exti_disable_request(instance->exti);
+        nvic_disable_irq(instance->exti_irq);
+    }
     instance->send_count = 0;
     pulsecount_debug("Pulsecount '%s' disabled", instance->info.name);
 }
@@ -237,7 +476,7 @@ static measurements_sensor_state_t _pulsecount_begin(char* name, bool in_isolati
         return MEASUREMENTS_SENSOR_STATE_ERROR;
     if (!io_is_pulsecount_now(instance->info.io))
         return MEASUREMENTS_SENSOR_STATE_ERROR;
-    pulsecount_debug("%s at start %"PRIu32, instance->info.name, instance->count);
+    pulsecount_debug("%s at start %"PRIu32, instance->info.name, _pulsecount_read(instance));
     return MEASUREMENTS_SENSOR_STATE_SUCCESS;
 }
 
@@ -261,7 +500,7 @@ static measurements_sensor_state_t _pulsecount_get(char* name, measurements_read
         return MEASUREMENTS_SENSOR_STATE_ERROR;
     }
 
-    instance->send_count = instance->count;
+    instance->send_count = _pulsecount_read(instance);
     pulsecount_debug("%s at end %"PRIu32, instance->info.name, instance->send_count);
     value->v_i64 = (int64_t)instance->send_count;
     return MEASUREMENTS_SENSOR_STATE_SUCCESS;
@@ -274,7 +513,7 @@ static void _pulsecount_ack(char* name)
     if (!_pulsecount_get_instance(&instance, name))
         return;
     pulsecount_debug("%s ack'ed", instance->info.name);
-    __sync_sub_and_fetch(&instance->count, instance->send_count);
+    instance->base += instance->send_count;
     instance->send_count = 0;
 }
 
@@ -295,6 +534,133 @@ void     pulsecount_inf_init(measurements_inf_t* inf)
 }
 
 
+static bool _pulsecount_get_stats_instance(pulsecount_instance_t** instance, char* name, pulsecount_stats_kind_t* kind)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        bool rate = strncmp(name, inst->rate_name, MEASURE_NAME_LEN) == 0;
+        if (rate || strncmp(name, inst->ival_name, MEASURE_NAME_LEN) == 0)
+        {
+            if (!io_is_pulsecount_now(inst->info.io))
+            {
+                pulsecount_debug("IO %s not set up.", inst->info.name);
+                return false;
+            }
+            *instance = inst;
+            *kind = (rate)?PULSECOUNT_STATS_RATE:PULSECOUNT_STATS_IVAL;
+            return true;
+        }
+    }
+    pulsecount_debug("Could not find name in instances.");
+    return false;
+}
+
+
+/* Timer counted IOs have no edge times, so take a window at a time. */
+static void _pulsecount_hw_window(pulsecount_instance_t* instance)
+{
+    uint32_t now = get_since_boot_ms();
+    uint32_t elapsed = since_boot_delta(now, instance->window_ms);
+    if (elapsed < PULSECOUNT_STATS_WINDOW_MS)
+        return;
+    uint32_t count = _pulsecount_hw_read(instance);
+    uint32_t pulses = count - instance->window_count;
+    /* Without pulses the window goes on, until the interval is known. */
+    if (!pulses)
+        return;
+    if (elapsed > UINT32_MAX / 1000)
+        elapsed = UINT32_MAX / 1000;
+    for (unsigned k = 0; k < PULSECOUNT_STATS_COUNT; k++)
+        pulsecount_stats_window(&instance->stats[k], pulses, elapsed * 1000);
+    instance->window_count = count;
+    instance->window_ms = now;
+}
+
+
+static void _pulsecount_drain_instance(pulsecount_instance_t* instance)
+{
+    if (instance->hw && !instance->capture)
+        _pulsecount_hw_window(instance);
+    else
+        pulsecount_stats_drain(&instance->edges, instance->stats);
+}
+
+
+void pulsecount_drain(void)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(_pulsecount_instances); i++)
+    {
+        pulsecount_instance_t* inst = &_pulsecount_instances[i];
+        if (io_is_pulsecount_now(inst->info.io))
+            _pulsecount_drain_instance(inst);
+    }
+}
+
+
+static measurements_sensor_state_t _pulsecount_stats_get_summary(char* name, measurements_value_t* value, uint8_t* num_samples)
+{
+    if (!value || !num_samples)
+    {
+        pulsecount_debug("Handed a NULL pointer.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    pulsecount_instance_t* instance;
+    pulsecount_stats_kind_t kind;
+    if (!_pulsecount_get_stats_instance(&instance, name, &kind))
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+
+    _pulsecount_drain_instance(instance);
+    pulsecount_stats_t* stats = &instance->stats[kind];
+    if (!pulsecount_stats_summary(stats, get_since_boot_ms(), kind, value, num_samples))
+    {
+        pulsecount_debug("%s has no intervals.", name);
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    pulsecount_debug("%s %"PRIi64" [%"PRIi64" - %"PRIi64"] over %"PRIu32" pulses", name,
+                     value->value_64.sum / *num_samples, value->value_64.min, value->value_64.max, stats->pulses);
+    return MEASUREMENTS_SENSOR_STATE_SUCCESS;
+}
+
+
+static measurements_sensor_state_t _pulsecount_stats_get(char* name, measurements_reading_t* value)
+{
+    if (!value)
+    {
+        pulsecount_debug("Handed a NULL pointer.");
+        return MEASUREMENTS_SENSOR_STATE_ERROR;
+    }
+    measurements_value_t summary;
+    uint8_t num_samples;
+    measurements_sensor_state_t r = _pulsecount_stats_get_summary(name, &summary, &num_samples);
+    if (r == MEASUREMENTS_SENSOR_STATE_SUCCESS)
+        value->v_i64 = summary.value_64.sum / num_samples;
+    return r;
+}
+
+
+static void _pulsecount_stats_ack(char* name)
+{
+    pulsecount_instance_t* instance;
+    pulsecount_stats_kind_t kind;
+    if (!_pulsecount_get_stats_instance(&instance, name, &kind))
+        return;
+    pulsecount_debug("%s ack'ed", name);
+    _pulsecount_drain_instance(instance);
+    pulsecount_stats_restart(&instance->stats[kind], get_since_boot_ms());
+}
+
+
+void     pulsecount_stats_inf_init(measurements_inf_t* inf)
+{
+    inf->collection_time_cb = _pulsecount_collection_time;
+    inf->get_cb             = _pulsecount_stats_get;
+    inf->get_summary_cb     = _pulsecount_stats_get_summary;
+    inf->acked_cb           = _pulsecount_stats_ack;
+    inf->value_type_cb      = _pulsecount_value_type;
+}
+
+
 static command_response_t _hw_pupd_cb(char* args)
 {
     char* p;
@@ -0,0 +1,138 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "pulsecount_stats.h"
+
+#include "common.h"
+
+
+#define PULSECOUNT_US_PER_HOUR              (60ULL * 60 * 1000 * 1000)
+#define PULSECOUNT_MS_PER_HOUR              (60 * 60 * 1000)
+
+
+static void _pulsecount_stats_interval(pulsecount_stats_t* stats, uint32_t gap)
+{
+    if (!stats->intervals || gap < stats->min_us)
+        stats->min_us = gap;
+    if (gap > stats->max_us)
+        stats->max_us = gap;
+    stats->sum_us += gap;
+    stats->intervals++;
+}
+
+
+static void _pulsecount_stats_edge(pulsecount_stats_t* stats, uint32_t us)
+{
+    if (stats->has_last)
+        _pulsecount_stats_interval(stats, us - stats->last_us);
+    stats->last_us = us;
+    stats->has_last = true;
+    stats->pulses++;
+}
+
+
+/* Edges written over before they were read are still pulses, but the
+ * interval up to the next one read isn't known. */
+static void _pulsecount_stats_lost(pulsecount_stats_t* stats, uint32_t count)
+{
+    stats->pulses += count;
+    stats->has_last = false;
+}
+
+
+/* Reduce the edges written since the last drain into each kind's stats. */
+void pulsecount_stats_drain(pulsecount_edges_t* edges, pulsecount_stats_t* stats)
+{
+    uint32_t head = edges->head;
+    while (edges->tail != head)
+    {
+        uint32_t behind = head - edges->tail;
+        if (behind > PULSECOUNT_EDGES_RING_SIZE)
+        {
+            for (unsigned k = 0; k < PULSECOUNT_STATS_COUNT; k++)
+                _pulsecount_stats_lost(&stats[k], behind - PULSECOUNT_EDGES_RING_SIZE);
+            edges->tail = head - PULSECOUNT_EDGES_RING_SIZE;
+        }
+        uint32_t us = edges->us[edges->tail % PULSECOUNT_EDGES_RING_SIZE];
+        /* Written over while it was read. */
+        if (edges->head - edges->tail > PULSECOUNT_EDGES_RING_SIZE)
+        {
+            head = edges->head;
+            continue;
+        }
+        for (unsigned k = 0; k < PULSECOUNT_STATS_COUNT; k++)
+            _pulsecount_stats_edge(&stats[k], us);
+        edges->tail++;
+    }
+}
+
+
+/* For edges only counted, not timed: each pulse of the window is taken
+ * to be the window's mean interval apart. */
+void pulsecount_stats_window(pulsecount_stats_t* stats, uint32_t pulses, uint32_t elapsed_us)
+{
+    if (!pulses)
+        return;
+    uint32_t gap = elapsed_us / pulses;
+    if (!stats->intervals || gap < stats->min_us)
+        stats->min_us = gap;
+    if (gap > stats->max_us)
+        stats->max_us = gap;
+    stats->sum_us += elapsed_us;
+    stats->intervals += pulses;
+    stats->pulses += pulses;
+}
+
+
+/* The last edge is kept so the next interval starts from it. */
+void pulsecount_stats_restart(pulsecount_stats_t* stats, uint32_t now)
+{
+    stats->start_ms = now;
+    stats->pulses = 0;
+    stats->intervals = 0;
+    stats->sum_us = 0;
+    stats->min_us = 0;
+    stats->max_us = 0;
+}
+
+
+/* Rate is in pulses per hour and the interval in us. The rate's min and
+ * max are from the longest and shortest interval between edges. */
+bool pulsecount_stats_summary(const pulsecount_stats_t* stats, uint32_t now, pulsecount_stats_kind_t kind, measurements_value_t* value, uint8_t* num_samples)
+{
+    uint32_t elapsed = since_boot_delta(now, stats->start_ms);
+    if (!elapsed)
+        elapsed = 1;
+
+    int64_t mean, min, max;
+    if (kind == PULSECOUNT_STATS_RATE)
+    {
+        mean = (int64_t)stats->pulses * PULSECOUNT_MS_PER_HOUR / elapsed;
+        if (stats->intervals)
+        {
+            max = PULSECOUNT_US_PER_HOUR / (stats->min_us ? stats->min_us : 1);
+            min = PULSECOUNT_US_PER_HOUR / (stats->max_us ? stats->max_us : 1);
+            if (min > mean)
+                min = mean;
+            if (max < mean)
+                max = mean;
+        }
+        else
+            min = max = mean;
+    }
+    else
+    {
+        if (!stats->intervals)
+            return false;
+        mean = stats->sum_us / stats->intervals;
+        min = stats->min_us;
+        max = stats->max_us;
+    }
+
+    uint8_t count = (stats->intervals > UINT8_MAX) ? UINT8_MAX : (stats->intervals ? stats->intervals : 1);
+    value->value_64.sum = mean * count;
+    value->value_64.min = min;
+    value->value_64.max = max;
+    *num_samples = count;
+    return true;
+}
@@ -28,9 +28,14 @@ Application Guide:
 #define VEML7700_COLLECTION_TIME_OFFSET_MS      10
 #define VEML7700_RES_SCALE                      10000
 #define VEML7700_COUNT_LOWER_THRESHOLD          100
+#define VEML7700_COUNT_UPPER_THRESHOLD          50000 // Saturating above this.
+#define VEML7700_COUNT_TARGET                   (VEML7700_COUNT_LOWER_THRESHOLD * 4) // Headroom for it getting a bit darker.
 #define VEML7700_DEFAULT_COLLECT_TIME           6600  // Max time in ms
 #define VEML7700_MAX_READ_TIME                  VEML7700_DEFAULT_COLLECT_TIME + 100
 #define VEML7700_TIMEOUT_TIME_MS                1000
+#define VEML7700_PSM_WAIT_MS                    4000  // Wait between integrations in power save mode 4.
+#define VEML7700_ACTIVE_UA                      45    // Sensor current while integrating.
+#define VEML7700_MCU_AWAKE_UA                   2000  // Rough MCU current kept awake waiting on an integration.
 
 
 typedef enum
@@ -192,6 +197,18 @@ typedef struct
 } veml7700_time_t;
 
 
+/* Range predicted from the last reading, kept between samples. */
+typedef struct
+{
+    uint8_t                 gain_index;
+    uint8_t                 int_index;
+    bool                    retried;
+    bool                    continuous;         // This sample is in power save mode.
+    bool                    psm_on;             // Left on in power save mode since psm_since.
+    uint32_t                psm_since;
+} veml7700_range_t;
+
+
 
 static const veml7700_gain_t    _veml7700_gains[]               = { { VEML7700_CONF_ALS_SM_GAIN_1_8, 16} ,
                                                                     { VEML7700_CONF_ALS_SM_GAIN_1_4,  8} ,
@@ -229,6 +246,13 @@ static veml7700_sensor_state_t  _veml7700_state_machine = {.state=VEML7700_STATE
 static veml7700_time_t          _veml7700_time          = {.start_time=0,
                                                            .last_time_taken=VEML7700_DEFAULT_COLLECT_TIME};
 
+static veml7700_range_t         _veml7700_range         = {.gain_index=0,
+                                                           .int_index=2,
+                                                           .retried=false,
+                                                           .continuous=false,
+                                                           .psm_on=false,
+                                                           .psm_since=0};
+
 
 static void _veml7700_get_u16(uint8_t d[2], uint16_t *r)
 {
@@ -269,27 +293,43 @@ static bool _veml7700_write_reg16(veml7700_cmd_t reg, uint16_t data)
 }
 
 
-static uint16_t _veml7700_get_resolution(void)
+static uint16_t _veml7700_resolution(uint8_t gain_index, uint8_t int_index)
 {
     uint16_t resolution_scaled = 0.0036 * VEML7700_RES_SCALE;
-    uint8_t multiplier = 1;
-    multiplier *= _veml7700_gains[_veml7700_ctx.gain_index].resolution_multiplier;
-    multiplier *= _veml7700_integration_times[_veml7700_ctx.int_index].resolution_multiplier;
+    uint16_t multiplier = 1;
+    multiplier *= _veml7700_gains[gain_index].resolution_multiplier;
+    multiplier *= _veml7700_integration_times[int_index].resolution_multiplier;
     return resolution_scaled * multiplier;
 }
 
 
-static uint32_t _veml7700_get_wait_time(void)
+static uint16_t _veml7700_get_resolution(void)
 {
-    uint32_t wait_time = _veml7700_integration_times[_veml7700_ctx.int_index].wait_time;
+    return _veml7700_resolution(_veml7700_ctx.gain_index, _veml7700_ctx.int_index);
+}
+
+
+static uint32_t _veml7700_wait_time(uint8_t int_index)
+{
+    uint32_t wait_time = _veml7700_integration_times[int_index].wait_time;
     wait_time *= 1.1;
     return wait_time;
 }
 
 
+static uint32_t _veml7700_get_wait_time(void)
+{
+    return _veml7700_wait_time(_veml7700_ctx.int_index);
+}
+
+
 static void _veml7700_reset_ctx(void)
 {
     _veml7700_ctx = _veml7700_default_ctx;
+    _veml7700_ctx.gain_index = _veml7700_range.gain_index;
+    _veml7700_ctx.int_index  = _veml7700_range.int_index;
+    _veml7700_ctx.resolution_scaled = _veml7700_get_resolution();
+    _veml7700_ctx.wait_time = _veml7700_get_wait_time();
 }
 
 
@@ -383,49 +423,76 @@ static bool _veml7700_conv(uint32_t* lux_dt, uint16_t counts)
 #endif
 
 
-static bool _veml7700_increase_integration_time(void)
+static bool _veml7700_counts_in_range(uint16_t counts)
 {
-    if (_veml7700_ctx.int_index + 1 == VEML7700_INT_COUNT)
+    return counts > VEML7700_COUNT_LOWER_THRESHOLD && counts < VEML7700_COUNT_UPPER_THRESHOLD;
+}
+
+
+/* Rather than stepping up a setting an integration at a time, work out
+ * from the counts at the current setting the shortest integration time,
+ * then lowest gain, that the same light gives enough counts at.
+ * Returns if that differs from the current setting. */
+static bool _veml7700_predict_range(uint16_t counts)
+{
+    uint8_t gain_index = 0;
+    uint8_t int_index  = 0;
+    if (counts < VEML7700_COUNT_UPPER_THRESHOLD)
     {
-        light_debug("Cannot increase the integration time any more.");
-        return false;
+        /* Light in 1/VEML7700_RES_SCALE lux, under a count taken as half. */
+        uint64_t light_scaled = counts ? (uint64_t)counts * _veml7700_ctx.resolution_scaled : _veml7700_ctx.resolution_scaled / 2;
+        gain_index = VEML7700_GAINS_COUNT - 1;
+        int_index  = VEML7700_INT_COUNT - 1;
+        for (uint8_t i = 0; i < VEML7700_INT_COUNT; i++)
+        {
+            for (uint8_t g = 0; g < VEML7700_GAINS_COUNT; g++)
+            {
+                if (light_scaled >= (uint64_t)VEML7700_COUNT_TARGET * _veml7700_resolution(g, i))
+                {
+                    gain_index = g;
+                    int_index  = i;
+                    goto found;
+                }
+            }
+        }
     }
-    _veml7700_ctx.int_index++;
-    light_debug("Increasing the integration time. (mode = %"PRIu8")", _veml7700_ctx.int_index);
-    return true;
+found:
+    _veml7700_range.gain_index = gain_index;
+    _veml7700_range.int_index  = int_index;
+    light_debug("Predicted gain index %"PRIu8", integration %"PRIu32"ms.", gain_index, _veml7700_integration_times[int_index].wait_time);
+    return (gain_index != _veml7700_ctx.gain_index || int_index != _veml7700_ctx.int_index);
 }
 
 
-static bool _veml7700_increase_gain(void)
+/* Charge per sample in uA.ms: kept awake for a one shot integration, or
+ * the sensor's duty cycled current over the sample period in power save
+ * mode, where the last result is read straight away. */
+static bool _veml7700_psm_cheaper(char* name)
 {
-    light_debug("Increasing the gain.");
-    if (_veml7700_ctx.gain_index + 1 == VEML7700_GAINS_COUNT)
-    {
-        light_debug("Cannot increase the gain any more.");
+    uint8_t interval;
+    uint8_t samplecount;
+    if (!measurements_get_interval(name, &interval) ||
+        !measurements_get_samplecount(name, &samplecount) ||
+        !interval || !samplecount)
         return false;
-    }
-    _veml7700_ctx.gain_index++;
-    return true;
+    uint64_t sample_ms = (uint64_t)transmit_interval * 60 * interval / samplecount;
+    uint32_t it_ms = _veml7700_integration_times[_veml7700_range.int_index].wait_time;
+    uint64_t one_shot = (uint64_t)_veml7700_wait_time(_veml7700_range.int_index) * (VEML7700_MCU_AWAKE_UA + VEML7700_ACTIVE_UA);
+    uint64_t psm = (uint64_t)VEML7700_ACTIVE_UA * it_ms * sample_ms / (it_ms + VEML7700_PSM_WAIT_MS);
+    return psm < one_shot;
 }
 
 
-static bool _veml7700_increase_settings(void)
+static bool _veml7700_psm_ready(void)
 {
-    if (!_veml7700_increase_gain())
-    {
-        if (!_veml7700_increase_integration_time())
-        {
-            light_debug("Cannot increase count any more.");
-            return false;
-        }
-        _veml7700_ctx.gain_index = 0;
-    }
-    return true;
+    uint32_t refresh = _veml7700_wait_time(_veml7700_range.int_index) + VEML7700_PSM_WAIT_MS;
+    return _veml7700_range.psm_on && since_boot_delta(get_since_boot_ms(), _veml7700_range.psm_since) >= refresh;
 }
 
 
 static bool _veml7700_get_counts_begin(void)
 {
+    _veml7700_range.psm_on = false;
     if (!_veml7700_set_config())
     {
         return false;
@@ -441,6 +508,8 @@ static bool _veml7700_get_counts_begin(void)
 static bool _veml7700_get_counts_collect(uint16_t* counts)
 {
     *counts = _veml7700_read_als();
+    if (_veml7700_range.continuous)
+        return true;
     if (!_veml7700_turn_off())
     {
         return false;
@@ -449,6 +518,45 @@ static bool _veml7700_get_counts_collect(uint16_t* counts)
 }
 
 
+/* Left on at the predicted range, duty cycled by the sensor itself. */
+static bool _veml7700_psm_enter(void)
+{
+    _veml7700_ctx.gain_index    = _veml7700_range.gain_index;
+    _veml7700_ctx.int_index     = _veml7700_range.int_index;
+    _veml7700_ctx.power.psm_en  = VEML7700_PWR_PSM_EN_ENABLE;
+    _veml7700_ctx.power.psm     = VEML7700_PWR_PSM_MODE_4;
+    if (!_veml7700_set_config() || !_veml7700_turn_on())
+    {
+        light_debug("Could not enter power save mode.");
+        _veml7700_range.psm_on = false;
+        return false;
+    }
+    _veml7700_range.psm_on = true;
+    _veml7700_range.psm_since = get_since_boot_ms();
+    return true;
+}
+
+
+static bool _veml7700_reading_done(uint16_t counts)
+{
+    _veml7700_time.last_time_taken = since_boot_delta(get_since_boot_ms(), _veml7700_time.start_time);
+    _veml7700_state_machine.state = VEML7700_STATE_DONE;
+    _veml7700_reading.is_valid = true;
+    if (!_veml7700_conv(&_veml7700_reading.lux, counts))
+    {
+        light_debug("Could not convert light.");
+        return false;
+    }
+    bool changed = _veml7700_predict_range(counts);
+    if (_veml7700_range.continuous && (changed || !_veml7700_range.psm_on))
+    {
+        if (!_veml7700_psm_enter())
+            _veml7700_turn_off();
+    }
+    return true;
+}
+
+
 static bool _veml7700_check_state(void)
 {
     bool r = since_boot_delta(get_since_boot_ms(), _veml7700_time.start_time) <= VEML7700_MAX_READ_TIME;
@@ -476,30 +584,19 @@ static bool _veml7700_iteration_reading(void)
             light_debug("Could not collect counts.");
             goto bad_exit;
         }
-        if (counts > VEML7700_COUNT_LOWER_THRESHOLD)
+        if (_veml7700_counts_in_range(counts) ||
+            _veml7700_range.retried ||
+            !_veml7700_predict_range(counts))
         {
-            _veml7700_time.last_time_taken = since_boot_delta(get_since_boot_ms(), _veml7700_time.start_time);
-            _veml7700_state_machine.state = VEML7700_STATE_DONE;
-            _veml7700_reading.is_valid = true;
-            if (!_veml7700_conv(&_veml7700_reading.lux, counts))
-            {
-                light_debug("Could not convert light.");
+            if (!_veml7700_reading_done(counts))
                 goto bad_exit;
-            }
-            return true;
-        }
-        if (!_veml7700_increase_settings())
-        {
-            _veml7700_time.last_time_taken = since_boot_delta(get_since_boot_ms(), _veml7700_time.start_time);
-            _veml7700_state_machine.state = VEML7700_STATE_DONE;
-            _veml7700_reading.is_valid = true;
-            if (!_veml7700_conv(&_veml7700_reading.lux, counts))
-            {
-                light_debug("Could not convert light.");
-                goto bad_exit;
-            }
             return true;
         }
+        /* One retry, straight at the range this reading says is right. */
+        light_debug("Counts %"PRIu16" out of range, retrying.", counts);
+        _veml7700_range.retried = true;
+        _veml7700_ctx.gain_index = _veml7700_range.gain_index;
+        _veml7700_ctx.int_index  = _veml7700_range.int_index;
         _veml7700_state_machine.last_read = get_since_boot_ms();
         if (!_veml7700_get_counts_begin())
         {
@@ -511,6 +608,7 @@ static bool _veml7700_iteration_reading(void)
 
 bad_exit:
     _veml7700_turn_off();
+    _veml7700_range.psm_on = false;
     _veml7700_state_machine.state = VEML7700_STATE_OFF;
     return false;
 }
@@ -558,6 +656,7 @@ static measurements_sensor_state_t _veml7700_light_measurements_init(char* name,
             if (!_veml7700_check_state())
             {
                 _veml7700_turn_off();
+                _veml7700_range.psm_on = false;
                 _veml7700_state_machine.state = VEML7700_STATE_OFF;
                 break;
             }
@@ -570,6 +669,22 @@ static measurements_sensor_state_t _veml7700_light_measurements_init(char* name,
     _veml7700_state_machine.state = VEML7700_STATE_READING;
     _veml7700_state_machine.last_read = now;
     _veml7700_reset_ctx();
+    _veml7700_range.retried = false;
+    _veml7700_range.continuous = _veml7700_psm_cheaper(name);
+    if (_veml7700_range.continuous && _veml7700_psm_ready())
+    {
+        /* Already integrating at this range, take its last result. */
+        uint16_t counts = _veml7700_read_als();
+        if (_veml7700_counts_in_range(counts))
+            return (_veml7700_reading_done(counts) ? MEASUREMENTS_SENSOR_STATE_SUCCESS : MEASUREMENTS_SENSOR_STATE_ERROR);
+        _veml7700_predict_range(counts);
+        _veml7700_ctx.gain_index = _veml7700_range.gain_index;
+        _veml7700_ctx.int_index  = _veml7700_range.int_index;
+    }
+    else if (!_veml7700_range.continuous && _veml7700_range.psm_on)
+    {
+        light_debug("Leaving power save mode.");
+    }
     return (_veml7700_get_counts_begin() ? MEASUREMENTS_SENSOR_STATE_SUCCESS : MEASUREMENTS_SENSOR_STATE_ERROR);
 }
 
@@ -610,6 +725,15 @@ static measurements_value_type_t _veml7700_value_type(char* name)
 }
 
 
+static void _veml7700_enable(char* name, bool enabled)
+{
+    if (enabled || !_veml7700_range.psm_on)
+        return;
+    _veml7700_turn_off();
+    _veml7700_range.psm_on = false;
+}
+
+
 void veml7700_inf_init(measurements_inf_t* inf)
 {
     inf->collection_time_cb = _veml7700_measurements_collection_time;
@@ -617,4 +741,5 @@ void veml7700_inf_init(measurements_inf_t* inf)
     inf->get_cb             = _veml7700_light_measurements_get;
     inf->iteration_cb       = _veml7700_iteration;
     inf->value_type_cb      = _veml7700_value_type;
+    inf->enable_cb          = _veml7700_enable;
 }
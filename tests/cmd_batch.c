@@ -0,0 +1 @@
+../core/src/cmd_batch.c
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd_batch.h"
+
+#include "test.h"
+
+
+typedef struct
+{
+    char *      line;
+    unsigned    count;
+    char *      cmds[4];
+} test_batch_t;
+
+
+static test_batch_t _test_batches[] =
+{
+    { "count",                              1, { "count" } },
+    { "count;version",                      2, { "count", "version" } },
+    { "a;;b;",                              4, { "a", "", "b", "" } },
+    { "comms_send \"a;b\";count",           2, { "comms_send \"a;b\"", "count" } },
+    { "x \"a\";y \"b;c\" d;z",              3, { "x \"a\"", "y \"b;c\" d", "z" } },
+    /* Unclosed, the rest of the line is quoted. */
+    { "x \"a;b;c",                          1, { "x \"a;b;c" } },
+};
+
+
+static void _test_batch(test_batch_t* batch)
+{
+    char buf[64];
+    unsigned len = strlen(batch->line);
+    memcpy(buf, batch->line, len + 1);
+
+    char* command = buf;
+    char* end = buf + len;
+    unsigned count = 0;
+    while (command <= end && count < ARRAY_SIZE(batch->cmds))
+    {
+        char* sep = cmds_batch_next(command, end);
+        unsigned cmd_len = sep - command;
+        char name[96];
+        snprintf(name, sizeof(name), "\"%s\" command %u length", batch->line, count);
+        basic_test(name, strlen(batch->cmds[count]), cmd_len);
+        snprintf(name, sizeof(name), "\"%s\" command %u", batch->line, count);
+        basic_test(name, 0, strncmp(command, batch->cmds[count], cmd_len));
+        count++;
+        if (sep == end)
+            break;
+        command = sep + 1;
+    }
+    basic_test(batch->line, batch->count, count);
+}
+
+
+int main(int argc, char * argv)
+{
+    for (unsigned n = 0; n < ARRAY_SIZE(_test_batches); n++)
+        _test_batch(&_test_batches[n]);
+
+    char empty[] = "";
+    basic_test("Empty", 0, cmds_batch_next(empty, empty) - empty);
+    return 0;
+}
@@ -0,0 +1 @@
+cmd_batch_test_SOURCES:=cmd_batch_test.c cmd_batch.c
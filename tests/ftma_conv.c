@@ -0,0 +1 @@
+../sensors/src/ftma_conv.c
\ No newline at end of file
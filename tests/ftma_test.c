@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ftma_conv.h"
+
+#include "test.h"
+
+#define TEST_MAX_UV         (3300 * 1000)
+#define TEST_UV_STEP        997
+#define TEST_CHANNELS       4
+#define TEST_SAMPLES        1500
+
+
+typedef struct
+{
+    char *  name;
+    float   coeffs[FTMA_NUM_COEFFS];
+    bool    is_fixed;
+} test_coeffs_t;
+
+
+static test_coeffs_t _test_coeffs[] =
+{
+    { "default",    { 0.f, 1.f / (30.f * ((50000.f / 12400.f) + 1.f)), 0.f, 0.f },  true },
+    { "calibrated", { -0.12f, 0.0068f, 0.0004f, -0.00002f },                       true },
+    { "negative",   { 0.02f, -0.0066f, 0.f, 0.f },                                 true },
+    { "too big",    { 0.f, 10.f, 0.f, 0.f },                                       false },
+};
+
+
+/* Fixed point against the float it replaces, over the ADC's range. */
+static void _test_conv(void)
+{
+    for (unsigned n = 0; n < ARRAY_SIZE(_test_coeffs); n++)
+    {
+        test_coeffs_t * test = &_test_coeffs[n];
+        ftma_conv_t conv;
+        ftma_conv_setup(&conv, test->coeffs);
+        basic_test(test->name, test->is_fixed, conv.is_fixed);
+
+        unsigned off = 0;
+        unsigned worst = 0;
+        for (uint32_t uV = 0; uV <= TEST_MAX_UV; uV += TEST_UV_STEP)
+        {
+            int32_t ref = ftma_conv_float(test->coeffs, uV);
+            int32_t got = ftma_conv_uV(&conv, uV);
+            unsigned diff = abs(ref - got);
+            if (diff > worst)
+                worst = diff;
+            if (diff > 1)
+                off++;
+        }
+        printf("%s worst difference %uuA\n", test->name, worst);
+        basic_test("Conv off by more than 1uA", 0, off);
+    }
+}
+
+
+static void _test_batch(void)
+{
+    ftma_conv_t convs[TEST_CHANNELS];
+    uint32_t uVs[TEST_CHANNELS] = { 600000, 1500000, 2700000, 3299999 };
+    int32_t uAs[TEST_CHANNELS];
+
+    for (unsigned n = 0; n < TEST_CHANNELS; n++)
+        ftma_conv_setup(&convs[n], _test_coeffs[n % ARRAY_SIZE(_test_coeffs)].coeffs);
+
+    ftma_conv_batch(convs, uVs, uAs, TEST_CHANNELS);
+
+    for (unsigned n = 0; n < TEST_CHANNELS; n++)
+        basic_test("Batch same as single", ftma_conv_uV(&convs[n], uVs[n]), uAs[n]);
+}
+
+
+static void _test_avgs(void)
+{
+    uint16_t samples[TEST_SAMPLES];
+    uint32_t avgs[TEST_CHANNELS];
+
+    /* Each channel its own level, with a little dither around it. */
+    for (unsigned i = 0; i < TEST_SAMPLES; i++)
+    {
+        unsigned channel = i % TEST_CHANNELS;
+        samples[i] = 1000 * (channel + 1) + ((i / TEST_CHANNELS) % 2);
+    }
+
+    basic_test("Average", 1, ftma_avgs(samples, TEST_SAMPLES, TEST_CHANNELS, avgs));
+    for (unsigned c = 0; c < TEST_CHANNELS; c++)
+    {
+        uint64_t sum = 0;
+        for (unsigned i = c; i < TEST_SAMPLES; i += TEST_CHANNELS)
+            sum += samples[i];
+        basic_test("Channel average", sum * 1000 / (TEST_SAMPLES / TEST_CHANNELS), avgs[c]);
+    }
+
+    basic_test("No channels", 0, ftma_avgs(samples, TEST_SAMPLES, 0, avgs));
+    basic_test("Too few samples", 0, ftma_avgs(samples, TEST_CHANNELS - 1, TEST_CHANNELS, avgs));
+}
+
+
+int main(int argc, char * argv[])
+{
+    _test_conv();
+    _test_batch();
+    _test_avgs();
+    return 0;
+}
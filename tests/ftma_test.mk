@@ -0,0 +1 @@
+ftma_test_SOURCES:=ftma_test.c ftma_conv.c
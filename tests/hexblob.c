@@ -0,0 +1 @@
+../protocols/src/hexblob.c
\ No newline at end of file
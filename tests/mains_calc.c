@@ -0,0 +1 @@
+../sensors/src/mains_calc.c
\ No newline at end of file
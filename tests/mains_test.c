@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "mains_calc.h"
+
+#include "test.h"
+
+#define TEST_CHANNELS       3
+#define TEST_SAMPLES        1500
+/* As the STM's ADC, between one conversion and the next. */
+#define TEST_PERIOD_S       0.0005224f
+#define TEST_MID            2048.f
+
+
+typedef struct
+{
+    char *  name;
+    float   freq_hz;
+    float   amplitudes[TEST_CHANNELS];
+    float   phases_deg[TEST_CHANNELS];
+    float   third;                      /* Of the fundamental. */
+    float   fifth;
+} test_wave_t;
+
+
+static test_wave_t _test_waves[] =
+{
+    { "50Hz clean",     50.f,   { 500.f, 750.f, 1000.f }, { 0.f, 120.f, -120.f }, 0.f,    0.f },
+    { "49.8Hz 3rd",     49.8f,  { 800.f, 800.f, 800.f },  { 0.f, -30.f, 90.f },   0.1f,   0.f },
+    { "60Hz 3rd 5th",   60.f,   { 300.f, 600.f, 900.f },  { 0.f, 45.f, 180.f },   0.05f,  0.04f },
+};
+
+
+/* Interleaved as the ADC leaves them, each a conversion after the last. */
+static void _test_fill(const test_wave_t* wave, float period_s, uint16_t* samples)
+{
+    for (unsigned i = 0; i < TEST_SAMPLES; i++)
+    {
+        unsigned c = i % TEST_CHANNELS;
+        float x = 2.f * (float)M_PI * wave->freq_hz * period_s * i + wave->phases_deg[c] * (float)M_PI / 180.f;
+        float y = cosf(x) + wave->third * cosf(3.f * x) + wave->fifth * cosf(5.f * x);
+        samples[i] = (uint16_t)lroundf(TEST_MID + wave->amplitudes[c] * y);
+    }
+}
+
+
+static void _test_close(char * name, float expected, float got, float tolerance)
+{
+    printf("%s expected %.3f got %.3f\n", name, expected, got);
+    basic_test(name, 1, fabsf(expected - got) <= tolerance);
+}
+
+
+static void _test_waves_calc(void)
+{
+    uint16_t samples[TEST_SAMPLES];
+    mains_result_t result;
+
+    for (unsigned n = 0; n < ARRAY_SIZE(_test_waves); n++)
+    {
+        test_wave_t* wave = &_test_waves[n];
+        printf("== %s ==\n", wave->name);
+        _test_fill(wave, TEST_PERIOD_S, samples);
+
+        basic_test("Calc", 1, mains_calc(samples, TEST_SAMPLES, TEST_CHANNELS, TEST_PERIOD_S, &result));
+        _test_close("Frequency", wave->freq_hz, result.freq_hz, 0.05f);
+
+        float thd = 100.f * sqrtf(wave->third * wave->third + wave->fifth * wave->fifth);
+        for (unsigned c = 0; c < TEST_CHANNELS; c++)
+        {
+            mains_channel_t* channel = &result.channels[c];
+            basic_test("Valid", 1, channel->is_valid);
+            basic_test("Harmonics", MAINS_HARMONICS, channel->harmonic_count);
+            _test_close("Fundamental", wave->amplitudes[c], channel->amplitudes[0], wave->amplitudes[c] / 100.f);
+            _test_close("THD", thd, channel->thd, 0.5f);
+
+            float phase_deg;
+            basic_test("Phase", 1, mains_calc_phase_deg(&result, c, 0, &phase_deg));
+            /* Compared round the circle, 180 and -180 are the same. */
+            float expected = wave->phases_deg[c] - wave->phases_deg[0];
+            float error = fmodf(phase_deg - expected + 540.f, 360.f) - 180.f;
+            _test_close("Phase", expected, expected + error, 1.f);
+        }
+    }
+}
+
+
+static void _test_limits(void)
+{
+    uint16_t samples[TEST_SAMPLES];
+    mains_result_t result;
+
+    printf("== Limits ==\n");
+    for (unsigned i = 0; i < TEST_SAMPLES; i++)
+        samples[i] = (uint16_t)TEST_MID + (i % 2);
+    basic_test("Flat", 0, mains_calc(samples, TEST_SAMPLES, TEST_CHANNELS, TEST_PERIOD_S, &result));
+
+    _test_fill(&_test_waves[0], TEST_PERIOD_S, samples);
+    basic_test("Too few samples", 0, mains_calc(samples, 31 * TEST_CHANNELS, TEST_CHANNELS, TEST_PERIOD_S, &result));
+    basic_test("Too many channels", 0, mains_calc(samples, TEST_SAMPLES, MAINS_MAX_CHANNELS + 1, TEST_PERIOD_S, &result));
+
+    /* Slow enough sampling the higher harmonics are over Nyquist. */
+    _test_fill(&_test_waves[0], TEST_PERIOD_S * 2, samples);
+    basic_test("Slow", 1, mains_calc(samples, TEST_SAMPLES, TEST_CHANNELS, TEST_PERIOD_S * 2, &result));
+    basic_test("Harmonics under Nyquist", 3, result.channels[0].harmonic_count);
+
+    _test_fill(&_test_waves[0], TEST_PERIOD_S, samples);
+    /* One clamp not fitted, the others still measured. */
+    for (unsigned i = 1; i < TEST_SAMPLES; i += TEST_CHANNELS)
+        samples[i] = (uint16_t)TEST_MID;
+    basic_test("Missing clamp", 1, mains_calc(samples, TEST_SAMPLES, TEST_CHANNELS, TEST_PERIOD_S, &result));
+    basic_test("Missing clamp valid", 0, result.channels[1].is_valid);
+    float phase_deg;
+    basic_test("Missing clamp phase", 0, mains_calc_phase_deg(&result, 1, 0, &phase_deg));
+    basic_test("Others phase", 1, mains_calc_phase_deg(&result, 2, 0, &phase_deg));
+}
+
+
+int main(int argc, char * argv[])
+{
+    _test_waves_calc();
+    _test_limits();
+    return 0;
+}
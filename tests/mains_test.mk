@@ -0,0 +1,2 @@
+mains_test_SOURCES:=mains_test.c mains_calc.c
+mains_test_LDFLAGS:=-lm
@@ -0,0 +1 @@
+../core/src/modbus_mem.c
\ No newline at end of file
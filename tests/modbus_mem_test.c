@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "modbus.h"
+
+#include "test.h"
+
+/* Builds version 2 blobs, as older firmware left them in flash, and
+ * checks what modbus_bus_init() moves them over to. */
+
+#define TEST_V2_BLOCK           16
+#define TEST_V2_BLOCKS          (MODBUS_MEMORY_SIZE / TEST_V2_BLOCK)
+
+
+static uint8_t _blob[MODBUS_MEMORY_SIZE];
+static unsigned _next_block;
+
+
+void modbus_regs_moving(void) {}
+unsigned modbus_bus_count(void) { return 1 + MODBUS_EXTRA_BUSES; }
+void log_debug(uint32_t flag, const char * s, ...) {}
+void log_error(const char * s, ...) {}
+void log_out(const char * s, ...) {}
+
+
+static void _put16(uint8_t * p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+
+static void _test_v2_start(void)
+{
+    memset(_blob, 0, sizeof(_blob));
+    _next_block = 1;
+    _blob[0] = 2;                       /* version */
+    _blob[1] = 1;                       /* binary_protocol */
+    _blob[2] = 8 | (1 << 4) | (2 << 6); /* databits, stopbits, parity */
+    _blob[4] = 0x80;                    /* baudrate 9600 */
+    _blob[5] = 0x25;
+    _blob[12] = 5;                      /* slave_unit_id */
+    _blob[15] = 30;                     /* cache_max_age_s */
+}
+
+
+static uint16_t _test_v2_block(void)
+{
+    return (_next_block++) * TEST_V2_BLOCK;
+}
+
+
+/* As version 2 did, each new device goes at the front. */
+static uint16_t _test_v2_add_dev(const char * name, uint16_t unit_id, uint8_t bus)
+{
+    uint16_t offset = _test_v2_block();
+    uint8_t * dev = &_blob[offset];
+    memcpy(dev, name, strnlen(name, MODBUS_NAME_LEN));
+    dev[4] = MODBUS_BYTE_ORDER_LSB;
+    dev[5] = MODBUS_WORD_ORDER_MSW;
+    dev[7] = bus;
+    _put16(&dev[8], unit_id);
+    _put16(&dev[12], _blob[8] | (_blob[9] << 8));
+    _put16(&_blob[8], offset);
+    _blob[3]++;
+    return offset;
+}
+
+
+/* Registers were kept in the order added, not by address. */
+static void _test_v2_add_reg(uint16_t dev_offset, const char * name, uint16_t reg_addr, uint8_t type, uint8_t func)
+{
+    uint16_t offset = _test_v2_block();
+    uint8_t * reg = &_blob[offset];
+    memcpy(reg, name, strnlen(name, MODBUS_NAME_LEN));
+    reg[8] = type;
+    reg[9] = func;
+    _put16(&reg[10], reg_addr);
+
+    uint8_t * dev = &_blob[dev_offset];
+    uint8_t * link = &dev[10];
+    while (link[0] | link[1])
+        link = &_blob[(link[0] | (link[1] << 8)) + 14];
+    _put16(link, offset);
+    dev[6]++;
+}
+
+
+static unsigned _test_reg_addr(const char * name)
+{
+    modbus_reg_t * reg = modbus_get_reg((char*)name);
+    return (reg)?reg->reg_addr:0;
+}
+
+
+static void _test_several_devs(void)
+{
+    printf("== Several devices ==\n");
+    _test_v2_start();
+
+    uint16_t buses_offset = _test_v2_block();
+    uint8_t * buses = &_blob[buses_offset];
+    buses[0] = 0x00;                    /* Second bus at 19200 */
+    buses[1] = 0x4B;
+    buses[5] = 8;
+    _put16(&_blob[13], buses_offset);
+
+    uint16_t dev1 = _test_v2_add_dev("DEV1", 0x10, 0);
+    _test_v2_add_reg(dev1, "VP1", 0x30, MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC);
+    _test_v2_add_reg(dev1, "VP2", 0x10, MODBUS_REG_TYPE_FLOAT, MODBUS_READ_INPUT_FUNC);
+    _test_v2_add_reg(dev1, "VP3", 0x20, MODBUS_REG_TYPE_I32, MODBUS_READ_HOLDING_FUNC);
+    uint16_t dev2 = _test_v2_add_dev("DEV2", 0x20, 1);
+    _test_v2_add_reg(dev2, "AP1", 0x05, MODBUS_REG_TYPE_U32, MODBUS_READ_INPUT_FUNC);
+    /* Same name on another device, allowed by version 2. */
+    _test_v2_add_reg(dev2, "VP1", 0x01, MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC);
+    uint16_t dev3 = _test_v2_add_dev("DEV3", 0x30, 0);
+    (void)dev3;
+
+    modbus_bus_init((modbus_bus_t*)_blob);
+    modbus_bus_t * bus = (modbus_bus_t*)_blob;
+
+    basic_test("Version", MODBUS_BLOB_VERSION, bus->version);
+    basic_test("Binary", 1, bus->binary_protocol);
+    basic_test("Databits", 8, bus->databits);
+    basic_test("Stopbits", 1, bus->stopbits);
+    basic_test("Parity", 2, bus->parity);
+    basic_test("Baudrate", 9600, bus->baudrate);
+    basic_test("Slave", 5, bus->slave_unit_id);
+    basic_test("Cache", 30, bus->cache_max_age_s);
+
+    modbus_bus_comms_t comms;
+    basic_test("Bus 2 comms", 1, modbus_bus_get_comms(1, &comms));
+    basic_test("Bus 2 baudrate", 19200, comms.baudrate);
+    basic_test("Bus 2 databits", 8, comms.databits);
+
+    basic_test("Devices", 3, modbus_get_device_count());
+    basic_test("Registers", 4, bus->reg_count);
+
+    modbus_dev_t * dev = modbus_get_device_by_name("DEV1");
+    basic_test("DEV1", 1, dev != NULL);
+    basic_test("DEV1 first", 1, dev == (modbus_dev_t*)bus->data);
+    basic_test("DEV1 unit", 0x10, modbus_dev_get_unit_id(dev));
+    basic_test("DEV1 bus", 0, dev->bus);
+    basic_test("DEV1 byte order", MODBUS_BYTE_ORDER_LSB, dev->byte_order);
+    basic_test("DEV1 regs", 3, dev->reg_count);
+
+    dev = modbus_get_device_by_name("DEV2");
+    basic_test("DEV2 unit", 0x20, modbus_dev_get_unit_id(dev));
+    basic_test("DEV2 bus", 1, dev->bus);
+    basic_test("DEV2 regs", 1, dev->reg_count);
+    basic_test("DEV3 regs", 0, modbus_get_device_by_name("DEV3")->reg_count);
+
+    /* First added kept, its duplicate on DEV2 dropped. */
+    modbus_reg_t * reg = modbus_get_reg("VP1");
+    basic_test("VP1 addr", 0x30, _test_reg_addr("VP1"));
+    basic_test("VP1 unit", 0x10, modbus_reg_get_unit_id(reg));
+    basic_test("VP2 addr", 0x10, _test_reg_addr("VP2"));
+    basic_test("VP2 type", MODBUS_REG_TYPE_FLOAT, modbus_reg_get_type(modbus_get_reg("VP2")));
+    basic_test("VP2 func", MODBUS_READ_INPUT_FUNC, modbus_get_reg("VP2")->func);
+    basic_test("VP3 type", MODBUS_REG_TYPE_I32, modbus_reg_get_type(modbus_get_reg("VP3")));
+    basic_test("AP1 unit", 0x20, modbus_reg_get_unit_id(modbus_get_reg("AP1")));
+    basic_test("AP1 dev", 1, modbus_reg_get_dev(modbus_get_reg("AP1")) == modbus_get_device_by_name("DEV2"));
+
+    /* Sorted by address within the device. */
+    modbus_reg_rec_t * recs = (modbus_reg_rec_t*)&bus->data[3 * sizeof(modbus_dev_t)];
+    basic_test("Rec 0", 0x10, recs[0].reg_addr);
+    basic_test("Rec 1", 0x20, recs[1].reg_addr);
+    basic_test("Rec 2", 0x30, recs[2].reg_addr);
+    basic_test("Rec 3", 0x05, recs[3].reg_addr);
+    basic_test("Names", 0, memcmp(&bus->data[3 * sizeof(modbus_dev_t) + 4 * sizeof(modbus_reg_rec_t)], "VP2VP3VP1AP1", 12));
+    basic_test("Names len", 12, bus->names_len);
+
+    /* What was moved over loads again as is. */
+    uint8_t copy[MODBUS_MEMORY_SIZE];
+    memcpy(copy, _blob, sizeof(copy));
+    modbus_bus_init((modbus_bus_t*)_blob);
+    basic_test("Reload", 0, memcmp(copy, _blob, sizeof(copy)));
+}
+
+
+static void _test_full(void)
+{
+    printf("== Full ==\n");
+    _test_v2_start();
+
+    uint16_t dev = _test_v2_add_dev("FULL", 1, 0);
+    char name[MODBUS_NAME_LEN + 1];
+    unsigned count = 0;
+    while (_next_block < TEST_V2_BLOCKS)
+    {
+        snprintf(name, sizeof(name), "R%03u", count);
+        /* Added high address first, so all need sorting. */
+        _test_v2_add_reg(dev, name, 1000 - count, MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC);
+        count++;
+    }
+    basic_test("Blob registers", 62, count);
+
+    modbus_bus_init((modbus_bus_t*)_blob);
+    modbus_bus_t * bus = (modbus_bus_t*)_blob;
+    basic_test("Devices", 1, modbus_get_device_count());
+    basic_test("Registers", 62, bus->reg_count);
+    basic_test("Names len", 62 * MODBUS_NAME_LEN, bus->names_len);
+    basic_test("First", 1000, _test_reg_addr("R000"));
+    basic_test("Last", 1000 - 61, _test_reg_addr("R061"));
+
+    modbus_reg_rec_t * recs = (modbus_reg_rec_t*)&bus->data[sizeof(modbus_dev_t)];
+    basic_test("Lowest first", 1000 - 61, recs[0].reg_addr);
+    basic_test("Highest last", 1000, recs[61].reg_addr);
+
+    /* Room left for more. */
+    basic_test("Add", 1, modbus_dev_add_reg(modbus_get_device_by_name("FULL"), "MORE", MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC, 2000));
+    basic_test("Added", 2000, _test_reg_addr("MORE"));
+}
+
+
+/* Unit ids are only unique on a bus, registers go to their own bus's. */
+static void _test_same_unit_id(void)
+{
+    printf("== Same unit id ==\n");
+    modbus_bus_t * bus = (modbus_bus_t*)_blob;
+    memset(_blob, 0xFF, sizeof(_blob));
+    modbus_bus_init(bus);
+
+    modbus_dev_t * dev0 = modbus_add_device(1, "DEV0", MODBUS_BYTE_ORDER_MSB, MODBUS_WORD_ORDER_MSW, 0);
+    modbus_dev_t * dev1 = modbus_add_device(1, "DEV1", MODBUS_BYTE_ORDER_MSB, MODBUS_WORD_ORDER_MSW, 1);
+    basic_test("Bus 0 added", 1, dev0 != NULL);
+    basic_test("Bus 1 added", 1, dev1 != NULL);
+    basic_test("Same bus refused", 1, modbus_add_device(1, "DEV2", MODBUS_BYTE_ORDER_MSB, MODBUS_WORD_ORDER_MSW, 0) == NULL);
+    dev0 = modbus_get_device_by_name("DEV0");
+    dev1 = modbus_get_device_by_name("DEV1");
+    basic_test("By id bus 0", 1, modbus_get_device_by_id(0, 1) == dev0);
+    basic_test("By id bus 1", 1, modbus_get_device_by_id(1, 1) == dev1);
+
+    basic_test("Reg bus 1", 1, modbus_dev_add_reg(dev1, "R1", MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC, 0x10));
+    dev0 = modbus_get_device_by_name("DEV0");
+    basic_test("Reg bus 0", 1, modbus_dev_add_reg(dev0, "R0", MODBUS_REG_TYPE_U16, MODBUS_READ_HOLDING_FUNC, 0x10));
+    dev0 = modbus_get_device_by_name("DEV0");
+    dev1 = modbus_get_device_by_name("DEV1");
+    basic_test("R0 dev", 1, modbus_reg_get_dev(modbus_get_reg("R0")) == dev0);
+    basic_test("R1 dev", 1, modbus_reg_get_dev(modbus_get_reg("R1")) == dev1);
+    basic_test("R1 not bus 0's", 1, modbus_dev_get_reg_by_name(dev0, "R1") == NULL);
+
+    /* Registers are found on their bus again once loaded. */
+    modbus_bus_init(bus);
+    basic_test("R1 dev reload", 1, modbus_reg_get_dev(modbus_get_reg("R1")) == modbus_get_device_by_name("DEV1"));
+}
+
+
+static void _test_invalid(void)
+{
+    printf("== Invalid ==\n");
+    modbus_bus_t * bus = (modbus_bus_t*)_blob;
+
+    memset(_blob, 0, sizeof(_blob));
+    bus->version = MODBUS_BLOB_VERSION;
+    bus->dev_count = MODBUS_MAX_DEVS + 1;
+    modbus_bus_init(bus);
+    basic_test("Too many devices", 0, modbus_get_device_count());
+
+    memset(_blob, 0, sizeof(_blob));
+    bus->version = MODBUS_BLOB_VERSION;
+    bus->dev_count = 1;
+    ((modbus_dev_t*)bus->data)->reg_count = 2;
+    bus->reg_count = 1;
+    modbus_bus_init(bus);
+    basic_test("Register count", 0, modbus_get_device_count());
+
+    memset(_blob, 0, sizeof(_blob));
+    bus->version = MODBUS_BLOB_VERSION;
+    bus->dev_count = 1;
+    ((modbus_dev_t*)bus->data)->reg_count = 1;
+    bus->reg_count = 1;
+    bus->names_len = 3;
+    modbus_bus_init(bus);
+    basic_test("Names length", 0, modbus_get_device_count());
+
+    memset(_blob, 0xFF, sizeof(_blob));
+    bus->version = MODBUS_BLOB_VERSION;
+    modbus_bus_init(bus);
+    basic_test("Erased", 0, modbus_get_device_count());
+    basic_test("Erased reset", MODBUS_BLOB_VERSION, bus->version);
+
+    /* Version 2 with links going nowhere moves nothing. */
+    _test_v2_start();
+    _put16(&_blob[8], 7);
+    modbus_bus_init(bus);
+    basic_test("Bad link", 0, modbus_get_device_count());
+    basic_test("Bad link comms", 9600, bus->baudrate);
+}
+
+
+int main(int argc, char * argv[])
+{
+    _test_several_devs();
+    _test_full();
+    _test_same_unit_id();
+    _test_invalid();
+    return 0;
+}
@@ -0,0 +1,2 @@
+modbus_mem_test_SOURCES:=modbus_mem_test.c modbus_mem.c
+modbus_mem_test_CFLAGS:=-DFW_NAME=PENGUIN -Dfw_name=penguin -I../comms/include -I../protocols/include -I../model/penguin -I../ports/linux/include
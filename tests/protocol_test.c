@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "measurements.h"
+#include "protocol.h"
+
+#include "test.h"
+
+/* Encodes frames with the firmware's hexblob protocol and checks the
+ * compression picked. Given a file name, it also writes each frame as a
+ * corpus line, "<hex> <expected JSON>", for the host side decoders to be
+ * validated against. */
+
+#define JS_MAX_SAFE_INTEGER     9007199254740991LL
+
+#define TEST_SIZE_NAME          MEASURE_NAME_LEN
+#define TEST_SIZE_HEADER        (TEST_SIZE_NAME + 1)
+
+static FILE*    _corpus = NULL;
+
+static int8_t   _sent[PROTOCOL_HEX_ARRAY_SIZE];
+static unsigned _sent_len = 0;
+static uint16_t _mtu = 0;
+
+static char     _expected[1024];
+static unsigned _expected_pos = 0;
+
+
+uint16_t linux_comms_get_mtu(void)
+{
+    return _mtu;
+}
+
+
+void linux_comms_send(int8_t* hex_arr, uint16_t arr_len)
+{
+    memcpy(_sent, hex_arr, arr_len);
+    _sent_len = arr_len;
+}
+
+
+void log_debug(uint32_t flag, const char * s, ...) {}
+void log_error(const char * s, ...) {}
+
+
+static void _expect(const char * fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _expected_pos += vsnprintf(_expected + _expected_pos, sizeof(_expected) - _expected_pos, fmt, ap);
+    va_end(ap);
+}
+
+
+static void _expect_key(const char * name, const char * suffix)
+{
+    _expect("%s\"%s%s\":", (_expected[_expected_pos - 1] != '{') ? "," : "", name, suffix);
+}
+
+
+/* Beyond what a double holds exactly, the decoder gives a string. */
+static void _expect_i64(const char * name, const char * suffix, int64_t value)
+{
+    _expect_key(name, suffix);
+    if (value > JS_MAX_SAFE_INTEGER || value < -JS_MAX_SAFE_INTEGER)
+        _expect("\"%"PRId64"\"", value);
+    else
+        _expect("%"PRId64, value);
+}
+
+
+static void _expect_float(const char * name, const char * suffix, int32_t value)
+{
+    _expect_key(name, suffix);
+    int64_t v = value;
+    _expect("%s%"PRId64".%03"PRId64, (v < 0) ? "-" : "", ((v < 0) ? -v : v) / 1000, ((v < 0) ? -v : v) % 1000);
+}
+
+
+static void _frame_start(void)
+{
+    _expected_pos = 0;
+    _expect("{");
+    _sent_len = 0;
+    protocol_init();
+}
+
+
+static void _corpus_write(void)
+{
+    if (!_corpus)
+        return;
+    for (unsigned n = 0; n < _sent_len; n++)
+        fprintf(_corpus, "%02"PRIx8, (uint8_t)_sent[n]);
+    fprintf(_corpus, " %s\n", _expected);
+}
+
+
+static void _frame_end(void)
+{
+    protocol_send();
+    _expect("}");
+    _corpus_write();
+}
+
+
+static bool _append_i64(const char * name, int64_t value)
+{
+    measurements_def_t def = {.samplecount = 1};
+    measurements_data_t data = {.value_type = MEASUREMENTS_VALUE_TYPE_I64, .num_samples = 1};
+    strncpy(def.name, name, MEASURE_NAME_LEN);
+    data.value.value_64.sum = value;
+    _expect_i64(name, "", value);
+    return protocol_append_measurement(&def, &data);
+}
+
+
+static bool _append_i64_avg(const char * name, int64_t sum, int64_t min, int64_t max, uint8_t num_samples)
+{
+    measurements_def_t def = {.samplecount = num_samples};
+    measurements_data_t data = {.value_type = MEASUREMENTS_VALUE_TYPE_I64, .num_samples = num_samples};
+    strncpy(def.name, name, MEASURE_NAME_LEN);
+    data.value.value_64.sum = sum;
+    data.value.value_64.min = min;
+    data.value.value_64.max = max;
+    _expect_i64(name, "", sum / num_samples);
+    _expect_i64(name, "_min", min);
+    _expect_i64(name, "_max", max);
+    return protocol_append_measurement(&def, &data);
+}
+
+
+static bool _append_float(const char * name, int32_t value)
+{
+    measurements_def_t def = {.samplecount = 1};
+    measurements_data_t data = {.value_type = MEASUREMENTS_VALUE_TYPE_FLOAT, .num_samples = 1};
+    strncpy(def.name, name, MEASURE_NAME_LEN);
+    data.value.value_f.sum = value;
+    _expect_float(name, "", value);
+    return protocol_append_measurement(&def, &data);
+}
+
+
+static bool _append_float_avg(const char * name, int32_t sum, int32_t min, int32_t max, uint8_t num_samples)
+{
+    measurements_def_t def = {.samplecount = num_samples};
+    measurements_data_t data = {.value_type = MEASUREMENTS_VALUE_TYPE_FLOAT, .num_samples = num_samples};
+    strncpy(def.name, name, MEASURE_NAME_LEN);
+    data.value.value_f.sum = sum;
+    data.value.value_f.min = min;
+    data.value.value_f.max = max;
+    _expect_float(name, "", sum / num_samples);
+    _expect_float(name, "_min", min);
+    _expect_float(name, "_max", max);
+    return protocol_append_measurement(&def, &data);
+}
+
+
+static bool _append_str(const char * name, const char * value)
+{
+    measurements_def_t def = {.samplecount = 1};
+    measurements_data_t data = {.value_type = MEASUREMENTS_VALUE_TYPE_STR, .num_samples = 1};
+    strncpy(def.name, name, MEASURE_NAME_LEN);
+    strncpy(data.value.value_s.str, value, MEASUREMENTS_VALUE_STR_LEN - 1);
+    _expect_key(name, "");
+    _expect("\"%.8s\"", value);
+    return protocol_append_measurement(&def, &data);
+}
+
+
+static struct
+{
+    int64_t     value;
+    uint8_t     send_type;
+    unsigned    size;
+} _i64_cases[] =
+{
+    {0,                     0x11, 1},
+    {1,                     0x01, 1},
+    {-1,                    0x11, 1},
+    {127,                   0x01, 1},
+    {128,                   0x01, 1},
+    {-128,                  0x11, 1},
+    {-129,                  0x12, 2},
+    {255,                   0x01, 1},
+    {256,                   0x02, 2},
+    {-32768,                0x12, 2},
+    {-32769,                0x13, 4},
+    {65535,                 0x02, 2},
+    {65536,                 0x03, 4},
+    {2147483647,            0x03, 4},
+    {2147483648LL,          0x03, 4},
+    {-2147483648LL,         0x13, 4},
+    {-2147483649LL,         0x14, 8},
+    {4294967295LL,          0x03, 4},
+    {4294967296LL,          0x04, 8},
+    {JS_MAX_SAFE_INTEGER,   0x04, 8},
+    {JS_MAX_SAFE_INTEGER+1, 0x04, 8},
+    {-JS_MAX_SAFE_INTEGER,  0x14, 8},
+    {-JS_MAX_SAFE_INTEGER-2,0x14, 8},
+    {INT64_MAX,             0x04, 8},
+    {INT64_MIN,             0x14, 8},
+};
+
+
+static void _test_i64(void)
+{
+    char test[64];
+    for (unsigned n = 0; n < ARRAY_SIZE(_i64_cases); n++)
+    {
+        _frame_start();
+        _append_i64("CNT1", _i64_cases[n].value);
+        _frame_end();
+        snprintf(test, sizeof(test), "i64 %"PRId64" type", _i64_cases[n].value);
+        basic_test(test, _i64_cases[n].send_type, (uint8_t)_sent[1 + TEST_SIZE_HEADER]);
+        snprintf(test, sizeof(test), "i64 %"PRId64" length", _i64_cases[n].value);
+        basic_test(test, 1 + TEST_SIZE_HEADER + 1 + _i64_cases[n].size, _sent_len);
+    }
+}
+
+
+static void _test_float(void)
+{
+    static const int32_t cases[] = {0, 1, -1, 21500, -500, -21999, INT32_MAX, INT32_MIN};
+    for (unsigned n = 0; n < ARRAY_SIZE(cases); n++)
+    {
+        _frame_start();
+        _append_float("TEMP", cases[n]);
+        _frame_end();
+        basic_test("float type", 0x15, (uint8_t)_sent[1 + TEST_SIZE_HEADER]);
+        basic_test("float length", 1 + TEST_SIZE_HEADER + 1 + 4, _sent_len);
+    }
+}
+
+
+static void _test_str(void)
+{
+    static const char * cases[] = {"", "v1.2", "abcdefgh", "longer_than_8"};
+    for (unsigned n = 0; n < ARRAY_SIZE(cases); n++)
+    {
+        _frame_start();
+        _append_str("FW", cases[n]);
+        _frame_end();
+        basic_test("str type", 0x20, (uint8_t)_sent[1 + TEST_SIZE_HEADER]);
+        basic_test("str length", 1 + TEST_SIZE_HEADER + 1 + 8, _sent_len);
+    }
+}
+
+
+static void _test_averaged(void)
+{
+    _frame_start();
+    _append_i64_avg("PM10", 55, 3, 40, 5);
+    _frame_end();
+    basic_test("avg i64 datatype", MEASUREMENTS_DATATYPE_AVERAGED, (uint8_t)_sent[1 + TEST_SIZE_NAME]);
+    basic_test("avg i64 length", 1 + TEST_SIZE_HEADER + 3 * 2, _sent_len);
+
+    _frame_start();
+    _append_i64_avg("CNT2", -10, -300, 4294967296LL, 3);
+    _frame_end();
+    basic_test("avg mixed length", 1 + TEST_SIZE_HEADER + 2 + 3 + 9, _sent_len);
+
+    _frame_start();
+    _append_float_avg("HUMI", 212345, 40000, 45100, 5);
+    _frame_end();
+    basic_test("avg float length", 1 + TEST_SIZE_HEADER + 3 * 5, _sent_len);
+}
+
+
+static void _test_multiple(void)
+{
+    _frame_start();
+    _append_float("TEMP", 21512);
+    _append_float_avg("HUMI", -12, -30, 6, 3);
+    _append_i64("CNT1", 5000000000LL);
+    _append_str("FW", "[1-abc]");
+    _append_i64_avg("PM25", 12, 2, 8, 2);
+    _frame_end();
+    basic_test("multiple length", 1 + (TEST_SIZE_HEADER + 5) + (TEST_SIZE_HEADER + 15) +
+                                  (TEST_SIZE_HEADER + 9) + (TEST_SIZE_HEADER + 9) +
+                                  (TEST_SIZE_HEADER + 6), _sent_len);
+}
+
+
+static void _test_instant(void)
+{
+    measurements_def_t def = {.name = "CNT1"};
+    measurements_reading_t reading = {.v_i64 = 6000000000LL};
+    _frame_start();
+    _expect_i64("CNT1", "", reading.v_i64);
+    protocol_append_instant_measurement(&def, &reading, MEASUREMENTS_VALUE_TYPE_I64);
+    _frame_end();
+    basic_test("instant i64 type", 0x04, (uint8_t)_sent[1 + TEST_SIZE_HEADER]);
+
+    measurements_def_t str_def = {.name = "FW"};
+    reading.v_str = "inst";
+    _frame_start();
+    _expect_key("FW", "");
+    _expect("\"inst\"");
+    protocol_append_instant_measurement(&str_def, &reading, MEASUREMENTS_VALUE_TYPE_STR);
+    _frame_end();
+    basic_test("instant str", 'i', (uint8_t)_sent[1 + TEST_SIZE_HEADER + 1]);
+}
+
+
+static void _test_backlog(void)
+{
+    int8_t records[PROTOCOL_HEX_ARRAY_SIZE];
+    int8_t* pending;
+
+    /* Records of an interval that could not be sent. */
+    protocol_init();
+    _append_float("TEMP", 19250);
+    _append_i64("CNT1", 300);
+    unsigned len = protocol_get_records(&pending);
+    memcpy(records, pending, len);
+    basic_test("backlog records", 2 * TEST_SIZE_HEADER + 5 + 3, len);
+
+    _expected_pos = 0;
+    _expect("{");
+    _sent_len = 0;
+    protocol_init_backlog();
+    _append_i64("BAT", 3300);
+    _expect(",\"backlog\":[{");
+    _expect_i64("AGE", "", 900);
+    _expect_float("TEMP", "", 19250);
+    _expect_i64("CNT1", "", 300);
+    _expect("}]");
+    basic_test("backlog append", true, protocol_append_backlog(900, records, len));
+    _frame_end();
+}
+
+
+static void _test_singles(void)
+{
+    _frame_start();
+    _expect("\"ERR\":\"Success\"}");
+    protocol_send_error_code(1);
+    _corpus_write();
+    basic_test("err length", 1 + TEST_SIZE_HEADER + 2, _sent_len);
+
+    _frame_start();
+    _expect("\"CMDS\":{\"count\":3,\"ok\":[true,false,true]}}");
+    protocol_send_cmd_results(3, 0x5);
+    _corpus_write();
+    basic_test("cmds length", 1 + TEST_SIZE_HEADER + 5, _sent_len);
+}
+
+
+static void _test_mtu(void)
+{
+    _mtu = 12;
+    _frame_start();
+    basic_test("mtu fits", true, _append_float("TEMP", 1000));
+    basic_test("mtu full", false, _append_i64("CNT1", 1));
+    /* Nothing of the failed measurement is left behind. */
+    _expected_pos = 0;
+    _expect("{");
+    _expect_float("TEMP", "", 1000);
+    _frame_end();
+    basic_test("mtu length", 11, _sent_len);
+    _mtu = 0;
+}
+
+
+int main(int argc, char * argv[])
+{
+    if (argc > 1)
+    {
+        _corpus = fopen(argv[1], "w");
+        if (!_corpus)
+        {
+            printf(BADRED"Failed to open corpus \"%s\" FAIL"NORMAL"\n", argv[1]);
+            return -1;
+        }
+    }
+
+    _test_i64();
+    _test_float();
+    _test_str();
+    _test_averaged();
+    _test_multiple();
+    _test_instant();
+    _test_backlog();
+    _test_singles();
+    _test_mtu();
+
+    if (_corpus)
+        fclose(_corpus);
+    return 0;
+}
@@ -0,0 +1,2 @@
+protocol_test_SOURCES:=protocol_test.c hexblob.c
+protocol_test_CFLAGS:=-DFW_NAME=PENGUIN -Dfw_name=penguin -I../comms/include -I../protocols/include -I../model/penguin -I../ports/linux/include
@@ -26,6 +26,7 @@ int main(int argc, char * argv)
     ring_buf_t ring = RING_BUF_INIT(buf, sizeof(buf));
 
     basic_test("Init", 0, ring_buf_get_pending(&ring));
+    basic_test("Init free", sizeof(buf) - 1, ring_buf_get_free(&ring));
 
     for(unsigned n = 0; n < ARRAY_SIZE(test_lines); n++)
     {
@@ -95,6 +96,7 @@ int main(int argc, char * argv)
 
     basic_test("Full", 1, ring_buf_is_full(&ring));
     basic_test("Fill", sizeof(buf) - 1,  ring_buf_get_pending(&ring));
+    basic_test("Full free", 0, ring_buf_get_free(&ring));
 
     char temp[128] = {0};
 